@@ -27,6 +27,10 @@
 #ifdef CONFIG_MMAP
 #include <sys/mman.h>
 #endif
+#ifndef CONFIG_WIN32
+#include <sys/uio.h>
+#include <sys/wait.h>
+#endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
                       int offset, int size);
@@ -58,18 +62,97 @@ static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
     return p;
 }
 
+/* Page data can be shared between pages of different buffers, the
+ * kill ring and undo logs.  Shared pages have the PG_READ_ONLY flag
+ * and point into a reference counted PageBlock holding either a heap
+ * allocated page payload or a file mapping.  The data is copied upon
+ * the first write.
+ */
+struct PageBlock {
+    int ref_count;
+    int map_length;     /* length of the file mapping, 0 for heap data */
+    int size;           /* size of the data block */
+    u8 *data;
+    dev_t map_dev;      /* identity of the mapped file */
+    ino_t map_ino;
+};
+
+static PageBlock *page_block_new(u8 *data, int size, int map_length,
+                                 int ref_count)
+{
+    PageBlock *blk = qe_malloc(PageBlock);
+
+    if (blk) {
+        blk->ref_count = ref_count;
+        blk->map_length = map_length;
+        blk->size = size;
+        blk->data = data;
+    }
+    return blk;
+}
+
+static void page_block_release(PageBlock **blkp)
+{
+    PageBlock *blk = *blkp;
+
+    if (blk && --blk->ref_count <= 0) {
+#ifdef CONFIG_MMAP
+        if (blk->map_length) {
+            munmap(blk->data, blk->map_length);
+        } else
+#endif
+        {
+            qe_free(&blk->data);
+        }
+        qe_free(blkp);
+    }
+    *blkp = NULL;
+}
+
+/* free the data of a page */
+static void page_free(Page *p)
+{
+    if (p->flags & PG_READ_ONLY)
+        page_block_release(&p->block);
+    else
+        qe_free(&p->data);
+    p->data = NULL;
+}
+
+/* make the data of a page shareable, return 0 if successful */
+static int page_share(Page *p)
+{
+    if (!(p->flags & PG_READ_ONLY)) {
+        p->block = page_block_new(p->data, p->size, 0, 1);
+        if (!p->block)
+            return -1;
+        p->flags |= PG_READ_ONLY;
+    }
+    return 0;
+}
+
 /* prepare a page to be written */
 static void update_page(Page *p)
 {
+    PageBlock *blk;
     u8 *buf;
 
     /* if the page is read only, copy it */
     if (p->flags & PG_READ_ONLY) {
-        buf = qe_malloc_dup(p->data, p->size);
-        /* XXX: should return an error */
-        if (!buf)
-            return;
-        p->data = buf;
+        blk = p->block;
+        if (blk && blk->ref_count == 1 && !blk->map_length
+        &&  p->data == blk->data && p->size == blk->size) {
+            /* last reference to a heap block holding just this page:
+               take ownership */
+            blk->data = NULL;
+        } else {
+            buf = qe_malloc_dup(p->data, p->size);
+            /* XXX: should return an error */
+            if (!buf)
+                return;
+            p->data = buf;
+        }
+        page_block_release(&p->block);
         p->flags &= ~PG_READ_ONLY;
     }
     p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
@@ -201,6 +284,7 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
                 len = MAX_PAGE_SIZE;
             p->size = len;
             p->data = qe_malloc_dup(buf, len);
+            p->block = NULL;
             p->flags = 0;
             buf += len;
             size -= len;
@@ -294,16 +378,105 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
     b->cur_page = NULL;
 }
 
+/* Split the page containing 'offset' so a page starts at 'offset',
+ * return the index of this page.  We must have: 0 <= offset <= b->total_size
+ */
+static int eb_split_page(EditBuffer *b, int offset)
+{
+    Page *p, *q;
+    int page_index, len;
+    u8 *data;
+
+    if (offset >= b->total_size)
+        return b->nb_pages;
+
+    p = find_page(b, offset, &offset);
+    page_index = p - b->page_table;
+    if (offset == 0)
+        return page_index;
+
+    len = p->size - offset;
+    if (p->flags & PG_READ_ONLY) {
+        /* both parts share the same block */
+        data = p->data + offset;
+        p->block->ref_count++;
+    } else {
+        data = qe_malloc_dup(p->data + offset, len);
+        if (!data)
+            return -1;
+    }
+    if (!qe_realloc(&b->page_table, (b->nb_pages + 1) * sizeof(Page))) {
+        if (p->flags & PG_READ_ONLY)
+            b->page_table[page_index].block->ref_count--;
+        else
+            qe_free(&data);
+        return -1;
+    }
+    b->nb_pages++;
+    p = b->page_table + page_index;
+    blockmove(p + 2, p + 1, b->nb_pages - page_index - 2);
+    q = p + 1;
+    q->size = len;
+    q->data = data;
+    q->block = p->block;
+    q->flags = p->flags & PG_READ_ONLY;
+    p->size = offset;
+    p->flags &= PG_READ_ONLY;
+    if (!(p->flags & PG_READ_ONLY))
+        qe_realloc(&p->data, p->size);
+
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+    return page_index + 1;
+}
+
+/* Insert 'n' pages from 'src' at 'dest_offset' in 'dest', sharing the
+ * page data.  Return the number of bytes inserted.
+ */
+static int eb_insert_pages(EditBuffer *dest, int dest_offset,
+                           Page *src, int n)
+{
+    Page *q;
+    int i, page_index, size;
+
+    for (i = 0; i < n; i++) {
+        if (page_share(&src[i]))
+            return 0;
+    }
+    page_index = eb_split_page(dest, dest_offset);
+    if (page_index < 0
+    ||  !qe_realloc(&dest->page_table, (dest->nb_pages + n) * sizeof(Page)))
+        return 0;
+
+    q = dest->page_table + page_index;
+    blockmove(q + n, q, dest->nb_pages - page_index);
+    dest->nb_pages += n;
+    for (size = 0, i = 0; i < n; i++, q++) {
+        q->size = src[i].size;
+        q->data = src[i].data;
+        q->block = src[i].block;
+        q->block->ref_count++;
+        q->flags = PG_READ_ONLY;
+        size += q->size;
+    }
+    dest->total_size += size;
+
+    /* the page cache is no longer valid */
+    dest->cur_page = NULL;
+    return size;
+}
+
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Raw insertion performed, encoding is ignored.
+ * Complete pages are shared between both buffers instead of copied.
  */
 int eb_insert_buffer(EditBuffer *dest, int dest_offset,
                      EditBuffer *src, int src_offset,
                      int size)
 {
-    Page *p;
-    int len, size0;
+    Page *p, *p_end;
+    int len, n, size0;
 
     if (dest->flags & BF_READONLY)
         return 0;
@@ -324,116 +497,55 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
     size0 = size;
 
     eb_addlog(dest, LOGOP_INSERT, dest_offset, size);
-#if 1
-    /* Much simpler algorithm with fewer pathological cases */
+
     p = find_page(src, src_offset, &src_offset);
+    p_end = src->page_table + src->nb_pages;
     while (size > 0) {
-        len = p->size - src_offset;
-        if (len > size)
-            len = size;
-        if ((p->flags & PG_READ_ONLY) && src_offset == 0 && len == MAX_PAGE_SIZE) {
-            /* XXX: should share complete read-only pages.  This is
-             * actually a little tricky: the mapping may be removed
-             * upon buffer close. We need a ref count scheme to keep
-             * track of these pages.
-             * A brute force approach may prove best: upon unmapping a
-             * file, scan all buffers for shared pages and delay
-             * unmapping until these get freed.  We may keep a global
-             * and a buffer based count of shared pages and a list of
-             * mappings to accelerate this phase.
-             */
+        len = n = 0;
+        if (src_offset == 0) {
+            /* share runs of large complete pages */
+            for (; p + n < p_end && p[n].size <= size - len
+                 &&  p[n].size >= MAX_PAGE_SIZE / 2; n++) {
+                len += p[n].size;
+            }
+        }
+        if (n > 0 && eb_insert_pages(dest, dest_offset, p, n) == len) {
+            p += n;
+        } else {
+            len = min_int(p->size - src_offset, size);
+            eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
+            p++;
         }
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
         dest_offset += len;
         src_offset = 0;
-        p++;
         size -= len;
     }
     return size0;
-#else
-    Page *p_start, *q;
-    int n, page_index;
-
-    /* insert the data from the first page if it is not completely
-       selected */
-    p = find_page(src, src_offset, &src_offset);
-    if (src_offset > 0 /* || size <= p->size */ ) {
-        len = p->size - src_offset;
-        if (len > size)
-            len = size;
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
-        dest_offset += len;
-        size -= len;
-        p++;
-    }
+}
 
-    if (size == 0)
-        return size0;
-
-    /* cut the page at dest offset if needed */
-    if (dest_offset < dest->total_size) {
-        q = find_page(dest, dest_offset, &dest_offset);
-        page_index = q - dest->page_table;
-        if (dest_offset > 0) {
-            page_index++;
-            eb_insert1(dest, page_index, q->data + dest_offset,
-                       q->size - dest_offset);
-            /* must reload q because page_table may have been
-               realloced */
-            q = dest->page_table + page_index - 1;
-            update_page(q);
-            qe_realloc(&q->data, dest_offset);
-            q->size = dest_offset;
-        }
-    } else {
-        page_index = dest->nb_pages;
-    }
+/* Return the number of bytes of a buffer range that eb_insert_buffer
+ * would share instead of copy.
+ */
+static int eb_get_shared_size(EditBuffer *b, int offset, int size)
+{
+    Page *p, *p_end;
+    int shared = 0;
 
-    /* update total_size */
-    dest->total_size += size;
+    if (offset < 0 || offset >= b->total_size)
+        return 0;
 
-    /* compute the number of complete pages to insert */
-    p_start = p;
-    while (size > 0 && p->size <= size) {
-        size -= p->size;
+    p = find_page(b, offset, &offset);
+    p_end = b->page_table + b->nb_pages;
+    if (offset > 0) {
+        size -= p->size - offset;
         p++;
     }
-    n = p - p_start; /* number of pages to insert */
-    p = p_start;
-    if (n > 0) {
-        /* add the pages */
-        dest->nb_pages += n;
-        qe_realloc(&dest->page_table, dest->nb_pages * sizeof(Page));
-        q = dest->page_table + page_index;
-        blockmove(q + n, q, dest->nb_pages - n - page_index);
-        p = p_start;
-        while (n > 0) {
-            len = p->size;
-            q->size = len;
-            if (p->flags & PG_READ_ONLY) {
-                /* simply copy the reference */
-                q->flags = PG_READ_ONLY;
-                q->data = p->data;
-            } else {
-                /* allocate a new page */
-                q->flags = 0;
-                q->data = qe_malloc_dup(p->data, len);
-            }
-            n--;
-            p++;
-            q++;
-        }
-        page_index = q - dest->page_table;
-    }
-
-    /* insert the remaning bytes */
-    if (size > 0) {
-        eb_insert1(dest, page_index, p->data, size);
+    for (; p < p_end && p->size <= size; p++) {
+        if (p->size >= MAX_PAGE_SIZE / 2)
+            shared += p->size;
+        size -= p->size;
     }
-    /* the page cache is no longer valid */
-    dest->cur_page = NULL;
-    return size0;
-#endif
+    return shared;
 }
 
 /* Insert 'size' bytes from 'buf' into 'b' at offset 'offset'. We must
@@ -460,6 +572,53 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
     return size;
 }
 
+/* Insert 'size' bytes of heap allocated data '*bufp' at 'offset',
+ * taking ownership of the allocation: large blocks are not copied,
+ * the pages are built over the data and share it until written to.
+ * '*bufp' is set to NULL. Return number of bytes inserted.
+ */
+int eb_insert_block(EditBuffer *b, int offset, u8 **bufp, int size)
+{
+    PageBlock *blk;
+    Page *q;
+    int i, n, page_index;
+
+    if (size < 2 * MAX_PAGE_SIZE || (b->flags & BF_READONLY)
+    ||  offset < 0 || offset > b->total_size) {
+        size = eb_insert(b, offset, *bufp, size);
+        qe_free(bufp);
+        return size;
+    }
+
+    eb_addlog(b, LOGOP_INSERT, offset, size);
+
+    n = (size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
+    blk = page_block_new(*bufp, size, 0, n);
+    page_index = eb_split_page(b, offset);
+    if (!blk || page_index < 0
+    ||  !qe_realloc(&b->page_table, (b->nb_pages + n) * sizeof(Page))) {
+        qe_free(&blk);
+        eb_insert_lowlevel(b, offset, *bufp, size);
+        qe_free(bufp);
+        return size;
+    }
+    q = b->page_table + page_index;
+    blockmove(q + n, q, b->nb_pages - page_index);
+    b->nb_pages += n;
+    for (i = 0; i < n; i++, q++) {
+        q->size = min_int(size - i * MAX_PAGE_SIZE, MAX_PAGE_SIZE);
+        q->data = *bufp + i * MAX_PAGE_SIZE;
+        q->block = blk;
+        q->flags = PG_READ_ONLY;
+    }
+    b->total_size += size;
+    *bufp = NULL;
+
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+    return size;
+}
+
 /* We must have : 0 <= offset <= b->total_size,
  * return actual number of bytes removed.
  */
@@ -495,9 +654,7 @@ int eb_delete(EditBuffer *b, int offset, int size)
         if (len == p->size) {
             if (!del_start)
                 del_start = p;
-            /* we cannot free if read only */
-            if (!(p->flags & PG_READ_ONLY))
-                qe_free(&p->data);
+            page_free(p);
             p++;
             offset = 0;
             n++;
@@ -650,6 +807,12 @@ void eb_free_log_buffer(EditBuffer *b)
     b->log_new_index = 0;
     b->log_current = 0;
     b->nb_logs = 0;
+    b->log_spill_index = 0;
+    b->log_spill_size = 0;
+    if (b->log_spill_file) {
+        fclose(b->log_spill_file);
+        b->log_spill_file = NULL;
+    }
 }
 
 /* rename a buffer: modify name to ensure uniqueness */
@@ -756,6 +919,8 @@ EditBuffer *eb_scratch(const char *name, int flags)
 
 void eb_clear(EditBuffer *b)
 {
+    eb_stop_loading(b, -1);
+    eb_wait_saving(b);
     b->flags &= ~BF_READONLY;
 
     /* XXX: should just reset logging instead of disabling it */
@@ -814,9 +979,6 @@ void eb_free(EditBuffer **bp)
             if (b1->log_buffer == b) {
                 b1->log_buffer = NULL;
             }
-            if (b1->b_styles == b) {
-                b1->b_styles = NULL;
-            }
             if (b1 == b)
                 *pb = b1->next;
             else
@@ -1036,15 +1198,110 @@ void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
     }
 }
 
+/* find the index of the style run containing offset */
+static int style_map_find(StyleMap *map, int offset)
+{
+    int lo, hi, mid;
+
+    /* fast path for sequential accesses */
+    lo = map->last_run;
+    if (lo < map->nb_runs && map->runs[lo].offset <= offset) {
+        if (lo + 1 >= map->nb_runs || offset < map->runs[lo + 1].offset)
+            return lo;
+        if (lo + 2 >= map->nb_runs || offset < map->runs[lo + 2].offset)
+            return map->last_run = lo + 1;
+    }
+    /* binary search the last run starting at or before offset */
+    lo = 0;
+    hi = map->nb_runs;
+    while (hi - lo > 1) {
+        mid = (lo + hi) >> 1;
+        if (map->runs[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return map->last_run = lo;
+}
+
+/* replace del_size bytes at offset with ins_size bytes of style */
+static void style_map_replace(StyleMap *map, int offset, int del_size,
+                              int ins_size, QETermStyle style)
+{
+    QETermStyle style_after = 0;
+    int i, lo, hi, end, n, has_after;
+
+    offset = clamp_offset(offset, 0, map->size);
+    del_size = clamp_offset(del_size, 0, map->size - offset);
+    end = offset + del_size;
+    has_after = (end < map->size);
+    if (has_after)
+        style_after = map->runs[style_map_find(map, end)].style;
+
+    /* runs starting in [offset, end] are removed */
+    lo = hi = map->nb_runs;
+    if (map->nb_runs > 0 && offset <= map->runs[map->nb_runs - 1].offset) {
+        lo = style_map_find(map, offset);
+        if (map->runs[lo].offset < offset)
+            lo++;
+        for (hi = lo; hi < map->nb_runs && map->runs[hi].offset <= end; hi++)
+            continue;
+    }
+    /* at most 2 runs are inserted */
+    n = map->nb_runs - (hi - lo) + 2;
+    if (n > map->nb_allocated) {
+        int nb_allocated = max_int(n, map->nb_allocated + (map->nb_allocated >> 1) + 16);
+        if (!qe_realloc(&map->runs, nb_allocated * sizeof(StyleRun)))
+            return;
+        map->nb_allocated = nb_allocated;
+    }
+    n = (ins_size > 0) + has_after;
+    memmove(map->runs + lo + n, map->runs + hi,
+            (map->nb_runs - hi) * sizeof(StyleRun));
+    map->nb_runs += n - (hi - lo);
+    for (i = lo + n; i < map->nb_runs; i++)
+        map->runs[i].offset += ins_size - del_size;
+    i = lo;
+    if (ins_size > 0) {
+        map->runs[i].offset = offset;
+        map->runs[i].style = style;
+        i++;
+    }
+    if (has_after) {
+        map->runs[i].offset = offset + ins_size;
+        map->runs[i].style = style_after;
+    }
+    map->size += ins_size - del_size;
+
+    /* merge adjacent runs with the same style */
+    for (i = max_int(lo, 1); i < map->nb_runs && i <= lo + n; ) {
+        if (map->runs[i].style == map->runs[i - 1].style) {
+            memmove(map->runs + i, map->runs + i + 1,
+                    (map->nb_runs - i - 1) * sizeof(StyleRun));
+            map->nb_runs--;
+            n--;
+        } else {
+            i++;
+        }
+    }
+    map->last_run = 0;
+    if (map->nb_allocated > 64 && map->nb_runs < map->nb_allocated / 4) {
+        /* shrink the array after large deletions */
+        int nb_allocated = map->nb_allocated / 2;
+        if (qe_realloc(&map->runs, nb_allocated * sizeof(StyleRun)))
+            map->nb_allocated = nb_allocated;
+    }
+}
+
 int eb_create_style_buffer(EditBuffer *b, int flags)
 {
     if (b->b_styles) {
         /* XXX: should extend style width if needed */
         return 0;
     } else {
-        char name[MAX_BUFFERNAME_SIZE];
-        snprintf(name, sizeof(name), "*S<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
-        b->b_styles = eb_new(name, BF_SYSTEM | BF_IS_STYLE | BF_RAW);
+        b->b_styles = qe_mallocz(StyleMap);
+        if (!b->b_styles)
+            return 0;
         b->flags |= flags & BF_STYLES;
         b->style_shift = ((unsigned)(flags & BF_STYLES) / BF_STYLE1) - 1;
         b->style_bytes = 1 << b->style_shift;
@@ -1054,86 +1311,538 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
     }
 }
 
-void eb_free_style_buffer(EditBuffer *b)
-{
-    eb_free(&b->b_styles);
-    b->style_shift = b->style_bytes = 0;
-    eb_free_callback(b, eb_style_callback, NULL);
+void eb_free_style_buffer(EditBuffer *b)
+{
+    if (b->b_styles) {
+        qe_free(&b->b_styles->runs);
+        qe_free(&b->b_styles);
+    }
+    b->style_shift = b->style_bytes = 0;
+    eb_free_callback(b, eb_style_callback, NULL);
+}
+
+void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
+                  int offset, int size)
+{
+    if (!b->b_styles || !size)
+        return;
+
+    /* styles are truncated to the buffer style width */
+    if (b->style_bytes < (int)sizeof(QETermStyle))
+        style &= ((QETermStyle)1 << (b->style_bytes * 8)) - 1;
+
+    switch (op) {
+    case LOGOP_WRITE:
+        style_map_replace(b->b_styles, offset, size, size, style);
+        break;
+    case LOGOP_INSERT:
+        style_map_replace(b->b_styles, offset, 0, size, style);
+        break;
+    case LOGOP_DELETE:
+        style_map_replace(b->b_styles, offset, size, 0, style);
+        break;
+    default:
+        break;
+    }
+}
+
+void eb_style_callback(EditBuffer *b, void *opaque, int arg,
+                       enum LogOperation op, int offset, int size)
+{
+    eb_set_style(b, b->cur_style, op, offset, size);
+}
+
+
+/************************************************************/
+/* undo buffer */
+
+/* Undo records are stored in a log buffer:
+ *   LogBuffer header, payload, int trailer (payload size)
+ * Payloads of deletes and writes are stored as raw bytes, sharing
+ * complete pages with the buffer, or as a sequence of compressed blocks
+ * above UNDO_PACK_MIN if few pages can be shared.  Ranges from untouched
+ * pages of the file mapping are referenced instead of copied.  When the
+ * log buffer exceeds qs->undo_limit, the oldest payloads are compressed
+ * into a temporary spill file and the oldest records are discarded if
+ * this is not enough.
+ */
+
+#define UNDO_PACK_MIN    4096   /* minimum payload size for compression */
+#define UNDO_BLOCK_SIZE  65536  /* size of independently compressed blocks */
+#define UNDO_SPILL_MIN   256    /* minimum payload size for spilling */
+
+/* Minimal LZ77 block compressor using a LZ4 style sequence format:
+ * token (literal length:4, match length - 4:4), extra literal length
+ * bytes, literals, 16-bit match offset, extra match length bytes.
+ * The last sequence only has literals.
+ */
+#define LZ_HASH_BITS   12
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_OFFSET  65535
+
+static inline uint32_t lz_read32(const u8 *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u8 *lz_put_length(u8 *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Return the compressed size or -1 if it would exceed dst_size */
+static int lz_compress_block(u8 *dst, int dst_size, const u8 *src, int size)
+{
+    int table[1 << LZ_HASH_BITS];
+    const u8 *ip = src, *anchor = src, *end = src + size, *ref = NULL;
+    u8 *op = dst, *oend = dst + dst_size;
+    int lit, mlen, h;
+    uint32_t seq;
+
+    memset(table, 0, sizeof(table));
+    for (;;) {
+        mlen = 0;
+        while (ip + LZ_MIN_MATCH <= end) {
+            seq = lz_read32(ip);
+            h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+            ref = table[h] ? src + table[h] - 1 : NULL;
+            table[h] = ip - src + 1;
+            if (ref && ip - ref <= LZ_MAX_OFFSET && lz_read32(ref) == seq) {
+                for (mlen = LZ_MIN_MATCH;
+                     ip + mlen < end && ref[mlen] == ip[mlen];
+                     mlen++)
+                    continue;
+                break;
+            }
+            ip++;
+        }
+        if (!mlen)
+            ip = end;
+        lit = ip - anchor;
+        /* token, literals, offset and length bytes must fit */
+        if (oend - op < 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1)
+            return -1;
+        *op++ = (min_int(lit, 15) << 4) |
+                (mlen ? min_int(mlen - LZ_MIN_MATCH, 15) : 0);
+        if (lit >= 15)
+            op = lz_put_length(op, lit - 15);
+        memcpy(op, anchor, lit);
+        op += lit;
+        if (!mlen)
+            break;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        if (mlen - LZ_MIN_MATCH >= 15)
+            op = lz_put_length(op, mlen - LZ_MIN_MATCH - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+    return op - dst;
+}
+
+/* Return the decompressed size or -1 if the data is inconsistent */
+static int lz_decompress_block(u8 *dst, int dst_size, const u8 *src, int size)
+{
+    const u8 *ip = src, *iend = src + size, *match;
+    u8 *op = dst, *oend = dst + dst_size;
+    int token, len, c, offset;
+
+    for (;;) {
+        if (ip >= iend)
+            return -1;
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += c = *ip++;
+            } while (c == 255);
+        }
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += c = *ip++;
+            } while (c == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+        /* byte copy handles overlapping matches */
+        for (match = op - offset; len-- > 0;)
+            *op++ = *match++;
+    }
+    return op - dst;
+}
+
+/* Return the offset in the file mapping of a buffer range if it lies
+ * entirely in contiguous untouched mapped pages, -1 otherwise.
+ */
+static int eb_get_map_offset(EditBuffer *b, int offset, int size)
+{
+    const u8 *map = b->map_address;
+    const u8 *start, *ptr;
+    const Page *p;
+    int len;
+
+    if (!map || size <= 0)
+        return -1;
+
+    p = find_page(b, offset, &offset);
+    start = ptr = p->data + offset;
+    for (;;) {
+        if (!(p->flags & PG_READ_ONLY) || p->block != b->map_block
+        ||  p->data + offset != ptr)
+            return -1;
+        len = p->size - offset;
+        if (len >= size)
+            break;
+        ptr += len;
+        size -= len;
+        p++;
+        offset = 0;
+    }
+    return start - map;
+}
+
+/* Store 'size' bytes from offset 'offset' of buffer 'src' as
+ * compressed blocks, each preceded by an int: the compressed length
+ * if positive, minus the raw length otherwise.  The blocks are written
+ * to the spill file 'f' at its current position if not NULL, to the
+ * log buffer of 'b' at 'log_index' otherwise.
+ * Return the number of bytes stored or -1 upon failure.
+ */
+static int eb_log_pack(EditBuffer *b, EditBuffer *src, int offset, int size,
+                       FILE *f, int log_index)
+{
+    int pos, done, len, clen, hdr;
+    const u8 *data;
+    u8 *buf;
+
+    buf = qe_malloc_bytes(UNDO_BLOCK_SIZE * 2);
+    if (!buf)
+        return -1;
+
+    pos = log_index;
+    for (done = 0; done < size; done += len) {
+        len = eb_read(src, offset + done, buf, min_int(size - done, UNDO_BLOCK_SIZE));
+        if (len <= 0)
+            break;
+        clen = lz_compress_block(buf + UNDO_BLOCK_SIZE, len - 1, buf, len);
+        if (clen > 0) {
+            hdr = clen;
+            data = buf + UNDO_BLOCK_SIZE;
+        } else {
+            hdr = -len;
+            clen = len;
+            data = buf;
+        }
+        if (f) {
+            if (fwrite(&hdr, sizeof(int), 1, f) != 1
+            ||  (int)fwrite(data, 1, clen, f) != clen) {
+                pos = log_index - 1;
+                break;
+            }
+            pos += sizeof(int) + clen;
+        } else {
+            pos += eb_write(b->log_buffer, pos, &hdr, sizeof(int));
+            pos += eb_write(b->log_buffer, pos, data, clen);
+        }
+    }
+    qe_free(&buf);
+    return pos - log_index;
+}
+
+/* Store the payload for a delete or write record at 'log_index',
+ * set lb->encoding and return the payload size.
+ */
+static int eb_log_save_data(EditBuffer *b, LogBuffer *lb, int log_index)
+{
+    int map_offset, size;
+
+    /* the file mapping is immutable, keep a reference to it */
+    map_offset = eb_get_map_offset(b, lb->offset, lb->size);
+    if (map_offset >= 0) {
+        lb->encoding = LOG_DATA_MAPPED;
+        return eb_write(b->log_buffer, log_index, &map_offset, sizeof(int));
+    }
+    /* share complete pages if possible, compress otherwise */
+    if (lb->size >= UNDO_PACK_MIN
+    &&  eb_get_shared_size(b, lb->offset, lb->size) < lb->size / 2) {
+        size = eb_log_pack(b, b, lb->offset, lb->size, NULL, log_index);
+        if (size >= 0) {
+            lb->encoding = LOG_DATA_PACKED;
+            return size;
+        }
+    }
+    lb->encoding = LOG_DATA_RAW;
+    return eb_insert_buffer(b->log_buffer, log_index, b, lb->offset, lb->size);
+}
+
+/* Read payload bytes from the spill file if 'f' is not NULL, from the
+ * log buffer otherwise.  Return 'size' or -1 upon failure.
+ */
+static int eb_log_read(EditBuffer *b, FILE *f, int pos, void *buf, int size)
+{
+    if (f) {
+        if (fseek(f, pos, SEEK_SET) || (int)fread(buf, 1, size, f) != size)
+            return -1;
+        return size;
+    }
+    if (eb_read(b->log_buffer, pos, buf, size) != size)
+        return -1;
+    return size;
+}
+
+/* Insert the payload of undo record 'lb' stored at 'log_index' into
+ * buffer 'b' at 'offset'.  Return the number of bytes inserted.
+ */
+static int eb_log_restore(EditBuffer *b, int offset, int log_index,
+                          const LogBuffer *lb)
+{
+    FILE *f = NULL;
+    int encoding = lb->encoding;
+    int pos = log_index;
+    int size = lb->size;
+    int done, len, clen, map_offset;
+    LogSpill ls;
+    u8 *buf;
+
+    if (encoding == LOG_DATA_SPILLED) {
+        if (!b->log_spill_file
+        ||  eb_read(b->log_buffer, log_index, &ls, sizeof(ls)) != sizeof(ls))
+            return 0;
+        f = b->log_spill_file;
+        pos = ls.file_offset;
+        encoding = ls.encoding;
+    }
+    if (encoding == LOG_DATA_MAPPED) {
+        if (eb_read(b->log_buffer, pos, &map_offset, sizeof(int)) != sizeof(int)
+        ||  !b->map_address || map_offset < 0
+        ||  map_offset > b->map_length - size)
+            return 0;
+        return eb_insert(b, offset, (u8 *)b->map_address + map_offset, size);
+    }
+    if (encoding == LOG_DATA_RAW && !f)
+        return eb_insert_buffer(b, offset, b->log_buffer, pos, size);
+
+    buf = qe_malloc_bytes(UNDO_BLOCK_SIZE * 2);
+    if (!buf)
+        return 0;
+
+    for (done = 0; done < size; done += len) {
+        len = min_int(size - done, UNDO_BLOCK_SIZE);
+        if (encoding == LOG_DATA_PACKED) {
+            if (eb_log_read(b, f, pos, &clen, sizeof(int)) < 0)
+                break;
+            pos += sizeof(int);
+            if (clen < 0) {
+                if (-clen != len || eb_log_read(b, f, pos, buf, len) < 0)
+                    break;
+                pos += len;
+            } else {
+                if (clen >= UNDO_BLOCK_SIZE
+                ||  eb_log_read(b, f, pos, buf + UNDO_BLOCK_SIZE, clen) < 0
+                ||  lz_decompress_block(buf, len, buf + UNDO_BLOCK_SIZE, clen) != len)
+                    break;
+                pos += clen;
+            }
+        } else {
+            if (eb_log_read(b, f, pos, buf, len) < 0)
+                break;
+            pos += len;
+        }
+        eb_insert(b, offset + done, buf, len);
+    }
+    qe_free(&buf);
+    return done;
+}
+
+/* Move the payload of the oldest unspilled undo record to the spill
+ * file.  Return 1 if a record was spilled, 0 otherwise.
+ */
+static int eb_log_spill(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    u8 buf[4096];
+    LogBuffer lb;
+    LogSpill ls;
+    int index, pos, len, delta, trailer;
+
+    for (index = b->log_spill_index; index < b->log_new_index;
+         index += sizeof(lb) + lb.data_size + sizeof(int)) {
+        if (eb_read(b->log_buffer, index, &lb, sizeof(lb)) != sizeof(lb))
+            return 0;
+        if ((lb.encoding == LOG_DATA_RAW || lb.encoding == LOG_DATA_PACKED)
+        &&  lb.data_size >= UNDO_SPILL_MIN)
+            break;
+    }
+    b->log_spill_index = index;
+    if (index >= b->log_new_index
+    ||  lb.data_size > qs->undo_spill_limit - b->log_spill_size)
+        return 0;
+
+    if (!b->log_spill_file) {
+        b->log_spill_file = tmpfile();
+        b->log_spill_size = 0;
+        if (!b->log_spill_file)
+            return 0;
+    }
+    if (fseek(b->log_spill_file, b->log_spill_size, SEEK_SET))
+        return 0;
+
+    pos = index + sizeof(lb);
+    ls.file_offset = b->log_spill_size;
+    ls.data_size = lb.data_size;
+    ls.encoding = lb.encoding;
+    if (lb.encoding == LOG_DATA_RAW && lb.data_size >= UNDO_PACK_MIN) {
+        /* compress shared pages on their way to the spill file */
+        ls.data_size = eb_log_pack(b, b->log_buffer, pos, lb.data_size,
+                                   b->log_spill_file, 0);
+        if (ls.data_size < 0)
+            return 0;
+        ls.encoding = LOG_DATA_PACKED;
+    } else {
+        for (len = 0; len < lb.data_size;) {
+            int n = eb_read(b->log_buffer, pos + len, buf,
+                            min_int(lb.data_size - len, ssizeof(buf)));
+            if (n <= 0 || (int)fwrite(buf, 1, n, b->log_spill_file) != n)
+                return 0;
+            len += n;
+        }
+    }
+    b->log_spill_size += ls.data_size;
+
+    /* replace the payload with the spill reference */
+    delta = lb.data_size - sizeof(ls);
+    eb_replace(b->log_buffer, pos, lb.data_size, &ls, sizeof(ls));
+    lb.encoding = LOG_DATA_SPILLED;
+    lb.data_size = trailer = sizeof(ls);
+    eb_write(b->log_buffer, index, &lb, sizeof(lb));
+    eb_write(b->log_buffer, pos + sizeof(ls), &trailer, sizeof(int));
+
+    b->log_new_index -= delta;
+    if (b->log_current > index + 1)
+        b->log_current -= delta;
+    b->log_spill_index = pos + sizeof(ls) + sizeof(int);
+    return 1;
 }
 
-/* XXX: should compress styles buffer with run length encoding */
-void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size)
+/* Discard the oldest undo record */
+static void eb_log_drop_first(EditBuffer *b)
 {
-    union {
-        uint64_t buf8[256 / 8];
-        uint32_t buf4[256 / 4];
-        uint16_t buf2[256 / 2];
-        unsigned char buf[256];
-        QETermStyle align;
-    } s;
-    int i, len;
-
-    if (!b->b_styles || !size)
-        return;
+    LogBuffer lb;
+    int len;
 
-    offset = (offset >> b->char_shift) << b->style_shift;
-    size = (size >> b->char_shift) << b->style_shift;
+    /* XXX: should check undo record integrity */
+    eb_read(b->log_buffer, 0, &lb, sizeof(lb));
+    len = sizeof(LogBuffer) + lb.data_size + sizeof(int);
+    eb_delete(b->log_buffer, 0, len);
+    b->log_new_index -= len;
+    if (b->log_current > 0)
+        b->log_current = max_int(1, b->log_current - len);
+    b->log_spill_index = max_int(0, b->log_spill_index - len);
+    if (b->log_spill_index == 0 && b->log_spill_file) {
+        /* no spilled records left: release the spill file */
+        fclose(b->log_spill_file);
+        b->log_spill_file = NULL;
+        b->log_spill_size = 0;
+    }
+    b->nb_logs--;
+}
+
+/* Enforce the undo record count and memory budget.  The newest record
+ * is always kept so that the last change can be undone, with a warning
+ * if it exceeds the budget by itself.
+ */
+static void eb_log_trim(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
 
-    switch (op) {
-    case LOGOP_WRITE:
-    case LOGOP_INSERT:
-        /* XXX: should use a single loop to initialize buf */
-        /* XXX: should initialize buf just once */
-        while (size > 0) {
-            len = min_offset(size, ssizeof(s.buf));
-            if (b->style_shift == 3) {
-                for (i = 0; i < len >> 3; i++) {
-                    s.buf8[i] = style;
-                }
-            } else
-            if (b->style_shift == 2) {
-                for (i = 0; i < len >> 2; i++) {
-                    s.buf4[i] = style;
-                }
-            } else
-            if (b->style_shift == 1) {
-                for (i = 0; i < len >> 1; i++) {
-                    s.buf2[i] = style;
-                }
-            } else {
-                memset(s.buf, style, len);
-            }
-            if (op == LOGOP_WRITE)
-                eb_write(b->b_styles, offset, s.buf, len);
-            else
-                eb_insert(b->b_styles, offset, s.buf, len);
-            size -= len;
-            offset += len;
+    while (b->nb_logs > 1) {
+        if (b->nb_logs < NB_LOGS_MAX) {
+            if (qs->undo_limit <= 0
+            ||  b->log_buffer->total_size <= qs->undo_limit)
+                return;
+            if (qs->undo_spill_limit > 0 && eb_log_spill(b))
+                continue;
         }
-        break;
-    case LOGOP_DELETE:
-        eb_delete(b->b_styles, offset, size);
-        break;
-    default:
-        break;
+        eb_log_drop_first(b);
+    }
+    if (b->nb_logs == 1 && qs->undo_limit > 0
+    &&  b->log_buffer->total_size > qs->undo_limit) {
+        if (qs->undo_spill_limit > 0 && eb_log_spill(b)
+        &&  b->log_buffer->total_size <= qs->undo_limit)
+            return;
+        put_status(NULL, "Undo record of %d bytes for %s exceeds undo-limit",
+                   b->log_buffer->total_size, b->name);
     }
 }
 
-void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size)
+#ifdef CONFIG_MMAP
+/* Copy the payload of undo records referring to the file mapping into
+ * the log buffer before the mapping is released.
+ */
+static void eb_log_unmap(EditBuffer *b)
 {
-    eb_set_style(b, b->cur_style, op, offset, size);
-}
+    LogBuffer lb;
+    int index, pos, map_offset, delta, trailer;
 
+    if (!b->log_buffer || !b->map_address)
+        return;
 
-/************************************************************/
-/* undo buffer */
+    for (index = 0; index < b->log_new_index;
+         index += sizeof(lb) + lb.data_size + sizeof(int)) {
+        if (eb_read(b->log_buffer, index, &lb, sizeof(lb)) != sizeof(lb))
+            return;
+        if (lb.encoding != LOG_DATA_MAPPED)
+            continue;
+        pos = index + sizeof(lb);
+        if (eb_read(b->log_buffer, pos, &map_offset, sizeof(int)) != sizeof(int)
+        ||  map_offset < 0 || map_offset > b->map_length - lb.size)
+            continue;
+        delta = lb.size - sizeof(int);
+        eb_replace(b->log_buffer, pos, sizeof(int),
+                   (u8 *)b->map_address + map_offset, lb.size);
+        lb.encoding = LOG_DATA_RAW;
+        lb.data_size = trailer = lb.size;
+        eb_write(b->log_buffer, index, &lb, sizeof(lb));
+        eb_write(b->log_buffer, pos + lb.size, &trailer, sizeof(int));
+
+        b->log_new_index += delta;
+        if (b->log_current > index + 1)
+            b->log_current += delta;
+        if (b->log_spill_index > index)
+            b->log_spill_index += delta;
+    }
+    eb_log_trim(b);
+}
+#endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
                       int offset, int size)
 {
-    int was_modified, len, size_trailer;
+    int was_modified, size_trailer;
     LogBuffer lb;
     EditBufferCallbackList *l;
 
@@ -1168,21 +1877,7 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         b->last_log = 0;
         b->last_log_char = 0;
         b->nb_logs = 0;
-    }
-    /* XXX: better test to limit size */
-    if (b->nb_logs >= (NB_LOGS_MAX-1)) {
-        /* no free space, delete least recent entry */
-        /* XXX: should check undo record integrity */
-        eb_read(b->log_buffer, 0, &lb, sizeof(lb));
-        len = lb.size;
-        if (lb.op == LOGOP_INSERT)
-            len = 0;
-        len += sizeof(LogBuffer) + sizeof(int);
-        eb_delete(b->log_buffer, 0, len);
-        b->log_new_index -= len;
-        if (b->log_current > 1)
-            b->log_current -= len;
-        b->nb_logs--;
+        b->log_spill_index = 0;
     }
 
     /* If inserting, try and coalesce log record with previous */
@@ -1206,38 +1901,41 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
 
     /* header */
     lb.pad1 = '\n';   /* make log buffer display readable */
-    lb.pad2 = ':';
+    lb.encoding = LOG_DATA_RAW;
     lb.op = op;
     lb.offset = offset;
     lb.size = size;
+    lb.data_size = 0;
     lb.was_modified = was_modified;
     eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
-    b->log_new_index += sizeof(lb);
 
     /* data */
     switch (op) {
     case LOGOP_DELETE:
     case LOGOP_WRITE:
-        eb_insert_buffer(b->log_buffer, b->log_new_index, b, offset, size);
-        b->log_new_index += size;
-        size_trailer = size;
+        lb.data_size = eb_log_save_data(b, &lb, b->log_new_index + sizeof(lb));
+        /* update header with payload encoding and size */
+        eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
         break;
     default:
-        size_trailer = 0;
         break;
     }
+    b->log_new_index += sizeof(lb) + lb.data_size;
+
     /* trailer */
+    size_trailer = lb.data_size;
     eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(int));
     b->log_new_index += sizeof(int);
 
     b->nb_logs++;
+    eb_log_trim(b);
 }
 
 void do_undo(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    int log_index, log_current, size_trailer, len;
     LogBuffer lb;
 
     if (!b->log_buffer) {
@@ -1254,10 +1952,11 @@ void do_undo(EditState *s)
         b->log_current = 0;
     }
 
-    if (b->log_current == 0) {
+    log_current = b->log_current;
+    if (log_current == 0) {
         log_index = b->log_new_index;
     } else {
-        log_index = b->log_current - 1;
+        log_index = log_current - 1;
     }
     if (log_index == 0) {
         put_status(s, "No further undo information");
@@ -1291,8 +1990,14 @@ void do_undo(EditState *s)
         /* we must disable the log because we want to record a single
            write (we should have the single operation: eb_write_buffer) */
         b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        /* restore the old data before deleting the current data */
+        len = eb_log_restore(b, lb.offset, log_index, &lb);
+        if (len != lb.size) {
+            eb_delete(b, lb.offset, len);
+            b->save_log &= ~2;
+            goto fail;
+        }
+        eb_delete(b, lb.offset + lb.size, lb.size);
         b->save_log &= ~2;
         eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
         s->offset = lb.offset + lb.size;
@@ -1302,7 +2007,12 @@ void do_undo(EditState *s)
            would be modified BEFORE we insert it by the implicit
            eb_addlog */
         b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        len = eb_log_restore(b, lb.offset, log_index, &lb);
+        if (len != lb.size) {
+            eb_delete(b, lb.offset, len);
+            b->save_log &= ~2;
+            goto fail;
+        }
         b->save_log &= ~2;
         eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
         s->offset = lb.offset + lb.size;
@@ -1316,12 +2026,18 @@ void do_undo(EditState *s)
     }
 
     b->modified = lb.was_modified;
+    return;
+
+ fail:
+    /* leave the undo state unchanged */
+    b->log_current = log_current;
+    put_status(s, "Undo data is no longer available");
 }
 
 void do_redo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
+    int log_index, log_current, size_trailer, len;
     LogBuffer lb;
 
     if (!b->log_buffer) {
@@ -1345,12 +2061,10 @@ void do_redo(EditState *s)
     put_status(s, "Redo!");
 
     /* go forward in undo stack */
-    log_index = b->log_current - 1;
+    log_current = b->log_current;
+    log_index = log_current - 1;
     eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-    if (lb.op != LOGOP_INSERT)
-        log_index += lb.size;
-    log_index += sizeof(int);
+    log_index += sizeof(LogBuffer) + lb.data_size + sizeof(int);
     /* log_current is 1 + index to have zero as default value */
     b->log_current = log_index + 1;
 
@@ -1369,8 +2083,14 @@ void do_redo(EditState *s)
         /* we must disable the log because we want to record a single
            write (we should have the single operation: eb_write_buffer) */
         b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        /* restore the old data before deleting the current data */
+        len = eb_log_restore(b, lb.offset, log_index, &lb);
+        if (len != lb.size) {
+            eb_delete(b, lb.offset, len);
+            b->save_log &= ~2;
+            goto fail;
+        }
+        eb_delete(b, lb.offset + lb.size, lb.size);
         b->save_log &= ~3;
         eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
         b->save_log |= 1;
@@ -1381,7 +2101,12 @@ void do_redo(EditState *s)
            would be modified BEFORE we insert it by the implicit
            eb_addlog */
         b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
+        len = eb_log_restore(b, lb.offset, log_index, &lb);
+        if (len != lb.size) {
+            eb_delete(b, lb.offset, len);
+            b->save_log &= ~2;
+            goto fail;
+        }
         b->save_log &= ~3;
         eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
         b->save_log |= 1;
@@ -1402,11 +2127,19 @@ void do_redo(EditState *s)
     log_index -= sizeof(LogBuffer);
     eb_delete(b->log_buffer, log_index, b->log_new_index - log_index);
     b->log_new_index = log_index;
+    if (b->log_spill_index > log_index)
+        b->log_spill_index = log_index;
 
     if (b->log_current >= log_index + 1) {
         /* redone everything */
         b->log_current = 0;
     }
+    return;
+
+ fail:
+    /* leave the undo state unchanged */
+    b->log_current = log_current;
+    put_status(s, "Redo data is no longer available");
 }
 
 /************************************************************/
@@ -1499,30 +2232,28 @@ char32_t eb_nextc(EditBuffer *b, int offset, int *next_ptr)
 
 QETermStyle eb_get_style(EditBuffer *b, int offset)
 {
-    if (b->b_styles) {
-        if (b->style_shift == 3) {
-            uint64_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 3, &style, 8);
-            return style;
-        } else
-        if (b->style_shift == 2) {
-            uint32_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 2, &style, 4);
-            return style;
-        } else
-        if (b->style_shift == 1) {
-            uint16_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 1, &style, 2);
-            return style;
-        } else {
-            uint8_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 0, &style, 1);
-            return style;
-        }
-    }
+    StyleMap *map = b->b_styles;
+
+    if (map && offset >= 0 && offset < map->size)
+        return map->runs[style_map_find(map, offset)].style;
     return 0;
 }
 
+/* get the style at offset, return the end offset of its style run */
+int eb_get_style_run(EditBuffer *b, int offset, QETermStyle *stylep)
+{
+    StyleMap *map = b->b_styles;
+    int i;
+
+    if (map && offset >= 0 && offset < map->size) {
+        i = style_map_find(map, offset);
+        *stylep = map->runs[i].style;
+        return i + 1 < map->nb_runs ? map->runs[i + 1].offset : map->size;
+    }
+    *stylep = 0;
+    return b->total_size;
+}
+
 /* compute offset after moving 'n' chars from 'offset'.
  * 'n' can be negative
  */
@@ -1884,110 +2615,124 @@ int eb_replace(EditBuffer *b, int offset, int size,
 
 #define IOBUF_SIZE 32768
 
-#if 0
+/* Large files are loaded in the background: the file descriptor is
+ * registered as a read handler in the event loop and each callback
+ * appends data to the buffer for a limited time slice.  The buffer
+ * stays readonly and in 'loading' state until the end of file.
+ */
+#define LOAD_SLICE_MS    40     /* time slice for each batch */
+#define LOAD_DISPLAY_MS  200    /* minimum delay between redisplays */
 
 typedef struct BufferIOState {
-    URLContext *handle;
-    void (*progress_cb)(void *opaque, int size);
-    void (*completion_cb)(void *opaque, int err);
-    void *opaque;
-    int offset;
-    int saved_flags;
-    int saved_log;
-    int nolog;
+    int fd;             /* file being loaded */
+    int pid;            /* process saving the buffer */
+    int offset;         /* number of bytes loaded */
+    int size;           /* expected file size */
+    int saved_readonly; /* BF_READONLY state before loading */
+    int display_time;   /* time of last redisplay request */
     unsigned char buffer[IOBUF_SIZE];
 } BufferIOState;
 
-static void load_connected_cb(void *opaque, int err);
-static void load_read_cb(void *opaque, int size);
-static void eb_io_stop(EditBuffer *b, int err);
+static void eb_load_read_cb(void *opaque);
 
-/* load a buffer asynchronously and launch the callback. The buffer
-   stays in 'loading' state while begin loaded. It is also marked
-   readonly. */
-int load_buffer(EditBuffer *b, const char *filename,
-                int offset, int nolog,
-                void (*progress_cb)(void *opaque, int size),
-                void (*completion_cb)(void *opaque, int err), void *opaque)
+static int eb_start_loading(EditBuffer *b, FILE *f, int size)
 {
-    URLContext *h;
     BufferIOState *s;
+    int fd;
 
-    /* cannot load a buffer if already I/Os or readonly */
-    if (b->flags & (BF_LOADING | BF_SAVING | BF_READONLY))
-        return -1;
-    s = qe_mallocz(BufferIOState);
-    if (!s)
+    fd = dup(fileno(f));
+    if (fd < 0)
         return -1;
-    b->io_state = s;
-    h = url_new();
-    if (!h) {
-        qe_free(&b->io_state);
+    if (lseek(fd, 0, SEEK_SET) < 0 || (s = qe_mallocz(BufferIOState)) == NULL) {
+        close(fd);
         return -1;
     }
-    s->handle = h;
-    s->saved_flags = b->flags;
-    s->nolog = nolog;
-    if (s->nolog) {
-        s->saved_log = b->save_log;
-        b->save_log = 0;
-    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    s->fd = fd;
+    s->size = size;
+    s->saved_readonly = b->flags & BF_READONLY;
+    b->io_state = s;
     b->flags |= BF_LOADING | BF_READONLY;
-    s->handle = h;
-    s->progress_cb = progress_cb;
-    s->completion_cb = completion_cb;
-    s->opaque = opaque;
-    s->offset = offset;
-    printf("connect_async: '%s'\n", filename);
-    url_connect_async(s->handle, filename, URL_RDONLY,
-                      load_connected_cb, b);
+    /* load the first batch immediately so the first screen is complete */
+    eb_load_read_cb(b);
+    if (b->io_state)
+        set_read_handler(fd, eb_load_read_cb, b);
     return 0;
 }
 
-static void load_connected_cb(void *opaque, int err)
+static void eb_load_read_cb(void *opaque)
 {
     EditBuffer *b = opaque;
     BufferIOState *s = b->io_state;
-    printf("connect_cb: err=%d\n", err);
-    if (err) {
-        eb_io_stop(b, err);
+    int len, saved_log, modified, start_time, now;
+
+    if (!s)
         return;
+
+    /* data is appended without undo records nor modification */
+    saved_log = b->save_log;
+    modified = b->modified;
+    b->save_log = 0;
+    b->flags &= ~BF_READONLY;
+    start_time = now = get_clock_ms();
+    for (;;) {
+        len = read(s->fd, s->buffer, IOBUF_SIZE);
+        if (len <= 0)
+            break;
+        s->offset += eb_insert(b, b->total_size, s->buffer, len);
+        now = get_clock_ms();
+        if (now - start_time >= LOAD_SLICE_MS)
+            break;
+    }
+    b->flags |= BF_READONLY;
+    b->save_log = saved_log;
+    b->modified = modified;
+
+    if (len < 0 && errno != EINTR && errno != EAGAIN) {
+        put_status(NULL, "Error while loading '%s': %s",
+                   b->filename, strerror(errno));
+        eb_stop_loading(b, -1);
+    } else
+    if (len == 0) {
+        eb_stop_loading(b, 0);
+    } else
+    if (now - s->display_time >= LOAD_DISPLAY_MS) {
+        s->display_time = now;
+        url_redisplay();
     }
-    url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
 }
 
-static void load_read_cb(void *opaque, int size)
+/* Stop background loading of buffer <b>.  <err> is 0 upon normal
+ * completion.  If loading is interrupted, the partial contents are
+ * kept but the buffer stays readonly to prevent overwriting the file.
+ */
+void eb_stop_loading(EditBuffer *b, int err)
 {
-    EditBuffer *b = opaque;
     BufferIOState *s = b->io_state;
 
-    printf("read_cb: size=%d\n", size);
-    if (size < 0) {
-        eb_io_stop(b, -EIO);
-    } else if (size == 0) {
-        /* end of file */
-        eb_io_stop(b, 0);
-    } else {
-        s->offset += eb_insert(b, s->offset, s->buffer, size);
-        /* launch next read request */
-        url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
-    }
+    if (!s || !(b->flags & BF_LOADING))
+        return;
+
+    set_read_handler(s->fd, NULL, NULL);
+    close(s->fd);
+    b->flags &= ~BF_LOADING;
+    if (!err && !s->saved_readonly && !access(b->filename, W_OK))
+        b->flags &= ~BF_READONLY;
+    qe_free(&b->io_state);
+    url_redisplay();
 }
 
-static void eb_io_stop(EditBuffer *b, int err)
+/* Return the percentage of the file loaded or -1 if not loading */
+int eb_get_load_progress(EditBuffer *b)
 {
     BufferIOState *s = b->io_state;
 
-    b->flags = s->saved_flags;
-    if (s->nolog) {
-        b->modified = 0;
-        b->save_log = s->saved_log;
-    }
-    url_close(s->handle);
-    s->completion_cb(s->opaque, err);
-    qe_free(&b->io_state);
+    if (!s || !(b->flags & BF_LOADING))
+        return -1;
+    if (s->size <= 0)
+        return 0;
+    return (int)((long long)s->offset * 100 / s->size);
 }
-#endif
 
 /* CG: returns number of bytes read, or -1 upon read error */
 int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
@@ -2015,15 +2760,17 @@ int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
 #ifdef CONFIG_MMAP
 void eb_munmap_buffer(EditBuffer *b)
 {
-    if (b->map_address) {
-        munmap(b->map_address, b->map_length);
-        b->map_address = NULL;
-        b->map_length = 0;
-    }
+    /* undo records cannot refer to a released mapping */
+    eb_log_unmap(b);
+    /* the mapping is released when no longer referenced by any page */
+    page_block_release(&b->map_block);
+    b->map_address = NULL;
+    b->map_length = 0;
 }
 
 int eb_mmap_buffer(EditBuffer *b, const char *filename)
 {
+    struct stat st;
     int fd, len, file_size, n, size;
     u8 *file_ptr, *ptr;
     Page *p;
@@ -2040,12 +2787,25 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
         close(fd);
         return -1;
     }
+    n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
+    /* the mapping is referenced by each page and by the buffer */
+    b->map_block = page_block_new(file_ptr, file_size, file_size, n + 1);
+    if (!b->map_block) {
+        munmap(file_ptr, file_size);
+        close(fd);
+        return -1;
+    }
     b->map_address = file_ptr;
     b->map_length = file_size;
+    if (!fstat(fd, &st)) {
+        b->map_block->map_dev = st.st_dev;
+        b->map_block->map_ino = st.st_ino;
+    }
 
-    n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
     p = qe_malloc_array(Page, n);
     if (!p) {
+        b->map_block->ref_count = 1;
+        eb_munmap_buffer(b);
         close(fd);
         return -1;
     }
@@ -2060,6 +2820,7 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
             len = MAX_PAGE_SIZE;
         p->data = ptr;
         p->size = len;
+        p->block = b->map_block;
         p->flags = PG_READ_ONLY;
         ptr += len;
         size -= len;
@@ -2082,6 +2843,7 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     if (stat(b->filename, &st))
         return -1;
 
+    b->mtime = st.st_mtime;
 #ifdef CONFIG_MMAP
     if (st.st_size >= qs->mmap_threshold) {
         if (!eb_mmap_buffer(b, b->filename))
@@ -2089,25 +2851,110 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     }
 #endif
     if (st.st_size <= qs->max_load_size) {
+        /* positions restored from a session need the whole contents */
+        if (qs->async_load_threshold > 0
+        &&  st.st_size >= qs->async_load_threshold
+        &&  !(b->flags & BF_DEFERRED)
+        &&  !eb_start_loading(b, f, st.st_size)) {
+            return 0;
+        }
         return eb_raw_buffer_load1(b, f, 0);
     }
     return -1;
 }
 
+#define SAVE_IOV_MAX  64
+
+/* Write buffer contents between <start> and <end> to file descriptor
+ * <fd> directly from the page data, return bytes written or -1 if error
+ */
+static int eb_write_fd(EditBuffer *b, int fd, int start, int end)
+{
+    struct iovec iov[SAVE_IOV_MAX];
+    const Page *p;
+    int offset, size, len, written, i, n;
+
+    written = 0;
+    if (start >= end)
+        return 0;
+
+    p = find_page(b, start, &offset);
+    for (size = end - start; size > 0;) {
+        /* gather a batch of page chunks */
+        for (n = 0; n < SAVE_IOV_MAX && size > 0; n++, p++) {
+            len = min_int(p->size - offset, size);
+            iov[n].iov_base = (void *)(p->data + offset);
+            iov[n].iov_len = len;
+            size -= len;
+            offset = 0;
+        }
+        /* write the batch, handling partial writes */
+        for (i = 0; i < n;) {
+            len = writev(fd, iov + i, n - i);
+            if (len <= 0) {
+                if (len < 0 && errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += len;
+            while (i < n && len >= (int)iov[i].iov_len) {
+                len -= iov[i].iov_len;
+                i++;
+            }
+            if (i < n) {
+                iov[i].iov_base = (u8 *)iov[i].iov_base + len;
+                iov[i].iov_len -= len;
+            }
+        }
+    }
+    return written;
+}
+
+/* Get the target of symbolic link <filename> so saving the file does
+ * not replace the link, return <filename> if not a link.
+ */
+static const char *eb_resolve_link(const char *filename, char *buf, int size)
+{
+    struct stat st;
+    char path[PATH_MAX];
+
+    if (lstat(filename, &st) || !S_ISLNK(st.st_mode)
+    ||  !realpath(filename, path))
+        return filename;
+    pstrcpy(buf, size, path);
+    return buf;
+}
+
 /* Write bytes between <start> and <end> to file filename,
- * return bytes written or -1 if error
+ * return bytes written or -1 if error.
+ * Regular files are written to a temporary file in the same directory,
+ * synced to disk and renamed atomically over the original file, so a
+ * crash never leaves a truncated file.
  */
+/* Return true if buffer data is mapped from the file described by st */
+static int eb_maps_file(EditBuffer *b, const struct stat *st)
+{
+#ifdef CONFIG_MMAP
+    const Page *p;
+    int i;
+
+    for (i = 0, p = b->page_table; i < b->nb_pages; i++, p++) {
+        if ((p->flags & PG_READ_ONLY) && p->block && p->block->map_length
+        &&  p->block->map_dev == st->st_dev && p->block->map_ino == st->st_ino)
+            return 1;
+    }
+#endif
+    return 0;
+}
+
 static int raw_buffer_save(EditBuffer *b, int start, int end,
                            const char *filename)
 {
-    int fd, len, size, written;
-    unsigned char buf[IOBUF_SIZE];
-
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0)
-        return -1;
+    char path[MAX_FILENAME_SIZE];
+    char tmpname[MAX_FILENAME_SIZE];
+    struct stat st;
+    int fd, written, exists, mode, mask;
 
-    //put_status(NULL, "writing %s", filename);
     if (end < start) {
         int tmp = start;
         start = end;
@@ -2117,24 +2964,61 @@ static int raw_buffer_save(EditBuffer *b, int start, int end,
         start = 0;
     if (end > b->total_size)
         end = b->total_size;
-    written = 0;
-    size = end - start;
-    while (size > 0) {
-        len = size;
-        if (len > IOBUF_SIZE)
-            len = IOBUF_SIZE;
-        eb_read(b, start, buf, len);
-        len = write(fd, buf, len);
-        if (len < 0) {
-            close(fd);
+
+    filename = eb_resolve_link(filename, path, sizeof(path));
+    exists = !stat(filename, &st);
+
+    fd = -1;
+    if ((!exists || S_ISREG(st.st_mode))
+    &&  snprintf(tmpname, sizeof(tmpname), "%s.qeXXXXXX",
+                 filename) < ssizeof(tmpname)) {
+        fd = mkstemp(tmpname);
+    }
+    if (fd < 0) {
+        /* special file or directory not writable: write in place.
+           Truncating a regular file would also destroy its backup if
+           it is a link, or the buffer data if it is mapped */
+        if (exists && S_ISREG(st.st_mode)
+        &&  (st.st_nlink > 1 || eb_maps_file(b, &st))) {
+            errno = EBUSY;
             return -1;
         }
-        written += len;
-        start += len;
-        size -= len;
+        fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        written = eb_write_fd(b, fd, start, end);
+        if (close(fd) < 0)
+            written = -1;
+        return written;
+    }
+
+    if (exists) {
+        mode = st.st_mode & 07777;
+        /* try and preserve the file owner, ignore failure */
+        if (fchown(fd, st.st_uid, st.st_gid)) {
+            /* file will belong to the current user */
+        }
+    } else {
+        mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    written = eb_write_fd(b, fd, start, end);
+    if (written >= 0 && (fchmod(fd, mode) < 0 || fsync(fd) < 0))
+        written = -1;
+    if (close(fd) < 0)
+        written = -1;
+    if (written < 0 || rename(tmpname, filename) < 0) {
+        unlink(tmpname);
+        return -1;
+    }
+    /* make the rename durable */
+    get_dirname(path, sizeof(path), filename);
+    fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
-    close(fd);
-    //put_status(NULL, "");
     return written;
 }
 
@@ -2452,7 +3336,13 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
         return eb_insert_buffer(dest, dest_offset, src, src_offset, size);
     } else {
         EditBuffer *b;
+        Page *p;
+        char32_t cbuf[1024];
+        u8 obuf[4096 + 2 * MAX_CHAR_BYTES];
+        u8 tmp[4 * MAX_CHAR_BYTES];
         int offset, offset_max, offset1 = dest_offset;
+        int page_offset, style_end, len, n, i, olen;
+        QETermStyle style;
 
         b = dest;
         if (!styles_flags
@@ -2462,18 +3352,36 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
             offset1 = 0;
         }
 
-        /* well, not very fast, but simple */
-        /* XXX: should optimize save_log system for insert sequences */
-        // XXX: should optimize styles transfer
+        /* transcode blocks of characters directly from the page data,
+         * one style run at a time */
         offset_max = min_offset(src->total_size, src_offset + size);
         size = 0;
+        style = 0;
+        style_end = offset_max;
         for (offset = src_offset; offset < offset_max;) {
-            char buf[MAX_CHAR_BYTES];
-            QETermStyle style = eb_get_style(src, offset);
-            char32_t c = eb_nextc(src, offset, &offset);
-            int len = eb_encode_char32(b, buf, c);
+            if (styles_flags) {
+                style_end = min_offset(eb_get_style_run(src, offset, &style),
+                                       offset_max);
+            }
+            p = find_page(src, offset, &page_offset);
+            len = min_offset(p->size - page_offset, style_end - offset);
+            n = charset_decode_block(&src->charset_state, cbuf, countof(cbuf),
+                                     p->data + page_offset, &len,
+                                     offset + len >= style_end);
+            if (len == 0) {
+                /* character split across pages: decode it from a copy */
+                len = eb_read(src, offset, tmp, min_offset(sizeof(tmp), style_end - offset));
+                n = charset_decode_block(&src->charset_state, cbuf, 1,
+                                         tmp, &len, 1);
+            }
+            offset += len;
             b->cur_style = style;
-            size += eb_insert(b, offset1 + size, buf, len);
+            for (i = 0; i < n; i += len) {
+                len = n - i;
+                olen = charset_encode_block(&b->charset_state, obuf, sizeof(obuf),
+                                            cbuf + i, &len);
+                size += eb_insert(b, offset1 + size, obuf, olen);
+            }
         }
 
         if (b != dest) {
@@ -2763,34 +3671,63 @@ int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
     return b->data_type->buffer_save(b, start, end, filename);
 }
 
+/* backup old file <filename> if present */
+static void eb_backup_file(const char *filename)
+{
+    QEmacsState *qs = &qe_state;
+    char buf1[MAX_FILENAME_SIZE];
+    struct stat st;
+
+    if (qs->backup_inhibited
+    ||  strlen(filename) >= MAX_FILENAME_SIZE - 1
+    ||  stat(filename, &st) || !S_ISREG(st.st_mode))
+        return;
+
+    if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
+        /* link the old file so it is never missing, the new contents
+           will be renamed over it. Rename if links are not supported */
+        unlink(buf1);
+        if (link(filename, buf1)) {
+            // should check error code
+            rename(filename, buf1);
+        }
+    }
+}
+
+/* Record the modification time of the file after saving the buffer
+ * so that only changes made by other programs are detected.
+ */
+static void eb_update_mtime(EditBuffer *b)
+{
+    struct stat st;
+
+    if (!stat(b->filename, &st))
+        b->mtime = st.st_mtime;
+}
+
 /* Save buffer contents to buffer associated file, handle backups,
  * return bytes written or -1 if error
  */
 int eb_save_buffer(EditBuffer *b)
 {
-    QEmacsState *qs = &qe_state;
     int ret, st_mode;
-    char buf1[MAX_FILENAME_SIZE];
+    char path[MAX_FILENAME_SIZE];
     const char *filename;
     struct stat st;
 
-    if (!b->data_type->buffer_save)
+    if (!b->data_type->buffer_save || (b->flags & (BF_LOADING | BF_DEFERRED)))
         return -1;
 
-    filename = b->filename;
+    /* wait for a pending background save to complete */
+    eb_wait_saving(b);
+
+    filename = eb_resolve_link(b->filename, path, sizeof(path));
     /* get old file permission */
     st_mode = 0644;
     if (stat(filename, &st) == 0)
         st_mode = st.st_mode & 0777;
 
-    if (!qs->backup_inhibited
-    &&  strlen(filename) < MAX_FILENAME_SIZE - 1) {
-        /* backup old file if present */
-        if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
-            // should check error code
-            rename(filename, buf1);
-        }
-    }
+    eb_backup_file(filename);
 
     /* CG: should pass st_mode to buffer_save */
     ret = b->data_type->buffer_save(b, 0, b->total_size, filename);
@@ -2801,6 +3738,7 @@ int eb_save_buffer(EditBuffer *b)
     /* set correct file st_mode to old file permissions */
     chmod(filename, st_mode);
 #endif
+    eb_update_mtime(b);
     /* reset log */
     /* CG: should not do this! */
     //eb_free_log_buffer(b);
@@ -2808,6 +3746,98 @@ int eb_save_buffer(EditBuffer *b)
     return ret;
 }
 
+#ifndef CONFIG_WIN32
+static void eb_save_done_cb(void *opaque, int status)
+{
+    EditBuffer *b = opaque;
+    BufferIOState *s = b->io_state;
+
+    if (!s || !(b->flags & BF_SAVING))
+        return;
+
+    set_pid_handler(s->pid, NULL, NULL);
+    b->flags &= ~BF_SAVING;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        eb_update_mtime(b);
+        put_status(NULL, "Wrote %d bytes to %s", s->size, b->filename);
+    } else {
+        /* the buffer contents are still unsaved */
+        b->modified = 1;
+        put_status(NULL, "Could not write %s", b->filename);
+    }
+    qe_free(&b->io_state);
+    url_redisplay();
+}
+#endif
+
+/* Save large raw buffers in a child process writing a snapshot of the
+ * pages while editing continues, return 0 if the save was started or
+ * -1 if the buffer must be saved synchronously.
+ */
+int eb_start_saving(EditBuffer *b)
+{
+#ifndef CONFIG_WIN32
+    QEmacsState *qs = &qe_state;
+    BufferIOState *s;
+    char path[MAX_FILENAME_SIZE];
+    const char *filename;
+    int pid;
+
+    if (b->data_type != &raw_data_type
+    ||  qs->async_save_threshold <= 0
+    ||  b->total_size < qs->async_save_threshold
+    ||  (b->flags & (BF_LOADING | BF_SAVING)) || b->io_state)
+        return -1;
+
+    s = qe_mallocz(BufferIOState);
+    if (!s)
+        return -1;
+
+    filename = eb_resolve_link(b->filename, path, sizeof(path));
+    eb_backup_file(filename);
+    pid = fork();
+    if (pid < 0) {
+        qe_free(&s);
+        return -1;
+    }
+    if (pid == 0) {
+        /* child process: write the file and exit */
+        _exit(raw_buffer_save(b, 0, b->total_size, filename) < 0);
+    }
+    s->fd = -1;
+    s->pid = pid;
+    s->size = b->total_size;
+    b->io_state = s;
+    b->flags |= BF_SAVING;
+    /* modifications during the save will set the flag again */
+    b->modified = 0;
+    set_pid_handler(pid, eb_save_done_cb, b);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Wait for the background save of buffer <b> to complete */
+void eb_wait_saving(EditBuffer *b)
+{
+#ifndef CONFIG_WIN32
+    BufferIOState *s = b->io_state;
+    int status;
+
+    if (!s || !(b->flags & BF_SAVING))
+        return;
+
+    while (waitpid(s->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    eb_save_done_cb(b, status);
+#endif
+}
+
 /* invalidate buffer raw data */
 void eb_invalidate_raw_data(EditBuffer *b)
 {
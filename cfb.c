@@ -162,91 +162,68 @@ static void cfb32_xor_rectangle(QEditScreen *s,
     }
 }
 
-static void cfb16_draw_glyph(QEditScreen *s1,
-                             int x1, int y1, int w, int h, QEColor color,
-                             unsigned char *glyph, int glyph_wrap)
+/* mask of the bits [lo, hi) of a 32-bit word */
+static inline uint32_t cfb_clip_mask(int lo, int hi)
 {
-    CFBContext *cfb = s1->priv_data;
-    unsigned char *dest, *d, *s, *src;
-    int n;
-    unsigned int col;
+    uint32_t m = 0xffffffff;
 
-    col = cfb->get_color(color);
-    dest = cfb->base + y1 * cfb->wrap + x1 * 2;
-    src = glyph;
+    if (lo > 0)
+        m = lo >= 32 ? 0 : m << lo;
+    if (hi < 32)
+        m &= hi <= 0 ? 0 : 0xffffffff >> (32 - hi);
+    return m;
+}
 
-    while (h > 0) {
-        n = w;
-        s = src;
-        d = dest;
-        while (n >= 4) {
-            if (s[0] >= 0x80)
-                ((uint16_t *)(void *)d)[0] = col;
-            if (s[1] >= 0x80)
-                ((uint16_t *)(void *)d)[1] = col;
-            if (s[2] >= 0x80)
-                ((uint16_t *)(void *)d)[2] = col;
-            if (s[3] >= 0x80)
-                ((uint16_t *)(void *)d)[3] = col;
-            s += 4;
-            d += 4 * 2;
-            n -= 4;
-        }
-        while (n > 0) {
-            if (s[0] >= 0x80)
-                ((uint16_t *)(void *)d)[0] = col;
-            s++;
-            d += 2;
-            n--;
+/* Draw a glyph whose top left corner is at x0, y0, clipped to the
+   x1, y1, x2, y2 rectangle.  Only the set pixels are visited, using
+   the glyph row masks. */
+static void cfb16_draw_glyph(QEditScreen *s1, const GlyphCache *g,
+                             int x0, int y0, int x1, int y1, int x2, int y2,
+                             unsigned int col)
+{
+    CFBContext *cfb = s1->priv_data;
+    const uint32_t *masks;
+    unsigned char *dest;
+    uint16_t *d;
+    int nw, k, y;
+    uint32_t bits;
+
+    nw = glyph_row_words(g);
+    masks = glyph_row_masks(g) + (y1 - y0) * nw;
+    dest = cfb->base + y1 * cfb->wrap + x0 * 2;
+    for (y = y1; y < y2; y++, dest += cfb->wrap) {
+        d = (uint16_t *)(void *)dest;
+        for (k = 0; k < nw; k++, d += 32) {
+            bits = *masks++ & cfb_clip_mask(x1 - x0 - 32 * k,
+                                            x2 - x0 - 32 * k);
+            for (; bits != 0; bits &= bits - 1)
+                d[ctz32(bits)] = col;
         }
-
-        h--;
-        src += glyph_wrap;
-        dest += cfb->wrap;
     }
 }
 
-static void cfb32_draw_glyph(QEditScreen *s1,
-                             int x1, int y1, int w, int h, QEColor color,
-                             unsigned char *glyph, int glyph_wrap)
+static void cfb32_draw_glyph(QEditScreen *s1, const GlyphCache *g,
+                             int x0, int y0, int x1, int y1, int x2, int y2,
+                             unsigned int col)
 {
     CFBContext *cfb = s1->priv_data;
-    unsigned char *dest, *d, *s, *src;
-    int n;
-    unsigned int col;
-
-    col = cfb->get_color(color);
-    dest = cfb->base + y1 * cfb->wrap + x1 * 4;
-    src = glyph;
-
-    while (h > 0) {
-        n = w;
-        s = src;
-        d = dest;
-        while (n >= 4) {
-            if (s[0] >= 0x80)
-                ((uint32_t *)(void *)d)[0] = col;
-            if (s[1] >= 0x80)
-                ((uint32_t *)(void *)d)[1] = col;
-            if (s[2] >= 0x80)
-                ((uint32_t *)(void *)d)[2] = col;
-            if (s[3] >= 0x80)
-                ((uint32_t *)(void *)d)[3] = col;
-            s += 4;
-            d += 4 * 4;
-            n -= 4;
-        }
-        while (n > 0) {
-            if (s[0] >= 0x80)
-                ((uint32_t *)(void *)d)[0] = col;
-            s++;
-            d += 4;
-            n--;
+    const uint32_t *masks;
+    unsigned char *dest;
+    uint32_t *d;
+    int nw, k, y;
+    uint32_t bits;
+
+    nw = glyph_row_words(g);
+    masks = glyph_row_masks(g) + (y1 - y0) * nw;
+    dest = cfb->base + y1 * cfb->wrap + x0 * 4;
+    for (y = y1; y < y2; y++, dest += cfb->wrap) {
+        d = (uint32_t *)(void *)dest;
+        for (k = 0; k < nw; k++, d += 32) {
+            bits = *masks++ & cfb_clip_mask(x1 - x0 - 32 * k,
+                                            x2 - x0 - 32 * k);
+            for (; bits != 0; bits &= bits - 1)
+                d[ctz32(bits)] = col;
         }
-
-        h--;
-        src += glyph_wrap;
-        dest += cfb->wrap;
     }
 }
 
@@ -256,10 +233,10 @@ static void cfb_draw_text(QEditScreen *s, QEFont *font,
 {
     CFBContext *cfb = s->priv_data;
     GlyphCache *g;
-    unsigned char *glyph_ptr;
-    int i, x1, y1, x2, y2, wrap, x;
-    unsigned int cc;
+    int i, x0, y0, x1, y1, x2, y2, x;
+    unsigned int cc, col;
 
+    col = cfb->get_color(color);
     x = x_start;
     for (i = 0;i < len; i++) {
         cc = str[i];
@@ -267,37 +244,20 @@ static void cfb_draw_text(QEditScreen *s, QEFont *font,
         if (!g)
             continue;
 
-        x1 = x + g->x;
+        x0 = x1 = x + g->x;
         x2 = x1 + g->w;
         y2 = y - g->y;
-        y1 = y2 - g->h;
-        glyph_ptr = g->data;
-        wrap = g->w;
-
-        if (x1 >= s->clip_x1 && y1 >= s->clip_y1 &&
-            x2 <= s->clip_x2 && y2 <= s->clip_y2)
-            goto draw;
+        y0 = y1 = y2 - g->h;
 
         if (x2 <= s->clip_x1 || y2 <= s->clip_y1 ||
             x1 >= s->clip_x2 || y1 >= s->clip_y2)
             goto nodraw;
 
-        if (x1 < s->clip_x1) {
-            glyph_ptr += s->clip_x1 - x1;
-            x1 = s->clip_x1;
-        }
-        if (x2 > s->clip_x2)
-            x2 = s->clip_x2;
-        if (y1 < s->clip_y1) {
-            glyph_ptr += (s->clip_y1 - y1) * wrap;
-            y1 = s->clip_y1;
-        }
-        if (y2 > s->clip_y2)
-            y2 = s->clip_y2;
-    draw:
-        cfb->draw_glyph(s, x1, y1,
-                        x2 - x1, y2 - y1,
-                        color, glyph_ptr, wrap);
+        x1 = max_int(x1, s->clip_x1);
+        y1 = max_int(y1, s->clip_y1);
+        x2 = min_int(x2, s->clip_x2);
+        y2 = min_int(y2, s->clip_y2);
+        cfb->draw_glyph(s, g, x0, y0, x1, y1, x2, y2, col);
     nodraw:
         x += g->xincr;
     }
@@ -22,15 +22,17 @@
  * THE SOFTWARE.
  */
 
+struct GlyphCache;
+
 typedef struct CFBContext {
     unsigned char *base;
     int bpp;   /* number of bytes per pixel */
     int depth; /* number of color bits per pixel */
     int wrap;
     unsigned int (*get_color)(unsigned int);
-    void (*draw_glyph)(QEditScreen *s1,
-                       int x1, int y1, int w, int h, QEColor color,
-                       unsigned char *glyph, int glyph_wrap);
+    void (*draw_glyph)(QEditScreen *s1, const struct GlyphCache *g,
+                       int x0, int y0, int x1, int y1, int x2, int y2,
+                       unsigned int col);
 } CFBContext;
 
 int cfb_init(QEditScreen *s,
@@ -50,6 +50,151 @@ struct QECharset *first_charset;
 static unsigned short const table_idem[256] = { RUN256(0) };
 static unsigned short const table_none[256] = { REP256(ESCAPE_CHAR) };
 
+/* word at a time byte tests, x must not have bytes with the high bit set */
+#define ASCII_MASK64  0x8080808080808080ULL
+#define BYTES64(c)    (0x0101010101010101ULL * (c))
+/* true if the 64-bit word contains a byte equal to c */
+#define HAS_BYTE64(x, c)  ((((x) ^ BYTES64(c)) - BYTES64(1)) & ~((x) ^ BYTES64(c)) & ASCII_MASK64)
+/* true if the 64-bit word contains a byte less than c */
+#define HAS_LESS64(x, c)  (((x) - BYTES64(c)) & ~(x) & ASCII_MASK64)
+
+/* Count the code units equal to c in a block of n units of 1, 2 or 4
+ * bytes.  Units are compared 8 bytes at a time with exact lane masks
+ * and the matches accumulated per lane before summing them.
+ * c is in host byte order.
+ */
+static inline uint32_t load_unit(const u8 *p, int unit)
+{
+    uint16_t u16;
+    uint32_t u32;
+
+    if (unit == 1)
+        return *p;
+    if (unit == 2) {
+        memcpy(&u16, p, 2);
+        return u16;
+    }
+    memcpy(&u32, p, 4);
+    return u32;
+}
+
+static inline uint64_t lanes64(int unit)
+{
+    return unit == 1 ? 0x0101010101010101ULL :
+           unit == 2 ? 0x0001000100010001ULL : 0x0000000100000001ULL;
+}
+
+static int count_units(const u8 *buf, int n, int unit, uint32_t c)
+{
+    int width = unit * 8;
+    uint64_t ones = lanes64(unit);
+    uint64_t high = ones << (width - 1);
+    uint64_t low = high - ones;
+    uint64_t pat = ones * c;
+    const u8 *p = buf;
+    int count = 0, nwords = n * unit / 8, k, i;
+
+    while (nwords > 0) {
+        /* 31 words at most so 8-bit lane counts do not overflow */
+        uint64_t acc = 0;
+        k = min_int(nwords, 31);
+        nwords -= k;
+        while (k-- > 0) {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            p += 8;
+            x ^= pat;
+            acc += ~(((x & low) + low) | x | low) >> (width - 1);
+        }
+        count += (acc * ones) >> (64 - width);
+    }
+    for (i = (p - buf) / unit; i < n; i++) {
+        count += (load_unit(buf + i * unit, unit) == c);
+    }
+    return count;
+}
+
+/* Return the index of the last code unit equal to c or -1 */
+static int last_unit(const u8 *buf, int n, int unit, uint32_t c)
+{
+    int width = unit * 8;
+    uint64_t ones = lanes64(unit);
+    uint64_t high = ones << (width - 1);
+    uint64_t low = high - ones;
+    uint64_t pat = ones * c;
+    int i = n, step = 8 / unit;
+
+    while (i > 0 && ((i * unit) & 7)) {
+        i--;
+        if (load_unit(buf + i * unit, unit) == c)
+            return i;
+    }
+    while (i >= step) {
+        uint64_t x;
+        memcpy(&x, buf + (i - step) * unit, 8);
+        x ^= pat;
+        if (~(((x & low) + low) | x | low))
+            break;
+        i -= step;
+    }
+    while (i-- > 0) {
+        if (load_unit(buf + i * unit, unit) == c)
+            return i;
+    }
+    return -1;
+}
+
+/* Count the lines in a block of n code units, return the index of the
+ * first unit of the last line.  nl and lf are in host byte order.
+ */
+static int get_line_start(CharsetDecodeState *s, const u8 *buf, int n,
+                          int unit, uint32_t nl, uint32_t lf, int *line_ptr)
+{
+    int line, i;
+
+    line = count_units(buf, n, unit, nl);
+    i = 0;
+    if (line > 0)
+        i = last_unit(buf, n, unit, nl) + 1;
+    /* Skip \n after \r, or at start of buffer.
+     * Should check for pending skip state */
+    if (s->eol_type == EOL_DOS && i < n && load_unit(buf + i * unit, unit) == lf)
+        i++;
+    *line_ptr = line;
+    return i;
+}
+
+/* Count the UTF-8 character boundaries in a block: bytes other than
+ * trailing bytes, and other than '\n' if skip_lf.
+ */
+static int count_utf8_chars(const u8 *buf, int size, int skip_lf)
+{
+    uint64_t lf_mask = skip_lf ? ~0ULL : 0;
+    const u8 *p = buf;
+    const u8 *p_end = buf + size;
+    int count = size, k, c;
+
+    while (p_end - p >= 8) {
+        uint64_t acc = 0;
+        k = min_int((p_end - p) / 8, 31);
+        while (k-- > 0) {
+            uint64_t x, y;
+            memcpy(&x, p, 8);
+            p += 8;
+            y = x ^ BYTES64('\n');
+            y = ~(((y & ~ASCII_MASK64) + ~ASCII_MASK64) | y | ~ASCII_MASK64);
+            /* trailing bytes have bit 7 set and bit 6 clear */
+            acc += (((x & ~(x << 1)) | (y & lf_mask)) & ASCII_MASK64) >> 7;
+        }
+        count -= (acc * BYTES64(1)) >> 56;
+    }
+    while (p < p_end) {
+        c = *p++;
+        count -= ((c ^ 0x80) <= 0x3f) || (c == '\n' && skip_lf);
+    }
+    return count;
+}
+
 /********************************************************/
 /* raw */
 
@@ -231,6 +376,18 @@ static int probe_utf8(qe__unused__ QECharset *charset, const u8 *buf, int size)
     count_spaces = count_lines = count_utf8 = 0;
 
     while (p < p_end) {
+        /* skip words of printable ASCII characters and spaces */
+        while (p_end - p >= 8) {
+            uint64_t x;
+            memcpy(&x, p, 8);
+            if ((x & ASCII_MASK64) || HAS_LESS64(x, ' ') || HAS_BYTE64(x, 0x7F))
+                break;
+            if (HAS_BYTE64(x, ' '))
+                count_spaces++;
+            p += 8;
+        }
+        if (p >= p_end)
+            break;
         c = *p++;
         if (c <= 32) {
             if (c == ' ')
@@ -290,63 +447,27 @@ static u8 *encode_utf8(qe__unused__ QECharset *charset, u8 *q, char32_t c)
 static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const u8 *p, *p1, *lp;
-    int nl, line, col;
+    int start;
 
     QASSERT(size >= 0);
 
-    line = 0;
-    lp = p = buf;
-    p1 = p + size;
-    nl = s->eol_char;
-
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        lp = p;
-        line++;
-    }
-    /* now compute number of chars (XXX: potential problem if out of
-     * block, but works for correctly encoded UTF-8 contents. */
-    // XXX: trailing bytes are counted at the start of the block.
-    //      this is inconsistent with charset_goto_char_utf8().
-    //      should instead count the number of single and leading bytes
-    col = 0;
-    while (lp < p1) {
-        col++;
-        lp += utf8_length[*lp];
-    }
-    *line_ptr = line;
-    *col_ptr = col;
+    start = get_line_start(s, buf, size, 1, s->eol_char, '\n', line_ptr);
+    /* count the single and leading bytes of the last line, consistent
+     * with charset_goto_char_utf8() */
+    *col_ptr = count_utf8_chars(buf + start, size - start, 0);
 }
 
 static int charset_get_chars_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
-    int nb_chars, c;
-    const u8 *buf_end, *buf_ptr;
-
-    nb_chars = 0;
-    buf_ptr = buf;
-    buf_end = buf_ptr + size;
-    while (buf_ptr < buf_end) {
-        c = *buf_ptr++;
-        if (c == '\n' && s->eol_type == EOL_DOS) {
-            /* ignore \n in EOL_DOS scan, but count \r.
-             * XXX: potentially incorrect if buffer contains
-             * \n not preceded by \r and requires special state
-             * data to handle \r\n sequence at page boundary.
-             */
-            continue;
-        }
-        /* ignoring trailing bytes: will produce incorrect
-         * count on isolated and trailing bytes and overlong
-         * sequences.
-         */
-        nb_chars += ((c ^ 0x80) > 0x3f);
-    }
+    /* ignore \n in EOL_DOS scan, but count \r.
+     * XXX: potentially incorrect if buffer contains
+     * \n not preceded by \r and requires special state
+     * data to handle \r\n sequence at page boundary.
+     * Trailing bytes are ignored: this will produce incorrect
+     * counts on isolated and trailing bytes and overlong
+     * sequences.
+     */
     /* CG: nb_chars is the number of character boundaries, trailing
      * UTF-8 sequence at start of buffer is ignored in count while
      * incomplete UTF-8 sequence at end of buffer is counted.  This may
@@ -355,7 +476,7 @@ static int charset_get_chars_utf8(CharsetDecodeState *s,
      * incorrect counts on broken UTF-8 sequences spanning page
      * boundaries.
      */
-    return nb_chars;
+    return count_utf8_chars(buf, size, s->eol_type == EOL_DOS);
 }
 
 static int charset_goto_char_utf8(CharsetDecodeState *s,
@@ -482,39 +603,18 @@ static u8 *encode_ucs2le(qe__unused__ QECharset *charset, u8 *p, char32_t c)
 static void charset_get_pos_ucs2(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const uint16_t *p, *p1, *lp;
     uint16_t nl, lf;
     union { uint16_t n; char c[2]; } u;
-    int line, col;
+    int n = size >> 1;
 
-    line = 0;
-    lp = p = (const uint16_t *)(const void *)buf;
-    p1 = p + (size >> 1);
     u.n = 0;
     u.c[s->charset == &charset_ucs2be] = s->eol_char;
     nl = u.n;
     u.c[s->charset == &charset_ucs2be] = '\n';
     lf = u.n;
 
-    if (s->eol_type == EOL_DOS && p < p1 && *p == lf) {
-        /* Skip \n at start of buffer.
-         * Should check for pending skip state */
-        p++;
-        lp++;
-    }
-
     /* XXX: should handle surrogates */
-    while (p < p1) {
-        if (*p++ == nl) {
-            if (s->eol_type == EOL_DOS && p < p1 && *p == lf)
-                p++;
-            lp = p;
-            line++;
-        }
-    }
-    col = p1 - lp;
-    *line_ptr = line;
-    *col_ptr = col;
+    *col_ptr = n - get_line_start(s, buf, n, 2, nl, lf, line_ptr);
 }
 
 static int charset_goto_line_ucs2(CharsetDecodeState *s,
@@ -614,27 +714,18 @@ static int charset_get_chars_ucs2(CharsetDecodeState *s,
 {
     /* XXX: should handle surrogates */
     int count = size >> 1;  /* convert byte count to char16 count */
-    const uint16_t *buf_end, *buf_ptr;
     uint16_t nl;
     union { uint16_t n; char c[2]; } u;
 
     if (s->eol_type != EOL_DOS)
         return count;
 
-    buf_ptr = (const uint16_t *)(const void *)buf;
-    buf_end = buf_ptr + count;
-    // XXX: undefined behavior
     u.n = 0;
     u.c[s->charset == &charset_ucs2be] = '\n';
     nl = u.n;
 
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == nl) {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return count - count_units(buf, count, 2, nl);
 }
 
 static int charset_goto_char_ucs2(CharsetDecodeState *s,
@@ -758,38 +849,17 @@ static u8 *encode_ucs4le(qe__unused__ QECharset *charset, u8 *p, char32_t c)
 static void charset_get_pos_ucs4(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const uint32_t *p, *p1, *lp;
     uint32_t nl, lf;
     union { uint32_t n; char c[4]; } u;
-    int line, col;
+    int n = size >> 2;
 
-    line = 0;
-    lp = p = (const uint32_t *)(const void *)buf;
-    p1 = p + (size >> 2);
     u.n = 0;
     u.c[(s->charset == &charset_ucs4be) * 3] = s->eol_char;
     nl = u.n;
     u.c[(s->charset == &charset_ucs4be) * 3] = '\n';
     lf = u.n;
 
-    if (s->eol_type == EOL_DOS && p < p1 && *p == lf) {
-        /* Skip \n at start of buffer.
-         * Should check for pending skip state */
-        p++;
-        lp++;
-    }
-
-    while (p < p1) {
-        if (*p++ == nl) {
-            if (s->eol_type == EOL_DOS && p < p1 && *p == lf)
-                p++;
-            lp = p;
-            line++;
-        }
-    }
-    col = p1 - lp;
-    *line_ptr = line;
-    *col_ptr = col;
+    *col_ptr = n - get_line_start(s, buf, n, 4, nl, lf, line_ptr);
 }
 
 static int charset_goto_line_ucs4(CharsetDecodeState *s,
@@ -889,27 +959,18 @@ static int charset_get_chars_ucs4(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
     int count = size >> 2;  /* convert byte count to char32 count */
-    const uint32_t *buf_end, *buf_ptr;
     uint32_t nl;
     union { uint32_t n; char c[4]; } u;
 
     if (s->eol_type != EOL_DOS)
         return count;
 
-    buf_ptr = (const uint32_t *)(const void *)buf;
-    buf_end = buf_ptr + count;
-    // XXX: undefined behavior
     u.n = 0;
     u.c[(s->charset == &charset_ucs4be) * 3] = '\n';
     nl = u.n;
 
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == nl) {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return count - count_units(buf, count, 4, nl);
 }
 
 static int charset_goto_char_ucs4(CharsetDecodeState *s,
@@ -1059,6 +1120,188 @@ void charset_decode_close(CharsetDecodeState *s)
     memset(s, 0, sizeof(CharsetDecodeState));
 }
 
+/* Block transcoding: decode and encode arrays of characters with the
+ * end of line conversions performed by eb_nextc() and
+ * eb_encode_char32().  Runs of ASCII bytes are processed 8 bytes at a
+ * time and the UCS-2/UCS-4 encodings are handled inline.
+ */
+
+/* check if the charset decodes and encodes ASCII as single bytes */
+static int charset_is_ascii(CharsetDecodeState *s)
+{
+    int i;
+
+    if (s->char_size != 1)
+        return 0;
+    if (s->charset->variable_size
+    &&  s->charset != &charset_utf8 && s->charset != &charset_utf8x)
+        return 0;
+    for (i = 0; i < 128; i++) {
+        if (s->table[i] != i)
+            return 0;
+    }
+    return 1;
+}
+
+static char32_t charset_decode_one(CharsetDecodeState *s, const u8 **pp,
+                                   const u8 *p_end)
+{
+    u8 buf[MAX_CHAR_BYTES];
+    const u8 *p = *pp;
+    char32_t c;
+
+    if (p_end - p >= MAX_CHAR_BYTES) {
+        s->p = p;
+        c = s->decode_func(s);
+        *pp = s->p;
+    } else {
+        /* decode from a padded copy at the end of the block */
+        memset(buf, 0, sizeof buf);
+        memcpy(buf, p, p_end - p);
+        s->p = buf;
+        c = s->decode_func(s);
+        p += s->p - buf;
+        *pp = p < p_end ? p : p_end;
+    }
+    return c;
+}
+
+/* Decode the bytes from buf into at most dest_size code points.
+ * Decoding stops before a character that may be incomplete, unless
+ * flush is true.  Return the number of code points and update *sizep
+ * with the number of bytes used.
+ */
+int charset_decode_block(CharsetDecodeState *s, char32_t *dest, int dest_size,
+                         const u8 *buf, int *sizep, int flush)
+{
+    QECharset *charset = s->charset;
+    const unsigned short *table = s->table;
+    const u8 *p = buf, *p_end = buf + *sizep, *p0;
+    int n = 0, need, ascii = charset_is_ascii(s);
+    EOLType eol_type = s->eol_type;
+    char32_t c;
+
+    while (n < dest_size && p < p_end) {
+        if (ascii) {
+            /* copy runs of ASCII bytes without end of line conversion */
+            while (p_end - p >= 8 && dest_size - n >= 8) {
+                uint64_t x;
+                memcpy(&x, p, 8);
+                if ((x & ASCII_MASK64)
+                ||  (eol_type != EOL_UNIX && (HAS_BYTE64(x, '\r') || HAS_BYTE64(x, '\n'))))
+                    break;
+                dest[n + 0] = p[0];
+                dest[n + 1] = p[1];
+                dest[n + 2] = p[2];
+                dest[n + 3] = p[3];
+                dest[n + 4] = p[4];
+                dest[n + 5] = p[5];
+                dest[n + 6] = p[6];
+                dest[n + 7] = p[7];
+                p += 8;
+                n += 8;
+            }
+            if (p >= p_end || n >= dest_size)
+                break;
+        }
+        p0 = p;
+        if (charset == &charset_ucs2le || charset == &charset_ucs2be) {
+            if (p_end - p < 2 && !flush)
+                break;
+            c = charset_decode_one(s, &p, p_end);
+        } else
+        if (s->char_size == 1 && (c = table[*p]) != ESCAPE_CHAR) {
+            p++;
+        } else {
+            need = s->char_size;
+            if (charset == &charset_utf8 || charset == &charset_utf8x)
+                need = utf8_length[*p];
+            else
+            if (charset->variable_size)
+                need = MAX_CHAR_BYTES;
+            if (p_end - p < need && !flush)
+                break;
+            c = charset_decode_one(s, &p, p_end);
+        }
+        if (c == '\r') {
+            if (eol_type == EOL_DOS) {
+                /* \r\n is decoded as \n */
+                if (p_end - p < s->char_size) {
+                    if (!flush) {
+                        p = p0;
+                        break;
+                    }
+                } else {
+                    const u8 *p1 = p;
+                    if (charset_decode_one(s, &p1, p_end) == '\n')
+                        p = p1, c = '\n';
+                }
+            } else
+            if (eol_type == EOL_MAC) {
+                c = '\n';
+            }
+        } else
+        if (c == '\n' && eol_type == EOL_MAC) {
+            c = '\r';
+        }
+        dest[n++] = c;
+    }
+    *sizep = p - buf;
+    return n;
+}
+
+/* Encode code points from src into at most dest_size bytes, characters
+ * that cannot be encoded are replaced with '?'.  Return the number of
+ * bytes and update *np with the number of code points used.
+ */
+int charset_encode_block(CharsetDecodeState *s, u8 *dest, int dest_size,
+                         const char32_t *src, int *np)
+{
+    QECharset *charset = s->charset;
+    EOLType eol_type = s->eol_type;
+    u8 *q = dest, *q_end = dest + dest_size - 2 * MAX_CHAR_BYTES, *q1;
+    int i, n = *np, ascii = charset_is_ascii(s);
+    char32_t c;
+
+    for (i = 0; i < n && q <= q_end; i++) {
+        c = src[i];
+        if (ascii && c < 0x80 && ((c != '\n' && c != '\r') || eol_type == EOL_UNIX)) {
+            *q++ = c;
+            continue;
+        }
+        if (c == '\n') {
+            if (eol_type == EOL_MAC) {
+                c = '\r';
+            } else
+            if (eol_type == EOL_DOS) {
+                q = charset->encode_func(charset, q, '\r');
+            }
+        }
+        if (charset == &charset_ucs2le) {
+            q[0] = c;
+            q[1] = c >> 8;
+            q += 2;
+        } else
+        if (charset == &charset_ucs2be) {
+            q[0] = c >> 8;
+            q[1] = c;
+            q += 2;
+        } else
+        if (charset == &charset_utf8) {
+            q += utf8_encode((char *)q, c);
+        } else {
+            q1 = charset->encode_func(charset, q, c);
+            if (q1) {
+                q = q1;
+            } else {
+                *q++ = '?';
+            }
+        }
+    }
+    *np = i;
+    return q - dest;
+}
+
 /* detect the end of line type. */
 static void detect_eol_type_8bit(const u8 *buf, int size,
                                  QECharset *charset, EOLType *eol_typep)
@@ -1471,11 +1714,45 @@ char32_t decode_8bit(CharsetDecodeState *s)
     return s->table[*(s->p)++];
 }
 
-/* not very fast, but not critical yet */
+/* code points of the last 8 bit charset used for encoding, sorted
+ * for binary search.
+ */
+static struct {
+    QECharset *charset;
+    int count;
+    unsigned short code[256];
+    u8 byte[256];
+} encode_8bit_cache;
+
+static void encode_8bit_cache_init(QECharset *charset)
+{
+    int i, j, n, count;
+    unsigned short c;
+
+    n = charset->max_char - charset->min_char + 1;
+    count = 0;
+    for (i = 0; i < n; i++) {
+        c = charset->private_table[i];
+        /* insertion sort, keep the first byte for duplicate code points */
+        for (j = count; j > 0 && encode_8bit_cache.code[j - 1] > c; j--)
+            continue;
+        if (j > 0 && encode_8bit_cache.code[j - 1] == c)
+            continue;
+        memmove(encode_8bit_cache.code + j + 1, encode_8bit_cache.code + j,
+                (count - j) * sizeof(encode_8bit_cache.code[0]));
+        memmove(encode_8bit_cache.byte + j + 1, encode_8bit_cache.byte + j,
+                (count - j) * sizeof(encode_8bit_cache.byte[0]));
+        encode_8bit_cache.code[j] = c;
+        encode_8bit_cache.byte[j] = charset->min_char + i;
+        count++;
+    }
+    encode_8bit_cache.count = count;
+    encode_8bit_cache.charset = charset;
+}
+
 u8 *encode_8bit(QECharset *charset, u8 *q, char32_t c)
 {
-    int i, n;
-    const unsigned short *table;
+    int lo, hi, mid;
 
     if (c < charset->min_char) {
         /* nothing to do */
@@ -1483,15 +1760,20 @@ u8 *encode_8bit(QECharset *charset, u8 *q, char32_t c)
     if (c > charset->max_char && c <= 0xff) {
         /* nothing to do */
     } else {
-        n = charset->max_char - charset->min_char + 1;
-        table = charset->private_table;
-        for (i = 0; i < n; i++) {
-            if (table[i] == c)
-                goto found;
+        if (encode_8bit_cache.charset != charset)
+            encode_8bit_cache_init(charset);
+        lo = 0;
+        hi = encode_8bit_cache.count;
+        while (lo < hi) {
+            mid = (lo + hi) >> 1;
+            if (encode_8bit_cache.code[mid] < c)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
-        return NULL;
-    found:
-        c = charset->min_char + i;
+        if (lo >= encode_8bit_cache.count || encode_8bit_cache.code[lo] != c)
+            return NULL;
+        c = encode_8bit_cache.byte[lo];
     }
     *q++ = c;
     return q;
@@ -1501,36 +1783,9 @@ u8 *encode_8bit(QECharset *charset, u8 *q, char32_t c)
 void charset_get_pos_8bit(CharsetDecodeState *s, const u8 *buf, int size,
                           int *line_ptr, int *col_ptr)
 {
-    const u8 *p, *p1, *lp;
-    int nl, line, col;
-
     QASSERT(size >= 0);
 
-    line = 0;
-    lp = p = buf;
-    p1 = p + size;
-    nl = s->eol_char;
-
-    if (s->eol_type == EOL_DOS && p < p1 && *p == '\n') {
-        /* Skip \n at start of buffer.
-         * Should check for pending skip state */
-        p++;
-        lp++;
-    }
-
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        if (s->eol_type == EOL_DOS && p < p1 && *p == '\n')
-            p++;
-        lp = p;
-        line++;
-    }
-    col = p1 - lp;
-    *line_ptr = line;
-    *col_ptr = col;
+    *col_ptr = size - get_line_start(s, buf, size, 1, s->eol_char, '\n', line_ptr);
 }
 
 int charset_goto_line_8bit(CharsetDecodeState *s,
@@ -1566,21 +1821,11 @@ int charset_goto_line_8bit(CharsetDecodeState *s,
 int charset_get_chars_8bit(CharsetDecodeState *s,
                            const u8 *buf, int size)
 {
-    int count = size;
-    const u8 *buf_end, *buf_ptr;
-
     if (s->eol_type != EOL_DOS)
-        return count;
+        return size;
 
-    buf_ptr = buf;
-    buf_end = buf_ptr + count;
-    while (buf_ptr < buf_end) {
-        if (*buf_ptr++ == '\n') {
-            /* ignore \n in EOL_DOS scan, but count \r. (see above) */
-            count--;
-        }
-    }
-    return count;
+    /* ignore \n in EOL_DOS scan, but count \r. (see above) */
+    return size - count_units(buf, size, 1, '\n');
 }
 
 int charset_goto_char_8bit(CharsetDecodeState *s,
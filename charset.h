@@ -113,6 +113,10 @@ QECharset *find_charset(const char *str);
 void charset_decode_init(CharsetDecodeState *s, QECharset *charset,
                          EOLType eol_type);
 void charset_decode_close(CharsetDecodeState *s);
+int charset_decode_block(CharsetDecodeState *s, char32_t *dest, int dest_size,
+                         const u8 *buf, int *sizep, int flush);
+int charset_encode_block(CharsetDecodeState *s, u8 *dest, int dest_size,
+                         const char32_t *src, int *np);
 void charset_get_pos_8bit(CharsetDecodeState *s, const u8 *buf, int size,
                           int *line_ptr, int *col_ptr);
 int charset_get_chars_8bit(CharsetDecodeState *s, const u8 *buf, int size);
@@ -127,6 +127,7 @@ static QEDisplay const dummy_dpy = {
     NULL, /* dpy_draw_picture */
     NULL, /* dpy_full_screen */
     NULL, /* dpy_describe */
+    NULL, /* dpy_scroll */
     NULL, /* next */
 };
 
@@ -506,7 +507,7 @@ QEPicture *qe_create_picture(int width, int height,
     ip = qe_mallocz(QEPicture);
     if (ip) {
         /* align pixmap lines on 64 bit boundaries */
-        unsigned int wb = width * bits + 63 / 64 * 8;
+        unsigned int wb = (width * bits + 63) / 64 * 8;
         ip->width = width;
         ip->height = height;
         ip->format = format;
@@ -518,11 +519,77 @@ QEPicture *qe_create_picture(int width, int height,
 
 void qe_free_picture(QEPicture **ipp) {
     if (*ipp) {
+        qe_picture_free_mipmaps(*ipp);
         qe_free(&(*ipp)->data[0]);
         qe_free(ipp);
     }
 }
 
+void qe_picture_free_mipmaps(QEPicture *ip) {
+    if (ip)
+        qe_free_picture(&ip->mipmap);
+}
+
+/* Reduce a 32-bit picture by half in both directions with a 2x2 box
+ * filter.  Pixel bytes are averaged independently, so the format is
+ * preserved.
+ */
+static QEPicture *qe_picture_reduce(const QEPicture *ip)
+{
+    QEPicture *ip1;
+    int x, y, k, w, h;
+
+    w = (ip->width + 1) >> 1;
+    h = (ip->height + 1) >> 1;
+    ip1 = qe_create_picture(w, h, ip->format, 0);
+    if (!ip1 || !ip1->data[0]) {
+        qe_free_picture(&ip1);
+        return NULL;
+    }
+    for (y = 0; y < h; y++) {
+        const unsigned char *p0 = ip->data[0] + (2 * y) * ip->linesize[0];
+        const unsigned char *p1 = (2 * y + 1 < ip->height) ? p0 + ip->linesize[0] : p0;
+        unsigned char *q = ip1->data[0] + y * ip1->linesize[0];
+        int w2 = ip->width >> 1;
+
+        for (x = 0; x < w2; x++, p0 += 8, p1 += 8, q += 4) {
+            for (k = 0; k < 4; k++) {
+                q[k] = (p0[k] + p0[k + 4] + p1[k] + p1[k + 4] + 2) >> 2;
+            }
+        }
+        if (x < w) {
+            /* odd width: duplicate the last column */
+            for (k = 0; k < 4; k++) {
+                q[k] = (p0[k] + p1[k] + 1) >> 1;
+            }
+        }
+    }
+    return ip1;
+}
+
+/* Return the smallest picture of the mipmap chain of ip that is at
+ * least w x h pixels.  Reduced pictures are computed on demand and
+ * kept in the chain until qe_picture_free_mipmaps() is called, which
+ * must be done when the picture contents change.
+ */
+const QEPicture *qe_picture_get_level(QEPicture *ip, int w, int h)
+{
+    if (ip->format != QEBITMAP_FORMAT_RGBA32
+    &&  ip->format != QEBITMAP_FORMAT_BGRA32)
+        return ip;
+
+    while (ip->width >= 2 * w && ip->height >= 2 * h
+    &&     ip->width > 1 && ip->height > 1) {
+        if (!ip->mipmap) {
+            ip->mipmap = qe_picture_reduce(ip);
+            if (!ip->mipmap)
+                break;
+        }
+        ip = ip->mipmap;
+    }
+    return ip;
+}
+
 int qe_picture_set_palette(QEPicture *ip, int mode,
                            unsigned char *p, int count, int tcolor)
 {
@@ -559,82 +626,152 @@ int qe_picture_set_palette(QEPicture *ip, int mode,
     return 0;
 }
 
+/* Resampling filters are computed separately for each axis:
+ * destination pixel i is the weighted sum of len[i] source pixels
+ * starting at pos[i].  Reduction uses a box filter that averages the
+ * covered area, magnification uses bilinear interpolation.
+ * Weights are fixed point numbers with SCALE_BITS fractional bits.
+ */
+#define SCALE_BITS  14
+
+typedef struct ScaleAxis {
+    int *pos;
+    int *len;
+    uint16_t *weight;
+} ScaleAxis;
+
+static void scale_axis_free(ScaleAxis *ax)
+{
+    qe_free(&ax->pos);
+    qe_free(&ax->len);
+    qe_free(&ax->weight);
+}
+
+static int scale_axis_init(ScaleAxis *ax, int src_len, int dst_len)
+{
+    int i, j, k, sum;
+
+    ax->pos = qe_malloc_array(int, dst_len);
+    ax->len = qe_malloc_array(int, dst_len);
+    ax->weight = qe_malloc_array(uint16_t, src_len + 2 * dst_len);
+    if (!ax->pos || !ax->len || !ax->weight) {
+        scale_axis_free(ax);
+        return -1;
+    }
+    for (i = k = 0; i < dst_len; i++) {
+        if (dst_len < src_len) {
+            /* area covered by pixel i in 16.16 source coordinates */
+            int64_t a = (int64_t)i * src_len * 65536 / dst_len;
+            int64_t b = (int64_t)(i + 1) * src_len * 65536 / dst_len;
+            int j0 = a >> 16, j1 = (b - 1) >> 16;
+
+            ax->pos[i] = j0;
+            ax->len[i] = j1 - j0 + 1;
+            for (j = j0, sum = 0; j <= j1; j++) {
+                int64_t lo = max_int64(a, (int64_t)j << 16);
+                int64_t hi = min_int64(b, (int64_t)(j + 1) << 16);
+                int w = ((hi - lo) << SCALE_BITS) / (b - a);
+                ax->weight[k++] = w;
+                sum += w;
+            }
+            ax->weight[k - 1] += (1 << SCALE_BITS) - sum;
+        } else {
+            /* center of pixel i in 16.16 source coordinates */
+            int64_t c = (int64_t)(2 * i + 1) * src_len * 65536 / (2 * dst_len) - 32768;
+            int j0, f;
+
+            if (c < 0)
+                c = 0;
+            j0 = c >> 16;
+            f = (c & 0xFFFF) >> (16 - SCALE_BITS);
+            ax->pos[i] = j0;
+            if (j0 >= src_len - 1 || f == 0) {
+                ax->pos[i] = min_int(j0, src_len - 1);
+                ax->len[i] = 1;
+                ax->weight[k++] = 1 << SCALE_BITS;
+            } else {
+                ax->len[i] = 2;
+                ax->weight[k++] = (1 << SCALE_BITS) - f;
+                ax->weight[k++] = f;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Scale a 32-bit picture into a 32-bit picture: the source rows
+ * contributing to each destination row are accumulated into a row of
+ * per byte sums, which is then filtered horizontally.  Both passes
+ * process bytes independently, so RGBA32 and BGRA32 are scaled alike
+ * and converted on output if the formats differ.
+ */
 static int qe_picture_scale(QEPicture *to, int dst_x, int dst_y, int dst_w, int dst_h,
                             const QEPicture *from,
                             int src_x, int src_y, int src_w, int src_h, int flags)
 {
-    if (from->format != to->format)
+    ScaleAxis ax = { 0 }, ay = { 0 };
+    uint32_t *acc = NULL;
+    const uint16_t *wy, *wx;
+    int x, y, t, k, n, swap, res = -1;
+
+    if ((from->format != QEBITMAP_FORMAT_RGBA32
+    &&   from->format != QEBITMAP_FORMAT_BGRA32)
+    ||  to->format != QEBITMAP_FORMAT_RGBA32)
         return 1;
 
-    if (from->format != QEBITMAP_FORMAT_RGBA32
-    &&  from->format != QEBITMAP_FORMAT_BGRA32)
-        return 1;
-    {  // prevent -Wdeclaration-after-statement warning
-#if 0
-    /* Bilinear interpolation */
-    uint32_t w = src_w, h = src_h, w2 = dst_w, h2 = dst_h;
-    uint32_t x_ratio = ((w - 1) << 16) / w2;
-    uint32_t y_ratio = ((h - 1) << 16) / h2;
-    uint32_t pitch = from->linesize[0];
-    uint32_t pitch2 = to->linesize[0];
-    uint32_t y = 0;
-    for (uint32_t i = 0; i < h2; i++, y += y_ratio) {
-        uint32_t yr = y >> 16;
-        uint32_t y_diff = y & 0xFFFF;
-        const uint8_t *src = from->data[0] + (src_y + yr) * pitch + src_x * 4;
-        uint8_t *dst = to->data[0] + (dst_y + i) * pitch2 + dst_x * 4;
-        uint32_t x = 0;
-        for (uint32_t j = 0; j < w2; j++, x += x_ratio) {
-            uint32_t xr = x >> 16;
-            uint32_t x_diff = x & 0xFFFF;
-            uint32_t m0 = (0x10000 - x_diff) * (0x10000 - y_diff);
-            uint32_t m1 = x_diff * (0x10000 - y_diff);
-            uint32_t m2 = (0x10000 - x_diff) * y_diff;
-            uint32_t m3 = x_diff * y_diff;
-
-            for (int k = 0; k < 3; k++) {
-                uint32_t v = (src[xr * 4 + k + 0] * (int64_t)m0 +
-                              src[xr * 4 + k + 4] * (int64_t)m1 +
-                              src[xr * 4 + k + pitch + 0] * (int64_t)m2 +
-                              src[xr * 4 + k + pitch + 4] * (int64_t)m3) >> 32;
-                dst[j * 4 + k] = (uint8_t)v;
-            }
-        }
-    }
-#else
-    int x, y, sx, sy, sx0, sy0, dx, dy, width = dst_w, height = dst_h;
+    if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0)
+        return 0;
 
-    /* Nearest-neighbor interpolation */
-    dx = dy = sx0 = sy0 = 0;
-    if (dst_w > 1) {
-        if (dst_w > src_w) {
-            dx = src_w * 0x10000 / dst_w;
-        } else {
-            dx = (src_w - 1) * 0x10000 / (dst_w - 1);
-            sx0 = 0x8000;
-        }
-    }
-    if (dst_h > 1) {
-        if (dst_h > src_h) {
-            dy = src_h * 0x10000 / dst_h;
-        } else {
-            dy = (src_h - 1) * 0x10000 / (dst_h - 1);
-            sy0 = 0x8000;
+    swap = (from->format != to->format);
+    acc = qe_malloc_array(uint32_t, src_w * 4);
+    if (!acc
+    ||  scale_axis_init(&ax, src_w, dst_w)
+    ||  scale_axis_init(&ay, src_h, dst_h))
+        goto done;
+
+    for (y = 0, wy = ay.weight; y < dst_h; y++) {
+        unsigned char *dst = to->data[0] + (dst_y + y) * to->linesize[0] + dst_x * 4;
+
+        /* vertical pass: acc[n] < 255 << SCALE_BITS */
+        memset(acc, 0, src_w * 4 * sizeof(*acc));
+        for (t = 0; t < ay.len[y]; t++) {
+            const unsigned char *src = from->data[0] +
+                (src_y + ay.pos[y] + t) * from->linesize[0] + src_x * 4;
+            uint32_t w = *wy++;
+            for (n = 0; n < src_w * 4; n++) {
+                acc[n] += w * src[n];
+            }
         }
-    }
-    for (y = 0, sy = sy0; y < height; y++, sy += dy) {
-        const uint32_t *src = (const uint32_t *)(void *)(from->data[0] +
-                                                         (src_y + (sy >> 16)) * from->linesize[0]) + src_x;
-        uint32_t *dst = (uint32_t *)(void *)(to->data[0] + (dst_y + y) * to->linesize[0]) + dst_x;
-
-        for (x = 0, sx = sx0; x < width; x++, sx += dx) {
-            /* XXX: No filtering */
-            dst[x + 0] = src[sx >> 16];
+        /* horizontal pass: keep 8 fractional bits of the vertical sums */
+        for (x = 0, wx = ax.weight; x < dst_w; x++, dst += 4) {
+            const uint32_t *a = acc + ax.pos[x] * 4;
+            uint32_t s[4] = { 0, 0, 0, 0 };
+            for (t = 0; t < ax.len[x]; t++, a += 4) {
+                uint32_t w = *wx++;
+                for (k = 0; k < 4; k++) {
+                    s[k] += w * (a[k] >> (SCALE_BITS - 8));
+                }
+            }
+            for (k = 0; k < 4; k++) {
+                s[k] = (s[k] + (1U << (SCALE_BITS + 7))) >> (SCALE_BITS + 8);
+            }
+            if (swap) {
+                /* BGRA32 stores bytes in R, G, B, A order */
+                QEColor c = QERGB(s[0], s[1], s[2]);
+                memcpy(dst, &c, 4);
+            } else {
+                for (k = 0; k < 4; k++) {
+                    dst[k] = s[k];
+                }
+            }
         }
     }
-#endif
-    }
-    return 0;
+    res = 0;
+ done:
+    scale_axis_free(&ax);
+    scale_axis_free(&ay);
+    qe_free(&acc);
+    return res;
 }
 
 int qe_picture_copy(QEPicture *to, int dst_x, int dst_y, int dst_w, int dst_h,
@@ -649,7 +786,8 @@ int qe_picture_copy(QEPicture *to, int dst_x, int dst_y, int dst_w, int dst_h,
         /* Generic scaling */
         QEPicture *ip1 = NULL;
 
-        if (from->format != QEBITMAP_FORMAT_RGBA32) {
+        if (from->format != QEBITMAP_FORMAT_RGBA32
+        &&  from->format != QEBITMAP_FORMAT_BGRA32) {
             ip1 = qe_create_picture(src_w, src_h, QEBITMAP_FORMAT_RGBA32, 0);
             if (!ip1)
                 return -1;
@@ -69,6 +69,7 @@ typedef struct QEPicture {
     QEColor *palette;
     int palette_size;
     int tcolor;
+    struct QEPicture *mipmap;   /* half size copy, computed on demand */
 } QEPicture;
 
 typedef struct QEditScreen QEditScreen;
@@ -121,6 +122,9 @@ struct QEDisplay {
                             int flags);
     void (*dpy_full_screen)(QEditScreen *s, int full_screen);
     void (*dpy_describe)(QEditScreen *s, struct EditBuffer *b);
+    /* move the contents of a screen area by dy pixels vertically,
+       the uncovered part of the area is left undefined */
+    void (*dpy_scroll)(QEditScreen *s, int x, int y, int w, int h, int dy);
     QEDisplay *next;
 };
 
@@ -235,6 +239,15 @@ static inline void dpy_describe(QEditScreen *s, struct EditBuffer *b)
         s->dpy.dpy_describe(s, b);
 }
 
+static inline int dpy_scroll(QEditScreen *s, int x, int y, int w, int h, int dy)
+{
+    if (s->dpy.dpy_scroll) {
+        s->dpy.dpy_scroll(s, x, y, w, h, dy);
+        return 0;
+    }
+    return -1;
+}
+
 /* XXX: only needed for backward compatibility */
 static inline int glyph_width(QEditScreen *s, QEFont *font, char32_t ch) {
     char32_t buf[1];
@@ -268,6 +281,8 @@ QEPicture *qe_create_picture(int width, int height,
 static inline int qe_picture_lock(QEPicture *ip) { return ip == NULL; }
 static inline void qe_picture_unlock(QEPicture *ip) {}
 void qe_free_picture(QEPicture **ipp);
+void qe_picture_free_mipmaps(QEPicture *ip);
+const QEPicture *qe_picture_get_level(QEPicture *ip, int w, int h);
 
 #define QE_PAL_MODE(r, g, b, incr)  (((r) << 12) | ((g) << 8) | ((b) << 4) | (incr))
 #define QE_PAL_RGB3     QE_PAL_MODE(0, 1, 2, 3)
@@ -23,6 +23,7 @@
  */
 
 #include <time.h>
+#include <sys/wait.h>
 
 #include "qe.h"
 #include "variables.h"
@@ -1162,6 +1163,8 @@ static void do_describe_function(EditState *s, const char *cmd_name) {
 #define SF_BASENAME   0x40
 #define SF_PARAGRAPH  0x80
 #define SF_SILENT     0x100
+#define SF_UNIQ       0x200
+#define SF_COUNT      0x400
 static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags);
 
 static void print_bindings(EditBuffer *b, ModeDef *mode)
@@ -1573,9 +1576,14 @@ static void do_describe_buffer(EditState *s, int argval)
 
     eb_printf(b1, "    save_log: %d  (new_index=%d, current=%d, nb_logs=%d)\n",
               b->save_log, b->log_new_index, b->log_current, b->nb_logs);
-    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d)\n",
+    if (b->log_spill_file) {
+        eb_printf(b1, "   log_spill: %d  (index=%d)\n",
+                  b->log_spill_size, b->log_spill_index);
+    }
+    eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d, runs=%d)\n",
               !!b->b_styles, (long long)b->cur_style,
-              b->style_bytes, b->style_shift);
+              b->style_bytes, b->style_shift,
+              b->b_styles ? b->b_styles->nb_runs : 0);
 
     if (b->total_size > 0) {
         u8 iobuf[4096];
@@ -1777,20 +1785,86 @@ static void do_describe_screen(EditState *e, int argval)
     show_popup(e, b1, "Screen Description");
 }
 
+/*---------------- timer benchmark ----------------*/
+
+static struct {
+    int count;          /* number of pending timers */
+    int max_late;       /* maximum firing delay past deadline in ms */
+} timer_bench;
+
+static void timer_bench_cb(void *opaque)
+{
+    int late = get_clock_ms() - (int)(intptr_t)opaque;
+
+    timer_bench.max_late = max_int(timer_bench.max_late, late);
+    if (--timer_bench.count == 0) {
+        put_status(NULL, "Timers fired, max late: %d ms", timer_bench.max_late);
+        url_redisplay();
+    }
+}
+
+/* schedule argval timers (100000 by default) with random delays
+   below 1 second, cancel half of them and report the timings */
+static void do_timer_benchmark(EditState *s, int argval)
+{
+    QETimer **timers;
+    unsigned int seed = 1;
+    int i, n, delay, t0, t1, t2;
+
+    if (timer_bench.count > 0) {
+        put_status(s, "Timer benchmark already running");
+        return;
+    }
+    n = (argval == NO_ARG) ? 100000 : argval;
+    if (n <= 0 || !(timers = qe_malloc_array(QETimer *, n)))
+        return;
+
+    t0 = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        delay = (seed >> 16) % 1000;
+        timers[i] = qe_add_timer(delay, (void *)(intptr_t)(get_clock_ms() + delay),
+                                 timer_bench_cb);
+    }
+    t1 = get_clock_usec();
+    /* cancel every other timer */
+    for (i = 0; i < n; i += 2) {
+        qe_kill_timer(&timers[i]);
+    }
+    t2 = get_clock_usec();
+
+    timer_bench.max_late = 0;
+    for (i = 1; i < n; i += 2) {
+        if (timers[i])
+            timer_bench.count++;
+    }
+    qe_free(&timers);
+    put_status(s, "Added %d timers in %d us, cancelled %d in %d us",
+               n, t1 - t0, (n + 1) / 2, t2 - t1);
+}
+
 /*---------------- buffer contents sorting ----------------*/
 
-struct chunk_ctx {
+/* Lines are sorted on keys extracted once per line: the significant
+ * characters are transformed according to the sort flags and stored
+ * UTF-8 encoded in a key array so keys compare with memcmp() in code
+ * point order.  For SF_NUMBER, runs of digits are encoded as '0', the
+ * number of significant digits and the digits themselves.  If no
+ * transformation is needed and the buffer bytes already compare in
+ * code point order, keys refer directly to the copy of the text.
+ */
+struct sort_line {
+    int start, end;     /* line span in the text copy */
+    int key, key_len;   /* key span in the key array */
+};
+
+struct sort_ctx {
     EditBuffer *b;
     int flags;
     int col;
-    int nlines;
-    long ncmp;
-    long total_cmp;
-};
-
-struct chunk {
-    int start, end, offset;
-    unsigned short c[2];
+    u8 *keys;           /* key array: the text copy or the key arena */
+    int keys_len, keys_size;
+    int num_pos;        /* position of the current digit count or -1 */
 };
 
 static int eb_skip_to_basename(EditBuffer *b, int pos) {
@@ -1803,104 +1877,295 @@ static int eb_skip_to_basename(EditBuffer *b, int pos) {
     return base;
 }
 
-static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
-    struct chunk_ctx *cp = vp0;
-    const struct chunk *p1 = vp1;
-    const struct chunk *p2 = vp2;
-    int pos1, pos2;
+static int sort_key_putc(struct sort_ctx *sc, char32_t c) {
+    if (sc->keys_len + MAX_CHAR_BYTES + 2 > sc->keys_size) {
+        int size = sc->keys_size + (sc->keys_size >> 1) + 4096;
+        if (!qe_realloc(&sc->keys, size))
+            return -1;
+        sc->keys_size = size;
+    }
+    /* XXX: incorrect for non ASCII contents */
+    if ((sc->flags & SF_DICT) && !qe_iswalpha(c))
+        return 0;
+    if ((sc->flags & SF_NUMBER) && qe_isdigit(c)) {
+        // XXX: number conversion should not occur after decimal point
+        if (sc->num_pos < 0) {
+            sc->keys[sc->keys_len++] = '0';
+            sc->num_pos = sc->keys_len;
+            sc->keys[sc->keys_len++] = 0;
+        }
+        /* skip leading zeroes, the digit count saturates at 255 */
+        if ((c != '0' || sc->keys[sc->num_pos] != 0)
+        &&  sc->keys[sc->num_pos] < 255) {
+            sc->keys[sc->num_pos]++;
+            sc->keys[sc->keys_len++] = c;
+        }
+        return 0;
+    }
+    sc->num_pos = -1;
+    if (sc->flags & SF_FOLD) {
+        // XXX: should also ignore accents
+        c = qe_wtoupper(c);
+    }
+    sc->keys_len += utf8_encode((char *)sc->keys + sc->keys_len, c);
+    return 0;
+}
 
-    if ((++cp->ncmp & 8191) == 8191) {
+static void sort_progress(struct sort_ctx *sc, int i, int lines) {
+    if ((i & 65535) == 65535 && !(sc->flags & SF_SILENT)) {
         QEmacsState *qs = &qe_state;
-        put_status(NULL, "Sorting: %d%%", (int)((cp->ncmp * 90LL) / cp->total_cmp));
+        put_status(NULL, "Sorting: %d%%", (int)(i * 80LL / lines));
         dpy_flush(qs->screen);
     }
-    if (cp->flags & SF_REVERSE) {
-        p1 = vp2;
-        p2 = vp1;
-    }
+}
 
-    if (p1->c[0] != p2->c[0]) {
-        return p1->c[0] < p2->c[0] ? -1 : 1;
-    }
-    if (p1->c[1] != p2->c[1]) {
-        return p1->c[1] < p2->c[1] ? -1 : 1;
-    }
-    pos1 = p1->start + p1->offset;
-    pos2 = p2->start + p2->offset;
-    for (;;) {
-        // XXX: should compute offset to first significant character in the setup phase
-        char32_t c1 = 0, c2 = 0;
-        while (pos1 < p1->end) {
-            c1 = eb_nextc(cp->b, pos1, &pos1);
-            /* XXX: incorrect for non ASCII contents */
-            if (!(cp->flags & SF_DICT) || qe_iswalpha(c1))
-                break;
-            c1 = 0;
+/* Split the text copy into lines and extract the keys, for buffers
+ * with Unix line endings and a byte or UTF-8 encoding.
+ */
+static int sort_split_text(struct sort_ctx *sc, struct sort_line *sl,
+                           int lines, const u8 *text, int size)
+{
+    const u8 *p, *q, *eol, *end = text + size;
+    int utf8 = (sc->b->charset == &charset_utf8);
+    int i, col;
+
+    for (i = 0, p = text; i < lines && p < end; i++, sl++) {
+        eol = memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        q = p;
+        if (sc->flags & SF_COLUMN) {
+            for (col = sc->col; col-- > 0 && q < eol;) {
+                q += utf8 ? utf8_length[*q] : 1;
+            }
+            if (q > eol)
+                q = eol;
+        }
+        if (sc->flags & SF_BASENAME) {
+            const u8 *r;
+            for (r = q; r < eol; r++) {
+                if (*r == '/' || *r == '\\')
+                    q = r + 1;
+            }
         }
-        while (pos2 < p2->end) {
-            c2 = eb_nextc(cp->b, pos2, &pos2);
-            /* XXX: incorrect for non ASCII contents */
-            if (!(cp->flags & SF_DICT) || qe_iswalpha(c2))
-                break;
-            c2 = 0;
+        if (sc->flags & SF_PARAGRAPH) {
+            /* paragraph sorting: skip continuation lines */
+            // XXX: Should ignore initial indent
+            while (eol + 1 < end) {
+                const char *r = (const char *)eol + 1;
+                if (!qe_isspace(utf8 ? utf8_decode(&r) : eol[1]))
+                    break;
+                eol = memchr(eol + 1, '\n', end - eol - 1);
+                if (!eol)
+                    eol = end;
+            }
         }
-        // XXX: number conversion should not occur after decimal point
-        if ((cp->flags & SF_NUMBER) && qe_isdigit(c1) && qe_isdigit(c2)) {
-            unsigned long long n1 = c1 - '0';
-            unsigned long long n2 = c2 - '0';
-            c1 = 0;
-            while (pos1 < p1->end) {
-                c1 = eb_nextc(cp->b, pos1, &pos1);
-                if (!qe_isdigit(c1))
+        sl->start = p - text;
+        sl->end = eol - text;
+        if (sc->keys == text) {
+            sl->key = q - text;
+            sl->key_len = eol - q;
+        } else {
+            sl->key = sc->keys_len;
+            sc->num_pos = -1;
+            while (q < eol) {
+                char32_t c = *q;
+                if (utf8) {
+                    const char *r = (const char *)q;
+                    c = utf8_decode(&r);
+                    q = (const u8 *)r;
+                } else {
+                    q++;
+                }
+                if (sort_key_putc(sc, c))
+                    return -1;
+            }
+            sl->key_len = sc->keys_len - sl->key;
+        }
+        p = eol + 1;
+        sort_progress(sc, i, lines);
+    }
+    return i;
+}
+
+/* Split the buffer span into lines and extract the keys by decoding
+ * the buffer contents, for all other encodings and line endings.
+ */
+static int sort_split_buffer(struct sort_ctx *sc, struct sort_line *sl,
+                             int lines, int p1, int p2)
+{
+    EditBuffer *b = sc->b;
+    int i, col, offset, pos, pos1;
+    char32_t c;
+
+    for (i = 0, offset = p1; i < lines && offset < p2; i++, sl++) {
+        pos = offset;
+        if (sc->flags & SF_COLUMN) {
+            for (col = sc->col; col-- > 0;) {
+                c = eb_nextc(b, pos, &pos1);
+                if (c == '\n')
                     break;
-                n1 = n1 * 10 + c1 - '0';
-                c1 = 0;
+                pos = pos1;
             }
-            c2 = 0;
-            while (pos2 < p2->end) {
-                c2 = eb_nextc(cp->b, pos2, &pos2);
-                if (!qe_isdigit(c2))
+        }
+        if (sc->flags & SF_BASENAME) {
+            pos = eb_skip_to_basename(b, pos);
+        }
+        sl->start = offset - p1;
+        sl->key = sc->keys_len;
+        sc->num_pos = -1;
+        for (;;) {
+            c = eb_nextc(b, pos, &pos1);
+            if (c == '\n') {
+                /* paragraph sorting: include continuation lines */
+                // XXX: Should ignore initial indent
+                if (!(sc->flags & SF_PARAGRAPH) || pos1 >= p2
+                ||  !qe_isspace(eb_nextc(b, pos1, &offset)))
                     break;
-                n2 = n2 * 10 + c2 - '0';
-                c2 = 0;
             }
-            if (n1 < n2)
+            if (sort_key_putc(sc, c))
                 return -1;
-            if (n1 > n2)
-                return +1;
+            pos = pos1;
         }
-        if (cp->flags & SF_FOLD) {
-            // XXX: should also ignore accents
-            c1 = qe_wtoupper(c1);
-            c2 = qe_wtoupper(c2);
+        sl->key_len = sc->keys_len - sl->key;
+        sl->end = pos - p1;
+        offset = pos1;
+        sort_progress(sc, i, lines);
+    }
+    return i;
+}
+
+static inline int sort_key_byte(const struct sort_line *sl, const u8 *keys,
+                                int depth) {
+    return depth < sl->key_len ? keys[sl->key + depth] + 1 : 0;
+}
+
+static inline int sort_key_cmp(const struct sort_line *sl1,
+                               const struct sort_line *sl2,
+                               const u8 *keys, int depth) {
+    int len = min_int(sl1->key_len, sl2->key_len) - depth;
+    int res = 0;
+    if (len > 0)
+        res = memcmp(keys + sl1->key + depth, keys + sl2->key + depth, len);
+    return res ? res : sl1->key_len - sl2->key_len;
+}
+
+/* Stable MSD radix sort of the lines on their keys.  Ranges are
+ * distributed on the key byte at the current depth, keys shorter than
+ * depth first, and small ranges are finished by insertion sort.  Key
+ * bytes are read once per pass and common prefixes are skipped in a
+ * single scan.
+ */
+#define SORT_RADIX_MIN  32
+
+static int sort_lines(struct sort_line *sl, int n, const u8 *keys) {
+    struct sort_range { int lo, hi, depth; } *stack = NULL;
+    struct sort_line *tmp;
+    unsigned short *bytes;
+    int count[257], pos[257];
+    int sp = 0, stack_size = 0;
+    int lo = 0, hi = n, depth = 0;
+    int i, j, c, len;
+
+    tmp = qe_malloc_array(struct sort_line, n);
+    bytes = qe_malloc_array(unsigned short, n);
+    if (!tmp || !bytes) {
+        qe_free(&tmp);
+        qe_free(&bytes);
+        return -1;
+    }
+
+    for (;;) {
+        if (hi - lo < SORT_RADIX_MIN) {
+            for (i = lo + 1; i < hi; i++) {
+                struct sort_line cur = sl[i];
+                for (j = i; j > lo && sort_key_cmp(&cur, &sl[j - 1], keys, depth) < 0; j--) {
+                    sl[j] = sl[j - 1];
+                }
+                sl[j] = cur;
+            }
+        } else {
+            memset(count, 0, sizeof(count));
+            for (i = lo; i < hi; i++) {
+                count[bytes[i] = sort_key_byte(&sl[i], keys, depth)]++;
+            }
+            c = bytes[lo];
+            if (count[c] == hi - lo) {
+                /* single bucket: all keys ended or share this byte */
+                if (c != 0) {
+                    /* skip the whole common prefix */
+                    const u8 *k0 = keys + sl[lo].key;
+                    len = sl[lo].key_len;
+                    for (i = lo + 1; i < hi && len > depth + 1; i++) {
+                        const u8 *k1 = keys + sl[i].key;
+                        int len1 = min_int(len, sl[i].key_len);
+                        for (j = depth + 1; j < len1 && k0[j] == k1[j]; j++)
+                            continue;
+                        len = j;
+                    }
+                    depth = len;
+                    continue;
+                }
+            } else {
+                for (pos[0] = lo, c = 0; c < 256; c++) {
+                    pos[c + 1] = pos[c] + count[c];
+                }
+                for (i = lo; i < hi; i++) {
+                    tmp[pos[bytes[i]]++] = sl[i];
+                }
+                blockcpy(sl + lo, tmp + lo, hi - lo);
+                /* pos[c] is now the end of bucket c */
+                for (c = 1; c < 257; c++) {
+                    if (count[c] < 2)
+                        continue;
+                    if (sp == stack_size) {
+                        int size = stack_size + (stack_size >> 1) + 256;
+                        if (!qe_realloc(&stack, size * sizeof(*stack))) {
+                            qe_free(&stack);
+                            qe_free(&bytes);
+                            qe_free(&tmp);
+                            return -1;
+                        }
+                        stack_size = size;
+                    }
+                    stack[sp].lo = pos[c] - count[c];
+                    stack[sp].hi = pos[c];
+                    stack[sp].depth = depth + 1;
+                    sp++;
+                }
+            }
         }
-        if (c1 < c2)
-            return -1;
-        if (c1 > c2)
-            return +1;
-        if (c1 == 0)
+        if (sp == 0)
             break;
-    }
-    /* make sort stable by comparing offsets of equal elements */
-    return (p1->start > p2->start) - (p1->start < p2->start);
+        sp--;
+        lo = stack[sp].lo;
+        hi = stack[sp].hi;
+        depth = stack[sp].depth;
+    }
+    qe_free(&stack);
+    qe_free(&bytes);
+    qe_free(&tmp);
+    return 0;
 }
 
 static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags) {
-    struct chunk_ctx ctx;
-    EditBuffer *b1;
+    struct sort_ctx sc;
+    struct sort_line *sl = NULL;
+    EditBuffer *b1 = NULL;
+    u8 *text = NULL, *out = NULL;
+    char nl[MAX_CHAR_BYTES * 2];
     int p1 = *pp1, p2 = *pp2;
-    int i, j, offset, line1, line2, col1, col2, line, col, lines;
-    char32_t c;
-    struct chunk *chunk_array;
+    int i, k, k1, n, size, out_len, nl_len, direct;
+    int line1, line2, col1, col2, line, col, lines, groups;
 
     if (p1 > p2) {
         int tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
-    ctx.b = b;
-    ctx.flags = flags;
-    ctx.col = 0;
+    memset(&sc, 0, sizeof(sc));
+    sc.b = b;
+    sc.flags = flags;
     eb_get_pos(b, &line1, &col1, p1); /* line1 is included */
     eb_get_pos(b, &line2, &col2, p2); /* line2 is excluded */
     if (col1 > 0) {
@@ -1914,109 +2179,127 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
     // columns of the mark and point should determine the column range
     if (flags & SF_COLUMN) {
         eb_get_pos(b, &line, &col, cur_offset);
-        ctx.col = col ? col : col1;
+        sc.col = col ? col : col1;
     }
-    lines = line2 - line1;
+    lines = groups = line2 - line1;
     if (lines <= 1) {
         *pp1 = p2;
         *pp2 = p2;
         goto done;
     }
-    chunk_array = qe_malloc_array(struct chunk, lines);
-    if (!chunk_array) {
-        return -1;
+    size = p2 - p1;
+    text = qe_malloc_array(u8, size + 1);
+    sl = qe_malloc_array(struct sort_line, lines);
+    if (!text || !sl)
+        goto fail;
+    size = eb_read(b, p1, text, size);
+    text[size] = '\0';
+
+    /* UTF-8 and byte encodings compare in code point order */
+    direct = (b->eol_type == EOL_UNIX
+              && (b->charset == &charset_utf8 || b->charset == &charset_8859_1
+                  || b->charset == &charset_raw));
+    if (direct && !(flags & (SF_DICT | SF_FOLD | SF_NUMBER))) {
+        sc.keys = text;
+        sc.keys_size = sc.keys_len = size;
+    } else {
+        sc.keys_size = size + size / 8 + 4096;
+        if (!(sc.keys = qe_malloc_array(u8, sc.keys_size)))
+            goto fail;
     }
-    offset = p1;
-    for (i = 0; i < lines && offset < p2; i++) {
-        int pos, pos1;
-        pos = offset;
-        if (flags & SF_COLUMN) {
-            for (col = ctx.col; col-- > 0;) {
-                c = eb_nextc(b, pos, &pos1);
-                if (c == '\n')
-                    break;
-                pos = pos1;
-            }
-        }
-        if (flags & SF_BASENAME) {
-            pos = eb_skip_to_basename(b, pos);
-        }
-        /* read first 2 significant characters into cp->c,
-           skipping according to SF_DICT.
-         */
-        for (j = 0; j < countof(chunk_array[i].c); j++) {
-            for (;;) {
-                c = eb_nextc(b, pos, &pos1);
-                if (c == '\n') {
-                    c = 0;
-                    break;
-                }
-                if ((flags & SF_DICT) && !qe_iswalpha(c)) {
-                    pos = pos1;
-                    continue;
-                }
-                if ((flags & SF_NUMBER) && qe_isdigit(c)) {
-                    c = '0';
-                    break;
-                }
-                if (flags & SF_FOLD) {
-                    c = qe_wtoupper(c);
-                }
-                if (c > 0xFFFF)
-                    c = 0xFFFF;
-                else
-                    pos = pos1;
-                break;
-            }
-            chunk_array[i].c[j] = c;
-        }
-        chunk_array[i].start = offset;
-        chunk_array[i].offset = pos - offset;
-        chunk_array[i].end = offset = eb_goto_eol(b, pos);
-        offset = eb_next(b, offset);
-        if (flags & SF_PARAGRAPH) {
-            int offset1;
-            /* paragraph sorting: skip continuation lines */
-            // XXX: Should ignore initial indent
-            while (offset < p2 && qe_isspace(eb_nextc(b, offset, &offset1))) {
-                chunk_array[i].end = offset = eb_goto_eol(b, offset);
-                offset = eb_next(b, offset);
-            }
+    if (direct)
+        n = sort_split_text(&sc, sl, lines, text, size);
+    else
+        n = sort_split_buffer(&sc, sl, lines, p1, p2);
+    if (n < 0 || sort_lines(sl, n, sc.keys) < 0)
+        goto fail;
+    lines = n;
+
+    if (flags & SF_REVERSE) {
+        /* reversing the stable sort also reverses equal elements */
+        for (i = 0, k = n - 1; i < k; i++, k--) {
+            struct sort_line tmp = sl[i];
+            sl[i] = sl[k];
+            sl[k] = tmp;
         }
     }
-    /* for progress meter: n.log n comparisons + n insertions */
-    ctx.nlines = lines = i;
-    ctx.ncmp = 0;
-    /* evaluate the total number of comparisons: n.log2(n) */
-    for (ctx.total_cmp = 0; i > 0; i >>= 1) {
-        ctx.total_cmp += lines;
-    }
-    qe_qsort_r(chunk_array, lines, sizeof(*chunk_array), &ctx, chunk_cmp);
 
-    b1 = eb_new("*sorted*", BF_SYSTEM | (b->flags & BF_STYLES));
-    eb_set_charset(b1, b->charset, b->eol_type);
-
-    for (i = 0; i < lines; i++) {
-        /* XXX: should keep track of point if sorting full buffer */
-        eb_insert_buffer_convert(b1, b1->total_size, b, chunk_array[i].start,
-                                 chunk_array[i].end - chunk_array[i].start);
-        // XXX: style issue. Should include newline from source buffer
-        eb_putc(b1, '\n');
-        if ((i & 8191) == 8191 && !(flags & SF_SILENT)) {
-            QEmacsState *qs = &qe_state;
-            put_status(NULL, "Sorting: %d%%", (int)(90 + i * 10LL / lines));
-            dpy_flush(qs->screen);
+    /* Build the sorted text in the buffer encoding and insert it in a
+     * single operation.  Buffers with styles are rebuilt line by line.
+     */
+    nl_len = eb_encode_char32(b, nl, '\n');
+    if (b->flags & BF_STYLES) {
+        b1 = eb_new("*sorted*", BF_SYSTEM | BF_STYLES);
+        if (!b1)
+            goto fail;
+        eb_set_charset(b1, b->charset, b->eol_type);
+    } else {
+        int prefix = (flags & SF_COUNT) ? 12 * MAX_CHAR_BYTES : 0;
+        if (!(out = qe_malloc_array(u8, size + n * (nl_len + prefix))))
+            goto fail;
+    }
+    out_len = 0;
+    for (groups = 0, k = 0; k < n; k = k1, groups++) {
+        const struct sort_line *p = &sl[k];
+        k1 = k + 1;
+        if (flags & (SF_UNIQ | SF_COUNT)) {
+            /* keep the first line of each group of equal keys */
+            while (k1 < n && sort_key_cmp(&sl[k], &sl[k1], sc.keys, 0) == 0)
+                k1++;
+            if (flags & SF_REVERSE)
+                p = &sl[k1 - 1];
+        }
+        // XXX: should keep track of point if sorting full buffer
+        if (b1) {
+            if (flags & SF_COUNT)
+                eb_printf(b1, "%7d ", k1 - k);
+            eb_insert_buffer_convert(b1, b1->total_size, b, p1 + p->start,
+                                     p->end - p->start);
+            // XXX: style issue. Should include newline from source buffer
+            eb_putc(b1, '\n');
+        } else {
+            if (flags & SF_COUNT) {
+                char buf[16];
+                for (i = snprintf(buf, sizeof buf, "%7d ", k1 - k), col = 0; col < i; col++) {
+                    out_len += eb_encode_char32(b, (char *)out + out_len, buf[col]);
+                }
+            }
+            memcpy(out + out_len, text + p->start, p->end - p->start);
+            out_len += p->end - p->start;
+            memcpy(out + out_len, nl, nl_len);
+            out_len += nl_len;
         }
     }
     eb_delete_range(b, p1, p2);
     *pp1 = p1;
-    *pp2 = p1 + eb_insert_buffer_convert(b, p1, b1, 0, b1->total_size);
-    eb_free(&b1);
-    qe_free(&chunk_array);
+    if (b1) {
+        *pp2 = p1 + eb_insert_buffer_convert(b, p1, b1, 0, b1->total_size);
+        eb_free(&b1);
+    } else {
+        /* the page table is built over the sorted text */
+        qe_realloc(&out, out_len);
+        *pp2 = p1 + eb_insert_block(b, p1, &out, out_len);
+    }
+    if (sc.keys != text)
+        qe_free(&sc.keys);
+    qe_free(&text);
+    qe_free(&sl);
 done:
-    if (!(flags & SF_SILENT))
-        put_status(NULL, "%d lines sorted", lines);
+    if (!(flags & SF_SILENT)) {
+        if (flags & (SF_UNIQ | SF_COUNT))
+            put_status(NULL, "%d lines sorted, %d unique", lines, groups);
+        else
+            put_status(NULL, "%d lines sorted", lines);
+    }
     return 0;
+
+fail:
+    eb_free(&b1);
+    if (sc.keys != text)
+        qe_free(&sc.keys);
+    qe_free(&text);
+    qe_free(&sl);
+    return -1;
 }
 
 static void do_sort_span(EditState *s, int p1, int p2, int argval, int flags) {
@@ -2037,6 +2320,91 @@ static void do_sort_buffer(EditState *s, int argval, int flags) {
     do_sort_span(s, 0, s->b->total_size, argval, flags);
 }
 
+/* sort a copy of the buffer contents, then the same data with the
+   external sort command, and report both timings */
+static void do_sort_benchmark(EditState *s, int argval)
+{
+    char filename[MAX_FILENAME_SIZE];
+    const char *argv[12];
+    const char *tmpdir;
+    EditBuffer *b1;
+    pid_t pid;
+    int p1, p2, fd, status, t0, t1, t2, argc;
+    int flags = argval & ~1;
+
+    tmpdir = getenv("TMPDIR");
+    if (!tmpdir || !*tmpdir)
+        tmpdir = "/tmp";
+    if (snprintf(filename, sizeof(filename), "%s/qesortXXXXXX",
+                 tmpdir) >= ssizeof(filename)
+    ||  (fd = mkstemp(filename)) < 0) {
+        put_status(s, "Cannot create temporary file");
+        return;
+    }
+    close(fd);
+    if (eb_write_buffer(s->b, 0, s->b->total_size, filename) < 0) {
+        put_status(s, "Cannot write %s", filename);
+        unlink(filename);
+        return;
+    }
+    b1 = eb_new("*sort-benchmark*", BF_SYSTEM);
+    if (!b1) {
+        unlink(filename);
+        return;
+    }
+    eb_set_charset(b1, s->b->charset, s->b->eol_type);
+    eb_insert_buffer(b1, 0, s->b, 0, s->b->total_size);
+    p1 = 0;
+    p2 = b1->total_size;
+
+    t0 = get_clock_ms();
+    status = eb_sort_span(b1, &p1, &p2, 0, flags | SF_SILENT);
+    t1 = get_clock_ms();
+    eb_free(&b1);
+    if (status < 0) {
+        put_status(s, "Out of memory");
+        unlink(filename);
+        return;
+    }
+    /* approximate options, GNU sort differs for -d and -n.
+       The command is run without a shell: the file name is not quoted */
+    argc = 0;
+    argv[argc++] = "sort";
+    if (flags & SF_FOLD)
+        argv[argc++] = "-f";
+    if (flags & SF_REVERSE)
+        argv[argc++] = "-r";
+    if (flags & SF_DICT)
+        argv[argc++] = "-d";
+    if (flags & SF_NUMBER)
+        argv[argc++] = "-n";
+    if (flags & (SF_UNIQ | SF_COUNT))
+        argv[argc++] = "-u";
+    argv[argc++] = "-o";
+    argv[argc++] = "/dev/null";
+    argv[argc++] = "--";
+    argv[argc++] = filename;
+    argv[argc] = NULL;
+    status = -1;
+    pid = fork();
+    if (pid == 0) {
+        setenv("LC_ALL", "C", 1);
+        execvp(argv[0], unconst(char * const *)argv);
+        _exit(127);
+    }
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            continue;
+    }
+    t2 = get_clock_ms();
+    unlink(filename);
+    if (status != 0) {
+        put_status(s, "qemacs: %d ms, sort command failed", t1 - t0);
+        return;
+    }
+    put_status(s, "qemacs: %d ms, sort: %d ms", t1 - t0, t2 - t1);
+}
+
 /*---------------- tag handling ----------------*/
 
 static void tag_buffer(EditState *s) {
@@ -2682,6 +3050,9 @@ static const CmdDef extra_commands[] = {
     CMD2( "describe-window", "C-h w, C-h C-w",
           "Show information about the current window",
           do_describe_window, ESi, "p")
+    CMD2( "timer-benchmark", "",
+          "Measure scheduling, cancelling and firing of many timers",
+          do_timer_benchmark, ESi, "P")
 
     /* XXX: should take region as argument, implicit from keyboard */
     CMD2( "set-region-color", "C-c c",
@@ -2721,6 +3092,15 @@ static const CmdDef extra_commands[] = {
     CMD3( "sort-paragraphs", "",
           "Sort the paragraphs in the region as numbers",
           do_sort_region, ESii, "*" "p" "v", SF_PARAGRAPH)
+    CMD3( "sort-uniq", "",
+          "Sort the lines in the region and remove duplicate lines",
+          do_sort_region, ESii, "*" "p" "v", SF_UNIQ)
+    CMD3( "sort-count", "",
+          "Sort the lines in the region and prefix unique lines with their count",
+          do_sort_region, ESii, "*" "p" "v", SF_COUNT)
+    CMD2( "sort-benchmark", "",
+          "Compare sorting the buffer with the external sort command",
+          do_sort_benchmark, ESi, "p")
 
     CMD2( "list-tags", "",
           "List the buffer tags detected automatically",
@@ -40,6 +40,7 @@ static UniFontData *fallback_font;
 static GlyphCache *hash_table[HASH_SIZE];
 static int cache_size = 0;
 static GlyphCache first_cache_entry;
+static GlyphCacheStats cache_stats;
 
 static void glyph_cache_init(void)
 {
@@ -60,6 +61,7 @@ static GlyphCache *get_cached_glyph(QEFont *font, int index)
     GlyphCache *p;
     int h;
 
+    cache_stats.lookups++;
     h = glyph_hash(index, font->size, font->style);
     p = hash_table[h];
     while (p != NULL) {
@@ -71,6 +73,10 @@ static GlyphCache *get_cached_glyph(QEFont *font, int index)
     }
     return NULL;
  found:
+    cache_stats.hits++;
+    /* already the most recently used glyph */
+    if (first_cache_entry.next == p)
+        return p;
     /* suppress in linked list */
     p->next->prev = p->prev;
     p->prev->next = p->next;
@@ -103,6 +109,8 @@ static GlyphCache *add_cached_glyph(QEFont *font, int index, int data_size)
         *pp = p->hash_next;
 
         qe_free(&p);
+        cache_stats.evictions++;
+        cache_stats.nb_glyphs--;
     }
 
     p = qe_malloc_hack(GlyphCache, data_size);
@@ -122,11 +130,20 @@ static GlyphCache *add_cached_glyph(QEFont *font, int index, int data_size)
     p->next = first_cache_entry.next;
     first_cache_entry.next = p;
     p->prev = &first_cache_entry;
+    cache_stats.nb_glyphs++;
 
     return p;
 }
 
-static GlyphCache *fbf_decode_glyph1(QEFont *font, int code)
+void fbf_glyph_cache_stats(GlyphCacheStats *st)
+{
+    *st = cache_stats;
+    st->size = cache_size;
+}
+
+/* decode a glyph from 'font' and cache it for 'cache_font' */
+static GlyphCache *fbf_decode_glyph1(QEFont *font, QEFont *cache_font,
+                                     int code)
 {
     UniFontData *uf = font->priv_data;
     int glyph_index, size, src_width, src_height;
@@ -146,27 +163,34 @@ static GlyphCache *fbf_decode_glyph1(QEFont *font, int code)
     src_height = fbf_glyph_entry->h;
 
     size = src_width * src_height;
-    glyph_cache = add_cached_glyph(font, code, size);
+    /* room for the aligned row masks */
+    glyph_cache = add_cached_glyph(cache_font, code, size + 3 +
+                                   ((src_width + 31) >> 5) * src_height * 4);
     if (!glyph_cache)
         return NULL;
-    /* convert to bitmap */
+    glyph_cache->w = src_width;
+    glyph_cache->h = src_height;
+    /* convert to bitmap and row masks */
     {
         int x, y, bit, pitch;
         unsigned char *bitmap;
+        uint32_t *masks;
 
         bitmap = fbf_glyph_entry->bitmap;
+        masks = (uint32_t *)glyph_row_masks(glyph_cache);
+        memset(masks, 0, ((src_width + 31) >> 5) * src_height * 4);
         pitch = (src_width + 7) >> 3;
         for (y = 0; y < src_height; y++) {
             for (x = 0; x < src_width; x++) {
                 bit = (bitmap[pitch * y + (x >> 3)] >>
                        (7 - (x & 7))) & 1;
                 glyph_cache->data[src_width * y + x] = -bit;
+                masks[x >> 5] |= (uint32_t)bit << (x & 31);
             }
+            masks += (src_width + 31) >> 5;
         }
     }
 
-    glyph_cache->w = src_width;
-    glyph_cache->h = src_height;
     glyph_cache->x = fbf_glyph_entry->x;
     glyph_cache->y = fbf_glyph_entry->y;
     glyph_cache->xincr = fbf_glyph_entry->xincr;
@@ -175,7 +199,8 @@ static GlyphCache *fbf_decode_glyph1(QEFont *font, int code)
 
 
 /*
- * main function : get one glyph. Return -1 if no glyph found, 0 if OK.
+ * main function : get one glyph. Glyphs missing from the fonts are
+ * returned as empty glyphs, NULL is only returned on allocation failure.
  */
 GlyphCache *decode_cached_glyph(QEditScreen *s, QEFont *font, int code)
 {
@@ -184,15 +209,27 @@ GlyphCache *decode_cached_glyph(QEditScreen *s, QEFont *font, int code)
 
     g = get_cached_glyph(font, code);
     if (!g) {
-        g = fbf_decode_glyph1(font, code);
+        g = fbf_decode_glyph1(font, font, code);
         if (!g) {
             /* try with fallback font */
             font1 = select_font(s, font->style | (1 << QE_FONT_FAMILY_FALLBACK_SHIFT),
                                 font->size);
-            g = fbf_decode_glyph1(font1, code);
+            /* cache the glyph for the requested font so the fallback
+               lookup is not repeated */
+            g = fbf_decode_glyph1(font1, font, code);
             release_font(s, font1);
-            if (!g)
-                return NULL;
+            if (!g) {
+                /* cache missing glyphs as empty glyphs to avoid
+                   searching the fonts again */
+                g = add_cached_glyph(font, code, 0);
+                if (!g)
+                    return NULL;
+                g->w = g->h = 0;
+                g->x = g->y = 0;
+                g->xincr = 0;
+                g->is_fallback = 0;
+                return g;
+            }
             /* indicates that it is a fallback glyph so that the
                correct font height can be computed */
             g->is_fallback = 1;
@@ -39,13 +39,34 @@ typedef struct GlyphCache {
     unsigned short data_size;
     short xincr;  /* glyph x increment */
     unsigned char is_fallback; /* true if fallback glyph */
+    /* w * h bytes of bitmap (0x00 or 0xFF), followed by the same
+       bitmap as aligned 32-bit row masks, see glyph_row_masks() */
     unsigned char data[0];  /* CG: C99 flexible array */
 } GlyphCache;
 
+/* Glyph rows as bit masks: bit n of word k of a row is set if pixel
+   32 * k + n is set.  Each row uses glyph_row_words(g) words. */
+static inline int glyph_row_words(const GlyphCache *g) {
+    return (g->w + 31) >> 5;
+}
+
+static inline const uint32_t *glyph_row_masks(const GlyphCache *g) {
+    return (const uint32_t *)(((uintptr_t)(g->data + g->w * g->h) + 3) & ~3);
+}
+
+typedef struct GlyphCacheStats {
+    int lookups;        /* number of glyph cache lookups */
+    int hits;           /* number of lookups found in the cache */
+    int evictions;      /* number of glyphs freed to limit the cache size */
+    int nb_glyphs;      /* number of glyphs in the cache */
+    int size;           /* cache size in bytes */
+} GlyphCacheStats;
+
 void fbf_text_metrics(QEditScreen *s, QEFont *font,
                       QECharMetrics *metrics,
                       const char32_t *str, int len);
 GlyphCache *decode_cached_glyph(QEditScreen *s, QEFont *font, int code);
+void fbf_glyph_cache_stats(GlyphCacheStats *st);
 QEFont *fbf_open_font(QEditScreen *s, int style, int size);
 void fbf_close_font(QEditScreen *s, QEFont **fontp);
 
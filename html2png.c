@@ -26,6 +26,12 @@
 #include "qe.h"
 #include "css.h"
 #include "cfb.h"
+#include "fbfrender.h"
+
+#ifndef CONFIG_WIN32
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
 
 #ifdef CONFIG_PNG_OUTPUT
 #include <png.h>
@@ -34,8 +40,10 @@
 #define DEFAULT_WIDTH 640
 #ifdef CONFIG_PNG_OUTPUT
 #define DEFAULT_OUTFILENAME "a.png"
+#define DEFAULT_EXTENSION   ".png"
 #else
 #define DEFAULT_OUTFILENAME "a.ppm"
+#define DEFAULT_EXTENSION   ".ppm"
 #endif
 
 /* file I/O for the qHTML library */
@@ -131,6 +139,7 @@ static QEDisplay ppm_dpy = {
     NULL, /* dpy_draw_picture */
     NULL, /* dpy_full_screen */
     NULL, /* dpy_describe */
+    NULL, /* dpy_scroll */
     NULL, /* next */
 };
 
@@ -329,10 +338,69 @@ static int html_test_abort(qe__unused__ void *opaque)
     return 0;
 }
 
+/* monotonic clock for the stage timings */
+int get_clock_usec(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* rendering stages, timed separately for each document */
+enum {
+    STAGE_PARSE,
+    STAGE_COMPUTE,
+    STAGE_LAYOUT,
+    STAGE_RASTER,
+    STAGE_ENCODE,
+    NB_STAGES,
+};
+
+static const char * const stage_names[NB_STAGES] = {
+    "parse", "compute", "layout", "raster", "encode",
+};
+
+typedef struct RenderJob {
+    char *infilename;
+    char *outfilename;
+} RenderJob;
+
+typedef struct RenderStats {
+    int rendered;               /* 1 if OK, -1 on error, 0 if not done */
+    int usec[NB_STAGES];
+    int glyph_lookups, glyph_hits, glyph_evictions;
+} RenderStats;
+
+/* Job queue shared by the worker processes: each worker takes the
+   next document from the queue and stores its results in place. */
+typedef struct RenderQueue {
+    int next_job;
+    RenderStats stats[1];
+} RenderQueue;
+
+/* the default style sheet is parsed once and copied into each document */
+static CSSStyleSheet *default_style_sheet;
+
+static void stage_time(RenderStats *st, int stage, int *clock_ptr)
+{
+    int t = get_clock_usec();
+
+    st->usec[stage] += t - *clock_ptr;
+    *clock_ptr = t;
+}
+
 #define IO_BUF_SIZE 4096
 
-static int draw_html(QEditScreen *scr,
-                     const char *filename, QECharset *charset, int flags)
+static int draw_html(QEditScreen *scr, const char *filename,
+                     QECharset *charset, int flags, RenderStats *st)
 {
     CSSContext *s = NULL;
     CSSBox *top_box = NULL;
@@ -341,16 +409,17 @@ static int draw_html(QEditScreen *scr,
     int len;
     char buf[IO_BUF_SIZE];
     CSSRect rect;
-    int page_height;
+    int page_height, clock;
+
+    clock = get_clock_usec();
 
     s = css_new_document(scr, NULL);
     if (!s)
         return -1;
 
-    /* prepare default style sheet */
+    /* prepare style sheet from the default one */
     s->style_sheet = css_new_style_sheet();
-
-    css_parse_style_sheet_str(s->style_sheet, html_style, flags);
+    css_merge_style_sheet(s->style_sheet, default_style_sheet);
 
     /* default colors */
     s->selection_bgcolor = QERGB(0x00, 0x00, 0xff);
@@ -375,12 +444,15 @@ static int draw_html(QEditScreen *scr,
     css_close(&f);
 
     top_box = xml_end(&xml);
+    stage_time(st, STAGE_PARSE, &clock);
 
     /* CSS computation */
     css_compute(s, top_box);
+    stage_time(st, STAGE_COMPUTE, &clock);
 
     /* CSS layout */
     css_layout(s, top_box, scr->width, html_test_abort, NULL);
+    stage_time(st, STAGE_LAYOUT, &clock);
 
     /* now we know the total size, so we allocate the ppm */
     page_height = top_box->bbox.y2;
@@ -398,6 +470,7 @@ static int draw_html(QEditScreen *scr,
 
     css_delete_box(&top_box);
     css_delete_document(&s);
+    stage_time(st, STAGE_RASTER, &clock);
     return 0;
  fail:
     css_close(&f);
@@ -406,11 +479,238 @@ static int draw_html(QEditScreen *scr,
     return -1;
 }
 
+static int save_image(QEditScreen *s, const char *filename)
+{
+#ifdef CONFIG_PNG_OUTPUT
+    if (!strstr(filename, ".ppm"))
+        return png_save(s, filename);
+#endif
+    return ppm_save(s, filename);
+}
+
+static void render_job(QEditScreen *screen, RenderJob *job, RenderStats *st,
+                       QECharset *charset, int flags)
+{
+    GlyphCacheStats gs0, gs1;
+    int clock;
+
+    st->rendered = -1;
+    fbf_glyph_cache_stats(&gs0);
+    if (draw_html(screen, job->infilename, charset, flags, st) < 0)
+        return;
+    fbf_glyph_cache_stats(&gs1);
+    st->glyph_lookups = gs1.lookups - gs0.lookups;
+    st->glyph_hits = gs1.hits - gs0.hits;
+    st->glyph_evictions = gs1.evictions - gs0.evictions;
+    clock = get_clock_usec();
+    if (save_image(screen, job->outfilename) < 0)
+        return;
+    stage_time(st, STAGE_ENCODE, &clock);
+    st->rendered = 1;
+}
+
+static void render_queue(QEditScreen *screen, RenderJob *jobs, int nb_jobs,
+                         RenderQueue *q, QECharset *charset, int flags)
+{
+    int i;
+
+    while ((i = __atomic_fetch_add(&q->next_job, 1, __ATOMIC_RELAXED)) < nb_jobs)
+        render_job(screen, &jobs[i], &q->stats[i], charset, flags);
+}
+
+static RenderQueue *render_queue_alloc(int nb_jobs, size_t *sizep)
+{
+    size_t size = offsetof(RenderQueue, stats) + nb_jobs * sizeof(RenderStats);
+#ifdef CONFIG_WIN32
+    *sizep = size;
+    return qe_mallocz_bytes(size);
+#else
+    void *p;
+
+    /* the queue must be visible from all worker processes */
+    *sizep = size;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static void render_queue_free(RenderQueue *q, size_t size)
+{
+#ifdef CONFIG_WIN32
+    qe_free(&q);
+#else
+    munmap(q, size);
+#endif
+}
+
+/* Render all documents with 'nb_workers' processes forked after the
+   fonts are loaded and the default style sheet is parsed, so the
+   workers share them.  Fonts and glyph caches are per process: the
+   qHTML library and the display layer are not thread safe.
+   Return the number of documents that could not be rendered.
+ */
+static int render_jobs(QEditScreen *screen, RenderJob *jobs, int nb_jobs,
+                       int nb_workers, QECharset *charset, int flags,
+                       int timing)
+{
+    RenderQueue *q;
+    size_t size;
+    int i, j, nb_started, nb_errors, elapsed;
+    int totals[NB_STAGES];
+    int64_t lookups, hits, evictions;
+
+    q = render_queue_alloc(nb_jobs, &size);
+    if (!q) {
+        fprintf(stderr, "html2png: cannot allocate job queue\n");
+        return nb_jobs;
+    }
+
+    elapsed = get_clock_usec();
+    nb_started = 0;
+#ifndef CONFIG_WIN32
+    if (nb_workers > nb_jobs)
+        nb_workers = nb_jobs;
+    if (nb_workers > 1) {
+        fflush(NULL);
+        for (i = 0; i < nb_workers; i++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("html2png: fork");
+                break;
+            }
+            if (pid == 0) {
+                render_queue(screen, jobs, nb_jobs, q, charset, flags);
+                fflush(NULL);
+                _exit(0);
+            }
+            nb_started++;
+        }
+    }
+    while (nb_started > 0) {
+        if (wait(NULL) >= 0)
+            nb_started--;
+        else if (errno != EINTR)
+            break;
+    }
+#endif
+    /* render sequentially, or finish the queue if the workers failed */
+    render_queue(screen, jobs, nb_jobs, q, charset, flags);
+    elapsed = get_clock_usec() - elapsed;
+
+    nb_errors = 0;
+    memset(totals, 0, sizeof(totals));
+    lookups = hits = evictions = 0;
+    for (i = 0; i < nb_jobs; i++) {
+        RenderStats *st = &q->stats[i];
+        if (st->rendered <= 0) {
+            fprintf(stderr, "html2png: could not render '%s' to '%s'\n",
+                    jobs[i].infilename, jobs[i].outfilename);
+            nb_errors++;
+            continue;
+        }
+        lookups += st->glyph_lookups;
+        hits += st->glyph_hits;
+        evictions += st->glyph_evictions;
+        if (timing) {
+            printf("%s:", jobs[i].infilename);
+            for (j = 0; j < NB_STAGES; j++) {
+                printf(" %s %.1f", stage_names[j], st->usec[j] / 1000.0);
+                totals[j] += st->usec[j];
+            }
+            printf(" ms\n");
+        }
+    }
+    if (timing) {
+        printf("total:");
+        for (j = 0; j < NB_STAGES; j++)
+            printf(" %s %.1f", stage_names[j], totals[j] / 1000.0);
+        printf(" ms\n");
+        printf("glyph cache: %" PRId64 " lookups, %.1f%% hits, %" PRId64
+               " evictions\n", lookups,
+               lookups ? hits * 100.0 / lookups : 0.0, evictions);
+        printf("%d documents, %d errors, %d workers, %.3fs elapsed\n",
+               nb_jobs, nb_errors, max_int(nb_workers, 1), elapsed / 1e6);
+    }
+    render_queue_free(q, size);
+    return nb_errors;
+}
+
+static RenderJob *jobs;
+static int nb_jobs, nb_jobs_allocated;
+
+static int add_job(const char *infilename, const char *outfilename,
+                   const char *outdir)
+{
+    char buf[MAX_FILENAME_SIZE];
+    RenderJob *job;
+
+    if (nb_jobs == nb_jobs_allocated) {
+        int n = nb_jobs_allocated + (nb_jobs_allocated >> 1) + 16;
+        if (!qe_realloc(&jobs, n * sizeof(*jobs)))
+            return -1;
+        nb_jobs_allocated = n;
+    }
+    if (!outfilename) {
+        /* derive the output file name from the input file name */
+        if (outdir)
+            makepath(buf, sizeof(buf), outdir, get_basename(infilename));
+        else
+            pstrcpy(buf, sizeof(buf), infilename);
+        strip_extension(buf);
+        pstrcat(buf, sizeof(buf), DEFAULT_EXTENSION);
+        outfilename = buf;
+    }
+    job = &jobs[nb_jobs++];
+    job->infilename = qe_strdup(infilename);
+    job->outfilename = qe_strdup(outfilename);
+    return 0;
+}
+
+/* Read a list of documents to render: one input file name per line,
+   optionally followed by a tab and the output file name.  Blank lines
+   and lines starting with '#' are ignored.
+ */
+static int read_job_list(const char *filename, const char *outdir)
+{
+    char line[2 * MAX_FILENAME_SIZE];
+    char *p, *outfilename;
+    FILE *f;
+    int res = 0;
+
+    f = strequal(filename, "-") ? stdin : fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "html2png: cannot open '%s': %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        outfilename = NULL;
+        p = strchr(line, '\t');
+        if (p) {
+            *p++ = '\0';
+            if (*p)
+                outfilename = p;
+        }
+        if (add_job(line, outfilename, outdir) < 0) {
+            res = -1;
+            break;
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+    return res;
+}
+
 static void help(void)
 {
     printf("html2png version %s (c) 2002 Fabrice Bellard\n"
            "\n"
-           "usage: html2png [-h] [-x] [-w width] [-o outfile] [-f charset] infile\n"
+           "usage: html2png [-h] [-x] [-t] [-w width] [-o outfile] [-f charset]\n"
+           "                [-l listfile] [-d outdir] [-j jobs] [infile...]\n"
            "Convert the HTML page 'infile' into the png/ppm image file 'outfile'\n"
            "\n"
            "-h         : display this help\n"
@@ -418,19 +718,29 @@ static void help(void)
            "-w width   : set the image width (default=%d)\n"
            "-f charset : set the default charset (default='%s')\n"
            "             use -f ? to list supported charsets\n"
-           "-o outfile : set the output filename (default='%s')\n",
+           "-o outfile : set the output filename (default='%s')\n"
+           "-l listfile: read the input files from 'listfile' ('-' for stdin),\n"
+           "             one per line, optionally followed by a tab and the\n"
+           "             output filename\n"
+           "-d outdir  : store the images into 'outdir' (default=next to input)\n"
+           "-j jobs    : render documents with 'jobs' parallel processes\n"
+           "-t         : print the time spent in each rendering stage\n"
+           "\n"
+           "With several input files, each image is named after its input\n"
+           "file with a '%s' extension.\n",
            QE_VERSION,
            DEFAULT_WIDTH,
            "8859-1",
-           DEFAULT_OUTFILENAME);
+           DEFAULT_OUTFILENAME,
+           DEFAULT_EXTENSION);
 }
 
 int main(int argc, char **argv)
 {
     QEmacsState state, *qs;
     QEditScreen screen1, *screen = &screen1;
-    int page_width, c, strict_xml, flags;
-    const char *outfilename, *infilename;
+    int page_width, c, strict_xml, flags, nb_workers, timing, nb_errors;
+    const char *outfilename, *outdir, *listfilename;
     QECharset *charset;
 
     qs = memset(&state, 0, sizeof state);
@@ -441,12 +751,16 @@ int main(int argc, char **argv)
     css_init();
 
     page_width = DEFAULT_WIDTH;
-    outfilename = DEFAULT_OUTFILENAME;
+    outfilename = NULL;
+    outdir = NULL;
+    listfilename = NULL;
     charset = &charset_8859_1;
     strict_xml = 0;
+    nb_workers = 1;
+    timing = 0;
 
     for (;;) {
-        c = getopt(argc, argv, "h?w:o:f:x");
+        c = getopt(argc, argv, "h?w:o:f:xl:d:j:t");
         if (c == -1)
             break;
         switch (c) {
@@ -475,13 +789,38 @@ int main(int argc, char **argv)
         case 'x':
             strict_xml = 1;
             break;
+        case 'l':
+            listfilename = optarg;
+            break;
+        case 'd':
+            outdir = optarg;
+            break;
+        case 'j':
+            nb_workers = atoi(optarg);
+            break;
+        case 't':
+            timing = 1;
+            break;
+        }
+    }
+    if (listfilename && read_job_list(listfilename, outdir) < 0)
+        exit(1);
+    if (optind == argc - 1 && nb_jobs == 0) {
+        /* single document mode */
+        add_job(argv[optind], outfilename ? outfilename :
+                outdir ? NULL : DEFAULT_OUTFILENAME, outdir);
+    } else {
+        if (outfilename) {
+            fprintf(stderr, "html2png: -o requires a single input file\n");
+            exit(1);
         }
+        for (; optind < argc; optind++)
+            add_job(argv[optind], NULL, outdir);
     }
-    if (optind >= argc) {
+    if (nb_jobs == 0) {
         help();
         exit(1);
     }
-    infilename = argv[optind];
 
     /* init display driver with dummy height */
     if (screen_init(screen, &ppm_dpy, page_width, 1) < 0) {
@@ -493,19 +832,13 @@ int main(int argc, char **argv)
     if (!strict_xml)
         flags |= XML_IGNORE_CASE | XML_HTML_SYNTAX;
 
-    draw_html(screen, infilename, charset, flags);
+    default_style_sheet = css_new_style_sheet();
+    css_parse_style_sheet_str(default_style_sheet, html_style, flags);
 
-    /* save ppm file */
-#ifdef CONFIG_PNG_OUTPUT
-    if (strstr(outfilename, ".ppm"))
-        ppm_save(screen, outfilename);
-    else
-        png_save(screen, outfilename);
-#else
-    ppm_save(screen, outfilename);
-#endif
+    nb_errors = render_jobs(screen, jobs, nb_jobs, nb_workers,
+                            charset, flags, timing);
 
     /* close screen */
     dpy_close(screen);
-    return 0;
+    return nb_errors != 0;
 }
@@ -64,11 +64,11 @@ static int unicode_input(int *match_buf,
 }
 
 static InputMethod default_input_method = {
-    "default", default_input, NULL, NULL,
+    "default", default_input, NULL, NULL, NULL,
 };
 
 static InputMethod unicode_input_method = {
-    "unicode", unicode_input, NULL, NULL,
+    "unicode", unicode_input, NULL, NULL, NULL,
 };
 
 void register_input_method(InputMethod *m)
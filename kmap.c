@@ -28,142 +28,331 @@
 #include <sys/mman.h>
 #endif
 
-/* XXX: use an edit buffer to access the kmap !!!! */
+/* Each kmap is a trie of input sequences produced by kmaptoqe:
+ *   u8 flags          0x80: sequences end with an implicit space
+ *   u24 root          offset of the root node
+ * Each node has the following layout:
+ *   u8 n              number of children
+ *   u8 olen           number of output code points, 0 if none
+ *   u16 output[olen]
+ *   u8 label[n]       input characters in increasing order
+ *   u24 child[n]      offset of the child node relative to the flags
+ *                     byte, or 0x80 and the u16 output of a leaf child
+ * Identical subtrees are shared, so lookups only depend on the length
+ * of the key sequence.
+ */
+
+#define KMAP_TRAILING_SPACE  0x80
+
+typedef struct KmapCursor {
+    const u8 *node;     /* current node, NULL for an inline leaf */
+    const u8 *output;   /* output code points of the current position */
+    int olen;
+} KmapCursor;
+
+static inline int kmap_get_u24(const u8 *p) {
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static void kmap_root(KmapCursor *cp, const u8 *data) {
+    cp->node = data + kmap_get_u24(data + 1);
+    cp->olen = cp->node[1];
+    cp->output = cp->node + 2;
+}
+
+static inline int kmap_has_children(const KmapCursor *cp) {
+    return cp->node && cp->node[0] > 0;
+}
+
+/* move to the child i of the current node */
+static void kmap_child(KmapCursor *cp, const u8 *data, int i) {
+    const u8 *p = cp->node;
+    int n = p[0];
+    const u8 *q = p + 2 + 2 * p[1] + n + 3 * i;
+
+    if (q[0] & 0x80) {
+        cp->node = NULL;
+        cp->output = q + 1;
+        cp->olen = 1;
+    } else {
+        cp->node = data + kmap_get_u24(q);
+        cp->olen = cp->node[1];
+        cp->output = cp->node + 2;
+    }
+}
+
+/* move to the child for input character c, return 0 if found */
+static int kmap_step(KmapCursor *cp, const u8 *data, char32_t c) {
+    const u8 *labels;
+    int lo, hi, mid;
+
+    if (!cp->node || c > 0xff)
+        return -1;
+    lo = 0;
+    hi = cp->node[0];
+    labels = cp->node + 2 + 2 * cp->node[1];
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (labels[mid] < c) {
+            lo = mid + 1;
+        } else
+        if (labels[mid] > c) {
+            hi = mid;
+        } else {
+            kmap_child(cp, data, mid);
+            return 0;
+        }
+    }
+    return -1;
+}
 
-/* parse the internal compressed input method format */
+/* find the longest sequence of keys in buf that has a mapping: return
+ * INPUTMETHOD_MORECHARS if buf is a proper prefix of a longer sequence
+ */
 static int kmap_input(int *match_buf, int match_buf_size,
                       int *match_len_ptr, const u8 *data,
                       const char32_t *buf, int len)
 {
-    const u8 *p, *p1, *match_extra;
-    int flag, i, l, l1, match_len, match_char, match_count, match_real_len;
-    char32_t c;
-    int match_olen;
-    int nb_prefixes, last_outputc, match, prefix_len, trailing_space, olen;
-
-    p = data;
-    nb_prefixes = p[0] & 0x7f;
-    trailing_space = p[0] & 0x80;
-    p++;
-    prefix_len = 0;
-    if (nb_prefixes > 0) {
-        p1 = p;
-        for (i = 0; i < nb_prefixes; i++) {
-            if (buf[0] == p1[0])
-                goto prefix_match;
-            p1 += 4;
+    KmapCursor cur, match;
+    int i, trailing_space, match_len;
+
+    trailing_space = data[0] & KMAP_TRAILING_SPACE;
+    kmap_root(&cur, data);
+    match = cur;
+    match_len = 0;
+    for (i = 0; i < len; i++) {
+        if (trailing_space && cur.olen && buf[i] == ' ') {
+            match = cur;
+            match_len = i + 1;
         }
+        if (kmap_step(&cur, data, buf[i]))
+            goto done;
+        if (!trailing_space && cur.olen) {
+            match = cur;
+            match_len = i + 1;
+        }
+    }
+    if (kmap_has_children(&cur) || (trailing_space && cur.olen))
+        return INPUTMETHOD_MORECHARS;
+ done:
+    if (match_len == 0)
         return INPUTMETHOD_NOMATCH;
-    prefix_match:
-        p += nb_prefixes * 4 + (p1[1] << 16) + (p1[2] << 8) + p1[3];
-        prefix_len = 1;
+
+    *match_len_ptr = match_len;
+    for (i = 0; i < match.olen && i < match_buf_size; i++) {
+        match_buf[i] = (match.output[2 * i] << 8) | match.output[2 * i + 1];
     }
+    return match.olen;
+}
 
-    match_len = 0;
-    match_real_len = 0;
-    match_char = 0;
-    match_count = 0;
-    last_outputc = 0;
-    match_olen = 0;
-    match_extra = NULL;
-    for (;;) {
-        match = 1;
-        olen = 1;
-        l1 = prefix_len; /* length of input pattern */
-        for (;;) {
-            /* c = 0x00        end of table
-             * c = 0x01..0x1d  delta unicode
-             * c = 0x1e        unicode output mapping follows
-             * c = 0x1f        unicode input char follows.
-             * c = 0x20..0x7f  input character
-             * c = 0x80        unused
-             * c = 0x81        unused
-             * c = 0x82..0x9d  extra unicode outputs follow
-             * c = 0x9e        first unicode output mapping follows
-             * c = 0x9f        last unicode input char follows and delta==1.
-             * c = 0xa0..0xff  last input character and delta==1
-             */
-            c = *p++;
-            flag = c & 0x80;
-            c &= 0x7f;
-            if (c == 0) {
-                /* end of table / unused */
-                goto the_end;
-            } else
-            if (c < 0x1e) {
-                if (flag) {
-                    /* extra output glyphs */
-                    olen = c;
-                } else {
-                    /* delta */
-                    last_outputc += c;
-                }
-                break;
-            } else
-            if (c == 0x1e) {
-                /* explicit output */
-                last_outputc = (p[0] << 8) | p[1];
-                p += 2;
-                if (flag)
-                    continue;
-                else
-                    break;
-            } else
-            if (c == 0x1f) {
-                /* unicode value */
-                c = (p[0] << 8) | p[1];
-                p += 2;
+/* enumerate the mappings below the current node with exactly depth
+   more keys, return the number of candidates still expected.
+   '*reached' is set if the trie has nodes at this depth. */
+static int kmap_list_level(buf_t *out, int count, const u8 *data,
+                           const KmapCursor *cp, u8 *keys, int len,
+                           int depth, int *reached)
+{
+    KmapCursor cur;
+    int i, n;
+
+    if (depth == 0) {
+        *reached = 1;
+        if (cp->olen) {
+            if (out->len)
+                buf_put_byte(out, ' ');
+            for (i = 0; i < len; i++) {
+                buf_putc_utf8(out, keys[i]);
             }
-            if (l1 < len && c != buf[l1])
-                match = 0;
-            l1++;
-            if (flag) {
-                /* delta = 1 */
-                last_outputc++;
-                break;
+            buf_put_byte(out, ':');
+            for (i = 0; i < cp->olen; i++) {
+                buf_putc_utf8(out, (cp->output[2 * i] << 8) |
+                              cp->output[2 * i + 1]);
             }
+            count--;
         }
-        if (trailing_space) {
-            if (l1 < len && ' ' != buf[l1])
-                match = 0;
-            l1++;
-        }
+        return count;
+    }
+    if (!cp->node)
+        return count;
+    n = cp->node[0];
+    for (i = 0; i < n && count > 0; i++) {
+        cur = *cp;
+        keys[len] = cp->node[2 + 2 * cp->node[1] + i];
+        kmap_child(&cur, data, i);
+        count = kmap_list_level(out, count, data, &cur, keys, len + 1,
+                                depth - 1, reached);
+    }
+    return count;
+}
 
-        if (match) {
-            l = l1;
-            if (l > len)
-                l = len;
-            if (l == match_len) {
-                match_count++;
-            } else
-            if (l > match_len) {
-                match_len = l;
-                match_real_len = l1;
-                match_char = last_outputc;
-                match_count = 1;
-                match_olen = olen;
-                match_extra = p;
-            }
+/* list the completions of the keys in buf, shortest sequences first,
+ * as "keys:output" pairs with the keys typed so far omitted.
+ */
+static int kmap_candidates(buf_t *out, int max_count, const u8 *data,
+                           const char32_t *buf, int len)
+{
+    KmapCursor cur;
+    u8 keys[32];
+    int i, depth, count, reached;
+
+    kmap_root(&cur, data);
+    for (i = 0; i < len; i++) {
+        if (kmap_step(&cur, data, buf[i]))
+            return 0;
+    }
+    count = max_count;
+    for (depth = 0, reached = 1; reached && count > 0; depth++) {
+        if (depth >= countof(keys))
+            break;
+        reached = 0;
+        count = kmap_list_level(out, count, data, &cur, keys, 0, depth,
+                                &reached);
+    }
+    return max_count - count;
+}
+
+/*---------------- Input method benchmark ----------------*/
+
+typedef struct KmapBench {
+    char32_t *keys;     /* keystrokes of all mappings in trie order */
+    int nb_keys, keys_size;
+    int nb_maps;
+    int errors;
+    const u8 *data;
+} KmapBench;
+
+static int kmap_bench_add(KmapBench *kb, char32_t c) {
+    if (kb->nb_keys >= kb->keys_size) {
+        int size = kb->keys_size + (kb->keys_size >> 1) + 4096;
+        if (!qe_realloc(&kb->keys, size * sizeof(*kb->keys)))
+            return -1;
+        kb->keys_size = size;
+    }
+    kb->keys[kb->nb_keys++] = c;
+    return 0;
+}
+
+/* append the keys of each mapping below cp and check that looking them
+   up yields the mapping */
+static int kmap_bench_walk(KmapBench *kb, const KmapCursor *cp,
+                           char32_t *keys, int len)
+{
+    KmapCursor cur;
+    int match_buf[20], match_len, i, n, ret;
+    int trailing_space = kb->data[0] & KMAP_TRAILING_SPACE;
+
+    if (cp->olen) {
+        int klen = len;
+        if (trailing_space)
+            keys[klen++] = ' ';
+        ret = kmap_input(match_buf, countof(match_buf), &match_len,
+                         kb->data, keys, klen);
+        if (ret == INPUTMETHOD_MORECHARS && !trailing_space) {
+            /* prefix of a longer sequence */
+        } else
+        if (ret != cp->olen || match_len != klen
+        ||  match_buf[0] != ((cp->output[0] << 8) | cp->output[1])) {
+            kb->errors++;
+        }
+        for (i = 0; i < klen; i++) {
+            if (kmap_bench_add(kb, keys[i]))
+                return -1;
         }
-        p += (olen - 1) << 1;
+        kb->nb_maps++;
     }
-  the_end:
-    if (match_len == 0) {
-        return INPUTMETHOD_NOMATCH;
-    } else
-    if (match_count > 1 || match_real_len > len) {
-        return INPUTMETHOD_MORECHARS;
-    } else {
-        *match_len_ptr = match_len;
-        if (match_buf_size > 0) {
-            match_buf[0] = match_char;
-            p = match_extra;
-            for (i = 1; i < match_olen && i < match_buf_size; i++, p += 2) {
-                match_buf[i] = (p[0] << 8) + p[1];
+    if (!cp->node || len >= 31)
+        return 0;
+    n = cp->node[0];
+    for (i = 0; i < n; i++) {
+        cur = *cp;
+        keys[len] = cp->node[2 + 2 * cp->node[1] + i];
+        kmap_child(&cur, kb->data, i);
+        if (kmap_bench_walk(kb, &cur, keys, len + 1))
+            return -1;
+    }
+    return 0;
+}
+
+/* replay the keystrokes the way text_write_char() composes them,
+   return the number of code points produced */
+static int kmap_bench_replay(const u8 *data, const char32_t *keys, int nb_keys)
+{
+    char32_t compose_buf[32];
+    int match_buf[20], match_len, compose_len, i, ret, nb_output;
+
+    nb_output = 0;
+    compose_len = 0;
+    for (i = 0; i < nb_keys; i++) {
+        if (compose_len >= countof(compose_buf))
+            compose_len = 0;
+        compose_buf[compose_len++] = keys[i];
+        for (;;) {
+            ret = kmap_input(match_buf, countof(match_buf), &match_len,
+                             data, compose_buf, compose_len);
+            if (ret == INPUTMETHOD_NOMATCH) {
+                nb_output += compose_len;
+                compose_len = 0;
+                break;
             }
+            if (ret == INPUTMETHOD_MORECHARS)
+                break;
+            nb_output += ret;
+            compose_len -= match_len;
+            umemmove(compose_buf, compose_buf + match_len, compose_len);
+            if (compose_len == 0)
+                break;
         }
-        return match_olen;
     }
+    return nb_output + compose_len;
+}
+
+void do_input_method_benchmark(EditState *s, const char *name)
+{
+    QEmacsState *qs = s->qe_state;
+    InputMethod *m;
+    KmapBench kb;
+    KmapCursor cur;
+    char32_t keys[32];
+    int t0, elapsed, rounds, nb_output;
+
+    for (m = qs->input_methods; m != NULL; m = m->next) {
+        if (m->input_match == kmap_input && strequal(m->name, name))
+            break;
+    }
+    if (!m) {
+        put_status(s, "'%s' not found", name);
+        return;
+    }
+    memset(&kb, 0, sizeof(kb));
+    kb.data = m->data;
+    kmap_root(&cur, kb.data);
+    if (kmap_bench_walk(&kb, &cur, keys, 0)) {
+        put_error(s, "Out of memory");
+        goto done;
+    }
+    if (kb.nb_keys == 0) {
+        put_status(s, "%s: empty input method", name);
+        goto done;
+    }
+    /* repeat the replay for at least 100ms */
+    nb_output = 0;
+    t0 = get_clock_usec();
+    for (rounds = 0;;) {
+        nb_output = kmap_bench_replay(kb.data, kb.keys, kb.nb_keys);
+        rounds++;
+        elapsed = get_clock_usec() - t0;
+        if (elapsed >= 100000)
+            break;
+    }
+    put_status(s, "%s: %d mappings, %d keys -> %d chars, %.3fus/key%s",
+               name, kb.nb_maps, kb.nb_keys, nb_output,
+               (double)elapsed / ((double)rounds * kb.nb_keys),
+               kb.errors ? ", lookup errors!" : ", all mappings verified");
+    if (kb.errors)
+        put_error(s, "%s: %d mappings do not resolve to their output",
+                  name, kb.errors);
+ done:
+    qe_free(&kb.keys);
 }
 
 #ifdef CONFIG_MMAP
@@ -205,7 +394,7 @@ int load_input_methods(const char *filename)
         }
     }
 
-    if (memcmp(file_ptr, "kmap", 4) != 0)
+    if (file_size < 8 || memcmp(file_ptr, "kmp2", 4) != 0)
         goto fail;
 
     p = file_ptr + 4;
@@ -219,6 +408,7 @@ int load_input_methods(const char *filename)
         if (m) {
             m->data = file_ptr + offset;
             m->input_match = kmap_input;
+            m->input_candidates = kmap_candidates;
             m->name = (const char*)p;
             register_input_method(m);
         }
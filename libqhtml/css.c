@@ -385,6 +385,7 @@ static void set_counter(CSSContext *s, CSSIdent counter_id, int value)
     for (p = s->counter_stack_ptr; p != s->counter_stack_base; p = p->prev) {
         if (p->counter_id == counter_id) {
             p->value = value;
+            return;
         }
     }
     p = qe_mallocz(CSSCounterValue);
@@ -842,8 +843,7 @@ static inline int strcmp_null(const char *s1, const char *s2)
 }
 #endif
 
-/* hash a byte string */
-/* XXX: faster hash ? */
+/* hash a byte string: the modulo is only taken once by the caller */
 static inline unsigned int hash_bytes(unsigned int h,
                                       const unsigned char *p, int len)
 {
@@ -851,7 +851,7 @@ static inline unsigned int hash_bytes(unsigned int h,
 
     p_end = p + len;
     for (; p < p_end; p++) {
-        h = ((h << 8) + p[0]) % PROPS_HASH_SIZE;
+        h = h * 31 + p[0];
     }
     return h;
 }
@@ -863,7 +863,7 @@ static unsigned int hash_props(CSSState *props)
     /* since no holes are the the structure, we can compute the hash on
        the bytes */
     h = hash_bytes(1, (unsigned char *)props, PROPS_SIZE);
-    return h;
+    return h % PROPS_HASH_SIZE;
 }
 
 static int is_equal_props(CSSState *p1, CSSState *p2)
@@ -1116,15 +1116,14 @@ static CSSBox *add_marker_box(CSSContext *s, CSSBox *box)
     return box1;
 }
 
-/* compute the CSS properties of a box */
-static int css_compute_block(CSSContext *s, CSSBox *box,
-                             CSSState *parent_props)
+/* compute the CSS properties of a box before its children, return
+   the pseudo elements found for the box or -1 if error */
+static int css_compute_block_start(CSSContext *s, CSSBox *box,
+                                   CSSState *parent_props)
 {
     CSSState *aprops;
     CSSState props1, *props = &props1;
-    CSSBox *box1, *box_next, **pbox;
     int pelement_found;
-    CSSCounterValue *counter_stack;
 
     pelement_found = css_eval(s, props, box, 0, parent_props);
 
@@ -1141,22 +1140,17 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
         box->content_type != CSS_CONTENT_TYPE_IMAGE) {
         css_make_child_box(box);
     }
+    return pelement_found;
+}
 
-    /* if boxes are inside, then evaluate their properties too */
-    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
-        /* other boxes are inside: handle them */
-
-        counter_stack = push_counters(s);
-
-        for (box1 = box->u.child.first; box1 != NULL; box1 = box_next) {
-            /* need to take next here because of :after inserted boxes */
-            box_next = box1->next;
-            if (css_compute_block(s, box1, props) < 0)
-                return -1;
-        }
-
-        pop_counters(s, counter_stack);
+/* add the boxes generated for the pseudo elements of a box after its
+   children have been computed */
+static void css_compute_block_end(CSSContext *s, CSSBox *box,
+                                  int pelement_found)
+{
+    CSSBox *box1, **pbox;
 
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
         /* for :after and :before we create new boxes at the start or
            the end of the child list */
         /* XXX: mark them as temporary */
@@ -1171,7 +1165,7 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
         }
         /* for list items, we must generate a marker/inline box, unless it
            was already generated by ':before' */
-        if (props->display == CSS_DISPLAY_LIST_ITEM &&
+        if (box->props->display == CSS_DISPLAY_LIST_ITEM &&
             (!box1 || box1->props->display != CSS_DISPLAY_MARKER)) {
             box1 = add_marker_box(s, box);
             /* add it as first box */
@@ -1214,9 +1208,50 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
             }
         }
     }
+}
+
+static int css_compute_block(CSSContext *s, CSSBox *box,
+                             CSSState *parent_props);
+
+/* compute the CSS properties of the children of a box whose own
+   properties were computed by css_compute_block_start() */
+static int css_compute_block_finish(CSSContext *s, CSSBox *box,
+                                    int pelement_found)
+{
+    CSSBox *box1, *box_next;
+    CSSCounterValue *counter_stack;
+
+    /* if boxes are inside, then evaluate their properties too */
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        /* other boxes are inside: handle them */
+
+        counter_stack = push_counters(s);
+
+        for (box1 = box->u.child.first; box1 != NULL; box1 = box_next) {
+            /* need to take next here because of :after inserted boxes */
+            box_next = box1->next;
+            if (css_compute_block(s, box1, box->props) < 0)
+                return -1;
+        }
+
+        pop_counters(s, counter_stack);
+    }
+    css_compute_block_end(s, box, pelement_found);
     return 0;
 }
 
+/* compute the CSS properties of a box */
+static int css_compute_block(CSSContext *s, CSSBox *box,
+                             CSSState *parent_props)
+{
+    int pelement_found;
+
+    pelement_found = css_compute_block_start(s, box, parent_props);
+    if (pelement_found < 0)
+        return -1;
+    return css_compute_block_finish(s, box, pelement_found);
+}
+
 /* compute the CSS properties of a complete document */
 int css_compute(CSSContext *s, CSSBox *box)
 {
@@ -3293,12 +3328,103 @@ static int css_layout_block_iterate(InlineLayout *il, CSSBox *box, int baseline)
     return 0;
 }
 
+/* start the layout of a block level box in a block formatting
+   context: compute its width and horizontal position. x_parent and
+   y_parent receive the coordinates to pass to the layout of its
+   interior. */
+static void css_layout_block_box_start(InlineLayout *il, CSSBox *box,
+                                       int *x_parent, int *y_parent)
+{
+    CSSState *props = box->props;
+
+    if (il->layout_type != LAYOUT_TYPE_BLOCK) {
+        css_end_inline_layout(il);
+        il->last_ymargin = 0;
+    }
+    il->marker_box = NULL; /* the marker was already positionned correctly */
+
+    if (props->width == CSS_AUTO) {
+        int w;
+        w = props->padding.x1 + props->padding.x2 +
+            props->border.x1 + props->border.x2;
+        if (props->margin.x1 != CSS_AUTO)
+            w += props->margin.x1;
+        if (props->margin.x2 != CSS_AUTO)
+            w += props->margin.x2;
+        box->width = il->total_width - w;
+    } else {
+        box->width = props->width;
+    }
+
+    /* position the box before so that we can pass x_parent and y_parent */
+    if (props->margin.x1 == CSS_AUTO &&
+        props->margin.x2 == CSS_AUTO) {
+        int w;
+        w = props->border.x1 + props->padding.x1 +
+            box->width +
+            props->padding.x2 + props->border.x2;
+        box->x = (il->total_width - w) / 2;
+    } else if (props->direction == CSS_DIRECTION_LTR) {
+        box->x = props->margin.x1 + props->border.x1 + props->padding.x1;
+    } else {
+        box->x = il->total_width - (props->margin.x2 + props->border.x2 +
+                                     props->padding.x2 + box->width);
+    }
+    /* XXX: compute y position there, but difficult to do
+       because we do not have the complete margin info */
+
+    if (props->height == CSS_AUTO) {
+        box->height = 0; /* will be extended later */
+    } else {
+        box->height = props->height;
+    }
+    /* XXX: y_parent does not take into account margins ! */
+    *x_parent = il->x0 + box->x;
+    *y_parent = il->y0 + il->y + props->border.y1 + props->padding.y1;
+}
+
+/* compute the vertical position of a block level box in a block
+   formatting context once its interior is laid out */
+static void css_layout_block_box_end(InlineLayout *il, LayoutOutput *layout,
+                                     CSSBox *box)
+{
+    CSSState *props = box->props;
+    int ymargin;
+
+    /* compute the margin */
+    if (il->is_first_box) {
+        il->margin_top = max_int(il->margin_top, layout->margin_top);
+        ymargin = 0; /* the margin is taken into account by the parent block */
+    } else {
+        ymargin = max_int(il->last_ymargin, layout->margin_top);
+    }
+    il->last_ymargin = layout->margin_bottom;
+    /* compute the box position */
+    box->y = il->y + ymargin + props->border.y1 + props->padding.y1;
+    box->padding_top = 0;
+    box->padding_bottom = 0;
+    /* update position for the next box */
+    il->y = box->y + box->height + props->border.y2 + props->padding.y2;
+
+    /* apply relative offset if specified */
+    if (props->position == CSS_POSITION_RELATIVE) {
+        if (props->left != CSS_AUTO)
+            box->x += props->left;
+        else if (props->right != CSS_AUTO)
+            box->x -= props->right;
+        if (props->top != CSS_AUTO)
+            box->y += props->top;
+        else if (props->bottom != CSS_AUTO)
+            box->y -= props->bottom;
+    }
+}
+
 /* layout one box in an inline or block context */
 static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
                                      int baseline)
 {
     CSSState *props;
-    int ret, ymargin;
+    int ret;
     LayoutOutput layout;
 
     if (il->ctx->abort_func(il->ctx->abort_opaque))
@@ -3343,79 +3469,14 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
         case CSS_DISPLAY_LIST_ITEM:
         case CSS_DISPLAY_BLOCK:
         case CSS_DISPLAY_TABLE:
-            if (il->layout_type != LAYOUT_TYPE_BLOCK) {
-                css_end_inline_layout(il);
-                il->last_ymargin = 0;
-            }
-            il->marker_box = NULL; /* the marker was already positionned correctly */
-
-            if (props->width == CSS_AUTO) {
-                int w;
-                w = props->padding.x1 + props->padding.x2 +
-                    props->border.x1 + props->border.x2;
-                if (props->margin.x1 != CSS_AUTO)
-                    w += props->margin.x1;
-                if (props->margin.x2 != CSS_AUTO)
-                    w += props->margin.x2;
-                box->width = il->total_width - w;
-            } else {
-                box->width = props->width;
-            }
-
-            /* position the box before so that we can pass x_parent and y_parent */
-            if (props->margin.x1 == CSS_AUTO &&
-                props->margin.x2 == CSS_AUTO) {
-                int w;
-                w = props->border.x1 + props->padding.x1 +
-                    box->width +
-                    props->padding.x2 + props->border.x2;
-                box->x = (il->total_width - w) / 2;
-            } else if (props->direction == CSS_DIRECTION_LTR) {
-                box->x = props->margin.x1 + props->border.x1 + props->padding.x1;
-            } else {
-                box->x = il->total_width - (props->margin.x2 + props->border.x2 +
-                                             props->padding.x2 + box->width);
-            }
-            /* XXX: compute y position there, but difficult to do
-               because we do not have the complete margin info */
-
-            if (props->height == CSS_AUTO) {
-                box->height = 0; /* will be extended later */
-            } else {
-                box->height = props->height;
-            }
-            /* XXX: y_parent does not take into account margins ! */
-            if (css_layout_block_recurse(il->layout_state, &layout, box,
-                                         il->x0 + box->x,
-                                         il->y0 + il->y +
-                                         props->border.y1 + props->padding.y1))
-                return -1;
+            {
+                int x_parent, y_parent;
 
-            /* compute the margin */
-            if (il->is_first_box) {
-                il->margin_top = max_int(il->margin_top, layout.margin_top);
-                ymargin = 0; /* the margin is taken into account by the parent block */
-            } else {
-                ymargin = max_int(il->last_ymargin, layout.margin_top);
-            }
-            il->last_ymargin = layout.margin_bottom;
-            /* compute the box position */
-            box->y = il->y + ymargin + props->border.y1 + props->padding.y1;
-            box->padding_top = 0;
-            box->padding_bottom = 0;
-            /* update position for the next box */
-            il->y = box->y + box->height + props->border.y2 + props->padding.y2;
-
-            /* apply relative offset if specified */
-            if (props->position == CSS_POSITION_RELATIVE) {
-                if (props->left != CSS_AUTO)
-                    box->x += props->left;
-                else if (props->right != CSS_AUTO)
-                    box->x -= props->right;
-                if (props->top != CSS_AUTO)
-                    box->y += props->top;
-                else if (props->bottom != CSS_AUTO)
-                    box->y -= props->bottom;
+                css_layout_block_box_start(il, box, &x_parent, &y_parent);
+                if (css_layout_block_recurse(il->layout_state, &layout, box,
+                                             x_parent, y_parent))
+                    return -1;
+                css_layout_block_box_end(il, &layout, box);
             }
             break;
         case CSS_DISPLAY_MARKER:
@@ -3482,6 +3543,48 @@ static int css_layout_block_recurse1(InlineLayout *il, CSSBox *box,
     return 0;
 }
 
+/* initialize the layout context for the interior of box 'block_box' */
+static void css_layout_block_init(InlineLayout *il, LayoutState *s,
+                                  LayoutOutput *block_layout,
+                                  CSSBox *block_box, int x_parent, int y_parent)
+{
+    /* a subset of the inline layout is also used for the block layout */
+    il->ctx = s->ctx;
+    il->compute_min_max = 0;
+    il->layout_state = s;
+    il->y = 0;
+    il->x0 = x_parent;
+    il->y0 = y_parent;
+    il->total_width = block_box->width;
+    il->last_ymargin = 0; /* not used */
+    il->is_first_box = 1;
+    il->margin_top = block_layout->margin_top;
+    il->marker_box = NULL;
+    il->layout_type = LAYOUT_TYPE_BLOCK;
+    il->first_line_baseline = 0;
+    il->line_count = 0;
+}
+
+/* flush the last line and compute the margins and height of box
+   'block_box' once all its children are laid out */
+static void css_layout_block_flush(InlineLayout *il, LayoutOutput *block_layout,
+                                   CSSBox *block_box)
+{
+    /* start block layout to flush last line */
+    if (il->layout_type != LAYOUT_TYPE_BLOCK)
+        css_end_inline_layout(il);
+
+    /* update the bottom margin of the whole block */
+    block_layout->margin_top = il->margin_top;
+    block_layout->margin_bottom = max_int(block_layout->margin_bottom,
+                                          il->last_ymargin);
+    block_layout->baseline = il->first_line_baseline;
+    /* update the block height if necessary (XXX: incorrect if not
+       auto) */
+    if (il->y > block_box->height)
+        block_box->height = il->y;
+}
+
 /* layout the interior of box 'block_box'. 'block_box->width' and
    'block_box->height' must have reasonnable values before calling
    this function. If height == 0, then the box is extended as needed.
@@ -3532,39 +3635,13 @@ static int css_layout_block_recurse(LayoutState *s, LayoutOutput *block_layout,
             block_box->height = block_props->height;
         return 0;
     }
-    /* a subset of the inline layout is also used for the block layout */
-    il->ctx = s->ctx;
-    il->compute_min_max = 0;
-    il->layout_state = s;
-    il->y = 0;
-    il->x0 = x_parent;
-    il->y0 = y_parent;
-    il->total_width = block_box->width;
-    il->last_ymargin = 0; /* not used */
-    il->is_first_box = 1;
-    il->margin_top = block_layout->margin_top;
-    il->marker_box = NULL;
-    il->layout_type = LAYOUT_TYPE_BLOCK;
-    il->first_line_baseline = 0;
-    il->line_count = 0;
+    css_layout_block_init(il, s, block_layout, block_box, x_parent, y_parent);
 
     ret = css_layout_block_iterate(il, block_box, 0);
     if (ret)
         return ret;
 
-    /* start block layout to flush last line */
-    if (il->layout_type != LAYOUT_TYPE_BLOCK)
-        css_end_inline_layout(il);
-
-    /* update the bottom margin of the whole block */
-    block_layout->margin_top = il->margin_top;
-    block_layout->margin_bottom = max_int(block_layout->margin_bottom,
-                                          il->last_ymargin);
-    block_layout->baseline = il->first_line_baseline;
-    /* update the block height if necessary (XXX: incorrect if not
-       auto) */
-    if (il->y > block_box->height)
-        block_box->height = il->y;
+    css_layout_block_flush(il, block_layout, block_box);
     return 0;
 }
 
@@ -3712,6 +3789,20 @@ static int css_layout_block_min_max(CSSContext *s,
     return 0;
 }
 
+/* set the bounding box of a box from its absolute position */
+static void css_set_box_bbox(CSSBox *box)
+{
+    CSSState *props = box->props;
+
+    css_set_rect(&box->bbox,
+                 box->x - (props->padding.x1 + props->border.x1),
+                 box->y - (props->padding.y1 + box->padding_top +
+                           props->border.y1),
+                 box->x + box->width + props->padding.x2 + props->border.x2,
+                 box->y + box->height +
+                 (props->padding.y2 + box->padding_bottom + props->border.y2));
+}
+
 /* bounding box extraction. get document extends & global background
    infos. Also translate all relative coordinates into absolute
    ones. XXX: use absolute coordinates in the whole layout. */
@@ -3737,13 +3828,7 @@ static void css_compute_bbox_block(CSSContext *s,
     }
 
     /* update bounding box */
-    css_set_rect(&box->bbox,
-                 x0 - (props->padding.x1 + props->border.x1),
-                 y0 - (props->padding.y1 + box->padding_top +
-                       props->border.y1),
-                 x0 + box->width + props->padding.x2 + props->border.x2,
-                 y0 + box->height +
-                 (props->padding.y2 + box->padding_bottom + props->border.y2));
+    css_set_box_bbox(box);
 
     /* now display the content ! */
     if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
@@ -3785,6 +3870,510 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
     return 0;
 }
 
+/* incremental layout */
+
+/* A document can be styled and laid out while it is being parsed.
+   The block boxes still open in the parser which contain the boxes
+   being laid out are kept in a stack of frames, each with its own
+   inline layout state. Once complete, their children are styled,
+   laid out and converted to absolute coordinates so that the start
+   of the document can be displayed. If the structure of the document
+   does not permit it (for example if the root box floats), the whole
+   document is laid out when its end is parsed. */
+
+#define CSS_LAYOUT_MAX_DEPTH  32
+
+typedef struct CSSLayoutFrame {
+    CSSBox *box;            /* open block box */
+    CSSBox *last;           /* last child styled */
+    CSSBox *laid;           /* last child laid out */
+    CSSBox *shown;          /* last child with absolute coordinates */
+    CSSBox *started;        /* open child styled but not laid out */
+    int started_pelement;
+    int pelement_found;
+    CSSCounterValue *counter_stack;
+    BidirComputeState bidi;
+    LayoutOutput layout;
+    InlineLayout *il;
+    int rel_x, height;      /* position and height in the parent layout */
+    int x, y;               /* absolute content position */
+    int positioned;         /* true if x and y are known */
+    CSSRect bbox;           /* bounding box of the children shown */
+} CSSLayoutFrame;
+
+struct CSSLayoutStream {
+    CSSContext *ctx;
+    CSSBox *root;
+    int width;
+    int pelement_found;     /* pseudo elements of the root box */
+    int done;
+    CSSState default_props;
+    LayoutState layout_state;
+    int nb_frames;
+    CSSLayoutFrame frames[CSS_LAYOUT_MAX_DEPTH];
+};
+
+static int css_no_abort(qe__unused__ void *opaque)
+{
+    return 0;
+}
+
+static int css_floats_pending(LayoutState *s)
+{
+    FloatBlock *b;
+
+    for (b = s->first_float; b != NULL; b = b->next) {
+        if (b->float_type == -1)
+            return 1;
+    }
+    return 0;
+}
+
+/* return true if 'box' is 'open_box' or one of its ancestors */
+static int css_box_is_open(CSSBox *box, CSSBox *open_box)
+{
+    for (; open_box != NULL; open_box = open_box->parent) {
+        if (open_box == box)
+            return 1;
+    }
+    return 0;
+}
+
+CSSLayoutStream *css_new_layout_stream(CSSContext *s, CSSBox *root, int width)
+{
+    CSSLayoutStream *ls;
+
+    ls = qe_mallocz(CSSLayoutStream);
+    if (!ls)
+        return NULL;
+    ls->ctx = s;
+    ls->root = root;
+    ls->width = width;
+    set_default_props(s, &ls->default_props);
+    ls->layout_state.ctx = s;
+    ls->layout_state.first_float = NULL;
+    s->counter_stack_base = NULL;
+    s->counter_stack_ptr = NULL;
+    return ls;
+}
+
+void css_delete_layout_stream(CSSLayoutStream **lsp)
+{
+    CSSLayoutStream *ls = *lsp;
+    CSSLayoutFrame *f;
+
+    if (!ls)
+        return;
+    while (ls->nb_frames > 0) {
+        f = &ls->frames[--ls->nb_frames];
+        pop_counters(ls->ctx, f->counter_stack);
+        qe_free(&f->il);
+    }
+    pop_counters(ls->ctx, NULL);
+    css_free_floats(&ls->layout_state.first_float);
+    qe_free(lsp);
+}
+
+/* return true if the open box 'box' can be laid out before its end */
+static int css_layout_stream_can_open(CSSLayoutStream *ls, CSSBox *box,
+                                      int pelement_found)
+{
+    CSSState *props = box->props;
+
+    if (ls->nb_frames == 0) {
+        /* the root box is always laid out as a block */
+        return (box->content_type == CSS_CONTENT_TYPE_CHILDS &&
+                props->display != CSS_DISPLAY_TABLE &&
+                props->display != CSS_DISPLAY_INLINE_TABLE &&
+                props->visibility == CSS_VISIBILITY_VISIBLE &&
+                !(pelement_found & CSS_PCLASS_BEFORE));
+    }
+    return (ls->nb_frames < CSS_LAYOUT_MAX_DEPTH &&
+            box->content_type == CSS_CONTENT_TYPE_CHILDS &&
+            props->display == CSS_DISPLAY_BLOCK &&
+            (props->position == CSS_POSITION_STATIC ||
+             props->position == CSS_POSITION_RELATIVE) &&
+            props->block_float == CSS_FLOAT_NONE &&
+            props->visibility == CSS_VISIBILITY_VISIBLE &&
+            !(pelement_found & CSS_PCLASS_BEFORE) &&
+            !css_floats_pending(&ls->layout_state));
+}
+
+/* lay out the children of a frame which are styled */
+static void css_layout_stream_children(CSSLayoutStream *ls,
+                                       CSSLayoutFrame *f)
+{
+    CSSBox *box, *box1;
+
+    for (;;) {
+        box = f->laid ? f->laid->next : f->box->u.child.first;
+        if (!box || !box->props || box == f->started)
+            break;
+        box1 = box->next;
+        css_layout_block_recurse1(f->il, box, 0);
+        /* skip the parts of the box if it was split */
+        while (box->next != box1)
+            box = box->next;
+        f->laid = box;
+    }
+}
+
+/* terminate the current inline formatting context of a frame */
+static void css_layout_stream_flush(CSSLayoutStream *ls, CSSLayoutFrame *f)
+{
+    if (f->bidi.inline_layout)
+        bidir_end_inline(&f->bidi);
+    css_layout_stream_children(ls, f);
+}
+
+/* compute the top margin of frame 'i' as seen by its parent. Return
+   false if it is not known yet */
+static int css_layout_stream_margin(CSSLayoutStream *ls, int i,
+                                    int *margin_ptr)
+{
+    CSSLayoutFrame *f = &ls->frames[i];
+    int margin;
+
+    if (!f->il->is_first_box) {
+        *margin_ptr = f->il->margin_top;
+        return 1;
+    }
+    /* the margin of the first child is collapsed with ours */
+    if (i + 1 < ls->nb_frames && css_layout_stream_margin(ls, i + 1, &margin)) {
+        *margin_ptr = max_int(f->il->margin_top, margin);
+        return 1;
+    }
+    return 0;
+}
+
+/* compute the absolute position of the open boxes as soon as their
+   margins are known. It must match css_layout_block_box_end() */
+static void css_layout_stream_position(CSSLayoutStream *ls)
+{
+    CSSLayoutFrame *f, *pf;
+    CSSState *props;
+    InlineLayout *il;
+    int i, margin, x, y;
+
+    for (i = 1; i < ls->nb_frames; i++) {
+        f = &ls->frames[i];
+        if (f->positioned)
+            continue;
+        pf = f - 1;
+        if (!pf->positioned || !css_layout_stream_margin(ls, i, &margin))
+            break;
+        props = f->box->props;
+        il = pf->il;
+        x = f->rel_x;
+        y = il->y + props->border.y1 + props->padding.y1;
+        if (!il->is_first_box)
+            y += max_int(il->last_ymargin, margin);
+        if (props->position == CSS_POSITION_RELATIVE) {
+            if (props->left != CSS_AUTO)
+                x += props->left;
+            else if (props->right != CSS_AUTO)
+                x -= props->right;
+            if (props->top != CSS_AUTO)
+                y += props->top;
+            else if (props->bottom != CSS_AUTO)
+                y -= props->bottom;
+        }
+        f->x = pf->x + x;
+        f->y = pf->y + y;
+        f->positioned = 1;
+    }
+}
+
+/* convert the children of a frame which are laid out to absolute
+   coordinates. Unless 'force' is true, wait until the lines and the
+   floats are positioned. */
+static void css_layout_stream_show(CSSLayoutStream *ls, CSSLayoutFrame *f,
+                                   int force)
+{
+    CSSBox *box, *child_box;
+
+    if (!f->positioned || !f->laid || f->shown == f->laid)
+        return;
+    if (!force && (f->il->layout_type != LAYOUT_TYPE_BLOCK ||
+                   css_floats_pending(&ls->layout_state)))
+        return;
+    /* the open child is handled by its own frame */
+    child_box = NULL;
+    if (f + 1 < ls->frames + ls->nb_frames)
+        child_box = f[1].box;
+    for (;;) {
+        box = f->shown ? f->shown->next : f->box->u.child.first;
+        if (!box || box == child_box)
+            break;
+        css_compute_bbox_block(ls->ctx, box, f->x, f->y);
+        css_union_rect(&f->bbox, &box->bbox);
+        box->pending = 0;
+        f->shown = box;
+        if (box == f->laid)
+            break;
+    }
+}
+
+/* start the layout of the open box 'box' */
+static int css_layout_stream_open(CSSLayoutStream *ls, CSSBox *box,
+                                  int pelement_found)
+{
+    CSSLayoutFrame *f, *pf;
+    int x_parent, y_parent;
+
+    f = &ls->frames[ls->nb_frames];
+    memset(f, 0, sizeof(*f));
+    f->il = qe_malloc(InlineLayout);
+    if (!f->il)
+        return -1;
+    f->box = box;
+    f->pelement_found = pelement_found;
+    f->bidi.ctx = ls->ctx;
+    x_parent = y_parent = 0;
+    if (ls->nb_frames == 0) {
+        box->width = ls->width;
+        f->positioned = 1;
+    } else {
+        /* lay out the previous children before the box */
+        pf = f - 1;
+        css_layout_stream_flush(ls, pf);
+        pf->started = NULL;
+        css_layout_block_box_start(pf->il, box, &x_parent, &y_parent);
+        css_layout_stream_position(ls);
+        css_layout_stream_show(ls, pf, 1);
+        f->rel_x = box->x;
+        pf->last = pf->laid = box;
+    }
+    f->height = box->height;
+    f->layout.margin_top = box->props->margin.y1;
+    f->layout.margin_bottom = box->props->margin.y2;
+    css_layout_block_init(f->il, &ls->layout_state, &f->layout, box,
+                          x_parent, y_parent);
+    f->counter_stack = push_counters(ls->ctx);
+    ls->nb_frames++;
+    return 0;
+}
+
+/* style and lay out a complete child of the innermost open box */
+static int css_layout_stream_child(CSSLayoutStream *ls, CSSLayoutFrame *f,
+                                   CSSBox *box)
+{
+    CSSBox *box_next;
+    int ret;
+
+    /* boxes generated for ':before' and ':after' are inserted
+       around the box if it is inline */
+    box_next = box->next;
+    if (box == f->started) {
+        f->started = NULL;
+        ret = css_compute_block_finish(ls->ctx, box, f->started_pelement);
+    } else {
+        ret = css_compute_block(ls->ctx, box, f->box->props);
+    }
+    if (ret < 0)
+        return -1;
+
+    for (box = f->last ? f->last->next : f->box->u.child.first;
+         box != box_next; box = box->next) {
+        box->pending = 1;
+        css_layout_bidir_box(&f->bidi, box);
+        f->last = box;
+        /* lay out the boxes when the inline context is complete */
+        if (!f->bidi.inline_layout)
+            css_layout_stream_children(ls, f);
+    }
+    return 0;
+}
+
+/* terminate the layout of the innermost open box once its end is
+   parsed */
+static void css_layout_stream_close(CSSLayoutStream *ls)
+{
+    CSSContext *s = ls->ctx;
+    CSSLayoutFrame *f, *pf;
+    CSSBox *box, *box1;
+
+    f = &ls->frames[ls->nb_frames - 1];
+    box = f->box;
+    pop_counters(s, f->counter_stack);
+    css_compute_block_end(s, box, f->pelement_found);
+    /* handle the box generated by ':after' */
+    for (box1 = f->last ? f->last->next : box->u.child.first;
+         box1 != NULL; box1 = box1->next) {
+        if (!box1->split) {
+            box1->pending = 1;
+            css_layout_bidir_box(&f->bidi, box1);
+        }
+        f->last = box1;
+    }
+    css_layout_stream_flush(ls, f);
+    box->x = f->rel_x;
+    box->height = f->height;
+    css_layout_block_flush(f->il, &f->layout, box);
+    css_layout_stream_position(ls);
+    css_layout_stream_show(ls, f, 1);
+    qe_free(&f->il);
+    ls->nb_frames--;
+
+    if (ls->nb_frames == 0) {
+        /* end of the document */
+        css_set_box_bbox(box);
+        css_union_rect(&box->bbox, &f->bbox);
+        pop_counters(s, NULL);
+        css_free_floats(&ls->layout_state.first_float);
+        ls->done = 1;
+        return;
+    }
+    pf = f - 1;
+    css_layout_block_box_end(pf->il, &f->layout, box);
+    pf->il->is_first_box = 0;
+    box->x += pf->x;
+    box->y += pf->y;
+    css_set_box_bbox(box);
+    css_union_rect(&box->bbox, &f->bbox);
+    box->pending = 0;
+    css_union_rect(&pf->bbox, &box->bbox);
+    pf->shown = box;
+}
+
+/* give the open boxes a provisional size and bounding box so that the
+   document can be displayed */
+static void css_layout_stream_update(CSSLayoutStream *ls)
+{
+    CSSLayoutFrame *f;
+    CSSBox *box;
+    CSSRect rect;
+    int i;
+
+    css_layout_stream_position(ls);
+    for (i = ls->nb_frames; i-- > 0;) {
+        f = &ls->frames[i];
+        box = f->box;
+        /* the parser appends the next boxes after the last one */
+        while (box->u.child.last->next)
+            box->u.child.last = box->u.child.last->next;
+        if (!f->positioned) {
+            css_set_rect(&box->bbox, 0, 0, 0, 0);
+            continue;
+        }
+        css_layout_stream_show(ls, f, 0);
+        rect = f->bbox;
+        if (i + 1 < ls->nb_frames)
+            css_union_rect(&rect, &f[1].box->bbox);
+        /* the box extends to the children displayed so far */
+        box->x = f->x;
+        box->y = f->y;
+        box->height = f->height;
+        if (!css_is_null_rect(&rect))
+            box->height = max_int(box->height, rect.y2 - f->y);
+        css_set_box_bbox(box);
+        css_union_rect(&box->bbox, &rect);
+        box->pending = 0;
+    }
+}
+
+/* style and lay out the document being parsed. 'open_box' is the
+   innermost box whose end is not parsed yet, or NULL if the whole
+   document is parsed. Return 0 if the document is laid out, 1 if
+   more input is needed or if interrupted by 'abort_func' and -1 if
+   error. */
+int css_layout_stream(CSSLayoutStream *ls, CSSBox *open_box,
+                      CSSAbortFunc *abort_func, void *abort_opaque)
+{
+    CSSContext *s = ls->ctx;
+    CSSLayoutFrame *f;
+    CSSBox *box;
+    int pelement_found, ret;
+
+    /* the boxes are laid out completely, 'abort_func' is only tested
+       between them */
+    s->abort_func = css_no_abort;
+    s->abort_opaque = NULL;
+
+    ret = 0;
+    while (!ls->done) {
+        if (abort_func(abort_opaque)) {
+            ret = 1;
+            break;
+        }
+        if (ls->nb_frames == 0) {
+            box = ls->root;
+            if (!box->props) {
+                if (css_box_is_open(box, open_box) &&
+                    (box->content_type != CSS_CONTENT_TYPE_CHILDS ||
+                     !box->u.child.first)) {
+                    ret = 1;
+                    break;
+                }
+                pelement_found = css_compute_block_start(s, box,
+                                                         &ls->default_props);
+                if (pelement_found < 0)
+                    return -1;
+                ls->pelement_found = pelement_found;
+                if (css_layout_stream_can_open(ls, box, pelement_found)) {
+                    if (css_layout_stream_open(ls, box, pelement_found))
+                        return -1;
+                    continue;
+                }
+            }
+            if (css_box_is_open(box, open_box)) {
+                ret = 1;
+                break;
+            }
+            /* lay out the whole document at once */
+            if (css_compute_block_finish(s, box, ls->pelement_found) < 0)
+                return -1;
+            pop_counters(s, NULL);
+            if (css_layout(s, box, ls->width, css_no_abort, NULL))
+                return -1;
+            ls->done = 1;
+            break;
+        }
+        f = &ls->frames[ls->nb_frames - 1];
+        /* find the next child to style, skipping split boxes */
+        for (;;) {
+            box = f->last ? f->last->next : f->box->u.child.first;
+            if (!box || !box->split)
+                break;
+            f->last = box;
+        }
+        if (!box) {
+            if (css_box_is_open(f->box, open_box)) {
+                ret = 1;
+                break;
+            }
+            css_layout_stream_close(ls);
+            continue;
+        }
+        if (css_box_is_open(box, open_box)) {
+            if (box == f->started ||
+                box->content_type != CSS_CONTENT_TYPE_CHILDS ||
+                !box->u.child.first) {
+                ret = 1;
+                break;
+            }
+            pelement_found = css_compute_block_start(s, box, f->box->props);
+            if (pelement_found < 0)
+                return -1;
+            f->started = box;
+            f->started_pelement = pelement_found;
+            box->pending = 1;
+            if (css_layout_stream_can_open(ls, box, pelement_found)) {
+                if (css_layout_stream_open(ls, box, pelement_found))
+                    return -1;
+                continue;
+            }
+            /* finish it when complete */
+            ret = 1;
+            break;
+        }
+        if (css_layout_stream_child(ls, f, box))
+            return -1;
+    }
+    css_layout_stream_update(ls);
+    return ret;
+}
+
 /* display utils */
 
 #define MAX_LINE_SIZE 256
@@ -4139,6 +4728,9 @@ static void css_display_block(CSSContext *s,
         /* other boxes are inside: display them */
         tt = box->u.child.first;
         while (tt) {
+            /* stop at the boxes not laid out yet */
+            if (!tt->props || tt->pending)
+                break;
             css_display_block(s, tt, props, clip_box, dx, dy);
             tt = tt->next;
         }
@@ -4310,6 +4902,8 @@ int css_box_iterate(CSSContext *s,
     if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
         tt = box->u.child.first;
         while (tt) {
+            if (!tt->props || tt->pending)
+                break;
             if (css_box_iterate(s, tt, opaque, iterate_func))
                 return 1;
             tt = tt->next;
@@ -391,6 +391,9 @@ struct CSSBox {
                                      meaningful during layout */
     unsigned char split:1;        /* true if this box is a splitted box
                                      (no need to free its content) */
+    unsigned char pending:1;      /* true if this box is styled but not
+                                     yet positioned by the incremental
+                                     layout */
     /* true if there was a space in the previous box (useful in inline
        formatting context) */
     unsigned char last_space;
@@ -621,6 +624,14 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
 void css_display(CSSContext *s, CSSBox *box,
                  CSSRect *clip_box, int dx, int dy);
 
+/* incremental layout of a document being parsed */
+typedef struct CSSLayoutStream CSSLayoutStream;
+
+CSSLayoutStream *css_new_layout_stream(CSSContext *s, CSSBox *root, int width);
+int css_layout_stream(CSSLayoutStream *ls, CSSBox *open_box,
+                      CSSAbortFunc *abort_func, void *abort_opaque);
+void css_delete_layout_stream(CSSLayoutStream **lsp);
+
 #if 0
 /* rectangle handling */
 void css_union_rect(CSSRect *a, const CSSRect *b);
@@ -687,6 +698,11 @@ XMLState *xml_begin(CSSStyleSheet *style_sheet, int flags,
 int xml_parse(XMLState *s, char *buf, int buf_len);
 CSSBox *xml_end(XMLState **sp);
 
+int xml_parse_buffer_range(XMLState *s, struct EditBuffer *b,
+                           int offset, int offset_end);
+CSSBox *xml_get_root_box(XMLState *s);
+CSSBox *xml_get_open_box(XMLState *s);
+
 CSSBox *xml_parse_buffer(struct EditBuffer *b, const char *name,
                          int offset_start, int offset_end,
                          CSSStyleSheet *style_sheet, int flags,
@@ -283,6 +283,7 @@ struct XMLState {
     int pretaglen;
     char pretag[32]; /* current tag in XML_STATE_PRETAG */
     StringBuffer str;
+    int text_offset_start; /* start of pending text when parsing a buffer */
     char filename[MAX_FILENAME_SIZE];
     CharsetDecodeState charset_state;
 };
@@ -431,7 +432,7 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
     CSSProperty *first_prop, **last_prop;
     QEColor color;
     int width, height, val, type;
-    int border, padding;
+    int border;
     CSSPropertyValue arg;
     CSSPropertyValue args[2];
 
@@ -592,9 +593,6 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
                              CSS_BORDER_STYLE_GROOVE);
             css_add_prop_int(&last_prop, CSS_border_bottom_style,
                              CSS_BORDER_STYLE_GROOVE);
-            /* cell have a border of 1 pixel width */
-            if (border > 1)
-                border = 1;
         }
         val = css_attr_int(box, CSS_ID_cellspacing, -1);
         if (val >= 0) {
@@ -603,11 +601,6 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
             css_add_prop_unit(&last_prop, CSS_border_spacing_vertical,
                               CSS_UNIT_PIXEL, val);
         }
-        padding = css_attr_int(box, CSS_ID_cellpadding, -1);
-        /* apply border styles to each cell (cannot be done exactly by
-           CSS) */
-        if (border >= 1 || padding >= 1)
-            html_table_borders(box, border, padding);
         break;
 
     case CSS_ID_col:
@@ -796,6 +789,30 @@ static void html_eval_tag(XMLState *s, CSSBox *box)
     box->properties = first_prop;
 }
 
+/* the HTML attributes are converted to properties when the tag is
+   opened so that the box can be styled before its end is parsed */
+static void html_eval_tag_start(XMLState *s, CSSBox *box)
+{
+    if (s->html_syntax || s->is_html)
+        html_eval_tag(s, box);
+}
+
+/* the table cells are only known when the table is closed */
+static void html_eval_tag_end(XMLState *s, CSSBox *box)
+{
+    int border, padding;
+
+    if (box->tag == CSS_ID_table) {
+        /* cell have a border of 1 pixel width */
+        border = min_int(css_attr_int(box, CSS_ID_border, -1), 1);
+        padding = css_attr_int(box, CSS_ID_cellpadding, -1);
+        /* apply border styles to each cell (cannot be done exactly by
+           CSS) */
+        if (border >= 1 || padding >= 1)
+            html_table_borders(box, border, padding);
+    }
+}
+
 static void xml_error(XMLState *s, const char *fmt, ...)
         qe__attr_printf(2,3);
 
@@ -937,7 +954,7 @@ static int parse_tag(XMLState *s, const char *buf)
                 box1 = s->box;
                 while (box1 != NULL &&
                        css_get_enum(css_ident_str(box1->tag), ct->tag_closed) >= 0) {
-                    html_eval_tag(s, box1);
+                    html_eval_tag_end(s, box1);
                     box1 = box1->parent;
                 }
                 if (box1) {
@@ -959,6 +976,7 @@ static int parse_tag(XMLState *s, const char *buf)
         css_add_box(s->box, box);
     }
     s->box = box;
+    html_eval_tag_start(s, box);
 
     if ((s->flags & XML_DOCBOOK) &&
         css_tag == CSS_ID_programlisting) {
@@ -988,7 +1006,7 @@ static int parse_tag(XMLState *s, const char *buf)
                 if (css_tag != CSS_ID_NIL) {
                     /* close all non matching tags */
                     while (box1 != NULL && box1->tag != css_tag) {
-                        html_eval_tag(s, box1);
+                        html_eval_tag_end(s, box1);
                         box1 = box1->parent;
                     }
                 }
@@ -997,7 +1015,7 @@ static int parse_tag(XMLState *s, const char *buf)
                         xml_error(s, "unmatched closing tag </%s>",
                                   css_ident_str(css_tag));
                 } else {
-                    html_eval_tag(s, box1);
+                    html_eval_tag_end(s, box1);
                     s->box = box1->parent;
                 }
             } else {
@@ -1006,7 +1024,7 @@ static int parse_tag(XMLState *s, const char *buf)
                               css_ident_str(css_tag), css_ident_str(box1->tag));
                 } else {
                     if (s->is_html)
-                        html_eval_tag(s, box1);
+                        html_eval_tag_end(s, box1);
                     s->box = box1->parent;
                 }
             }
@@ -1081,7 +1099,7 @@ static int xml_tagcmp(const char *s1, const char *s2) {
 static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                               struct EditBuffer *b, int offset_start)
 {
-    int offset, offset0, text_offset_start, ret, offset_end;
+    int offset, offset0, ret, offset_end;
     const char *buf_end, *buf;
     char32_t ch;
 
@@ -1090,7 +1108,6 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
     offset = offset_start;
     offset_end = offset_start + buf_len;
     offset0 = 0; /* not used */
-    text_offset_start = 0; /* not used */
     for (;;) {
         if (buf) {
             if (buf >= buf_end)
@@ -1123,12 +1140,12 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                 xml_text:
                     strbuf_reset(&s->str);
                     s->state = XML_STATE_TEXT;
-                    text_offset_start = offset;
+                    s->text_offset_start = offset;
                     break;
                 case XML_STATE_PRETAG:
                     strbuf_reset(&s->str);
                     s->state = XML_STATE_PRETAG;
-                    text_offset_start = offset;
+                    s->text_offset_start = offset;
                     break;
                 }
             } else {
@@ -1151,7 +1168,7 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                     flush_text(s, (char *)s->str.buf);
                     strbuf_reset(&s->str);
                 } else {
-                    flush_text_buffer(s, b, text_offset_start, offset0);
+                    flush_text_buffer(s, b, s->text_offset_start, offset0);
                 }
                 s->state = XML_STATE_TAG;
             } else {
@@ -1212,7 +1229,7 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
                             flush_text(s, (char *)s->str.buf);
                         } else {
                             /* XXX: would be incorrect if non ascii chars */
-                            flush_text_buffer(s, b, text_offset_start, offset - taglen);
+                            flush_text_buffer(s, b, s->text_offset_start, offset - taglen);
                         }
                         strbuf_reset(&s->str);
                         if (s->box)
@@ -1229,7 +1246,8 @@ static int xml_parse_internal(XMLState *s, const char *buf_start, int buf_len,
             break;
         }
     }
-    /* CG: incorrect if parsing from buffer */
+    if (!buf)
+        return offset;
     return buf - buf_start;
 }
 
@@ -1311,12 +1329,35 @@ CSSBox *xml_end(XMLState **sp)
     strbuf_reset(&s->str);
     root_box = s->root_box;
 
-    qe_free(&s);
+    qe_free(sp);
     return root_box;
 }
 
+/* return the document root box, NULL if no tag was parsed yet */
+CSSBox *xml_get_root_box(XMLState *s)
+{
+    return s->root_box;
+}
+
+/* return the innermost box whose end tag has not been parsed yet */
+CSSBox *xml_get_open_box(XMLState *s)
+{
+    return s->box;
+}
+
 // XXX: move to qe source tree
 // XXX: should pass pass function to read a code point to xml_parse_internal, using an opaque
+/* parse the range [offset, offset_end) of an edit buffer. The parsing
+   can be resumed from the returned offset, which may be slightly
+   beyond offset_end. Return -1 if aborted */
+int xml_parse_buffer_range(XMLState *s, struct EditBuffer *b,
+                           int offset, int offset_end)
+{
+    if (offset >= offset_end)
+        return offset;
+    return xml_parse_internal(s, NULL, offset_end - offset, b, offset);
+}
+
 /* XML in edit buffer parsing */
 CSSBox *xml_parse_buffer(struct EditBuffer *b, const char *name,
                          int offset_start, int offset_end,
@@ -1328,7 +1369,7 @@ CSSBox *xml_parse_buffer(struct EditBuffer *b, const char *name,
     int ret;
 
     s = xml_begin(style_sheet, flags, abort_func, abort_opaque, name, NULL);
-    ret = xml_parse_internal(s, NULL, offset_end - offset_start, b, offset_start);
+    ret = xml_parse_buffer_range(s, b, offset_start, offset_end);
     box = xml_end(&s);
     if (ret < 0) {
         css_delete_box(&box);
@@ -201,9 +201,6 @@ static void build_bufed_list(BufedState *bs, EditState *s)
             if (b1->flags & BF_IS_LOG) {
                 mode_name = "log";
             } else
-            if (b1->flags & BF_IS_STYLE) {
-                mode_name = "style";
-            } else
             if (b1->saved_mode) {
                 mode_name = b1->saved_mode->name;
             } else
@@ -80,6 +80,9 @@ struct DiredState {
     int details_flag, last_details_flag;
     int sort_mode;
     DiredItem *last_cur;
+    QETimer *prefetch_timer;
+    int prefetch_index;     /* index of the previewed item in items */
+    int prefetch_step;      /* next neighbour to prefetch */
     long long total_bytes;
     int ndirs, nfiles, ndirs_hidden, nfiles_hidden;
     int blocksize;
@@ -127,6 +130,7 @@ static int dired_hflag = 0; /* 0=exact, 1=human-decimal, 2=human-binary */
 #define DIRED_DETAILS_HIDE  1
 #define DIRED_DETAILS_SHOW  2
 static int dired_sort_mode = DIRED_SORT_GROUP | DIRED_SORT_NAME;
+static int dired_prefetch_count = 2;
 
 static QVarType dired_sort_mode_set_value(EditState *s, VarDef *vp,
     void *ptr, const char *str, int sort_mode);
@@ -144,6 +148,8 @@ static VarDef dired_variables[] = {
           "Set to show hidden files (starting with a `.`)" )
     G_VAR( "dired-show-ds-store", dired_show_ds_store, VAR_NUMBER, VAR_RW_SAVE,
           "Set to show infamous macOS .DS_Store system files" )
+    G_VAR( "dired-prefetch-count", dired_prefetch_count, VAR_NUMBER, VAR_RW_SAVE,
+          "Number of files before and after the current one to decode ahead for preview" )
 };
 
 static inline DiredState *dired_get_state(EditState *e, int status)
@@ -177,6 +183,7 @@ static void dired_free(DiredState *ds)
 
         free_strings(&ds->items);
 
+        qe_kill_timer(&ds->prefetch_timer);
         ds->last_cur = NULL;
     }
 }
@@ -1125,6 +1132,66 @@ static EditState *dired_view_file(EditState *s, const char *filename)
     }
 }
 
+/* Prefetch the neighbours of the previewed item one at a time from a
+ * timer, nearest first, alternating after and before.  Moving to
+ * another item restarts the sequence and pending input postpones it.
+ */
+static void dired_prefetch_cb(void *opaque)
+{
+    char filename[MAX_FILENAME_SIZE];
+    DiredState *ds = opaque;
+    DiredItem *dip;
+    ModeDef *m;
+    int i, dir, n;
+
+    ds->prefetch_timer = NULL;
+
+    while (ds->prefetch_step < 2 * dired_prefetch_count) {
+        if (is_user_input_pending()) {
+            ds->prefetch_timer = qe_add_timer(100, ds, dired_prefetch_cb);
+            return;
+        }
+        n = ds->prefetch_step / 2 + 1;
+        dir = (ds->prefetch_step & 1) ? -1 : 1;
+        ds->prefetch_step++;
+        dip = NULL;
+        for (i = ds->prefetch_index + dir; i >= 0 && i < ds->items.nb_items; i += dir) {
+            dip = ds->items.items[i]->opaque;
+            if (!dip->hidden && --n == 0)
+                break;
+            dip = NULL;
+        }
+        if (!dip || !S_ISREG(dip->mode)
+        ||  !dired_get_filename(ds, dip, filename, sizeof(filename)))
+            continue;
+        m = qe_find_mode_filename(filename, MODEF_VIEW);
+        if (m && m->mode_prefetch) {
+            m->mode_prefetch(m, filename);
+            /* yield to the event loop after each decoded file */
+            if (ds->prefetch_step < 2 * dired_prefetch_count)
+                ds->prefetch_timer = qe_add_timer(0, ds, dired_prefetch_cb);
+            return;
+        }
+    }
+}
+
+static void dired_start_prefetch(DiredState *ds, DiredItem *cur)
+{
+    int i;
+
+    qe_kill_timer(&ds->prefetch_timer);
+    if (dired_prefetch_count <= 0)
+        return;
+    for (i = 0; i < ds->items.nb_items; i++) {
+        if (ds->items.items[i]->opaque == cur) {
+            ds->prefetch_index = i;
+            ds->prefetch_step = 0;
+            ds->prefetch_timer = qe_add_timer(100, ds, dired_prefetch_cb);
+            break;
+        }
+    }
+}
+
 static void dired_execute(EditState *s)
 {
     /* Actually delete, copy, or move the marked items */
@@ -1230,8 +1297,11 @@ static void dired_display_hook(EditState *s)
         dip = dired_get_cur_item(ds, s);
         if (dip != ds->last_cur) {
             ds->last_cur = dip;
-            if (dired_get_filename(ds, dip, filename, sizeof(filename))) {
-                dired_view_file(s, filename);
+            if (dired_get_filename(ds, dip, filename, sizeof(filename))
+            &&  dired_view_file(s, filename)) {
+                dired_start_prefetch(ds, dip);
+            } else {
+                qe_kill_timer(&ds->prefetch_timer);
             }
         }
     }
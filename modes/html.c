@@ -32,6 +32,9 @@
 #define SCROLL_MHEIGHT     10
 #define HTML_ERROR_BUFFER       "*xml-error*"
 
+#define HTML_SLICE_MS      20     /* time slice for loading the document */
+#define HTML_PARSE_CHUNK   32768  /* bytes parsed between layout steps */
+
 /* mode state */
 typedef struct HTMLState {
     QEModeData base;
@@ -48,6 +51,14 @@ typedef struct HTMLState {
     int up_to_date;    /* true if css representation is synced with
                           buffer content */
     int parse_flags;   /* can contain XML_HTML and XML_IGNORE_CASE */
+    /* the document is parsed and laid out in time slices */
+    XMLState *xml;     /* parser state, NULL once the buffer is parsed */
+    int parse_offset;
+    CSSLayoutStream *layout; /* NULL once the document is laid out */
+    QETimer *timer;
+    int slice_start;
+    int layout_width;
+    int layout_height; /* height of the document already displayed */
 } HTMLState;
 
 /* recompute cursor offset so that it is visible (find closest box) */
@@ -146,9 +157,128 @@ static int get_time(void)
 
 #endif
 
-static int html_test_abort(qe__unused__ void *opaque)
+static int html_no_abort(qe__unused__ void *opaque)
+{
+    return 0;
+}
+
+static int html_slice_abort(void *opaque)
+{
+    HTMLState *hs = opaque;
+
+    return get_clock_ms() - hs->slice_start >= HTML_SLICE_MS;
+}
+
+static inline int html_is_loading(HTMLState *hs)
+{
+    return hs->xml || hs->layout;
+}
+
+/* return true if the document can be displayed, possibly partially */
+static inline int html_is_ready(HTMLState *hs)
+{
+    return hs->up_to_date && hs->top_box && hs->top_box->props;
+}
+
+static void html_end_parse(HTMLState *hs)
+{
+    CSSBox *root_box;
+
+    root_box = xml_end(&hs->xml);
+    /* ignore extra top level elements */
+    if (root_box != hs->top_box)
+        css_delete_box(&root_box);
+}
+
+static void html_stop_loading(HTMLState *hs)
 {
-    return is_user_input_pending();
+    qe_kill_timer(&hs->timer);
+    html_end_parse(hs);
+    css_delete_layout_stream(&hs->layout);
+}
+
+/* parse and lay out the document during a time slice. Return true if
+   the document is complete */
+static int html_load_slice(HTMLState *hs)
+{
+    EditBuffer *b = hs->base.b;
+    CSSBox *open_box;
+    int offset_end, ret;
+
+    hs->slice_start = get_clock_ms();
+    for (;;) {
+        open_box = NULL;
+        if (hs->xml) {
+            offset_end = min_int(hs->parse_offset + HTML_PARSE_CHUNK,
+                                 b->total_size);
+            timer_start();
+            hs->parse_offset = xml_parse_buffer_range(hs->xml, b,
+                                                      hs->parse_offset,
+                                                      offset_end);
+            timer_stop("xml_parse_buffer_range");
+            if (!hs->top_box)
+                hs->top_box = xml_get_root_box(hs->xml);
+            if (hs->parse_offset >= b->total_size)
+                html_end_parse(hs);
+            else
+                open_box = xml_get_open_box(hs->xml);
+        }
+        if (!hs->top_box)
+            return !hs->xml;
+        if (!hs->layout) {
+            hs->layout = css_new_layout_stream(hs->css_ctx, hs->top_box,
+                                               hs->layout_width);
+            if (!hs->layout)
+                break;
+        }
+        timer_start();
+        ret = css_layout_stream(hs->layout, open_box, html_slice_abort, hs);
+        timer_stop("css_layout_stream");
+        if (ret <= 0)
+            break;
+        if (html_slice_abort(hs))
+            return 0;
+    }
+    html_stop_loading(hs);
+    return 1;
+}
+
+/* redisplay the windows where the document has grown */
+static void html_load_invalidate(HTMLState *hs, int complete)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *e;
+    int y1, y2;
+
+    y1 = hs->layout_height;
+    y2 = hs->top_box ? hs->top_box->bbox.y2 : 0;
+    hs->total_width = hs->top_box ? hs->top_box->bbox.x2 : 0;
+    hs->total_height = y2;
+    hs->layout_height = y2;
+    for (e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e->b != hs->base.b)
+            continue;
+        if (complete || (y2 > y1 && y1 < e->height - e->y_disp &&
+                         y2 > -e->y_disp)) {
+            e->display_invalid = 1;
+        }
+    }
+}
+
+static void html_load_timer_cb(void *opaque)
+{
+    HTMLState *hs = opaque;
+    int complete;
+
+    hs->timer = NULL;
+    /* the document will be reloaded by the next display */
+    if (!hs->up_to_date)
+        return;
+    complete = html_load_slice(hs);
+    if (!complete)
+        hs->timer = qe_add_timer(0, hs, html_load_timer_cb);
+    html_load_invalidate(hs, complete);
+    url_redisplay();
 }
 
 static void html_display(EditState *s)
@@ -156,7 +286,7 @@ static void html_display(EditState *s)
     HTMLState *hs;
     CSSRect cursor_pos;
     DirType dirc;
-    int n, cursor_found, d, ret, sel_start, sel_end;
+    int n, cursor_found, d, sel_start, sel_end;
     CSSRect rect;
     EditBuffer *b;
 
@@ -175,14 +305,8 @@ static void html_display(EditState *s)
 
     /* reparse & layout if needed */
     if (!hs->up_to_date) {
-        /* display busy message */
-        if (!s->busy) {
-            s->busy = 1;
-            display_mode_line(s);
-            dpy_flush(s->screen);
-        }
-
         /* delete previous document */
+        html_stop_loading(hs);
         css_delete_box(&hs->top_box);
         css_delete_document(&hs->css_ctx);
 
@@ -205,40 +329,29 @@ static void html_display(EditState *s)
         hs->css_ctx->selection_fgcolor = qe_styles[QE_STYLE_SELECTION].fg_color;
         hs->css_ctx->default_bgcolor = qe_styles[QE_STYLE_CSS_DEFAULT].bg_color;
 
-        timer_start();
-        hs->top_box = xml_parse_buffer(s->b, s->b->name, 0, s->b->total_size,
-                                       hs->css_ctx->style_sheet,
-                                       hs->parse_flags,
-                                       html_test_abort, NULL);
-        timer_stop("xml_parse_buffer");
-        if (!hs->top_box)
+        /* the parsing is never interrupted inside a slice */
+        hs->xml = xml_begin(hs->css_ctx->style_sheet, hs->parse_flags,
+                            html_no_abort, NULL, s->b->name, NULL);
+        if (!hs->xml)
             return;
+        hs->parse_offset = 0;
+        hs->layout_width = s->width;
+        hs->layout_height = 0;
+        hs->up_to_date = 1;
 
-        timer_start();
-        css_compute(hs->css_ctx, hs->top_box);
-        timer_stop("css_compute");
-
-        timer_start();
-        ret = css_layout(hs->css_ctx, hs->top_box, s->width,
-                         html_test_abort, NULL);
-        timer_stop("css_layout");
-        if (ret) {
-            return;
-        }
-
-        /* extract document size */
-        hs->total_width = hs->top_box->bbox.x2;
-        hs->total_height = hs->top_box->bbox.y2;
+        /* the first part of the document is displayed immediately,
+           the rest is loaded in the background */
+        if (!html_load_slice(hs))
+            hs->timer = qe_add_timer(0, hs, html_load_timer_cb);
+        html_load_invalidate(hs, 1);
 
         /* set invalid rectangle to the whole window */
         css_set_rect(&hs->invalid_rect, s->xleft, s->ytop,
                      s->xleft + s->width, s->ytop + s->height);
-        hs->up_to_date = 1;
-        s->busy = 0;
     }
 
     /* draw if possible */
-    if (hs->up_to_date) {
+    if (html_is_ready(hs)) {
         n = 0;
     redo:
         timer_start();
@@ -247,7 +360,8 @@ static void html_display(EditState *s)
                                           &cursor_pos, &dirc, s->offset);
         timer_stop("css_get_cursor_pos");
         //        printf("cursor_found=%d offset=%d\n", cursor_found, s->offset);
-        if (!cursor_found) {
+        /* the cursor may be in a part not laid out yet */
+        if (!cursor_found && !html_is_loading(hs)) {
             if (++n == 1) {
                 /* move the cursor to the closest visible position */
                 recompute_offset(s);
@@ -404,7 +518,7 @@ static void html_scroll_up_down(EditState *s, int dir)
     if (!(hs = html_get_state(s, 1)))
         return;
 
-    if (!hs->up_to_date)
+    if (!html_is_ready(hs))
         return;
 
     h = SCROLL_MHEIGHT;
@@ -565,7 +679,7 @@ static void html_move_up_down(EditState *s, int dir)
     if (!(hs = html_get_state(s, 1)))
         return;
 
-    if (!hs->up_to_date)
+    if (!html_is_ready(hs))
         return;
 
     if (s->qe_state->last_cmd_func != (CmdFunc)do_up_down)
@@ -620,7 +734,7 @@ static void html_move_left_right_visual(EditState *s, int dir)
     if (!(hs = html_get_state(s, 1)))
         return;
 
-    if (!hs->up_to_date)
+    if (!html_is_ready(hs))
         return;
 
     /* get the cursor position. If not found, do nothing */
@@ -672,7 +786,7 @@ static void html_move_bol_eol(EditState *s, int dir)
     if (!(hs = html_get_state(s, 1)))
         return;
 
-    if (!hs->up_to_date)
+    if (!html_is_ready(hs))
         return;
 
     /* get the cursor position. If not found, do nothing */
@@ -764,7 +878,7 @@ static void html_mouse_goto(EditState *s, int x, int y)
     if (!(hs = html_get_state(s, 1)))
         return;
 
-    if (!hs->up_to_date)
+    if (!html_is_ready(hs))
         return;
 
     m->dx_min = 0x3fffffff;
@@ -855,11 +969,23 @@ static void html_mode_free(EditBuffer *b, void *state)
     eb_free_callback(b, html_callback, hs);
 
     //s->busy = 0; /* make it a buffer flag? */
+    html_stop_loading(hs);
     css_delete_box(&hs->top_box);
     css_delete_document(&hs->css_ctx);
     css_free_style_sheet(&hs->default_style_sheet);
 }
 
+static void html_mode_line(EditState *s, buf_t *out)
+{
+    HTMLState *hs = html_get_state(s, 0);
+
+    text_mode_line(s, out);
+    if (hs && hs->up_to_date && html_is_loading(hs)) {
+        buf_printf(out, "--Layout %d%%",
+                   compute_percent(hs->parse_offset, s->b->total_size));
+    }
+}
+
 /* search for HTML tag */
 static int html_mode_probe(ModeDef *mode, ModeProbeData *p1)
 {
@@ -927,6 +1053,7 @@ ModeDef html_mode = {
     .mode_close = html_mode_close,
     .mode_free = html_mode_free,
     .display = html_display,
+    .get_mode_line = html_mode_line,
     .move_up_down = html_move_up_down,
     .move_left_right = html_move_left_right_visual,
     .move_bol = html_move_bol,
@@ -55,6 +55,15 @@ enum QETermState {
     QE_TERM_STATE_STRING,
 };
 
+/* Full screen programs use a grid of cells for the alternate screen.
+ * Terminal output updates the grid and the modified rows are copied
+ * to the buffer after each batch of output.
+ */
+typedef struct ShellCell {
+    char32_t c;         /* 0 for the right half of a wide glyph */
+    QETermStyle style;
+} ShellCell;
+
 typedef struct ShellState {
     QEModeData base;
     /* buffer state */
@@ -68,6 +77,11 @@ typedef struct ShellState {
     int cur_offset; /* current offset at position x, y */
     int cur_offset_hack; /* the target position is in the middle of a wide glyph */
     int cur_prompt; /* offset of end of prompt on current line */
+    ShellCell *grid;    /* cell grid of the alternate screen or NULL */
+    u8 *grid_dirty;     /* rows modified since last flush */
+    int grid_rows, grid_cols;
+    int grid_x, grid_y; /* cursor position, grid_x == grid_cols at end of row */
+    int grid_cursor_row;  /* row of the cursor at last flush */
     int save_x, save_y;
     int nb_params;
     int params[MAX_CSI_PARAMS + 1];
@@ -111,7 +125,7 @@ static void do_shell_refresh(EditState *e, int flags);
 static char *shell_get_curpath(EditBuffer *b, int offset,
                                char *buf, int buf_size);
 
-static void set_error_offset(EditBuffer *b, int offset)
+void set_error_offset(EditBuffer *b, int offset)
 {
     pstrcpy(error_buffer, sizeof(error_buffer), b ? b->name : "");
     error_offset = offset - 1;
@@ -119,6 +133,16 @@ static void set_error_offset(EditBuffer *b, int offset)
     *error_filename = '\0';
 }
 
+/* adjust the error position after removing size bytes at the start of b */
+static void shell_error_trim(EditBuffer *b, int size)
+{
+    if (error_offset >= 0 && strequal(error_buffer, b->name)) {
+        error_offset -= size;
+        if (error_offset < 0)
+            error_offset = -1;
+    }
+}
+
 #define PTYCHAR1 "pqrstuvwxyzabcde"
 #define PTYCHAR2 "0123456789abcdef"
 
@@ -495,7 +519,9 @@ static void qe_term_write(ShellState *s, const char *buf, int len)
     }
 }
 
-static inline void qe_term_set_style(ShellState *s) {
+/* cell grid for the alternate screen */
+
+static inline QETermStyle qe_term_get_style(ShellState *s) {
     QETermStyle composite_color;
 
     if (s->reverse) {
@@ -503,7 +529,295 @@ static inline void qe_term_set_style(ShellState *s) {
     } else {
         composite_color = QE_TERM_MAKE_COLOR(s->fgcolor, s->bgcolor);
     }
-    s->b->cur_style = QE_TERM_COMPOSITE | s->attr | composite_color;
+    return QE_TERM_COMPOSITE | s->attr | composite_color;
+}
+
+static inline void qe_term_set_style(ShellState *s) {
+    s->b->cur_style = qe_term_get_style(s);
+}
+
+static void qe_grid_resize(ShellState *s)
+{
+    ShellCell *grid;
+    u8 *dirty;
+    int rows = max_int(s->rows, 1), cols = max_int(s->cols, 1);
+    int x, y;
+
+    grid = qe_malloc_array(ShellCell, rows * cols);
+    dirty = qe_malloc_array(u8, rows);
+    if (!grid || !dirty) {
+        qe_free(&grid);
+        qe_free(&dirty);
+        return;
+    }
+    for (y = 0; y < rows; y++) {
+        for (x = 0; x < cols; x++) {
+            ShellCell *cp = &grid[y * cols + x];
+            if (s->grid && y < s->grid_rows && x < s->grid_cols) {
+                *cp = s->grid[y * s->grid_cols + x];
+            } else {
+                cp->c = ' ';
+                cp->style = QE_STYLE_DEFAULT;
+            }
+        }
+        /* do not keep the left half of a truncated wide glyph */
+        if (grid[y * cols + cols - 1].c != 0 && cols < s->grid_cols
+        &&  s->grid && y < s->grid_rows
+        &&  s->grid[y * s->grid_cols + cols].c == 0) {
+            grid[y * cols + cols - 1].c = ' ';
+        }
+        dirty[y] = 1;
+    }
+    qe_free(&s->grid);
+    qe_free(&s->grid_dirty);
+    s->grid = grid;
+    s->grid_dirty = dirty;
+    s->grid_rows = rows;
+    s->grid_cols = cols;
+    s->grid_x = min_int(s->grid_x, cols - 1);
+    s->grid_y = min_int(s->grid_y, rows - 1);
+    s->grid_cursor_row = 0;
+}
+
+static void qe_grid_close(ShellState *s)
+{
+    qe_free(&s->grid);
+    qe_free(&s->grid_dirty);
+    s->grid_rows = s->grid_cols = 0;
+}
+
+static inline ShellCell *qe_grid_row(ShellState *s, int y) {
+    return s->grid + y * s->grid_cols;
+}
+
+/* clamp the scroll region to the grid */
+static void qe_grid_get_region(ShellState *s, int *top, int *bottom) {
+    *bottom = s->scroll_bottom > 0 ? min_int(s->scroll_bottom, s->grid_rows) : s->grid_rows;
+    *top = clamp_int(s->scroll_top, 0, *bottom - 1);
+}
+
+/* erase cells [x0, x1) of row y with the current background */
+static void qe_grid_erase(ShellState *s, int y, int x0, int x1)
+{
+    ShellCell *row = qe_grid_row(s, y);
+    QETermStyle style = qe_term_get_style(s);
+    int x;
+
+    x0 = clamp_int(x0, 0, s->grid_cols);
+    x1 = clamp_int(x1, x0, s->grid_cols);
+    if (x0 >= x1)
+        return;
+    /* erasing half of a wide glyph erases the other half */
+    if (x0 > 0 && row[x0].c == 0)
+        row[x0 - 1].c = ' ';
+    if (x1 < s->grid_cols && row[x1].c == 0)
+        row[x1].c = ' ';
+    for (x = x0; x < x1; x++) {
+        row[x].c = ' ';
+        row[x].style = style;
+    }
+    s->grid_dirty[y] = 1;
+}
+
+/* scroll rows [top, bottom) up by n rows, down if n < 0 */
+static void qe_grid_scroll(ShellState *s, int top, int bottom, int n)
+{
+    int y, cols = s->grid_cols;
+
+    if (top >= bottom || n == 0)
+        return;
+    if (n > 0) {
+        n = min_int(n, bottom - top);
+        memmove(qe_grid_row(s, top), qe_grid_row(s, top + n),
+                (bottom - top - n) * cols * sizeof(ShellCell));
+        for (y = bottom - n; y < bottom; y++)
+            qe_grid_erase(s, y, 0, cols);
+    } else {
+        n = min_int(-n, bottom - top);
+        memmove(qe_grid_row(s, top + n), qe_grid_row(s, top),
+                (bottom - top - n) * cols * sizeof(ShellCell));
+        for (y = top; y < top + n; y++)
+            qe_grid_erase(s, y, 0, cols);
+    }
+    for (y = top; y < bottom; y++)
+        s->grid_dirty[y] = 1;
+}
+
+static void qe_grid_goto(ShellState *s, int x, int y)
+{
+    s->grid_x = clamp_int(x, 0, s->grid_cols - 1);
+    s->grid_y = clamp_int(y, 0, s->grid_rows - 1);
+}
+
+/* move the cursor down, scroll at the bottom of the scroll region */
+static void qe_grid_index(ShellState *s, int n)
+{
+    int top, bottom;
+
+    qe_grid_get_region(s, &top, &bottom);
+    while (n > 0) {
+        if (s->grid_y == bottom - 1)
+            qe_grid_scroll(s, top, bottom, 1);
+        else
+        if (s->grid_y < s->grid_rows - 1)
+            s->grid_y++;
+        n--;
+    }
+    while (n < 0) {
+        if (s->grid_y == top)
+            qe_grid_scroll(s, top, bottom, -1);
+        else
+        if (s->grid_y > 0)
+            s->grid_y--;
+        n++;
+    }
+}
+
+/* store a glyph of width w at the cursor position */
+static void qe_grid_put(ShellState *s, char32_t c, int w)
+{
+    ShellCell *row;
+    QETermStyle style = qe_term_get_style(s);
+    int x;
+
+    if (w <= 0) {
+        /* XXX: accents are not stored in the grid */
+        return;
+    }
+    if (s->grid_x + w > s->grid_cols) {
+        /* auto wrap, blank the last column for a wide glyph */
+        if (s->grid_x < s->grid_cols)
+            qe_grid_erase(s, s->grid_y, s->grid_x, s->grid_cols);
+        s->grid_x = 0;
+        qe_grid_index(s, 1);
+        if (w > s->grid_cols)
+            return;
+    }
+    row = qe_grid_row(s, s->grid_y);
+    x = s->grid_x;
+    /* overwriting half of a wide glyph erases the other half */
+    if (row[x].c == 0 && x > 0)
+        row[x - 1].c = ' ';
+    if (x + w < s->grid_cols && row[x + w].c == 0)
+        row[x + w].c = ' ';
+    row[x].c = c;
+    row[x].style = style;
+    if (w > 1) {
+        row[x + 1].c = 0;
+        row[x + 1].style = style;
+    }
+    s->grid_x += w;
+    s->grid_dirty[s->grid_y] = 1;
+}
+
+/* insert n blank cells at the cursor position, delete if n < 0 */
+static void qe_grid_insert_chars(ShellState *s, int n)
+{
+    ShellCell *row = qe_grid_row(s, s->grid_y);
+    int x = min_int(s->grid_x, s->grid_cols - 1);
+    int len = s->grid_cols - x;
+
+    if (n > 0) {
+        n = min_int(n, len);
+        memmove(row + x + n, row + x, (len - n) * sizeof(ShellCell));
+        qe_grid_erase(s, s->grid_y, x, x + n);
+    } else {
+        n = min_int(-n, len);
+        memmove(row + x, row + x + n, (len - n) * sizeof(ShellCell));
+        qe_grid_erase(s, s->grid_y, s->grid_cols - n, s->grid_cols);
+    }
+    /* fix wide glyphs split by the move */
+    if (row[x].c == 0)
+        row[x].c = ' ';
+    if (row[s->grid_cols - 1].c != 0 && s->grid_cols > 1
+    &&  qe_wcwidth(row[s->grid_cols - 1].c) > 1)
+        row[s->grid_cols - 1].c = ' ';
+    s->grid_dirty[s->grid_y] = 1;
+}
+
+/* insert n blank rows at the cursor row, delete if n < 0 */
+static void qe_grid_insert_lines(ShellState *s, int n)
+{
+    int top, bottom;
+
+    qe_grid_get_region(s, &top, &bottom);
+    if (s->grid_y >= top && s->grid_y < bottom) {
+        qe_grid_scroll(s, s->grid_y, bottom, -n);
+        s->grid_x = 0;
+    }
+}
+
+/* Copy the modified rows of the grid to the buffer, each row is a
+ * line without trailing default blanks, and update the cursor offset.
+ */
+static void qe_grid_flush(ShellState *s)
+{
+    EditBuffer *b = s->b;
+    char32_t buf[256];
+    ShellCell *row;
+    QETermStyle style;
+    int x, y, n, len, offset, end, cursor_start, offset1;
+
+    if (s->grid_rows != s->rows || s->grid_cols != s->cols) {
+        qe_grid_resize(s);
+        if (!s->grid)
+            return;
+    }
+    s->grid_dirty[s->grid_y] = 1;
+    s->grid_dirty[min_int(s->grid_cursor_row, s->grid_rows - 1)] = 1;
+    s->grid_cursor_row = s->grid_y;
+
+    offset = cursor_start = s->alternate_screen_top =
+        min_offset(s->alternate_screen_top, b->total_size);
+    for (y = 0; y < s->grid_rows; y++) {
+        end = eb_goto_eol(b, offset);
+        if (y == s->grid_y)
+            cursor_start = offset;
+        if (s->grid_dirty[y]) {
+            row = qe_grid_row(s, y);
+            n = s->grid_cols;
+            while (n > 0 && row[n - 1].c == ' '
+               &&  row[n - 1].style == QE_STYLE_DEFAULT)
+                n--;
+            if (y == s->grid_y)
+                n = max_int(n, min_int(s->grid_x, s->grid_cols));
+            eb_delete_range(b, offset, end);
+            end = offset;
+            for (x = 0; x < n;) {
+                style = row[x].style;
+                for (len = 0; x < n && row[x].style == style
+                     &&  len < countof(buf); x++) {
+                    if (row[x].c)
+                        buf[len++] = row[x].c;
+                }
+                b->cur_style = style;
+                end += eb_insert_char32_buf(b, end, buf, len);
+            }
+            s->grid_dirty[y] = 0;
+        }
+        if (y < s->grid_rows - 1) {
+            if (end >= b->total_size) {
+                b->cur_style = QE_STYLE_DEFAULT;
+                eb_insert_char32(b, end, '\n');
+            }
+            offset = eb_next(b, end);
+        } else {
+            eb_delete_range(b, end, b->total_size);
+        }
+    }
+    /* compute the offset of the cursor */
+    row = qe_grid_row(s, s->grid_y);
+    offset = cursor_start;
+    n = min_int(s->grid_x, s->grid_cols);
+    for (x = 0; x < n && offset < b->total_size; x++) {
+        if (row[x].c) {
+            if (eb_nextc(b, offset, &offset1) == '\n')
+                break;
+            offset = offset1;
+        }
+    }
+    s->cur_offset = offset;
+    s->cur_offset_hack = 0;
 }
 
 /* return offset of the n-th terminal line from a given offset */
@@ -1370,6 +1684,132 @@ static unsigned char const sco_color[16] = {
     0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15,
 };
 
+#define ESC2(c1,c2)  (((c1) << 8) | (unsigned char)(c2))
+
+/* handle a CSI sequence on the cell grid, return 0 if not handled */
+static int qe_grid_csi(ShellState *s, int code, int param1, int param2)
+{
+    int y, top, bottom;
+
+    switch (code) {
+    case '@':  /* ICH: Insert Ps (Blank) Character(s) (default = 1) */
+        qe_grid_insert_chars(s, param1);
+        break;
+    case 'A':  /* CUU: Cursor Up Ps Times (default = 1) */
+        qe_grid_goto(s, s->grid_x, s->grid_y - param1);
+        break;
+    case 'B':  /* CUD: Cursor Down Ps Times (default = 1) */
+    case 'e':  /* VPR: Line Position Relative [rows] (default = 1) */
+        qe_grid_goto(s, s->grid_x, s->grid_y + param1);
+        break;
+    case 'C':  /* CUF: Cursor Forward Ps Times (default = 1) */
+    case 'a':  /* HPR: Character Position Relative [columns] (default = 1) */
+        qe_grid_goto(s, s->grid_x + param1, s->grid_y);
+        break;
+    case 'D':  /* CUB: Cursor Backward Ps Times (default = 1) */
+        qe_grid_goto(s, min_int(s->grid_x, s->grid_cols - 1) - param1, s->grid_y);
+        break;
+    case 'E':  /* CNL: Cursor Next Line Ps Times (default = 1) and CR. */
+        qe_grid_goto(s, 0, s->grid_y + param1);
+        break;
+    case 'F':  /* CPL: Cursor Preceding Line Ps Times (default = 1) and CR. */
+        qe_grid_goto(s, 0, s->grid_y - param1);
+        break;
+    case 'G':  /* CHA: Cursor Character Absolute [column]. */
+    case '`':  /* HPA: Character Position Absolute [column] (default = 1) */
+        qe_grid_goto(s, param1 - 1, s->grid_y);
+        break;
+    case 'H':  /* CUP: Cursor Position [row;column] (default = [1,1]). */
+    case 'f':  /* HVP: Horizontal and Vertical Position [row;column] (default = [1,1]) */
+        qe_grid_goto(s, param2 - 1, param1 - 1);
+        break;
+    case 'I':  /* CHT: Cursor Forward Tabulation Ps tab stops (default = 1). */
+        qe_grid_goto(s, ((s->grid_x >> 3) + param1) << 3, s->grid_y);
+        break;
+    case 'Z':  /* CBT: Cursor Backward Tabulation Ps tab stops (default = 1). */
+        qe_grid_goto(s, (((min_int(s->grid_x, s->grid_cols - 1) + 7) >> 3) - param1) << 3, s->grid_y);
+        break;
+    case 'd':  /* VPA: Line Position Absolute [row] (default = 1). */
+        qe_grid_goto(s, s->grid_x, param1 - 1);
+        break;
+    case 'J':  /* ED: Erase in Display. */
+    case ESC2('?','J'):  /* DECSED: Selective Erase in Display. */
+        /* 0: Below (default), 1: Above, 2: All, 3: Saved Lines (xterm) */
+        if (s->params[0] <= 0) {
+            qe_grid_erase(s, s->grid_y, s->grid_x, s->grid_cols);
+            for (y = s->grid_y + 1; y < s->grid_rows; y++)
+                qe_grid_erase(s, y, 0, s->grid_cols);
+        } else
+        if (s->params[0] == 1) {
+            for (y = 0; y < s->grid_y; y++)
+                qe_grid_erase(s, y, 0, s->grid_cols);
+            qe_grid_erase(s, s->grid_y, 0, s->grid_x + 1);
+        } else {
+            for (y = 0; y < s->grid_rows; y++)
+                qe_grid_erase(s, y, 0, s->grid_cols);
+        }
+        break;
+    case 'K':  /* EL: Erase in Line. */
+    case ESC2('?','K'):  /* DECSEL: Selective Erase in Line. */
+        /* 0: to Right (default), 1: to Left, 2: All */
+        if (s->params[0] <= 0) {
+            qe_grid_erase(s, s->grid_y, s->grid_x, s->grid_cols);
+        } else
+        if (s->params[0] == 1) {
+            qe_grid_erase(s, s->grid_y, 0, s->grid_x + 1);
+        } else {
+            qe_grid_erase(s, s->grid_y, 0, s->grid_cols);
+        }
+        break;
+    case 'L':  /* IL: Insert Ps Line(s) (default = 1). */
+        qe_grid_insert_lines(s, param1);
+        break;
+    case 'M':  /* DL: Delete Ps Line(s) (default = 1). */
+        qe_grid_insert_lines(s, -param1);
+        break;
+    case 'P':  /* DCH: Delete Ps Character(s) (default = 1). */
+        qe_grid_insert_chars(s, -param1);
+        break;
+    case 'S':  /* SU: Scroll up Ps lines (default = 1). */
+        qe_grid_get_region(s, &top, &bottom);
+        qe_grid_scroll(s, top, bottom, param1);
+        break;
+    case 'T':  /* SD: Scroll down Ps lines (default = 1). */
+        qe_grid_get_region(s, &top, &bottom);
+        qe_grid_scroll(s, top, bottom, -param1);
+        break;
+    case 'X':  /* ECH: Erase Ps Character(s) (default = 1). */
+        qe_grid_erase(s, s->grid_y, s->grid_x, s->grid_x + param1);
+        break;
+    case 'b':  /* REP: Repeat the preceding graphic character Ps times. */
+        param1 = min_int(param1, s->grid_cols * s->grid_rows);
+        while (param1 --> 0) {
+            qe_grid_put(s, s->lastc, qe_wcwidth(s->lastc));
+        }
+        break;
+    case 'n':  /* DSR: Device Status Report. */
+        if (param1 == 6) {
+            /* Report Cursor Position (CPR) [row;column]. */
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\033[%d;%dR", s->grid_y + 1,
+                     min_int(s->grid_x, s->grid_cols - 1) + 1);
+            qe_term_write(s, buf, -1);
+            break;
+        }
+        return 0;
+    case 's':  /* Save cursor (ANSI.SYS) */
+        s->save_x = s->grid_x;
+        s->save_y = s->grid_y;
+        break;
+    case 'u':  /* Restore cursor (ANSI.SYS). */
+        qe_grid_goto(s, s->save_x, s->save_y);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
 static void qe_term_emulate(ShellState *s, int c)
 {
     int i, param1, param2, len, offset, offset1, offset2;
@@ -1387,7 +1827,6 @@ static void qe_term_emulate(ShellState *s, int c)
         s->term_len = s->term_pos;
     }
 
-#define ESC2(c1,c2)  (((c1) << 8) | (unsigned char)(c2))
     /* some bytes are state independent */
     switch (c) {
     case 0x18:
@@ -1417,6 +1856,12 @@ static void qe_term_emulate(ShellState *s, int c)
             break;
         case 8:     /* BS   Backspace (Ctrl-H). */
             //TRACE_PRINTF(s, "BS: ");
+            if (s->grid) {
+                /* This is iTerm2's behavior */
+                s->grid_x -= (s->grid_x >= s->grid_cols);
+                qe_grid_goto(s, s->grid_x - 1, s->grid_y);
+                break;
+            }
             qe_term_get_pos2(s, offset, &pos, 0);
             if (pos.col == 0) {
                 if (pos.row > 0 && (pos.flags & SP_LINE_START_WRAP)) {
@@ -1433,6 +1878,10 @@ static void qe_term_emulate(ShellState *s, int c)
             }
             break;
         case 9:     /* HT   Horizontal Tab (TAB) (Ctrl-I). */
+            if (s->grid) {
+                qe_grid_goto(s, (s->grid_x + 8) & ~7, s->grid_y);
+                break;
+            }
             qe_term_goto_tab(s, 1);
             break;
         case 10:    /* LF   Line Feed (Ctrl-J) or New Line (NL). */
@@ -1441,6 +1890,9 @@ static void qe_term_emulate(ShellState *s, int c)
         case 12:    /* FF   Form Feed (Ctrl-L) or New Page (NP).
                      *      FF is treated the same as LF. */
             //TRACE_PRINTF(s, "LF: ");
+            if (s->grid) {
+                qe_grid_index(s, 1);
+            } else
             if (s->use_alternate_screen) {
                 qe_term_goto_xy(s, 0, 1, TG_RELATIVE | TG_NOCLIP);
             } else {
@@ -1466,6 +1918,10 @@ static void qe_term_emulate(ShellState *s, int c)
         case 13:    /* CR   Carriage Return (Ctrl-M). */
             /* move to visual beginning of line */
             //TRACE_PRINTF(s, "CR: ");
+            if (s->grid) {
+                s->grid_x = 0;
+                break;
+            }
             qe_term_goto_xy(s, 0, 0, TG_RELATIVE_ROW);
             break;
         case 14:    /* SO   Shift Out (Ctrl-N) ->
@@ -1533,7 +1989,10 @@ static void qe_term_emulate(ShellState *s, int c)
                     buf1[0] = s->lastc = c;
                     len = 1;
                 }
-                s->cur_offset = qe_term_overwrite(s, offset, 1, buf1, len);
+                if (s->grid)
+                    qe_grid_put(s, s->lastc, 1);
+                else
+                    s->cur_offset = qe_term_overwrite(s, offset, 1, buf1, len);
             } else {
                 TRACE_MSG(s, "control");
             }
@@ -1546,6 +2005,9 @@ static void qe_term_emulate(ShellState *s, int c)
             const char *p = cs8(s->term_buf);
             char32_t ch = s->lastc = utf8_decode(&p);
             int w = qe_wcwidth(ch);
+            if (s->grid) {
+                qe_grid_put(s, ch, w);
+            } else
             if (w == 0) {
                 /* accents are always inserted */
                 // XXX: what if s->cur_offset_hack is not 0?
@@ -1606,9 +2068,18 @@ static void qe_term_emulate(ShellState *s, int c)
         case '6':   // Back Index (DECBI), VT420 and up.
             break;
         case '7':   // Save Cursor (DECSC). [sc]
+            if (s->grid) {
+                s->save_x = s->grid_x;
+                s->save_y = s->grid_y;
+                break;
+            }
             qe_term_get_pos(s, offset, &s->save_x, &s->save_y);
             break;
         case '8':   // Restore Cursor (DECRC). [rc]
+            if (s->grid) {
+                qe_grid_goto(s, s->save_x, s->save_y);
+                break;
+            }
             qe_term_goto_xy(s, s->save_x, s->save_y, 0);
             break;
         case 'c':   // Full Reset (RIS). [rs1, reset_1string]
@@ -1622,6 +2093,12 @@ static void qe_term_emulate(ShellState *s, int c)
                     // move cursor down, scroll if at bottom
         case 'E':   // Next Line (NEL  is 0x85).
                     // move cursor to beginning of next line, scroll if at bottom
+            if (s->grid) {
+                if (c == 'E')
+                    s->grid_x = 0;
+                qe_grid_index(s, 1);
+                break;
+            }
             {
                 int col, row;
                 qe_term_get_pos(s, offset, &col, &row);
@@ -1632,6 +2109,10 @@ static void qe_term_emulate(ShellState *s, int c)
             break;
         case 'M':   // Reverse Index (RI  is 0x8d). [ri]
                     // move cursor up, scroll if at top line
+            if (s->grid) {
+                qe_grid_index(s, -1);
+                break;
+            }
             {
                 int start, offset3, col, row;
                 start = qe_term_get_pos(s, offset, &col, &row);
@@ -1784,7 +2265,7 @@ static void qe_term_emulate(ShellState *s, int c)
         }
         break;
     case QE_TERM_STATE_CSI:
-        if (c == '?' || c == '=' || c == '"' || c == ' ' || c == '\'' || c == '&') {
+        if (c == '?' || c == '>' || c == '=' || c == '"' || c == ' ' || c == '\'' || c == '&') {
             s->esc1 = c;
             break;
         }
@@ -1807,6 +2288,8 @@ static void qe_term_emulate(ShellState *s, int c)
         /* default param is 1 for most commands */
         param1 = s->params[0] >= 0 ? s->params[0] : 1;
         param2 = s->params[1] >= 0 ? s->params[1] : 1;
+        if (s->grid && qe_grid_csi(s, ESC2(s->esc1,c), param1, param2))
+            break;
         switch (ESC2(s->esc1,c)) {
         case '@':  /* ICH: Insert Ps (Blank) Character(s) (default = 1) */
             {
@@ -2133,6 +2616,8 @@ static void qe_term_emulate(ShellState *s, int c)
                         s->use_alternate_screen = 1;
                         s->cur_offset = s->alternate_screen_top = offset;
                         // XXX: should update window top?
+                        s->grid_x = s->grid_y = 0;
+                        qe_grid_resize(s);
                     }
                     break;
                 default:
@@ -2209,6 +2694,10 @@ static void qe_term_emulate(ShellState *s, int c)
                         qe_ungrab_keys();
                         s->grab_keys = 0;
                     }
+                    if (s->grid) {
+                        qe_grid_flush(s);
+                        qe_grid_close(s);
+                    }
                     if (s->use_alternate_screen) {
                         // XXX: this will actually go to row s->rows-1
                         qe_term_goto_xy(s, 0, s->rows, 0);
@@ -2325,6 +2814,50 @@ static void qe_term_emulate(ShellState *s, int c)
 
 /* buffer related functions */
 
+/* Discard the oldest output when the buffer exceeds its scrollback
+ * limits.  The limits must be exceeded by 1/8 before the buffer is
+ * trimmed, so the page table is updated once for many pages of output.
+ * Marks and window positions are updated by the buffer callbacks.
+ */
+static void shell_trim_scrollback(ShellState *s)
+{
+    EditBuffer *b = s->b;
+    int offset, limit, line, col, save_log;
+
+    offset = 0;
+    if (b->scrollback_size > 0) {
+        limit = max_int(b->scrollback_size, MAX_PAGE_SIZE);
+        if (b->total_size - limit > limit / 8)
+            offset = b->total_size - limit;
+    }
+    if (b->scrollback_lines > 0) {
+        limit = b->scrollback_lines;
+        eb_get_pos(b, &line, &col, b->total_size);
+        if (line - limit > limit / 8)
+            offset = max_offset(offset, eb_goto_pos(b, line - limit, 0));
+    }
+    if (offset <= 0)
+        return;
+
+    /* cut at a line boundary before the terminal screen */
+    if (eb_prevc(b, offset, &col) != '\n')
+        offset = eb_next_line(b, offset);
+    offset = min_offset(offset, s->screen_top);
+    if (s->use_alternate_screen)
+        offset = min_offset(offset, s->alternate_screen_top);
+    offset = min_offset(offset, eb_goto_bol(b, s->cur_offset));
+    if (offset <= 0)
+        return;
+
+    /* the undo records would refer to discarded data */
+    save_log = b->save_log;
+    b->save_log = 0;
+    eb_delete(b, 0, offset);
+    b->save_log = save_log;
+    eb_free_log_buffer(b);
+    shell_error_trim(b, offset);
+}
+
 /* called when characters are available from the process */
 static void shell_read_cb(void *opaque)
 {
@@ -2356,6 +2889,8 @@ static void shell_read_cb(void *opaque)
         for (i = 0; i < len; i++) {
             qe_term_emulate(s, buf[i]);
         }
+        if (s->grid)
+            qe_grid_flush(s);
         if (s->last_char == '\000' || s->last_char == '\001'
         ||  s->last_char == '\003'
         ||  s->last_char == '\r' || s->last_char == '\n') {
@@ -2390,6 +2925,9 @@ static void shell_read_cb(void *opaque)
             }
         }
     }
+    if (b->scrollback_size > 0 || b->scrollback_lines > 0)
+        shell_trim_scrollback(s);
+
     if (save_readonly) {
         b->modified = 0;
         b->flags |= save_readonly;
@@ -2409,6 +2947,7 @@ static void shell_mode_free(EditBuffer *b, void *state)
     eb_free_callback(b, eb_offset_callback, &s->cur_prompt);
     eb_free_callback(b, eb_offset_callback, &s->alternate_screen_top);
     eb_free_callback(b, eb_offset_callback, &s->screen_top);
+    qe_grid_close(s);
 
     if (s->pid != -1) {
         sig = SIGINT;
@@ -2570,6 +3109,12 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
     s->qe_state = qs;
     s->caption = caption;
     s->shell_flags = shell_flags;
+    if ((shell_flags & SF_INTERACTIVE) || ((shell_flags & SF_INFINITE) && !b0)) {
+        /* limit the output kept in shell and compilation buffers,
+         * but not in file buffers (archives, compressed files) */
+        b->scrollback_size = qs->shell_scrollback_size;
+        b->scrollback_lines = qs->shell_scrollback_lines;
+    }
     s->cur_prompt = s->cur_offset = b->total_size;
     qe_term_init(s);
 
@@ -23,6 +23,7 @@
  */
 
 #include "qe.h"
+#include "variables.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ASSERT(x)
@@ -36,15 +37,118 @@
 
 /*----------------------------------------------------------------*/
 
+/* Decoded images are kept in a cache shared by all image buffers so
+ * that browsing back and forth in a dired preview does not decode the
+ * same files over and over.  Entries are kept in LRU order, most
+ * recently used first, and unreferenced entries are freed when the
+ * total size exceeds image_cache_size.
+ */
+typedef struct ImageCacheEntry {
+    struct ImageCacheEntry *next, *prev;  /* must be first for list_xxx */
+    int ref_count;
+    QEPicture pic;          /* picture with its reduced copies */
+    void *stb_image;
+    int stb_x, stb_y, stb_channels;
+    size_t size;            /* estimated memory footprint */
+    time_t mtime;           /* file identification for validation */
+    off_t file_size;
+    char filename[1];
+} ImageCacheEntry;
+
+static LIST_HEAD(image_cache);
+static size_t image_cache_used;
+static int image_cache_size = 256 << 20;
+
+static VarDef image_variables[] = {
+    G_VAR( "image-cache-size", image_cache_size, VAR_NUMBER, VAR_RW_SAVE,
+          "Memory budget in bytes for decoded images kept in the image cache" )
+};
+
+static void image_cache_free_entry(ImageCacheEntry *ce) {
+    list_del(ce);
+    image_cache_used -= ce->size;
+    qe_picture_free_mipmaps(&ce->pic);
+    stbi_image_free(ce->stb_image);
+    qe_free(&ce);
+}
+
+/* free least recently used entries until the budget is met, the most
+ * recent entry is always kept.
+ */
+static void image_cache_trim(void) {
+    ImageCacheEntry *ce, *ce1;
+
+    for (ce = (void *)image_cache.prev;
+         ce != (void *)image_cache.next && image_cache_used > (size_t)image_cache_size;
+         ce = ce1) {
+        ce1 = ce->prev;
+        if (ce->ref_count == 0)
+            image_cache_free_entry(ce);
+    }
+}
+
+/* Find or decode an image file, move it to the head of the cache.
+ * Entries are matched on file name, size and modification time.
+ */
+static ImageCacheEntry *image_cache_load(const char *filename) {
+    ImageCacheEntry *ce;
+    struct stat st;
+    int len;
+
+    if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    list_for_each(ce, &image_cache) {
+        if (ce->mtime == st.st_mtime && ce->file_size == st.st_size
+        &&  strequal(ce->filename, filename)) {
+            list_del(ce);
+            list_add(ce, &image_cache);
+            return ce;
+        }
+    }
+
+    len = strlen(filename);
+    ce = qe_mallocz_hack(ImageCacheEntry, len);
+    if (!ce)
+        return NULL;
+    ce->stb_image = stbi_load(filename, &ce->stb_x, &ce->stb_y,
+                              &ce->stb_channels, 4);
+    if (!ce->stb_image) {
+        qe_free(&ce);
+        return NULL;
+    }
+    memcpy(ce->filename, filename, len + 1);
+    ce->mtime = st.st_mtime;
+    ce->file_size = st.st_size;
+    ce->pic.width = ce->stb_x;
+    ce->pic.height = ce->stb_y;
+    ce->pic.format = QEBITMAP_FORMAT_BGRA32;
+    ce->pic.data[0] = ce->stb_image;
+    ce->pic.linesize[0] = ce->stb_x * 4;
+    /* account for the reduced copies built upon display */
+    ce->size = (size_t)ce->stb_x * ce->stb_y * 4 * 4 / 3;
+    image_cache_used += ce->size;
+    list_add(ce, &image_cache);
+    image_cache_trim();
+    return ce;
+}
+
+static void image_cache_release(ImageCacheEntry **cep) {
+    if (*cep) {
+        (*cep)->ref_count--;
+        *cep = NULL;
+        image_cache_trim();
+    }
+}
+
+/*----------------*/
+
 static ModeDef stb_mode;
 
 typedef struct ImageState {
     QEModeData base;
 
-    QEPicture pic;
-
-    void *stb_image;
-    int stb_x, stb_y, stb_channels;
+    ImageCacheEntry *img;
 
 } ImageState;
 
@@ -60,27 +164,29 @@ static void image_display(EditState *s) {
     QEColor col = qe_styles[QE_STYLE_GUTTER].bg_color;
 
     if (s->display_invalid) {
-        if (ms && ms->stb_image) {
+        if (ms && ms->img) {
+            QEPicture *pic = &ms->img->pic;
 #if 0
             int x0, y0, w, h;
 
             /* No scaling */
-            w = min_int(s->width, ms->pic.width);
-            h = min_int(s->height, ms->pic.height / s->screen->dpy.yfactor);
+            w = min_int(s->width, pic->width);
+            h = min_int(s->height, pic->height / s->screen->dpy.yfactor);
             x0 = (s->width - w) / 2;
             y0 = (s->height - h) / 2;
             qe_draw_picture(s->screen, s->xleft + x0, s->ytop + y0, w, h,
-                            &ms->pic, 0, 0, w, h * s->screen->dpy.yfactor,
+                            pic, 0, 0, w, h * s->screen->dpy.yfactor,
                             0, QERGB(128, 128, 128));
             fill_window_slack(s, x0, y0, w, h, col);
             put_status(s, "%dx%dx%d",
-                       ms->pic.width, ms->pic.height, ms->stb_channels * 8);
+                       pic->width, pic->height, ms->img->stb_channels * 8);
 #else
             int x0 = 0;
             int y0 = 0;
-            int w = ms->pic.width;
-            int h = (ms->pic.height + s->screen->dpy.yfactor - 1) / s->screen->dpy.yfactor;
+            int w = pic->width;
+            int h = (pic->height + s->screen->dpy.yfactor - 1) / s->screen->dpy.yfactor;
             int factor = 1024;
+            const QEPicture *ip;
 
             if (w > 0 && h > 0) {
                 /* compute scaling factor for scale up or down */
@@ -92,13 +198,16 @@ static void image_display(EditState *s) {
                 }
                 x0 = (s->width - w) / 2;
                 y0 = (s->height - h) / 2;
+                /* draw from the smallest reduced copy at least as large
+                   as the target area */
+                ip = qe_picture_get_level(pic, w, h * s->screen->dpy.yfactor);
                 qe_draw_picture(s->screen, s->xleft + x0, s->ytop + y0, w, h,
-                                &ms->pic, 0, 0, ms->pic.width, ms->pic.height,
+                                ip, 0, 0, ip->width, ip->height,
                                 0, QERGB(128, 128, 128));
             }
             fill_window_slack(s, x0, y0, w, h, col);
             put_status(s, "%dx%dx%d",
-                       ms->pic.width, ms->pic.height, ms->stb_channels * 8);
+                       pic->width, pic->height, ms->img->stb_channels * 8);
 #endif
         } else {
             fill_rectangle(s->screen, s->xleft, s->ytop, s->width, s->height, col);
@@ -123,15 +232,10 @@ static void image_display(EditState *s) {
 static void image_display_hook(EditState *s) {
     ImageState *ms = image_get_state(s, 0);
 
-    if (ms && !ms->stb_image) {
-        ms->stb_image = stbi_load(s->b->filename,
-                                  &ms->stb_x, &ms->stb_y, &ms->stb_channels, 4);
-        if (ms->stb_image) {
-            ms->pic.width = ms->stb_x;
-            ms->pic.height = ms->stb_y;
-            ms->pic.format = QEBITMAP_FORMAT_BGRA32;
-            ms->pic.data[0] = ms->stb_image;
-            ms->pic.linesize[0] = ms->stb_x * 4;
+    if (ms && !ms->img) {
+        ms->img = image_cache_load(s->b->filename);
+        if (ms->img) {
+            ms->img->ref_count++;
         } else {
             put_status(s, "stbi_load error");
         }
@@ -139,14 +243,14 @@ static void image_display_hook(EditState *s) {
     edit_invalidate(s, 1);
 }
 
+static int image_mode_prefetch(ModeDef *m, const char *filename) {
+    return image_cache_load(filename) ? 0 : -1;
+}
+
 static void image_mode_free(EditBuffer *b, void *state) {
     ImageState *ms = state;
 
-    if (ms->stb_image) {
-        stbi_image_free(ms->stb_image);
-        ms->stb_image = NULL;
-        ms->pic.data[0] = NULL;
-    }
+    image_cache_release(&ms->img);
 }
 
 static ModeDef stb_mode = {
@@ -155,6 +259,7 @@ static ModeDef stb_mode = {
     .extensions = "bmp|ico|jpg|jpeg|png|tga|psd|gif|hdr|pic|pnm|ppm|pgm",
     .buffer_instance_size = sizeof(ImageState),
     .mode_free = image_mode_free,
+    .mode_prefetch = image_mode_prefetch,
     .display_hook = image_display_hook,
     .display = image_display,
 };
@@ -162,6 +267,7 @@ static ModeDef stb_mode = {
 static int stb_init(QEmacsState *qs)
 {
     qe_register_mode(&stb_mode, MODEF_VIEW);
+    qe_register_variables(image_variables, countof(image_variables));
     return 0;
 }
 
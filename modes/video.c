@@ -45,13 +45,12 @@ typedef struct PacketQueue {
     pthread_cond_t cond;
 } PacketQueue;
 
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define VIDEO_PICTURE_QUEUE_SIZE 4
 
 typedef struct VideoPicture {
     int delay; /* delay before showing the next picture */
     QEBitmap *bmp; /* bitmap associated to the picture */
     int width, height; /* source height & width */
-    int allocated;
 } VideoPicture;
 
 typedef struct VideoState {
@@ -76,11 +75,19 @@ typedef struct VideoState {
     AVStream *video_st;
     PacketQueue videoq;
 
+    /* pool of preallocated pictures used as a ring buffer between
+       video_thread and video_refresh_timer */
     VideoPicture pictq[VIDEO_PICTURE_QUEUE_SIZE];
     int pictq_size, pictq_rindex, pictq_windex;
+    int pictq_allocated;        /* set by main thread when pool is ready */
+    int pictq_alloc_request;    /* set by decoder thread to realloc pool */
+    int pictq_width, pictq_height;
     pthread_mutex_t pictq_mutex;
     pthread_cond_t pictq_cond;
 
+    int frame_timer;            /* clock time when next frame is due */
+    int frames_dropped;
+
     QETimer *video_timer;
 } VideoState;
 
@@ -217,6 +224,35 @@ static inline VideoState *video_get_state(EditState *e, int status)
     return qe_get_window_mode_data(e, &video_mode, status);
 }
 
+static int pictq_count(VideoState *is)
+{
+    int size;
+
+    pthread_mutex_lock(&is->pictq_mutex);
+    size = is->pictq_size;
+    pthread_mutex_unlock(&is->pictq_mutex);
+    return size;
+}
+
+static inline VideoPicture *pictq_peek(VideoState *is)
+{
+    return &is->pictq[is->pictq_rindex];
+}
+
+/* release the displayed picture to video_thread */
+static void pictq_next(VideoState *is)
+{
+    if (++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE)
+        is->pictq_rindex = 0;
+
+    pthread_mutex_lock(&is->pictq_mutex);
+    is->pictq_size--;
+    pthread_cond_signal(&is->pictq_cond);
+    pthread_mutex_unlock(&is->pictq_mutex);
+}
+
+static void alloc_pictures(void *opaque);
+
 /* called to display each frame */
 static void video_refresh_timer(void *opaque)
 {
@@ -224,19 +260,45 @@ static void video_refresh_timer(void *opaque)
     QEmacsState *qs = &qe_state;
     VideoState *is;
     VideoPicture *vp;
+    int now, delay, alloc_request;
 
     if (!(is = video_get_state(s, 1)))
         return;
 
+    is->video_timer = NULL;
+    pthread_mutex_lock(&is->pictq_mutex);
+    alloc_request = is->pictq_alloc_request;
+    is->pictq_alloc_request = 0;
+    pthread_mutex_unlock(&is->pictq_mutex);
+    if (alloc_request) {
+        /* the decoder thread waits for the picture pool */
+        alloc_pictures(is);
+    }
+
     if (is->video_st) {
-        if (is->pictq_size == 0) {
+        if (pictq_count(is) == 0) {
             /* if no picture, need to wait */
             is->video_timer = qe_add_timer(40, s, video_refresh_timer);
         } else {
-            vp = &is->pictq[is->pictq_rindex];
+            now = get_clock_ms();
+            if (now - is->frame_timer > 100) {
+                /* too far behind (start, pause or stall): resync */
+                is->frame_timer = now;
+            }
+            /* drop pictures whose display time has already passed
+               as long as a later one is available */
+            vp = pictq_peek(is);
+            while (pictq_count(is) > 1 && now - is->frame_timer >= vp->delay) {
+                is->frame_timer += vp->delay;
+                is->frames_dropped++;
+                pictq_next(is);
+                vp = pictq_peek(is);
+            }
 
             /* launch timer for next picture */
-            is->video_timer = qe_add_timer(vp->delay, s, video_refresh_timer);
+            is->frame_timer += vp->delay;
+            delay = max_int(0, is->frame_timer - now);
+            is->video_timer = qe_add_timer(delay, s, video_refresh_timer);
 
             /* invalidate window */
             edit_invalidate(s, 0);
@@ -246,14 +308,8 @@ static void video_refresh_timer(void *opaque)
             edit_display(qs);
             dpy_flush(qs->screen);
 
-            /* update queue size and signal for next picture */
-            if (++is->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE)
-                is->pictq_rindex = 0;
-
-            pthread_mutex_lock(&is->pictq_mutex);
-            is->pictq_size--;
-            pthread_cond_signal(&is->pictq_cond);
-            pthread_mutex_unlock(&is->pictq_mutex);
+            /* free the slot for the next picture */
+            pictq_next(is);
         }
     } else if (is->audio_st) {
         /* draw the next audio frame */
@@ -284,7 +340,7 @@ static void video_image_display(EditState *s)
     if (!(is = video_get_state(s, 1)))
         return;
 
-    vp = &is->pictq[is->pictq_rindex];
+    vp = pictq_peek(is);
     if (vp->bmp) {
         /* XXX: use variable in the frame */
         aspect_ratio = is->video_st->codec.aspect_ratio;
@@ -366,18 +422,14 @@ static void video_display(EditState *s)
     }
 }
 
-/* allocate a picture (needs to do that in main thread to avoid
-   potential locking problems */
-static void alloc_picture(void *opaque)
+/* allocate the picture pool for the current video size (needs to
+   do that in main thread to avoid potential locking problems) */
+static void alloc_pictures(void *opaque)
 {
     VideoState *is = opaque;
     EditState *s = is->edit_state;
     VideoPicture *vp;
-    int is_yuv;
-
-    vp = &is->pictq[is->pictq_windex];
-
-    bmp_free(s->screen, &vp->bmp);
+    int i, is_yuv;
 
     /* XXX: use generic function */
     switch (is->video_st->codec.pix_fmt) {
@@ -394,31 +446,35 @@ static void alloc_picture(void *opaque)
         break;
     }
 
- retry:
-    if (is_yuv) {
-        vp->bmp = bmp_alloc(s->screen,
-                            is->video_st->codec.width,
-                            is->video_st->codec.height,
-                            QEBITMAP_FLAG_VIDEO);
-        /* currently we cannot resize, so we fallback to standard if
-           no exact size */
-        if (vp->bmp->width != is->video_st->codec.width ||
-            vp->bmp->height != is->video_st->codec.height) {
-            is_yuv = 0;
-            bmp_free(s->screen, &vp->bmp);
-            goto retry;
+    for (i = 0; i < VIDEO_PICTURE_QUEUE_SIZE; i++) {
+        vp = &is->pictq[i];
+        bmp_free(s->screen, &vp->bmp);
+        if (is_yuv) {
+            vp->bmp = bmp_alloc(s->screen,
+                                is->video_st->codec.width,
+                                is->video_st->codec.height,
+                                QEBITMAP_FLAG_VIDEO);
+            /* currently we cannot resize, so we fallback to standard if
+               no exact size */
+            if (vp->bmp->width != is->video_st->codec.width ||
+                vp->bmp->height != is->video_st->codec.height) {
+                is_yuv = 0;
+                bmp_free(s->screen, &vp->bmp);
+            }
         }
-    } else {
-        vp->bmp = bmp_alloc(s->screen,
-                            is->video_st->codec.width,
-                            is->video_st->codec.height,
-                            0);
+        if (!vp->bmp) {
+            vp->bmp = bmp_alloc(s->screen,
+                                is->video_st->codec.width,
+                                is->video_st->codec.height,
+                                0);
+        }
+        vp->width = is->video_st->codec.width;
+        vp->height = is->video_st->codec.height;
     }
-    vp->width = is->video_st->codec.width;
-    vp->height = is->video_st->codec.height;
-
     pthread_mutex_lock(&is->pictq_mutex);
-    vp->allocated = 1;
+    is->pictq_width = is->video_st->codec.width;
+    is->pictq_height = is->video_st->codec.height;
+    is->pictq_allocated = 1;
     pthread_cond_signal(&is->pictq_cond);
     pthread_mutex_unlock(&is->pictq_mutex);
 }
@@ -437,34 +493,36 @@ static int output_picture(VideoState *is, AVPicture *src_pict)
            !is->videoq.abort_request) {
         pthread_cond_wait(&is->pictq_cond, &is->pictq_mutex);
     }
-    pthread_mutex_unlock(&is->pictq_mutex);
-
-    if (is->videoq.abort_request)
-        return -1;
-
-    vp = &is->pictq[is->pictq_windex];
 
-    /* alloc or resize hardware picture buffer */
-    if (!vp->bmp ||
-        vp->width != is->video_st->codec.width ||
-        vp->height != is->video_st->codec.height) {
+    /* alloc or resize the picture pool: the pictures are reused
+       for all frames of the same size */
+    if (!is->videoq.abort_request &&
+        (!is->pictq_allocated ||
+         is->pictq_width != is->video_st->codec.width ||
+         is->pictq_height != is->video_st->codec.height)) {
 
-        vp->allocated = 0;
+        /* wait until all pictures have been displayed */
+        while (is->pictq_size > 0 && !is->videoq.abort_request) {
+            pthread_cond_wait(&is->pictq_cond, &is->pictq_mutex);
+        }
+        is->pictq_allocated = 0;
 
         /* the allocation must be done in the main thread to avoid
-           locking problems */
-        qe_add_timer(0, is, alloc_picture);
+           locking problems: it is requested from the refresh timer,
+           timers cannot be added from this thread */
+        is->pictq_alloc_request = 1;
 
-        /* wait until the picture is allocated */
-        pthread_mutex_lock(&is->pictq_mutex);
-        while (!vp->allocated && !is->videoq.abort_request) {
+        /* wait until the pictures are allocated */
+        while (!is->pictq_allocated && !is->videoq.abort_request) {
             pthread_cond_wait(&is->pictq_cond, &is->pictq_mutex);
         }
-        pthread_mutex_unlock(&is->pictq_mutex);
-
-        if (is->videoq.abort_request)
-            return -1;
     }
+    pthread_mutex_unlock(&is->pictq_mutex);
+
+    if (is->videoq.abort_request)
+        return -1;
+
+    vp = &is->pictq[is->pictq_windex];
 
     if (vp->bmp) {
         /* get a pointer on the bitmap */
@@ -944,6 +1002,15 @@ static void video_mode_line(EditState *s, buf_t *out)
                    name, get_stream_id(is->ic, is->audio_st, buf1, sizeof(buf1)),
                    dec->sample_rate, dec->channels);
     }
+    /* queue depths: video packets, audio packets and decoded pictures */
+    if (is->video_st || is->audio_st) {
+        buf_printf(out, "--q:%d/%d/%d",
+                   is->video_st ? is->videoq.nb_packets : 0,
+                   is->audio_st ? is->audioq.nb_packets : 0,
+                   pictq_count(is));
+    }
+    if (is->frames_dropped)
+        buf_printf(out, "--dropped:%d", is->frames_dropped);
 }
 
 static void av_cycle_stream(EditState *s, int codec_type)
@@ -23,6 +23,8 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
+
 #include "qe.h"
 #include "unicode_join.h"
 #include "variables.h"
@@ -30,6 +32,9 @@
 #ifdef CONFIG_DLL
 #include <dlfcn.h>
 #endif
+#ifdef CONFIG_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 /* each history list */
 typedef struct HistoryEntry {
@@ -84,6 +89,237 @@ static int generic_mode_probe(ModeDef *mode, ModeProbeData *p)
     return 1;
 }
 
+#ifndef CONFIG_TINY
+/* Modes without a specific probe function only match on the file name
+ * extension or the `#!` interpreter.  They are indexed by these keys
+ * so probe_mode does not call them all: a generic mode that is not
+ * found in the index scores 1 and cannot be selected anyway.  The
+ * index is built upon the first probe and discarded when modes are
+ * registered.
+ */
+#define MODE_INDEX_SIZE        256  /* number of hash chains, power of 2 */
+#define MODE_INDEX_CANDIDATES  32
+
+enum {
+    MIE_EXTENSION,      /* last component of an extension */
+    MIE_SHELL,          /* interpreter name */
+};
+
+typedef struct ModeIndexEntry {
+    struct ModeIndexEntry *next;
+    ModeDef *mode;
+    int kind;
+    int len;
+    char key[1];
+} ModeIndexEntry;
+
+static ModeIndexEntry *mode_index[MODE_INDEX_SIZE];
+static int mode_index_built;
+
+/* keys are matched ignoring case: candidates are a superset of the
+   modes whose probe will succeed. */
+static unsigned int mode_index_hash(int kind, const char *key, int len) {
+    unsigned int h = kind;
+
+    while (len-- > 0)
+        h = h * 31 + qe_tolower((u8)*key++);
+    return (h ^ (h >> 8)) & (MODE_INDEX_SIZE - 1);
+}
+
+static void mode_index_add(int kind, const char *key, int len, ModeDef *m) {
+    ModeIndexEntry *ep, **pp;
+
+    pp = &mode_index[mode_index_hash(kind, key, len)];
+    for (ep = *pp; ep; ep = ep->next) {
+        if (ep->mode == m && ep->kind == kind && ep->len == len
+        &&  !qe_memicmp(ep->key, key, len))
+            return;
+    }
+    ep = qe_mallocz_hack(ModeIndexEntry, len);
+    if (ep) {
+        ep->mode = m;
+        ep->kind = kind;
+        ep->len = len;
+        memcpy(ep->key, key, len);
+        ep->next = *pp;
+        *pp = ep;
+    }
+}
+
+static void mode_index_add_list(int kind, const char *list, ModeDef *m) {
+    const char *p, *key;
+
+    if (!list)
+        return;
+    for (;;) {
+        /* index the last component of multiple extensions */
+        for (p = key = list; *p && *p != '|'; p++) {
+            if (kind == MIE_EXTENSION && *p == '.')
+                key = p + 1;
+        }
+        mode_index_add(kind, key, p - key, m);
+        if (!*p)
+            break;
+        list = p + 1;
+    }
+}
+
+static void mode_index_free(void) {
+    int i;
+
+    for (i = 0; i < MODE_INDEX_SIZE; i++) {
+        while (mode_index[i]) {
+            ModeIndexEntry *ep = mode_index[i];
+            mode_index[i] = ep->next;
+            qe_free(&ep);
+        }
+    }
+    mode_index_built = 0;
+}
+
+static void mode_index_build(void) {
+    QEmacsState *qs = &qe_state;
+    ModeDef *m;
+
+    for (m = qs->first_mode; m; m = m->next) {
+        if (m->mode_probe == generic_mode_probe) {
+            mode_index_add_list(MIE_EXTENSION, m->extensions, m);
+            mode_index_add_list(MIE_SHELL, m->shell_handlers, m);
+        }
+    }
+    mode_index_built = 1;
+}
+
+/* Add the modes indexed for key to the candidate array.
+ * Return the new number of candidates or -1 if there are too many.
+ */
+static int mode_index_find(ModeDef **cands, int nb, int kind,
+                           const char *key, int len)
+{
+    ModeIndexEntry *ep;
+    int i;
+
+    for (ep = mode_index[mode_index_hash(kind, key, len)]; ep; ep = ep->next) {
+        if (ep->kind == kind && ep->len == len
+        &&  !qe_memicmp(ep->key, key, len)) {
+            for (i = 0; i < nb && cands[i] != ep->mode; i++)
+                continue;
+            if (i == nb) {
+                if (nb >= MODE_INDEX_CANDIDATES)
+                    return -1;
+                cands[nb++] = ep->mode;
+            }
+        }
+    }
+    return nb;
+}
+
+/* Collect the generic modes that may match the probe data, parsing the
+ * file name and the `#!` line as match_extension and
+ * match_shell_handler do.  Return -1 if all modes must be probed.
+ */
+static int mode_index_candidates(ModeDef **cands, const ModeProbeData *pd) {
+    const char *base, *p;
+    int nb = 0;
+
+    if (!mode_index_built)
+        mode_index_build();
+
+    base = get_basename(pd->filename);
+    while (*base == '.')
+        base++;
+    p = strrchr(base, '.');
+    if (p)
+        nb = mode_index_find(cands, nb, MIE_EXTENSION, p + 1, strlen(p + 1));
+
+    p = cs8(pd->buf);
+    if (nb >= 0 && p[0] == '#' && p[1] == '!') {
+        for (p += 2; qe_isblank(*p); p++)
+            continue;
+        for (base = p; *p && !qe_isspace(*p); p++) {
+            if (*p == '/')
+                base = p + 1;
+        }
+        nb = mode_index_find(cands, nb, MIE_SHELL, base, p - base);
+        if (nb >= 0 && p - base == 3 && !memcmp(base, "env", 3)) {
+            while (*p && *p != '\n') {
+                for (; qe_isblank(*p); p++)
+                    continue;
+                for (base = p; *p && !qe_isspace(*p); p++)
+                    continue;
+                if (*base != '-') {
+                    nb = mode_index_find(cands, nb, MIE_SHELL, base, p - base);
+                    break;
+                }
+            }
+        }
+    }
+    return nb;
+}
+
+/* Mode selection for regular files is cached by file name, size and
+ * modification time to speed up reloading files and reopening sets
+ * of files.  The cache is direct mapped and flushed when modes are
+ * registered.
+ */
+#define PROBE_CACHE_SIZE  128   /* power of 2 */
+
+typedef struct ProbeCacheEntry {
+    char *filename;
+    time_t mtime;
+    off_t size;
+    ModeDef *mode;
+    QECharset *charset;
+    EOLType eol_type;
+} ProbeCacheEntry;
+
+static ProbeCacheEntry probe_cache[PROBE_CACHE_SIZE];
+
+static ProbeCacheEntry *probe_cache_slot(const char *filename) {
+    unsigned int h = 0;
+
+    while (*filename)
+        h = h * 31 + (u8)*filename++;
+    return &probe_cache[(h ^ (h >> 10)) & (PROBE_CACHE_SIZE - 1)];
+}
+
+static ProbeCacheEntry *probe_cache_find(const char *filename,
+                                         const struct stat *st)
+{
+    ProbeCacheEntry *pc = probe_cache_slot(filename);
+
+    if (pc->filename && pc->mtime == st->st_mtime && pc->size == st->st_size
+    &&  strequal(pc->filename, filename)) {
+        return pc;
+    }
+    return NULL;
+}
+
+static void probe_cache_store(const char *filename, const struct stat *st,
+                              ModeDef *m, QECharset *charset, EOLType eol_type)
+{
+    ProbeCacheEntry *pc = probe_cache_slot(filename);
+
+    if (!pc->filename || !strequal(pc->filename, filename)) {
+        qe_free(&pc->filename);
+        pc->filename = qe_strdup(filename);
+    }
+    pc->mtime = st->st_mtime;
+    pc->size = st->st_size;
+    pc->mode = m;
+    pc->charset = charset;
+    pc->eol_type = eol_type;
+}
+
+static void probe_cache_flush(void) {
+    int i;
+
+    for (i = 0; i < PROBE_CACHE_SIZE; i++) {
+        qe_free(&probe_cache[i].filename);
+    }
+}
+#endif
+
 ModeDef *qe_find_mode(const char *name, int flags)
 {
     QEmacsState *qs = &qe_state;
@@ -171,6 +407,11 @@ void qe_register_mode(ModeDef *m, int flags)
     /* if no syntax probing function, use extension matcher */
     if (!m->mode_probe && m->extensions)
         m->mode_probe = generic_mode_probe;
+#ifndef CONFIG_TINY
+    /* mode selection may change */
+    mode_index_free();
+    probe_cache_flush();
+#endif
     if (!m->display)
         m->display = generic_text_display;
     if (!m->data_type)
@@ -1767,7 +2008,18 @@ void text_write_char(EditState *s, int key)
                 break;
             } else
             if (ret == INPUTMETHOD_MORECHARS) {
-                /* more chars expected: do nothing and insert current key */
+                /* more chars expected: insert current key and show
+                   the possible completions */
+                if (m->input_candidates) {
+                    char cbuf[256];
+                    buf_t outbuf, *out;
+
+                    out = buf_init(&outbuf, cbuf, sizeof(cbuf));
+                    if (m->input_candidates(out, 10, m->data, s->compose_buf,
+                                            s->compose_len) > 0) {
+                        put_status(s, "%s", cbuf);
+                    }
+                }
                 break;
             } else {
                 /* match: delete matched chars */
@@ -2017,6 +2269,11 @@ void do_keyboard_quit(EditState *s)
         return;
     }
 #endif
+    if (s->b->flags & BF_LOADING) {
+        eb_stop_loading(s->b, -1);
+        put_status(s, "Loading interrupted, buffer is read-only");
+        return;
+    }
     /* deactivate region hilite */
     s->region_style = 0;
     /* deactivate search hilite */
@@ -2272,17 +2529,25 @@ void do_exchange_point_and_mark(EditState *s)
 static int reload_buffer(EditState *s, EditBuffer *b)
 {
     FILE *f, *f1 = NULL;
-    int ret, saved;
+    int ret, saved, deferred;
 
     /* if no file associated, cannot do anything */
     if (b->filename[0] == '\0')
         return 0;
 
+    /* loading is attempted only once for buffers restored from a session,
+     * the flag is cleared after loading: the session positions require
+     * the file to be loaded synchronously.
+     */
+    deferred = b->flags & BF_DEFERRED;
+
     if (!f1 && b->data_type == &raw_data_type) {
         struct stat st;
 
-        if (stat(b->filename, &st) < 0 || !S_ISREG(st.st_mode))
+        if (stat(b->filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+            b->flags &= ~BF_DEFERRED;
             return -1;
+        }
 
         f = fopen(b->filename, "r");
         if (!f) {
@@ -2303,6 +2568,7 @@ static int reload_buffer(EditState *s, EditBuffer *b)
     else
         ret = -1;
 
+    b->flags &= ~BF_DEFERRED;
     b->modified = 0;
     b->save_log = saved;
 
@@ -2311,6 +2577,7 @@ static int reload_buffer(EditState *s, EditBuffer *b)
 
     if (ret < 0) {
       fail:
+        b->flags &= ~BF_DEFERRED;
         if (!f1) {
             put_status(s, "Could not load '%s'", b->filename);
         } else {
@@ -2318,10 +2585,29 @@ static int reload_buffer(EditState *s, EditBuffer *b)
         }
         return -1;
     } else {
+        if (deferred) {
+            /* restore the session positions, contents may have changed */
+            if (access(b->filename, W_OK))
+                b->flags |= BF_READONLY;
+            b->mark = clamp_offset(b->deferred_mark, 0, b->total_size);
+            if (s && s->b == b)
+                s->offset = clamp_offset(b->deferred_offset, 0, b->total_size);
+        }
         return 0;
     }
 }
 
+/* Load the contents of a buffer restored from a session before they
+ * are accessed without a window.  Buffers with a specific data type
+ * are loaded when a mode is selected.
+ */
+int eb_load_deferred(EditBuffer *b)
+{
+    if (!(b->flags & BF_DEFERRED) || b->data_type != &raw_data_type)
+        return 0;
+    return reload_buffer(NULL, b);
+}
+
 QEModeData *qe_create_buffer_mode_data(EditBuffer *b, ModeDef *m)
 {
     QEModeData *md = NULL;
@@ -2652,10 +2938,10 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, len, i;
+    StyleMap *styles;
+    int i;
     EditBufferCallbackList *cb;
     int pos[32];
-    char buf[MAX_CHAR_BYTES];
 
     eol_type = s->b->eol_type;
     charset = read_charset(s, charset_str, &eol_type);
@@ -2677,26 +2963,20 @@ void do_convert_buffer_file_coding_system(EditState *s,
         }
     }
 
-    // XXX: should use eb_insert_buffer_convert()
-    /* slow, but simple iterative method */
-    for (offset = 0; offset < b->total_size;) {
-        QETermStyle style = eb_get_style(b, offset);
-        char32_t c = eb_nextc(b, offset, &offset);
-        b1->cur_style = style;
-        len = eb_encode_char32(b1, buf, c);
-        eb_insert(b1, b1->total_size, buf, len);
-    }
+    /* transcode the contents and styles */
+    eb_insert_buffer_convert(b1, 0, b, 0, b->total_size);
 
     /* replace current buffer with conversion */
     /* quick hack to transfer styles from tmp buffer to b */
-    eb_free(&b->b_styles);
+    styles = b->b_styles;
+    b->b_styles = NULL;
     eb_delete(b, 0, b->total_size);
     eb_set_charset(b, charset, eol_type);
     // XXX: this does not transfer styles
     //      should use eb_insert_buffer_convert()
     eb_insert_buffer(b, 0, b1, 0, b1->total_size);
     b->b_styles = b1->b_styles;
-    b1->b_styles = NULL;
+    b1->b_styles = styles;
 
     /* restore positions */
     cb = b->first_callback;
@@ -2750,6 +3030,368 @@ static void do_linum_mode(EditState *s, int argval) {
     update_setting(s, "linum-mode", &s->b->linum_mode, argval);
 }
 
+#ifndef CONFIG_TINY
+/* Auto revert: when global-auto-revert-mode is set, unmodified buffers
+ * visiting files are updated when the files change on disk.  Files are
+ * watched with inotify and checked shortly after they are modified,
+ * files that cannot be watched are polled from the timer.
+ * The differing range is located by comparing the file and the buffer
+ * block by block from both ends and only this range is replaced, so
+ * positions and colorizer states outside of it are preserved.  If the
+ * whole buffer is found at the start of the file, only the appended
+ * data is inserted: windows at the end of the buffer follow it.
+ * Buffers mapped from the file cannot be compared and are replaced
+ * completely, discarding their undo records.
+ * Modification times are only precise to the second: a file rewritten
+ * with the same size within the same second is not detected.
+ */
+#define AUTO_REVERT_POLL_MS   2000  /* interval for polling and watch updates */
+#define AUTO_REVERT_DELAY_MS  50    /* delay before checking a modified file */
+#define AUTO_REVERT_BLOCK     4096
+
+static QETimer *auto_revert_timer;
+static int auto_revert_last_poll;
+static int auto_revert_notified;    /* check scheduled after notification */
+#ifdef CONFIG_INOTIFY
+static int auto_revert_fd = -1;
+static int *auto_revert_wds;    /* active watch descriptors */
+static int auto_revert_nb_wds, auto_revert_wds_size;
+#endif
+
+static void auto_revert_timer_cb(void *opaque);
+
+static void auto_revert_schedule(int delay) {
+    qe_kill_timer(&auto_revert_timer);
+    auto_revert_timer = qe_add_timer(delay, NULL, auto_revert_timer_cb);
+}
+
+static int auto_revert_eligible(EditBuffer *b) {
+    return *b->filename && b->mtime && S_ISREG(b->st_mode)
+        && b->data_type == &raw_data_type
+        && !(b->flags & (BF_SYSTEM | BF_DEFERRED | BF_LOADING | BF_SAVING |
+                         BF_DIRED | BF_SHELL));
+}
+
+#ifdef CONFIG_INOTIFY
+static void auto_revert_forget(int wd) {
+    QEmacsState *qs = &qe_state;
+    EditBuffer *b;
+    int i;
+
+    for (i = 0; i < auto_revert_nb_wds; i++) {
+        if (auto_revert_wds[i] == wd) {
+            auto_revert_wds[i] = auto_revert_wds[--auto_revert_nb_wds];
+            break;
+        }
+    }
+    for (b = qs->first_buffer; b; b = b->next) {
+        if (b->watch_wd == wd)
+            b->watch_wd = 0;
+    }
+}
+
+static void auto_revert_inotify_cb(void *opaque) {
+    QEmacsState *qs = &qe_state;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    EditBuffer *b;
+    ssize_t len;
+    char *p;
+
+    for (;;) {
+        len = read(auto_revert_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(void *)p;
+            for (b = qs->first_buffer; b; b = b->next) {
+                /* events were lost: check all watched files */
+                if (b->watch_wd == ev->wd
+                ||  (b->watch_wd && (ev->mask & IN_Q_OVERFLOW)))
+                    b->watch_pending = 1;
+            }
+            if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                /* the path may now refer to another file */
+                inotify_rm_watch(auto_revert_fd, ev->wd);
+                auto_revert_forget(ev->wd);
+            } else
+            if (ev->mask & IN_IGNORED) {
+                auto_revert_forget(ev->wd);
+            }
+        }
+    }
+    /* do not postpone a pending check if the file keeps changing */
+    if (!auto_revert_notified) {
+        auto_revert_notified = 1;
+        auto_revert_schedule(AUTO_REVERT_DELAY_MS);
+    }
+}
+#endif
+
+static void auto_revert_watch(EditBuffer *b) {
+#ifdef CONFIG_INOTIFY
+    int i, wd;
+
+    if (b->watch_wd)
+        return;
+    if (auto_revert_fd < 0) {
+        auto_revert_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (auto_revert_fd >= 256) {
+            /* cannot register a read handler */
+            close(auto_revert_fd);
+            auto_revert_fd = -1;
+        }
+        if (auto_revert_fd < 0) {
+            /* do not try again, poll files instead */
+            auto_revert_fd = -2;
+            return;
+        }
+        set_read_handler(auto_revert_fd, auto_revert_inotify_cb, NULL);
+    }
+    if (auto_revert_fd < 0)
+        return;
+    wd = inotify_add_watch(auto_revert_fd, b->filename,
+                           IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                           IN_MOVE_SELF | IN_DELETE_SELF);
+    if (wd <= 0)
+        return;
+    b->watch_wd = wd;
+    /* several buffers may share a watch */
+    for (i = 0; i < auto_revert_nb_wds && auto_revert_wds[i] != wd; i++)
+        continue;
+    if (i == auto_revert_nb_wds) {
+        if (auto_revert_nb_wds >= auto_revert_wds_size) {
+            int size = auto_revert_wds_size + 64;
+            if (!qe_realloc(&auto_revert_wds, size * sizeof(*auto_revert_wds))) {
+                inotify_rm_watch(auto_revert_fd, wd);
+                b->watch_wd = 0;
+                return;
+            }
+            auto_revert_wds_size = size;
+        }
+        auto_revert_wds[auto_revert_nb_wds++] = wd;
+    }
+#endif
+}
+
+/* remove the watches of files no longer visited by an eligible buffer */
+static void auto_revert_sweep(int all) {
+#ifdef CONFIG_INOTIFY
+    QEmacsState *qs = &qe_state;
+    EditBuffer *b;
+    int i, wd;
+
+    for (i = 0; i < auto_revert_nb_wds;) {
+        wd = auto_revert_wds[i];
+        for (b = qs->first_buffer; b; b = b->next) {
+            if (b->watch_wd == wd && !all && auto_revert_eligible(b))
+                break;
+        }
+        if (b) {
+            i++;
+        } else {
+            inotify_rm_watch(auto_revert_fd, wd);
+            auto_revert_forget(wd);
+        }
+    }
+#endif
+}
+
+/* Compare the buffer and file contents at the given offsets, return
+ * the length of the common prefix if backward is 0, of the common
+ * suffix otherwise, or -1 upon read error.
+ */
+static int auto_revert_compare(EditBuffer *b, int offset, FILE *f,
+                               int file_offset, int len, int backward)
+{
+    u8 buf1[AUTO_REVERT_BLOCK], buf2[AUTO_REVERT_BLOCK];
+    int i;
+
+    if (fseek(f, file_offset, SEEK_SET)
+    ||  fread(buf2, 1, len, f) != (size_t)len)
+        return -1;
+    eb_read(b, offset, buf1, len);
+    if (backward) {
+        for (i = 0; i < len && buf1[len - 1 - i] == buf2[len - 1 - i]; i++)
+            continue;
+    } else {
+        for (i = 0; i < len && buf1[i] == buf2[i]; i++)
+            continue;
+    }
+    return i;
+}
+
+/* Update the contents of buffer b from file f of size file_size */
+static int auto_revert_update(EditBuffer *b, FILE *f, int file_size) {
+    QEmacsState *qs = &qe_state;
+    u8 buf[AUTO_REVERT_BLOCK];
+    EditState *e;
+    int size = b->total_size;
+    int start, end, len, n, pos;
+
+    if (b->map_address) {
+        /* the file mapping is not reliable, replace the whole contents
+           without logging it: the undo records no longer apply */
+        eb_free_log_buffer(b);
+        b->save_log = 0;
+        start = end = 0;
+    } else {
+        /* find the common prefix and suffix, block by block */
+        n = min_int(size, file_size);
+        for (start = 0; start < n; start += len) {
+            len = min_int(n - start, AUTO_REVERT_BLOCK);
+            pos = auto_revert_compare(b, start, f, start, len, 0);
+            if (pos < 0)
+                return -1;
+            if (pos < len) {
+                start += pos;
+                break;
+            }
+        }
+        if (start == size) {
+            /* data was appended to the file, not recorded in the undo log */
+            b->save_log = 0;
+        }
+        for (end = 0; end < n - start; end += len) {
+            len = min_int(n - start - end, AUTO_REVERT_BLOCK);
+            pos = auto_revert_compare(b, size - end - len,
+                                      f, file_size - end - len, len, 1);
+            if (pos < 0)
+                return -1;
+            if (pos < len) {
+                end += pos;
+                break;
+            }
+        }
+    }
+
+    if (start < size - end)
+        eb_delete(b, start, size - end - start);
+#ifdef CONFIG_MMAP
+    if (b->map_address && start < size)
+        eb_munmap_buffer(b);
+#endif
+    if (fseek(f, start, SEEK_SET))
+        return -1;
+    for (pos = start, n = file_size - end - start; n > 0; n -= len) {
+        len = fread(buf, 1, min_int(n, AUTO_REVERT_BLOCK), f);
+        if (len <= 0)
+            break;
+        pos += eb_insert(b, pos, buf, len);
+    }
+    if (start == size) {
+        /* windows at the end of the buffer follow the appended data */
+        for (e = qs->first_window; e; e = e->next_window) {
+            if (e->b == b && e->offset == size)
+                e->offset = b->total_size;
+        }
+    }
+    return start < size;
+}
+
+/* Check the file of buffer b for changes, return 1 if display is needed */
+static int auto_revert_check(EditBuffer *b) {
+    QEmacsState *qs = &qe_state;
+    struct stat st;
+    FILE *f;
+    int saved_log, readonly, ret;
+
+    auto_revert_watch(b);
+    if (stat(b->filename, &st) < 0 || !S_ISREG(st.st_mode))
+        return 0;
+    if (b->modified) {
+        /* never overwrite changes, warn once */
+        if (st.st_mtime != b->mtime) {
+            b->mtime = st.st_mtime;
+            put_status(NULL, "File %s changed on disk", b->filename);
+            return 1;
+        }
+        return 0;
+    }
+    if (st.st_mtime == b->mtime && st.st_size == b->total_size)
+        return 0;
+    if (st.st_size > qs->max_load_size)
+        return 0;
+    f = fopen(b->filename, "r");
+    if (!f)
+        return 0;
+    /* the buffer is updated even if read only and stays unmodified */
+    saved_log = b->save_log;
+    readonly = b->flags & BF_READONLY;
+    b->flags &= ~BF_READONLY;
+    ret = auto_revert_update(b, f, st.st_size);
+    b->save_log = saved_log;
+    b->flags |= readonly;
+    b->modified = 0;
+    fclose(f);
+    b->mtime = st.st_mtime;
+    if (ret > 0)
+        put_status(NULL, "Reverted buffer %s", b->name);
+    return 1;
+}
+
+static void auto_revert_timer_cb(void *opaque) {
+    QEmacsState *qs = &qe_state;
+    EditBuffer *b;
+    int now = get_clock_ms();
+    int poll = (now - auto_revert_last_poll >= AUTO_REVERT_POLL_MS);
+    int updated = 0;
+
+    auto_revert_timer = NULL;
+    auto_revert_notified = 0;
+    if (poll)
+        auto_revert_last_poll = now;
+    if (!qs->global_auto_revert_mode) {
+        /* remove the watches and stop until the mode is enabled again */
+        auto_revert_sweep(1);
+        return;
+    }
+    for (b = qs->first_buffer; b; b = b->next) {
+        if (!auto_revert_eligible(b))
+            continue;
+        /* watched files are checked upon notification only */
+        if (b->watch_pending || (poll && !b->watch_wd)) {
+            b->watch_pending = 0;
+            updated |= auto_revert_check(b);
+        }
+    }
+    if (poll)
+        auto_revert_sweep(0);
+    if (updated) {
+        edit_display(qs);
+        dpy_flush(qs->screen);
+    }
+    auto_revert_schedule(AUTO_REVERT_POLL_MS);
+}
+
+static void auto_revert_close(void) {
+    qe_kill_timer(&auto_revert_timer);
+#ifdef CONFIG_INOTIFY
+    if (auto_revert_fd >= 0) {
+        set_read_handler(auto_revert_fd, NULL, NULL);
+        close(auto_revert_fd);
+    }
+    auto_revert_fd = -1;
+    qe_free(&auto_revert_wds);
+    auto_revert_nb_wds = auto_revert_wds_size = 0;
+#endif
+}
+
+/* Called when global-auto-revert-mode is set: the timer only runs
+   while the mode is enabled */
+void qe_auto_revert_update(void) {
+    /* watch or poll the files right away */
+    auto_revert_last_poll = get_clock_ms() - AUTO_REVERT_POLL_MS;
+    auto_revert_schedule(0);
+}
+
+static void do_global_auto_revert_mode(EditState *s, int argval) {
+    update_setting(s, "global-auto-revert-mode",
+                   &s->qe_state->global_auto_revert_mode, argval);
+    qe_auto_revert_update();
+}
+#endif
+
 void do_toggle_truncate_lines(EditState *s)
 {
     if (s->wrap == WRAP_TERM)
@@ -3051,6 +3693,11 @@ void basic_mode_line(EditState *s, buf_t *out, int c1)
     buf_printf(out, "%c%c:%c%c  %-20s  (%s)",
                c1, state, s->b->flags & BF_READONLY ? '%' : mod,
                mod, s->b->name, mode_name);
+    if (s->b->flags & BF_LOADING) {
+        int percent = eb_get_load_progress(s->b);
+        if (percent >= 0)
+            buf_printf(out, "--Loading %d%%", percent);
+    }
 }
 
 void text_mode_line(EditState *s, buf_t *out)
@@ -3674,6 +4321,20 @@ static void flush_line(DisplayState *ds,
         }
     }
 
+    /* only compute the line signature for scroll detection */
+    if (ds->do_disp == DISP_SHADOW
+    &&  ds->y + line_height >= 0
+    &&  ds->y < e->height) {
+        if (ds->line_num >= 0 && ds->line_num < ds->shadow_nb_lines) {
+            QELineShadow *ls = &ds->line_shadow[ds->line_num];
+
+            ls->crc = compute_crc(fragments, sizeof(*fragments) * nb_fragments, 0);
+            ls->crc = compute_crc(ds->line_chars, sizeof(*ds->line_chars) * ds->line_index, ls->crc);
+            ls->y = ds->y;
+            ls->x = ds->x_line;
+            ls->height = line_height;
+        }
+    } else
     /* draw everything if line is visible in window */
     if (ds->do_disp == DISP_PRINT
     &&  ds->y + line_height >= 0
@@ -4331,12 +4992,18 @@ static int get_staticly_colorized_line(EditState *s, char32_t *buf, int buf_size
 {
     EditBuffer *b = s->b;
     char32_t *buf_ptr, *buf_end;
+    QETermStyle style = 0;
+    int style_end = offset;
 
     buf_ptr = buf;
     buf_end = buf + buf_size - 1;
     for (;;) {
-        QETermStyle style = eb_get_style(b, offset);
-        char32_t c = eb_nextc(b, offset, &offset);
+        char32_t c;
+        if (offset >= style_end) {
+            /* fetch the styles one run at a time */
+            style_end = eb_get_style_run(b, offset, &style);
+        }
+        c = eb_nextc(b, offset, &offset);
         if (c == '\n') {
             /* XXX: set style for end of line? */
             break;
@@ -4475,9 +5142,12 @@ static int syntax_get_colorized_line(EditState *s,
     /* Combine with buffer styles on restricted range */
     if (s->b->b_styles) {
         int start = bom + cctx.combine_start, stop = bom + cctx.combine_stop;
-        offset = cctx.offset;
+        int style_end;
+        QETermStyle style = 0;
+        offset = style_end = cctx.offset;
         for (i = bom; i < stop; i++) {
-            QETermStyle style = eb_get_style(b, offset);
+            if (offset >= style_end)
+                style_end = eb_get_style_run(b, offset, &style);
             if (style && i >= start) {
                 sbuf[i] = style;
             }
@@ -4748,14 +5418,88 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     return offset;
 }
 
-/* Generic display algorithm with automatic fit */
-static void generic_text_display(EditState *s)
+/* Detect a vertical scroll of the window contents since the last
+ * display: compute the line signatures of the new layout, find the
+ * shift that matches the most lines of the line shadow and move the
+ * window contents with the display scroll operation.  The line shadow
+ * is moved along so only the remaining lines get redrawn.
+ */
+static void text_display_scroll(EditState *s)
 {
     CursorContext m1, *m = &m1;
     DisplayState ds1, *ds = &ds1;
-    int x1, xc, yc, offset, bottom = -1;
+    QELineShadow *old = s->line_shadow;
+    QELineShadow *cur;
+    int n = s->shadow_nb_lines;
+    int i, j, k, dy, count, best_k, best_dy, best_count, y;
 
-    if (s->offset == 0) {
+    cur = qe_malloc_array(QELineShadow, n);
+    if (!cur)
+        return;
+
+    /* put an impossible value for lines not displayed */
+    memset(cur, 0xff, n * sizeof(*cur));
+    memset(m, 0, sizeof(*m));
+    m->offsetc = s->offset;
+    m->xc = m->yc = NO_CURSOR;
+    display_init(ds, s, DISP_SHADOW, cursor_func, m);
+    ds->line_shadow = cur;
+    ds->shadow_nb_lines = n;
+    display1(ds);
+    display_close(ds);
+
+    /* find the best line shift k with a consistent vertical move dy */
+    best_k = best_dy = 0;
+    best_count = 1;  /* need at least 2 matching lines */
+    for (k = 1 - n; k < n; k++) {
+        if (k == 0)
+            continue;
+        count = dy = 0;
+        for (i = max_int(0, -k); i < n && i + k < n; i++) {
+            j = i + k;
+            if (cur[i].height > 0 && cur[i].crc == old[j].crc
+            &&  cur[i].x == old[j].x && cur[i].height == old[j].height) {
+                if (count == 0)
+                    dy = cur[i].y - old[j].y;
+                if (cur[i].y - old[j].y == dy)
+                    count++;
+            }
+        }
+        if (count > best_count && dy != 0 && abs(dy) < s->height) {
+            best_count = count;
+            best_k = k;
+            best_dy = dy;
+        }
+    }
+
+    if (best_k != 0
+    &&  !dpy_scroll(s->screen, s->xleft, s->ytop, s->width, s->height, best_dy)) {
+        /* move the line shadow along with the screen contents, lines
+           moved partially or completely out of the window are lost */
+        for (i = 0; i < n; i++) {
+            j = i + best_k;
+            memset(&cur[i], 0xff, sizeof(*cur));
+            if (j >= 0 && j < n && old[j].height > 0) {
+                y = old[j].y + best_dy;
+                if (y >= 0 && y + old[j].height <= s->height) {
+                    cur[i] = old[j];
+                    cur[i].y = y;
+                }
+            }
+        }
+        blockcpy(old, cur, n);
+    }
+    qe_free(&cur);
+}
+
+/* Generic display algorithm with automatic fit */
+static void generic_text_display(EditState *s)
+{
+    CursorContext m1, *m = &m1;
+    DisplayState ds1, *ds = &ds1;
+    int x1, xc, yc, offset, bottom = -1;
+
+    if (s->offset == 0) {
         s->offset_top = s->y_disp = s->x_disp[0] = s->x_disp[1] = 0;
     }
 
@@ -4879,6 +5623,14 @@ static void generic_text_display(EditState *s)
         s->x_disp[1] = 0;
     }
 
+    /* move the window contents if it was scrolled */
+    if (s->shadow_nb_lines > 0 && !disable_crc && s->screen->dpy.dpy_scroll
+    &&  (s->offset_top != s->shadow_offset_top || s->y_disp != s->shadow_y_disp)) {
+        text_display_scroll(s);
+    }
+    s->shadow_offset_top = s->offset_top;
+    s->shadow_y_disp = s->y_disp;
+
     /* now we can display the text and get the real cursor position !  */
 
     m->offsetc = s->offset;
@@ -6141,11 +6893,14 @@ EditState *find_file_window(const char *filename)
 }
 #endif
 
+static ModeDef *probe_restored_mode(EditState *s, EditBuffer *b);
+
 void switch_to_buffer(EditState *s, EditBuffer *b)
 {
     EditBuffer *b0 = s->b;
     EditState *e;
     ModeDef *mode;
+    int restored;
 
     /* remove region hilite */
     s->region_style = 0;
@@ -6175,6 +6930,12 @@ void switch_to_buffer(EditState *s, EditBuffer *b)
     }
 
     if (b) {
+        /* buffers restored from a session are set up upon first display */
+        restored = b->flags & BF_RESTORED;
+        b->flags &= ~BF_RESTORED;
+        if (restored && !b->default_mode)
+            b->default_mode = probe_restored_mode(s, b);
+
         if (b->saved_data) {
             /* Restore window mode and data from buffer saved data */
             memcpy(s, b->saved_data, SAVED_DATA_SIZE);
@@ -6205,6 +6966,8 @@ void switch_to_buffer(EditState *s, EditBuffer *b)
         }
         /* initialize the mode */
         edit_set_mode(s, mode);
+        if (restored)
+            do_load_qerc(s, b->filename);
     }
 }
 
@@ -6372,6 +7135,911 @@ static const char *file_completion_ignore_extensions = {
     "|"
 };
 
+/* ignore backup files and known binary file extensions */
+static int file_complete_ignore(const char *base)
+{
+    int len = strlen(base);
+
+    /* ignore known backup files (hardcoded test for *~) */
+    if (!len || base[len - 1] == '~')
+        return 1;
+    /* ignore known binary file extensions */
+    if (match_extension(base, file_completion_ignore_extensions))
+        return 1;
+    if (*base == '.') {
+        if (strequal(base, ".DS_Store"))
+            return 1;
+    }
+    return 0;
+}
+
+#ifndef CONFIG_TINY
+
+/*---------------- Project file index ----------------*/
+
+/* File name completion below a project root uses an index of the
+ * project tree instead of reading directories and calling stat() on
+ * every TAB.  The project root is the directory set in `project-root`
+ * or the closest parent directory with a .git entry.  The index is
+ * built by a timer callback in short slices, from the root down, and
+ * completions are computed from what has been indexed so far.
+ * Modified directories are rescanned: they are watched with inotify
+ * when available and their modification time is checked otherwise.
+ */
+
+#define FILE_INDEX_SLICE_MS     20
+#define FILE_INDEX_CHECK_MS     5000  /* interval between mtime checks */
+#define FILE_INDEX_REFRESH_MS   250   /* interval between popup updates */
+#define FILE_INDEX_MAX          4     /* number of project indexes kept */
+#define FILE_INDEX_MAX_MATCHES  500
+#define FILE_INDEX_MIN_GARBAGE  1024  /* deleted records before a compaction */
+
+enum {
+    FID_PENDING,    /* not scanned yet */
+    FID_SCANNED,
+    FID_STALE,      /* modified since last scan */
+    FID_DELETED,
+};
+
+typedef struct FileIndexEntry {
+    int name;       /* offset of the file name in the name pool */
+    int dir;        /* index of the directory record, or FIE_xxx */
+    uint32_t mask;  /* set of letters and digits in the name */
+} FileIndexEntry;
+
+#define FIE_FILE    -1
+#define FIE_LINK    -2  /* symbolic link to a directory, not followed */
+#define FIE_REUSED  -3  /* entry moved to the new list during a rescan */
+
+typedef struct FileIndexDir {
+    int path;       /* offset of the path relative to the root */
+    int path_len;
+    uint32_t mask;  /* set of letters and digits in the path */
+    int state;
+    int wd;         /* inotify watch descriptor or -1 */
+    time_t mtime;
+    FileIndexEntry *entries;    /* sorted by name */
+    int nb_entries;
+} FileIndexDir;
+
+typedef struct FileIndex {
+    struct FileIndex *next;
+    char root[MAX_FILENAME_SIZE];
+    int root_len;
+    FileIndexDir *dirs;
+    int nb_dirs, dirs_size;
+    char *names;                /* name pool */
+    int names_len, names_size;
+    int names_dead;             /* bytes of unused names in the pool */
+    int nb_files;
+    int nb_deleted;             /* number of FID_DELETED records */
+    int scan_pos;               /* lowest directory that may need a scan */
+    int check_pos;              /* next directory for the mtime check */
+    int changed;                /* entries added since the last refresh */
+    int last_refresh;
+    QETimer *timer;
+    int inotify_fd;
+    int *wd_dirs;               /* directory index by watch descriptor */
+    int wd_size;
+} FileIndex;
+
+static FileIndex *file_indexes;
+static char file_index_last_dir[MAX_FILENAME_SIZE];
+static char file_index_last_root[MAX_FILENAME_SIZE];
+
+static void minibuffer_refresh_completion(void);
+
+static const char *file_index_name(FileIndex *fi, int off) {
+    return fi->names + off;
+}
+
+static int file_index_add_name(FileIndex *fi, const char *name, int len) {
+    int off;
+
+    if (fi->names_len + len + 1 > fi->names_size) {
+        int size = fi->names_size + (fi->names_size >> 1) + len + 65536;
+        if (!qe_realloc(&fi->names, size))
+            return -1;
+        fi->names_size = size;
+    }
+    off = fi->names_len;
+    memcpy(fi->names + off, name, len);
+    fi->names[off + len] = '\0';
+    fi->names_len += len + 1;
+    return off;
+}
+
+/* compute a bitmask of the letters and digits in a string for quick
+   rejection of names that cannot match a query */
+static uint32_t file_index_mask(const char *str) {
+    uint32_t mask = 0;
+    int c;
+
+    while ((c = (u8)*str++) != '\0') {
+        if (qe_isalpha(c))
+            mask |= 1U << (qe_tolower(c) - 'a');
+        else
+        if (qe_isdigit(c))
+            mask |= 1U << (26 + (c - '0') % 6);
+    }
+    return mask;
+}
+
+static int file_index_new_dir(FileIndex *fi, const char *path, int len) {
+    FileIndexDir *d;
+    int off;
+
+    if (fi->nb_dirs >= fi->dirs_size) {
+        int size = fi->dirs_size + (fi->dirs_size >> 1) + 256;
+        if (!qe_realloc(&fi->dirs, size * sizeof(*fi->dirs)))
+            return -1;
+        fi->dirs_size = size;
+    }
+    off = file_index_add_name(fi, path, len);
+    if (off < 0)
+        return -1;
+    d = &fi->dirs[fi->nb_dirs];
+    memset(d, 0, sizeof(*d));
+    d->path = off;
+    d->path_len = len;
+    d->mask = file_index_mask(path);
+    d->state = FID_PENDING;
+    d->wd = -1;
+    return fi->nb_dirs++;
+}
+
+static void file_index_dir_path(FileIndex *fi, FileIndexDir *d,
+                                char *buf, int size) {
+    pstrcpy(buf, size, fi->root);
+    if (d->path_len) {
+        pstrcat(buf, size, "/");
+        pstrcat(buf, size, file_index_name(fi, d->path));
+    }
+}
+
+static void file_index_set_state(FileIndex *fi, int i, int state) {
+    fi->dirs[i].state = state;
+    if (state != FID_DELETED && i < fi->scan_pos)
+        fi->scan_pos = i;
+}
+
+/* remove a directory record and the records of its subdirectories */
+static void file_index_drop_dir(FileIndex *fi, int i) {
+    FileIndexDir *d = &fi->dirs[i];
+    int k;
+
+    if (d->state == FID_DELETED)
+        return;
+    for (k = 0; k < d->nb_entries; k++) {
+        fi->names_dead += strlen(file_index_name(fi, d->entries[k].name)) + 1;
+        if (d->entries[k].dir >= 0)
+            file_index_drop_dir(fi, d->entries[k].dir);
+        else
+            fi->nb_files--;
+    }
+#ifdef CONFIG_INOTIFY
+    if (d->wd >= 0) {
+        inotify_rm_watch(fi->inotify_fd, d->wd);
+        if (d->wd < fi->wd_size)
+            fi->wd_dirs[d->wd] = -1;
+    }
+#endif
+    d->wd = -1;
+    d->state = FID_DELETED;
+    fi->nb_deleted++;
+    fi->names_dead += d->path_len + 1;
+    qe_free(&d->entries);
+    d->nb_entries = 0;
+}
+
+static void file_index_watch(FileIndex *fi, int i, const char *path) {
+#ifdef CONFIG_INOTIFY
+    int wd;
+
+    if (fi->inotify_fd < 0 || fi->dirs[i].wd >= 0)
+        return;
+    wd = inotify_add_watch(fi->inotify_fd, path,
+                           IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                           IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0)
+        return;
+    if (wd >= fi->wd_size) {
+        int k, size = max_int(wd + 1, fi->wd_size * 2 + 256);
+        if (!qe_realloc(&fi->wd_dirs, size * sizeof(*fi->wd_dirs))) {
+            inotify_rm_watch(fi->inotify_fd, wd);
+            return;
+        }
+        for (k = fi->wd_size; k < size; k++)
+            fi->wd_dirs[k] = -1;
+        fi->wd_size = size;
+    }
+    fi->wd_dirs[wd] = i;
+    fi->dirs[i].wd = wd;
+#endif
+}
+
+static FileIndex *file_index_qsort_fi;
+
+static int file_index_entry_cmp(const void *a, const void *b) {
+    const FileIndexEntry *e1 = a;
+    const FileIndexEntry *e2 = b;
+    return strcmp(file_index_name(file_index_qsort_fi, e1->name),
+                  file_index_name(file_index_qsort_fi, e2->name));
+}
+
+static FileIndexEntry *file_index_find_entry(FileIndex *fi, FileIndexDir *d,
+                                             const char *name) {
+    int lo = 0, hi = d->nb_entries, mid, cmp;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        cmp = strcmp(file_index_name(fi, d->entries[mid].name), name);
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else
+        if (cmp > 0) {
+            hi = mid;
+        } else {
+            return &d->entries[mid];
+        }
+    }
+    return NULL;
+}
+
+/* Read directory i: entries of the previous scan are reused so that
+   subdirectories keep their records and only go away when removed */
+static void file_index_scan_dir(FileIndex *fi, int i) {
+    QEmacsState *qs = &qe_state;
+    char path[MAX_FILENAME_SIZE];
+    char subpath[MAX_FILENAME_SIZE];
+    FileIndexDir old;
+    FileIndexEntry *entries = NULL, *ep, *oep;
+    int nb_entries = 0, entries_size = 0, k, kind;
+    struct dirent *dirent;
+    struct stat st;
+    DIR *dir;
+
+    file_index_dir_path(fi, &fi->dirs[i], path, sizeof(path));
+    old = fi->dirs[i];
+    fi->dirs[i].entries = NULL;
+    fi->dirs[i].nb_entries = 0;
+    fi->dirs[i].state = FID_SCANNED;
+
+    /* watch before reading so that no modification is missed */
+    file_index_watch(fi, i, path);
+    if (stat(path, &st) || !(dir = opendir(path))) {
+        fi->dirs[i].entries = old.entries;
+        fi->dirs[i].nb_entries = old.nb_entries;
+        file_index_drop_dir(fi, i);
+        return;
+    }
+    fi->dirs[i].mtime = st.st_mtime;
+
+    while ((dirent = readdir(dir)) != NULL) {
+        const char *name = dirent->d_name;
+
+        if (*name == '.'
+        &&  (strequal(name, ".") || strequal(name, "..")
+        ||   strequal(name, ".git") || strequal(name, ".hg")
+        ||   strequal(name, ".svn")))
+            continue;
+        /* kind is 1 for directories, FIE_FILE or FIE_LINK otherwise */
+        kind = (dirent->d_type == DT_DIR) ? 1 : FIE_FILE;
+        if (dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK) {
+            /* do not follow symbolic links to avoid loops */
+            makepath(subpath, sizeof(subpath), path, name);
+            if (lstat(subpath, &st))
+                continue;
+            kind = S_ISDIR(st.st_mode) ? 1 : FIE_FILE;
+            if (S_ISLNK(st.st_mode) && !stat(subpath, &st)
+            &&  S_ISDIR(st.st_mode)) {
+                kind = FIE_LINK;
+            }
+        }
+        if (nb_entries >= entries_size) {
+            entries_size += (entries_size >> 1) + 32;
+            if (!qe_realloc(&entries, entries_size * sizeof(*entries)))
+                break;
+        }
+        ep = &entries[nb_entries];
+        oep = file_index_find_entry(fi, &old, name);
+        if (oep && (oep->dir >= 0 ? 1 : oep->dir) == kind
+        &&  (oep->dir < 0 || fi->dirs[oep->dir].state != FID_DELETED)) {
+            *ep = *oep;
+            oep->dir = FIE_REUSED;
+            nb_entries++;
+            continue;
+        }
+        if (kind < 0 && fi->nb_files >= qs->file_index_limit)
+            continue;
+        ep->dir = kind;
+        if (kind > 0) {
+            makepath(subpath, sizeof(subpath),
+                     file_index_name(fi, old.path), name);
+            if (fi->root_len + 1 + (int)strlen(subpath) + 1 >= MAX_FILENAME_SIZE)
+                continue;
+            ep->dir = file_index_new_dir(fi, subpath, strlen(subpath));
+            if (ep->dir < 0)
+                continue;
+        } else {
+            fi->nb_files++;
+        }
+        ep->name = file_index_add_name(fi, name, strlen(name));
+        if (ep->name < 0)
+            break;
+        ep->mask = file_index_mask(name);
+        nb_entries++;
+        fi->changed = 1;
+    }
+    closedir(dir);
+
+    /* drop the entries that disappeared */
+    for (k = 0; k < old.nb_entries; k++) {
+        if (old.entries[k].dir != FIE_REUSED) {
+            fi->names_dead += strlen(file_index_name(fi, old.entries[k].name)) + 1;
+            if (old.entries[k].dir >= 0)
+                file_index_drop_dir(fi, old.entries[k].dir);
+            else
+                fi->nb_files--;
+            fi->changed = 1;
+        }
+    }
+    qe_free(&old.entries);
+    file_index_qsort_fi = fi;
+    qsort(entries, nb_entries, sizeof(*entries), file_index_entry_cmp);
+    fi->dirs[i].entries = entries;
+    fi->dirs[i].nb_entries = nb_entries;
+}
+
+static void file_index_timer_cb(void *opaque);
+
+static void file_index_schedule(FileIndex *fi, int delay) {
+    /* run pending scans right away instead of after the mtime check delay */
+    if (delay == 0)
+        qe_kill_timer(&fi->timer);
+    if (!fi->timer)
+        fi->timer = qe_add_timer(delay, fi, file_index_timer_cb);
+}
+
+#ifdef CONFIG_INOTIFY
+static void file_index_inotify_cb(void *opaque) {
+    FileIndex *fi = opaque;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int i;
+
+    for (;;) {
+        len = read(fi->inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(void *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* events were lost: check everything again */
+                for (i = 0; i < fi->nb_dirs; i++) {
+                    if (fi->dirs[i].state == FID_SCANNED)
+                        file_index_set_state(fi, i, FID_STALE);
+                }
+                continue;
+            }
+            if (ev->wd >= 0 && ev->wd < fi->wd_size
+            &&  (i = fi->wd_dirs[ev->wd]) >= 0
+            &&  fi->dirs[i].state == FID_SCANNED) {
+                file_index_set_state(fi, i, FID_STALE);
+            }
+        }
+    }
+    file_index_schedule(fi, 0);
+}
+#endif
+
+static int file_index_copy_name(FileIndex *fi, char *names, int *lenp,
+                                int off) {
+    const char *name = file_index_name(fi, off);
+    int len = strlen(name) + 1;
+
+    memcpy(names + *lenp, name, len);
+    *lenp += len;
+    return *lenp - len;
+}
+
+/* Remove the deleted directory records and rebuild the name pool with
+   the names still in use.  Deleted records still referenced from their
+   parent directory are kept until the parent is rescanned. */
+static void file_index_compact(FileIndex *fi) {
+    FileIndexDir *d;
+    FileIndexEntry *ep;
+    char *names;
+    int *map;
+    int i, j, k, names_len, scan_pos, check_pos;
+
+    map = qe_malloc_array(int, fi->nb_dirs);
+    names = qe_malloc_bytes(fi->names_len + 1);
+    if (!map || !names) {
+        qe_free(&map);
+        qe_free(&names);
+        return;
+    }
+    /* the root record is always kept */
+    map[0] = 0;
+    for (i = 1; i < fi->nb_dirs; i++)
+        map[i] = (fi->dirs[i].state == FID_DELETED) ? -1 : 0;
+    for (i = 0; i < fi->nb_dirs; i++) {
+        d = &fi->dirs[i];
+        for (k = 0; k < d->nb_entries; k++) {
+            if (d->entries[k].dir >= 0)
+                map[d->entries[k].dir] = 0;
+        }
+    }
+    names_len = 0;
+    scan_pos = check_pos = 0;
+    fi->nb_deleted = 0;
+    for (i = j = 0; i < fi->nb_dirs; i++) {
+        if (i == fi->scan_pos)
+            scan_pos = j;
+        if (i == fi->check_pos)
+            check_pos = j;
+        if (map[i] < 0)
+            continue;
+        map[i] = j;
+        d = &fi->dirs[i];
+        d->path = file_index_copy_name(fi, names, &names_len, d->path);
+        for (k = 0; k < d->nb_entries; k++) {
+            ep = &d->entries[k];
+            ep->name = file_index_copy_name(fi, names, &names_len, ep->name);
+        }
+        if (d->state == FID_DELETED)
+            fi->nb_deleted++;
+        fi->dirs[j++] = *d;
+    }
+    if (fi->scan_pos >= fi->nb_dirs)
+        scan_pos = j;
+    if (fi->check_pos >= fi->nb_dirs)
+        check_pos = j;
+    fi->nb_dirs = j;
+    fi->scan_pos = scan_pos;
+    fi->check_pos = check_pos;
+    for (i = 0; i < fi->nb_dirs; i++) {
+        d = &fi->dirs[i];
+        for (k = 0; k < d->nb_entries; k++) {
+            if (d->entries[k].dir >= 0)
+                d->entries[k].dir = map[d->entries[k].dir];
+        }
+        if (d->wd >= 0 && d->wd < fi->wd_size)
+            fi->wd_dirs[d->wd] = i;
+    }
+    qe_free(&fi->names);
+    fi->names = names;
+    fi->names_len = fi->names_size = names_len;
+    fi->names_dead = 0;
+    qe_free(&map);
+}
+
+/* Scan pending directories and check unwatched ones for a time slice */
+static void file_index_update(FileIndex *fi) {
+    int start_time = get_clock_ms();
+    int i, state;
+    FileIndexDir *d;
+    struct stat st;
+    char path[MAX_FILENAME_SIZE];
+
+    if ((fi->nb_deleted > FILE_INDEX_MIN_GARBAGE
+    &&   fi->nb_deleted > fi->nb_dirs / 4)
+    ||  (fi->names_dead > FILE_INDEX_MIN_GARBAGE * 64
+    &&   fi->names_dead > fi->names_len / 2)) {
+        file_index_compact(fi);
+    }
+    while (fi->scan_pos < fi->nb_dirs) {
+        if (get_clock_ms() - start_time >= FILE_INDEX_SLICE_MS) {
+            file_index_schedule(fi, 0);
+            break;
+        }
+        i = fi->scan_pos;
+        state = fi->dirs[i].state;
+        if (state == FID_PENDING || state == FID_STALE)
+            file_index_scan_dir(fi, i);
+        fi->scan_pos++;
+    }
+    if (fi->scan_pos >= fi->nb_dirs) {
+        /* check the directories that are not watched, a slice at a time */
+        for (i = 0; i < fi->nb_dirs; i++) {
+            if (get_clock_ms() - start_time >= FILE_INDEX_SLICE_MS)
+                break;
+            if (fi->check_pos >= fi->nb_dirs)
+                fi->check_pos = 0;
+            d = &fi->dirs[fi->check_pos];
+            if (d->state == FID_SCANNED && d->wd < 0) {
+                file_index_dir_path(fi, d, path, sizeof(path));
+                if (stat(path, &st) || st.st_mtime != d->mtime)
+                    file_index_set_state(fi, fi->check_pos, FID_STALE);
+            }
+            fi->check_pos++;
+        }
+        file_index_schedule(fi, fi->scan_pos < fi->nb_dirs ?
+                            0 : FILE_INDEX_CHECK_MS);
+    }
+}
+
+static void file_index_timer_cb(void *opaque) {
+    FileIndex *fi = opaque;
+
+    fi->timer = NULL;
+    file_index_update(fi);
+    if (fi->changed
+    &&  (fi->scan_pos >= fi->nb_dirs
+    ||   get_clock_ms() - fi->last_refresh >= FILE_INDEX_REFRESH_MS)) {
+        /* show the new files in the completion popup */
+        fi->changed = 0;
+        fi->last_refresh = get_clock_ms();
+        minibuffer_refresh_completion();
+    }
+}
+
+static void file_index_free(FileIndex **fip) {
+    FileIndex *fi = *fip;
+    int i;
+
+    if (fi) {
+        qe_kill_timer(&fi->timer);
+#ifdef CONFIG_INOTIFY
+        if (fi->inotify_fd >= 0) {
+            set_read_handler(fi->inotify_fd, NULL, NULL);
+            close(fi->inotify_fd);
+        }
+#endif
+        for (i = 0; i < fi->nb_dirs; i++)
+            qe_free(&fi->dirs[i].entries);
+        qe_free(&fi->dirs);
+        qe_free(&fi->names);
+        qe_free(&fi->wd_dirs);
+        qe_free(fip);
+    }
+}
+
+/* Find the project root for an absolute directory name */
+static int file_index_find_root(const char *dir, char *root, int size) {
+    QEmacsState *qs = &qe_state;
+    char buf[MAX_FILENAME_SIZE];
+    struct stat st;
+    int len;
+
+    len = strlen(qs->project_root);
+    while (len > 1 && qs->project_root[len - 1] == '/')
+        len--;
+    if (len > 0 && !strncmp(dir, qs->project_root, len)
+    &&  (dir[len] == '/' || dir[len] == '\0')) {
+        pstrncpy(root, size, qs->project_root, len);
+        return 0;
+    }
+    if (strequal(dir, file_index_last_dir)) {
+        pstrcpy(root, size, file_index_last_root);
+        return *root ? 0 : -1;
+    }
+    pstrcpy(file_index_last_dir, sizeof(file_index_last_dir), dir);
+    *file_index_last_root = '\0';
+    pstrcpy(buf, sizeof(buf), dir);
+    for (len = strlen(buf); len > 1; ) {
+        buf[len] = '\0';
+        pstrcat(buf, sizeof(buf), "/.git");
+        if (!stat(buf, &st)) {
+            buf[len] = '\0';
+            pstrcpy(file_index_last_root, sizeof(file_index_last_root), buf);
+            break;
+        }
+        while (len > 1 && buf[--len] != '/')
+            continue;
+    }
+    pstrcpy(root, size, file_index_last_root);
+    return *root ? 0 : -1;
+}
+
+/* Get the index for a project root, start building it if needed */
+static FileIndex *file_index_get(const char *root) {
+    FileIndex **fip, *fi;
+    int n;
+
+    for (n = 0, fip = &file_indexes; (fi = *fip) != NULL; fip = &fi->next, n++) {
+        if (strequal(fi->root, root)) {
+            /* move to the head of the list */
+            *fip = fi->next;
+            fi->next = file_indexes;
+            file_indexes = fi;
+            return fi;
+        }
+        if (n + 1 >= FILE_INDEX_MAX && fi->next) {
+            /* forget the least recently used indexes */
+            FileIndex *fi1 = fi->next;
+            fi->next = fi1->next;
+            file_index_free(&fi1);
+        }
+    }
+    fi = qe_mallocz(FileIndex);
+    if (!fi)
+        return NULL;
+    pstrcpy(fi->root, sizeof(fi->root), root);
+    fi->root_len = strlen(fi->root);
+    fi->inotify_fd = -1;
+#ifdef CONFIG_INOTIFY
+    fi->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fi->inotify_fd >= 256) {
+        /* cannot register a read handler */
+        close(fi->inotify_fd);
+        fi->inotify_fd = -1;
+    }
+    if (fi->inotify_fd >= 0)
+        set_read_handler(fi->inotify_fd, file_index_inotify_cb, fi);
+#endif
+    if (file_index_new_dir(fi, "", 0) < 0) {
+        file_index_free(&fi);
+        return NULL;
+    }
+    fi->next = file_indexes;
+    file_indexes = fi;
+    /* index the top of the tree right away, the caller uses the result
+       so the completion popup does not need a refresh */
+    file_index_update(fi);
+    fi->changed = 0;
+    return fi;
+}
+
+/* Get the scanned record for a directory below the root, rescan it
+   if it is not watched and its modification time changed */
+static FileIndexDir *file_index_lookup_dir(FileIndex *fi, const char *rel) {
+    char name[MAX_FILENAME_SIZE];
+    char path[MAX_FILENAME_SIZE];
+    FileIndexEntry *ep;
+    FileIndexDir *d;
+    struct stat st;
+    const char *p;
+    int i = 0;
+
+    for (p = rel; *p;) {
+        const char *q = p + strcspn(p, "/");
+        d = &fi->dirs[i];
+        if (d->state != FID_SCANNED)
+            return NULL;
+        pstrncpy(name, sizeof(name), p, q - p);
+        ep = file_index_find_entry(fi, d, name);
+        if (!ep || ep->dir < 0)
+            return NULL;
+        i = ep->dir;
+        p = q + strspn(q, "/");
+    }
+    d = &fi->dirs[i];
+    if (d->state == FID_SCANNED && d->wd < 0) {
+        file_index_dir_path(fi, d, path, sizeof(path));
+        if (stat(path, &st) || st.st_mtime != d->mtime)
+            d->state = FID_STALE;
+    }
+    if (d->state == FID_STALE) {
+        file_index_scan_dir(fi, i);
+        file_index_schedule(fi, 0);
+        d = &fi->dirs[i];
+    }
+    return d->state == FID_SCANNED ? d : NULL;
+}
+
+/* case insensitive substring and subsequence matching */
+static const char *file_index_strstr(const char *str, const char *pat) {
+    int c0 = qe_tolower((u8)*pat);
+    int i;
+
+    for (; *str; str++) {
+        if (qe_tolower((u8)*str) == c0) {
+            for (i = 1; pat[i] && qe_tolower((u8)str[i]) == qe_tolower((u8)pat[i]); i++)
+                continue;
+            if (!pat[i])
+                return str;
+        }
+    }
+    return NULL;
+}
+
+/* return the number of characters of pat matched in order in str */
+static int file_index_subseq(const char *str, const char *pat) {
+    int n = 0;
+
+    for (; *str && pat[n]; str++) {
+        if (qe_tolower((u8)*str) == qe_tolower((u8)pat[n]))
+            n++;
+    }
+    return n;
+}
+
+typedef struct FileIndexMatch {
+    int dir, entry, rank;
+} FileIndexMatch;
+
+/* rank a name match: lower is better, -1 if no match */
+static int file_index_rank(const char *name, const char *q, int qlen) {
+    const char *p;
+
+    /* a subsequence test rejects most names in a single pass */
+    if (file_index_subseq(name, q) < qlen)
+        return -1;
+    if (!strncmp(name, q, qlen))
+        return 0;
+    if ((p = file_index_strstr(name, q)) != NULL) {
+        /* prefer matches at the start of a word */
+        if (p == name || p[-1] == '.' || p[-1] == '_' || p[-1] == '-')
+            return 1;
+        return 2;
+    }
+    return 4;
+}
+
+/* Enumerate the files of the tree whose path relative to the root
+ * matches q, best matches first: prefix of the name, substring of the
+ * name, substring of the path, subsequence of the path.
+ */
+static void file_index_complete(FileIndex *fi, CompleteState *cp,
+                                CompleteFunc enumerate,
+                                const char *prefix, const char *q) {
+    char filename[MAX_FILENAME_SIZE];
+    FileIndexMatch *matches = NULL;
+    int nb_matches = 0, matches_size = 0;
+    int counts[8] = { 0 }, cutoff, kept;
+    int i, k, rank, dsub, plen, qlen = strlen(q);
+    int has_slash = strchr(q, '/') != NULL;
+    uint32_t qmask = file_index_mask(q), smask;
+
+    for (i = 0; i < fi->nb_dirs; i++) {
+        FileIndexDir *d = &fi->dirs[i];
+        const char *dpath = file_index_name(fi, d->path);
+        int dir_has_q = 0;
+
+        if (d->state == FID_PENDING || d->state == FID_DELETED || !d->nb_entries)
+            continue;
+        /* part of the query matched in order by the directory path */
+        dsub = d->path_len ? file_index_subseq(dpath, q) : 0;
+        if (dsub < qlen && d->path_len && q[dsub] == '/')
+            dsub++;
+        smask = file_index_mask(q + dsub);
+        if (!has_slash && d->path_len && (qmask & ~d->mask) == 0
+        &&  file_index_strstr(dpath, q))
+            dir_has_q = 1;
+        plen = 0;
+        if (d->path_len) {
+            pstrcpy(filename, sizeof(filename), dpath);
+            plen = append_slash(filename, sizeof(filename));
+        }
+        for (k = 0; k < d->nb_entries; k++) {
+            FileIndexEntry *ep = &d->entries[k];
+            const char *name = file_index_name(fi, ep->name);
+
+            /* all ranks need every character of the query in the path */
+            if (qmask & ~(ep->mask | d->mask))
+                continue;
+            if (has_slash) {
+                /* match the whole relative path */
+                pstrcpy(filename + plen, sizeof(filename) - plen, name);
+                if (!strncmp(filename, q, qlen))
+                    rank = 0;
+                else
+                if (file_index_strstr(filename, q))
+                    rank = 3;
+                else
+                if (file_index_subseq(filename, q) == qlen)
+                    rank = 5;
+                else
+                    continue;
+            } else {
+                rank = -1;
+                if ((qmask & ~ep->mask) == 0)
+                    rank = file_index_rank(name, q, qlen);
+                if (rank < 0) {
+                    if (dir_has_q)
+                        rank = 3;
+                    else
+                    if (dsub > 0 && (smask & ~ep->mask) == 0
+                    &&  file_index_subseq(name, q + dsub) == qlen - dsub)
+                        rank = 5;
+                    else
+                        continue;
+                }
+            }
+            if (file_complete_ignore(name))
+                continue;
+            if (nb_matches >= matches_size) {
+                matches_size += (matches_size >> 1) + 256;
+                if (!qe_realloc(&matches, matches_size * sizeof(*matches)))
+                    goto done;
+            }
+            matches[nb_matches].dir = i;
+            matches[nb_matches].entry = k;
+            matches[nb_matches].rank = rank;
+            nb_matches++;
+            counts[rank]++;
+        }
+    }
+    /* only keep the best matches */
+    for (cutoff = kept = 0; cutoff < countof(counts) - 1; cutoff++) {
+        if (kept + counts[cutoff] > FILE_INDEX_MAX_MATCHES)
+            break;
+        kept += counts[cutoff];
+    }
+    kept = FILE_INDEX_MAX_MATCHES - kept;
+    for (k = 0; k < nb_matches; k++) {
+        FileIndexMatch *m = &matches[k];
+        FileIndexDir *d = &fi->dirs[m->dir];
+        FileIndexEntry *ep = &d->entries[m->entry];
+        if (m->rank > cutoff || (m->rank == cutoff && kept-- <= 0))
+            continue;
+        snprintf(filename, sizeof(filename), "%s%s%s%s%s", prefix,
+                 file_index_name(fi, d->path), d->path_len ? "/" : "",
+                 file_index_name(fi, ep->name), ep->dir != FIE_FILE ? "/" : "");
+        enumerate(cp, filename, CT_RANK + m->rank);
+    }
+ done:
+    qe_free(&matches);
+}
+
+/* Use the project index for file completion if the directory being
+ * completed is below a project root, return 0 if completion was done.
+ */
+static int file_index_file_complete(CompleteState *cp, CompleteFunc enumerate,
+                                    const char *current, const char *path,
+                                    const char *prefix) {
+    QEmacsState *qs = &qe_state;
+    char dir[MAX_FILENAME_SIZE];
+    char root[MAX_FILENAME_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+    FileIndexDir *d;
+    FileIndex *fi;
+    const char *rel;
+    int k, len;
+
+    if (qs->file_index_limit <= 0 || *current != '/' || !*path
+    ||  strpbrk(current, "*?["))
+        return -1;
+    pstrcpy(dir, sizeof(dir), path);
+    len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/')
+        dir[--len] = '\0';
+    if (file_index_find_root(dir, root, sizeof(root)))
+        return -1;
+    fi = file_index_get(root);
+    if (!fi)
+        return -1;
+    rel = dir + fi->root_len;
+    rel += strspn(rel, "/");
+
+    if (cp->fuzzy) {
+        /* match the relative path in the whole tree */
+        pstrcpy(filename, sizeof(filename), root);
+        pstrcat(filename, sizeof(filename), "/");
+        len = strlen(filename);
+        if (strncmp(current, filename, len) || !current[len])
+            return -1;
+        file_index_complete(fi, cp, enumerate, filename, current + len);
+        /* the index is still being built: keep the popup open
+           instead of replacing the input with partial results */
+        cp->incomplete = (fi->scan_pos < fi->nb_dirs);
+        return 0;
+    }
+    /* list a directory from the index */
+    d = file_index_lookup_dir(fi, rel);
+    if (!d)
+        return -1;
+    for (k = 0; k < d->nb_entries; k++) {
+        FileIndexEntry *ep = &d->entries[k];
+        const char *name = file_index_name(fi, ep->name);
+        if (!strstart(name, prefix, NULL))
+            continue;
+        if (file_complete_ignore(name))
+            continue;
+        makepath(filename, sizeof(filename), path, name);
+        if (ep->dir != FIE_FILE)
+            pstrcat(filename, sizeof(filename), "/");
+        enumerate(cp, filename, CT_SET);
+    }
+    return 0;
+}
+
+#endif /* CONFIG_TINY */
+
 void file_complete(CompleteState *cp, CompleteFunc enumerate)
 {
     char path[MAX_FILENAME_SIZE];
@@ -6380,7 +8048,6 @@ void file_complete(CompleteState *cp, CompleteFunc enumerate)
     char *current;
     FindFileState *ffst;
     const char *base;
-    int len;
 
     current = cp->current;
     if (*current == '~') {
@@ -6389,6 +8056,11 @@ void file_complete(CompleteState *cp, CompleteFunc enumerate)
     }
 
     splitpath(path, sizeof(path), file, sizeof(file), current);
+#ifndef CONFIG_TINY
+    if (!(cp->completion->flags & (CF_RESOURCE | CF_DIRNAME))
+    &&  !file_index_file_complete(cp, enumerate, current, path, file))
+        return;
+#endif
     pstrcat(file, sizeof(file), "*");
 
     if (cp->completion->flags & CF_RESOURCE) {
@@ -6405,17 +8077,8 @@ void file_complete(CompleteState *cp, CompleteFunc enumerate)
         struct stat sb;
 
         base = get_basename(filename);
-        /* ignore known backup files (hardcoded test for *~) */
-        len = strlen(base);
-        if (!len || base[len - 1] == '~')
-            continue;
-        /* ignore known binary file extensions */
-        if (match_extension(base, file_completion_ignore_extensions))
+        if (file_complete_ignore(base))
             continue;
-        if (*base == '.') {
-            if (strequal(base, ".DS_Store"))
-                continue;
-        }
         /* stat the file to find out if it's a directory.
          * In this case add a slash to speed up typing long paths
          */
@@ -6579,6 +8242,11 @@ static void complete_test(CompleteState *cp, const char *str, int mode) {
                 return;
         }
         break;
+    default:
+        /* CT_RANK + n: already matched, sort in group n */
+        if (mode >= CT_RANK)
+            fuzzy = mode - CT_RANK;
+        break;
     }
     add_string(&cp->cs, str, fuzzy);
 }
@@ -6651,6 +8319,28 @@ static int match_strings(const char *s1, const char *s2, int len) {
     return len;
 }
 
+/* modify the popup list with the current matches */
+static void minibuffer_fill_popup(MinibufState *mb, CompleteState *cp) {
+    EditState *e = mb->completion_popup_window;
+    EditBuffer *b = e->b;
+    StringItem **outputs = cp->cs.items;
+    int i, count = cp->cs.nb_items;
+
+    qsort(outputs, count, sizeof(StringItem *), completion_sort_func);
+    b->flags &= ~BF_READONLY;
+    eb_delete(b, 0, b->total_size);
+    b->tab_width = 4;
+    for (i = 0; i < count; i++) {
+        eb_putc(b, ' ');    /* XXX: should use window margins */
+        mb->completion->print_entry(cp, e, outputs[i]->str);
+        eb_putc(b, '\n');
+    }
+    b->flags |= BF_READONLY;
+    e->mouse_force_highlight = 1;
+    e->force_highlight = 1;
+    e->offset = 0;
+}
+
 void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     QEmacsState *qs = s->qe_state;
     int count, i, match_len, start, end;
@@ -6740,7 +8430,7 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
         if (p)
             match_len = p - outputs[0]->str;
     }
-    if (match_len > cs.len) {
+    if (match_len > cs.len && !cs.incomplete) {
         /* add the possible chars */
         // XXX: potential UTF-8 issue?
         // XXX: replace the completed part, not necessarily at the start (use mark?)
@@ -6754,7 +8444,7 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
             do_mark_region(s, cs.start + match_len, cs.start + cs.len);
         }
     } else {
-        if (count > 1) {
+        if (count > 1 || cs.incomplete) {
             /* if more than one match, then display them in a new popup
                buffer */
             if (!mb->completion_popup_window) {
@@ -6781,27 +8471,43 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
             do_refresh(s);
         }
     }
-    if (mb->completion_popup_window) {
-        /* modify the list with the current matches */
-        e = mb->completion_popup_window;
-        b = e->b;
-        qsort(outputs, count, sizeof(StringItem *), completion_sort_func);
-        b->flags &= ~BF_READONLY;
-        eb_delete(b, 0, b->total_size);
-        b->tab_width = 4;
-        for (i = 0; i < count; i++) {
-            eb_putc(b, ' ');    /* XXX: should use window margins */
-            mb->completion->print_entry(&cs, e, outputs[i]->str);
-            eb_putc(b, '\n');
-        }
-        b->flags |= BF_READONLY;
-        e->mouse_force_highlight = 1;
-        e->force_highlight = 1;
-        e->offset = 0;
-    }
+    if (mb->completion_popup_window)
+        minibuffer_fill_popup(mb, &cs);
     complete_end(&cs);
 }
 
+#ifndef CONFIG_TINY
+/* update the completion popups after the list of candidates changed */
+static void minibuffer_refresh_completion(void) {
+    QEmacsState *qs = &qe_state;
+    MinibufState *mb;
+    CompleteState cs;
+    EditState *s;
+    int offset;
+
+    for (s = qs->first_window; s != NULL; s = s->next_window) {
+        mb = minibuffer_get_state(s, 0);
+        if (!mb || !mb->completion || !check_window(&mb->completion_popup_window))
+            continue;
+        complete_start(&cs, s, mb->completion_start, mb->completion_end,
+                       s->target_window);
+        cs.completion = mb->completion;
+        if (!(mb->completion->flags & CF_NO_FUZZY))
+            cs.fuzzy = mb->completion_stage;
+        (*mb->completion->enumerate)(&cs, complete_test);
+        mb->completion_count = cs.cs.nb_items;
+        /* keep the position in the popup */
+        offset = mb->completion_popup_window->offset;
+        minibuffer_fill_popup(mb, &cs);
+        mb->completion_popup_window->offset =
+            eb_goto_bol(mb->completion_popup_window->b,
+                        min_int(offset, mb->completion_popup_window->b->total_size));
+        complete_end(&cs);
+        url_redisplay();
+    }
+}
+#endif
+
 static void do_minibuffer_electric_key(EditState *s, int key, int argval) {
     char32_t c;
     int offset, stop;
@@ -7713,6 +9419,10 @@ static int probe_mode(EditState *s, EditBuffer *b,
     ModeProbeData probe_data;
     int found_modes;
     const uint8_t *p;
+#ifndef CONFIG_TINY
+    ModeDef *cands[MODE_INDEX_CANDIDATES];
+    int nb_cands, j;
+#endif
 
     if (!modes || !scores || nb_modes < 1)
         return 0;
@@ -7756,7 +9466,10 @@ static int probe_mode(EditState *s, EditBuffer *b,
                 ch = probe_data.charset_state.decode_func(&probe_data.charset_state);
                 offset = probe_data.charset_state.p - rawbuf;
             }
-            bufp += utf8_encode((char *)bufp, ch);
+            if (ch < 0x80)
+                *bufp++ = ch;
+            else
+                bufp += utf8_encode((char *)bufp, ch);
             if (bufp > buf + sizeof(buf) - MAX_CHAR_BYTES - 1)
                 break;
         }
@@ -7779,9 +9492,22 @@ static int probe_mode(EditState *s, EditBuffer *b,
     p = memchr(probe_data.buf, '\n', probe_data.buf_size);
     probe_data.line_len = p ? p - probe_data.buf : probe_data.buf_size;
 
+#ifndef CONFIG_TINY
+    /* generic probes return 1 for non matching modes */
+    nb_cands = (min_score >= 1) ? mode_index_candidates(cands, &probe_data) : -1;
+#endif
     for (m = qs->first_mode; m != NULL; m = m->next) {
         if (m->mode_probe) {
-            int score = m->mode_probe(m, &probe_data);
+            int score;
+#ifndef CONFIG_TINY
+            if (m->mode_probe == generic_mode_probe && nb_cands >= 0) {
+                for (j = 0; j < nb_cands && cands[j] != m; j++)
+                    continue;
+                if (j == nb_cands)
+                    continue;
+            }
+#endif
+            score = m->mode_probe(m, &probe_data);
             if (score > min_score) {
                 int i;
                 /* sort appropriate modes by insertion in modes array */
@@ -7917,6 +9643,9 @@ int qe_load_file(EditState *s, const char *filename1, int lflags, int bflags)
     struct stat st;
     EOLType eol_type = EOL_UNIX;
     QECharset *charset = &charset_utf8;
+#ifndef CONFIG_TINY
+    ProbeCacheEntry *pc;
+#endif
 
 #ifndef CONFIG_TINY
     /* when exploring from a popleft dired buffer, load a directory or
@@ -8006,6 +9735,15 @@ int qe_load_file(EditState *s, const char *filename1, int lflags, int bflags)
         buf_size = 0;
         f = NULL;
 
+#ifndef CONFIG_TINY
+        if (S_ISREG(st_mode)
+        &&  (pc = probe_cache_find(filename, &st)) != NULL) {
+            selected_mode = pc->mode;
+            charset = pc->charset;
+            eol_type = pc->eol_type;
+            goto probed;
+        }
+#endif
         if (S_ISREG(st_mode)) {
             f = fopen(filename, "r");
             if (!f)
@@ -8028,15 +9766,20 @@ int qe_load_file(EditState *s, const char *filename1, int lflags, int bflags)
             f = NULL;
             goto fail;
         }
-        bdt = selected_mode->data_type;
-        if (bdt == &raw_data_type)
-            eb_set_charset(b, charset, eol_type);
-
         if (f) {
             /* XXX: should use f to load buffer if raw_data_type */
             fclose(f);
             f = NULL;
+#ifndef CONFIG_TINY
+            probe_cache_store(filename, &st, selected_mode, charset, eol_type);
+#endif
         }
+#ifndef CONFIG_TINY
+    probed:
+#endif
+        bdt = selected_mode->data_type;
+        if (bdt == &raw_data_type)
+            eb_set_charset(b, charset, eol_type);
 
         b->default_mode = selected_mode;
         /* attaching the buffer to the window will set the default_mode
@@ -8072,6 +9815,34 @@ int qe_load_file(EditState *s, const char *filename1, int lflags, int bflags)
     return -1;
 }
 
+/* Select the mode of a buffer restored from a session without a valid
+ * mode, as qe_load_file() does for a new buffer.
+ */
+static ModeDef *probe_restored_mode(EditState *s, EditBuffer *b)
+{
+    u8 buf[4097];
+    ModeDef *selected_mode = &text_mode;
+    int st_errno = 0, buf_size = 0, mode_score;
+    struct stat st;
+    FILE *f;
+
+    if (stat(b->filename, &st) < 0) {
+        st_errno = errno;
+        st.st_size = 0;
+    } else {
+        b->st_mode = st.st_mode;
+        if (S_ISREG(st.st_mode) && (f = fopen(b->filename, "r")) != NULL) {
+            buf_size = fread(buf, 1, sizeof(buf) - 1, f);
+            fclose(f);
+        }
+    }
+    buf[buf_size] = '\0';
+    probe_mode(s, b, &selected_mode, 1, &mode_score, 2,
+               b->filename, st_errno, b->st_mode, st.st_size,
+               buf, buf_size, b->charset, b->eol_type);
+    return selected_mode;
+}
+
 #ifndef CONFIG_TINY
 void qe_save_open_files(EditState *s, EditBuffer *b)
 {
@@ -8080,8 +9851,41 @@ void qe_save_open_files(EditState *s, EditBuffer *b)
 
     eb_puts(b, "// open files:\n");
     for (b1 = qs->first_buffer; b1 != NULL; b1 = b1->next) {
-        if (!(b1->flags & BF_SYSTEM) && *b1->filename)
-            eb_printf(b, "find_file(\"%s\");\n", b1->filename);
+        if ((b1->flags & BF_SYSTEM) || !*b1->filename)
+            continue;
+#ifdef CONFIG_SESSION
+        /* regular files are restored as placeholders, loaded on demand */
+        if (S_ISREG(b1->st_mode) && b1->data_type == &raw_data_type) {
+            const EditState *e = eb_find_window(b1, NULL);
+            ModeDef *m = b1->saved_mode ? b1->saved_mode : b1->default_mode;
+            int offset;
+
+            if (b1->flags & BF_DEFERRED) {
+                offset = b1->deferred_offset;
+            } else
+            if (e) {
+                offset = e->offset;
+            } else
+            if (b1->saved_data) {
+                offset = ((const EditState *)(void *)b1->saved_data)->offset;
+            } else {
+                offset = 0;
+            }
+            if (e && e->mode)
+                m = e->mode;
+            eb_printf(b, "restore_buffer(\"%s\", \"offset:%d mark:%d eol:%d",
+                      b1->filename, offset,
+                      (b1->flags & BF_DEFERRED) ? b1->deferred_mark : b1->mark,
+                      b1->eol_type);
+            if (b1->charset)
+                eb_printf(b, " charset:%s", b1->charset->name);
+            if (m)
+                eb_printf(b, " mode:%s", m->name);
+            eb_puts(b, "\");\n");
+            continue;
+        }
+#endif
+        eb_printf(b, "find_file(\"%s\");\n", b1->filename);
     }
     eb_putc(b, '\n');
 }
@@ -8218,6 +10022,10 @@ void do_save_buffer(EditState *s)
         put_status(s, "(No changes need to be saved)");
         return;
     }
+    if (!eb_start_saving(s->b)) {
+        put_status(s, "Saving %s in the background", s->b->filename);
+        return;
+    }
     put_save_message(s, s->b->filename, eb_save_buffer(s->b));
 }
 
@@ -8939,6 +10747,67 @@ void qe_save_window_layout(EditState *s, EditBuffer *b)
 #endif  /* !CONFIG_TINY */
 
 #ifdef CONFIG_SESSION
+/* Create a placeholder buffer for a file from a session.  The file is
+ * not accessed until the buffer is displayed or its contents are
+ * needed, so restoring a session does not depend on the number of
+ * files it lists.
+ * state is a list of `key:value` pairs: offset, mark, eol, charset and
+ * mode, which must come last.
+ */
+void do_restore_buffer(EditState *s, const char *filename, const char *state)
+{
+    EditBuffer *b;
+    ModeDef *m = NULL;
+    QECharset *charset = &charset_utf8;
+    EOLType eol_type = EOL_UNIX;
+    int offset = 0, mark = 0;
+    const char *p = state;
+    char buf[64];
+
+    if (eb_find_file(filename))
+        return;
+
+    for (;;) {
+        while (qe_isblank(*p))
+            p++;
+        if (!*p)
+            break;
+        if (strstart(p, "mode:", &p)) {
+            m = qe_find_mode(p, 0);
+            break;
+        }
+        if (strstart(p, "offset:", &p)) {
+            offset = strtol_c(p, &p, 0);
+        } else
+        if (strstart(p, "mark:", &p)) {
+            mark = strtol_c(p, &p, 0);
+        } else
+        if (strstart(p, "eol:", &p)) {
+            eol_type = clamp_int(strtol_c(p, &p, 0), EOL_UNIX, EOL_MAC);
+        } else
+        if (strstart(p, "charset:", &p)) {
+            get_str(&p, buf, sizeof(buf), "");
+            charset = find_charset(buf);
+            if (!charset)
+                charset = &charset_utf8;
+        } else {
+            /* skip unknown key */
+            while (*p && !qe_isblank(*p))
+                p++;
+        }
+    }
+
+    b = eb_new(get_basename(filename), BF_SAVELOG | BF_DEFERRED | BF_RESTORED);
+    if (!b)
+        return;
+    eb_set_filename(b, filename);
+    eb_set_charset(b, charset, eol_type);
+    b->st_mode = S_IFREG;
+    b->default_mode = m;
+    b->deferred_offset = offset;
+    b->deferred_mark = mark;
+}
+
 int qe_load_session(EditState *s)
 {
     return parse_config_file(s, ".qesession");
@@ -9955,6 +11824,12 @@ static void qe_init(void *opaque)
     qs->default_fill_column = DEFAULT_FILL_COLUMN;
     qs->mmap_threshold = MIN_MMAP_SIZE;
     qs->max_load_size = MAX_LOAD_SIZE;
+    qs->async_load_threshold = MIN_ASYNC_LOAD_SIZE;
+    qs->async_save_threshold = MIN_ASYNC_SAVE_SIZE;
+    qs->undo_limit = UNDO_LIMIT;
+    qs->undo_spill_limit = UNDO_SPILL_LIMIT;
+    qs->shell_scrollback_size = SHELL_SCROLLBACK_SIZE;
+    qs->file_index_limit = FILE_INDEX_LIMIT;
 
     /* setup resource path */
     set_user_option(NULL);
@@ -10141,6 +12016,16 @@ int main(int argc, char **argv)
     /* unmap/free input methods file */
     unload_input_methods();
 #endif
+#ifndef CONFIG_TINY
+    while (file_indexes) {
+        FileIndex *fi = file_indexes;
+        file_indexes = fi->next;
+        file_index_free(&fi);
+    }
+    mode_index_free();
+    probe_cache_flush();
+    auto_revert_close();
+#endif
 #ifdef CONFIG_UNICODE_JOIN
     /* free ligature arrays */
     unload_ligatures();
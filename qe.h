@@ -114,6 +114,9 @@ void url_redisplay(void);
 void register_bottom_half(void (*cb)(void *opaque), void *opaque);
 void unregister_bottom_half(void (*cb)(void *opaque), void *opaque);
 
+/* Timers are freed after their callback returns: callbacks must clear
+   their QETimer pointer unless they reschedule the timer.  Timers must
+   only be used from the main thread. */
 QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque));
 void qe_kill_timer(QETimer **tip);
 
@@ -130,6 +133,7 @@ struct CompleteState {
     struct EditState *target;
     struct CompletionDef *completion;
     int start, end, len, fuzzy;
+    int incomplete;     /* more matches may come later, do not commit */
     char current[MAX_FILENAME_SIZE];
 };
 
@@ -269,21 +273,37 @@ typedef void (*ColorizeFunc)(QEColorizeContext *cp,
 /* begin to mmap files from this size */
 #define MIN_MMAP_SIZE  (16*1024*1024)
 #define MAX_LOAD_SIZE  (512*1024*1024)
+/* load files asynchronously from this size */
+#define MIN_ASYNC_LOAD_SIZE  (1024*1024)
+/* save files in the background from this size */
+#define MIN_ASYNC_SAVE_SIZE  (16*1024*1024)
 
 #define MAX_PAGE_SIZE  4096
 //#define MAX_PAGE_SIZE 16
 
-#define NB_LOGS_MAX     100000  /* need better way to limit undo information */
-
-#define PG_READ_ONLY    0x0001 /* the page is read only */
+#define NB_LOGS_MAX     100000  /* maximum number of undo records */
+/* default memory budget for the undo records of a buffer */
+#define UNDO_LIMIT        (64*1024*1024)
+/* default size limit for the file where cold undo records are spilled */
+#define UNDO_SPILL_LIMIT  (512*1024*1024)
+/* default size limit for the output kept in shell buffers */
+#define SHELL_SCROLLBACK_SIZE  (32*1024*1024)
+/* default maximum number of files in a project file index */
+#define FILE_INDEX_LIMIT  1000000
+
+#define PG_READ_ONLY    0x0001 /* the page data is shared, copy before writing */
 #define PG_VALID_POS    0x0002 /* set if the nb_lines / col fields are up to date */
 #define PG_VALID_CHAR   0x0004 /* nb_chars is valid */
 #define PG_VALID_COLORS 0x0008 /* color state is valid (unused) */
 
+/* reference counted block of immutable page data */
+typedef struct PageBlock PageBlock;
+
 typedef struct Page {   /* should pack this */
     int size;     /* data size */
     int flags;
     u8 *data;
+    PageBlock *block;  /* block holding the data if PG_READ_ONLY */
     /* the following are needed to handle line / column computation */
     int nb_lines; /* Number of EOL characters in data */
     int col;      /* Number of chars since the last EOL */
@@ -291,6 +311,21 @@ typedef struct Page {   /* should pack this */
     int nb_chars;
 } Page;
 
+/* run length encoded buffer styles: run i applies to the bytes from
+ * runs[i].offset to runs[i + 1].offset, the last run extends to size.
+ */
+typedef struct StyleRun {
+    int offset;
+    QETermStyle style;
+} StyleRun;
+
+typedef struct StyleMap {
+    int size;           /* number of bytes covered: the buffer size */
+    int nb_runs, nb_allocated;
+    int last_run;       /* cache for sequential lookups */
+    StyleRun *runs;
+} StyleMap;
+
 #define DIR_LTR 0
 #define DIR_RTL 1
 
@@ -330,6 +365,8 @@ typedef struct EditBufferDataType {
 #define BF_PREVIEW   0x0008  /* used in dired mode to mark previewed files */
 #define BF_LOADING   0x0010  /* buffer is being loaded */
 #define BF_SAVING    0x0020  /* buffer is being saved */
+#define BF_DEFERRED  0x0040  /* file not loaded yet (restored from session) */
+#define BF_RESTORED  0x0080  /* restored from session, not displayed yet */
 #define BF_DIRED     0x0100  /* buffer is interactive dired */
 #define BF_UTF8      0x0200  /* buffer charset is UTF-8 */
 #define BF_RAW       0x0400  /* buffer charset is raw (no charset translation) */
@@ -339,7 +376,6 @@ typedef struct EditBufferDataType {
 #define BF_STYLE2    0x2000  /* buffer has 2 byte styles */
 #define BF_STYLE4    0x3000  /* buffer has 4 byte styles */
 #define BF_STYLE8    0x4000  /* buffer has 8 byte styles */
-#define BF_IS_STYLE  0x8000  /* buffer is a styles buffer */
 #define BF_IS_LOG    0x10000  /* buffer is a log buffer */
 #define BF_SHELL     0x20000  /* buffer is a shell buffer */
 
@@ -361,6 +397,7 @@ struct EditBuffer {
     void *map_address;
     int map_length;
     int map_handle;
+    PageBlock *map_block;  /* reference to the mapping shared by pages */
 
     /* buffer data type (default is raw) */
     ModeDef *data_mode;
@@ -390,9 +427,12 @@ struct EditBuffer {
     int last_log_char;
     int nb_logs;
     EditBuffer *log_buffer;
+    int log_spill_index;    /* records before this index have been spilled */
+    int log_spill_size;     /* number of bytes written to the spill file */
+    FILE *log_spill_file;   /* temporary file for cold undo payloads */
 
     /* style system */
-    EditBuffer *b_styles;
+    OWNED StyleMap *b_styles;
     QETermStyle cur_style;  /* current style for buffer writing APIs */
     int style_bytes;  /* 0, 1, 2, 4 or 8 bytes per char */
     int style_shift;  /* 0, 0, 1, 2 or 3 */
@@ -401,12 +441,8 @@ struct EditBuffer {
     OWNED EditBufferCallbackList *first_callback;
     OWNED QEProperty *property_list;
 
-#if 0
-    /* asynchronous loading/saving support */
-    struct BufferIOState *io_state;
-    /* used during loading */
-    int probed;
-#endif
+    /* asynchronous loading support */
+    OWNED struct BufferIOState *io_state;
 
     ModeDef *default_mode;
 
@@ -423,13 +459,21 @@ struct EditBuffer {
     /* default mode stuff when buffer is detached from window */
     int offset;
 
+    /* positions restored when a BF_DEFERRED buffer is loaded */
+    int deferred_offset;
+    int deferred_mark;
+
     int tab_width;
     int fill_column;
+    int scrollback_size;    /* maximum size of shell output, 0 for no limit */
+    int scrollback_lines;   /* maximum number of lines of shell output */
     EOLType eol_type;
 
     OWNED EditBuffer *next; /* next editbuffer in qe_state buffer list */
 
-    time_t mtime;                       /* buffer last modification time */
+    time_t mtime;                       /* file modification time when loaded or saved */
+    int watch_wd;                       /* inotify watch for auto-revert or 0 */
+    int watch_pending;                  /* file must be checked for changes */
     int st_mode;                        /* unix file mode */
     const char name[MAX_BUFFERNAME_SIZE];     /* buffer name */
     const char filename[MAX_FILENAME_SIZE];   /* file name */
@@ -442,13 +486,27 @@ struct EditBuffer {
 /* the log buffer is used for the undo operation */
 /* header of log operation */
 typedef struct LogBuffer {
-    u8 pad1, pad2;    /* for Log buffer readability */
+    u8 pad1;          /* for Log buffer readability */
+    u8 encoding;      /* LOG_DATA_xxx, printable for readability */
     u8 op;
     u8 was_modified;
     int offset;
-    int size;
+    int size;         /* number of bytes affected in the buffer */
+    int data_size;    /* size of the payload stored in the log buffer */
 } LogBuffer;
 
+/* encoding of the payload of undo records for deletes and writes */
+#define LOG_DATA_RAW      ':'  /* raw bytes */
+#define LOG_DATA_PACKED   'z'  /* sequence of compressed blocks */
+#define LOG_DATA_MAPPED   'm'  /* int offset into the buffer file mapping */
+#define LOG_DATA_SPILLED  's'  /* LogSpill reference into the spill file */
+
+typedef struct LogSpill {
+    int file_offset;  /* offset of the payload in the spill file */
+    int data_size;    /* size of the payload in the spill file */
+    int encoding;     /* encoding of the spilled payload */
+} LogSpill;
+
 void eb_trace_bytes(const void *buf, int size, int state);
 
 void eb_init(QEmacsState *qs);
@@ -459,6 +517,7 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
                      EditBuffer *src, int src_offset,
                      int size);
 int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
+int eb_insert_block(EditBuffer *b, int offset, u8 **bufp, int size);
 int eb_delete(EditBuffer *b, int offset, int size);
 int eb_replace(EditBuffer *b, int offset, int size, const void *buf, int size1);
 void eb_free_log_buffer(EditBuffer *b);
@@ -508,10 +567,14 @@ void do_undo(EditState *s);
 void do_redo(EditState *s);
 
 int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+int eb_get_load_progress(EditBuffer *b);
+void eb_stop_loading(EditBuffer *b, int err);
 int eb_mmap_buffer(EditBuffer *b, const char *filename);
 void eb_munmap_buffer(EditBuffer *b);
 int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
 int eb_save_buffer(EditBuffer *b);
+int eb_start_saving(EditBuffer *b);
+void eb_wait_saving(EditBuffer *b);
 
 int eb_set_buffer_name(EditBuffer *b, const char *name1);
 void eb_set_filename(EditBuffer *b, const char *filename);
@@ -523,6 +586,7 @@ void eb_offset_callback(EditBuffer *b, void *opaque, int edge,
 int eb_create_style_buffer(EditBuffer *b, int flags);
 void eb_free_style_buffer(EditBuffer *b);
 QETermStyle eb_get_style(EditBuffer *b, int offset);
+int eb_get_style_run(EditBuffer *b, int offset, QETermStyle *stylep);
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
                   int offset, int size);
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
@@ -743,6 +807,8 @@ struct EditState {
     char modeline_shadow[MAX_SCREEN_WIDTH];
     OWNED QELineShadow *line_shadow; /* per window shadow CRC data */
     int shadow_nb_lines;
+    int shadow_offset_top;  /* offset_top and y_disp for line_shadow */
+    int shadow_y_disp;
     /* compose state for input method */
     InputMethod *input_method; /* current input method */
     InputMethod *selected_input_method; /* selected input method (used to switch) */
@@ -804,6 +870,9 @@ struct ModeDef {
     int (*mode_init)(EditState *s, EditBuffer *b, int flags);
     void (*mode_close)(EditState *s);
     void (*mode_free)(EditBuffer *b, void *state);
+    /* decode a file ahead of display (eg: dired preview neighbours),
+       return < 0 if the file could not be loaded */
+    int (*mode_prefetch)(ModeDef *m, const char *filename);
 
     /* low level display functions (must be NULL to use text related
        functions)*/
@@ -864,6 +933,8 @@ int qe_free_mode_data(QEModeData *md);
 /* from tty.c */
 /* set from command line option to prevent GUI such as X11 */
 extern int force_tty;
+extern int tty_dither;
+extern int tty_graphics;
 
 enum QEStyle {
 #define STYLE_DEF(constant, name, fg_color, bg_color, \
@@ -1006,6 +1077,15 @@ struct QEmacsState {
     int hilite_region;  /* hilite the current region when selecting */
     int mmap_threshold; /* minimum file size for mmap */
     int max_load_size;  /* maximum file size for loading in memory */
+    int async_load_threshold;  /* minimum file size for background loading */
+    int async_save_threshold;  /* minimum buffer size for background saving */
+    int global_auto_revert_mode;  /* update unmodified buffers when their file changes */
+    int undo_limit;     /* maximum memory size of undo records per buffer */
+    int undo_spill_limit;  /* maximum size of undo spill files */
+    int shell_scrollback_size;   /* default scrollback-size for shell buffers */
+    int shell_scrollback_lines;  /* default scrollback-lines for shell buffers */
+    int file_index_limit;  /* maximum number of files in a project index */
+    char project_root[MAX_FILENAME_SIZE];  /* root for the file index */
     int default_tab_width;      /* DEFAULT_TAB_WIDTH */
     int default_fill_column;    /* DEFAULT_FILL_COLUMN */
     EOLType default_eol_type;  /* EOL_UNIX */
@@ -1203,6 +1283,8 @@ struct DisplayState {
     int eol_reached;
     EditState *edit_state;
     QETermStyle style;   /* current style for display_printf... */
+    QELineShadow *line_shadow;  /* line signatures output for DISP_SHADOW */
+    int shadow_nb_lines;
 
 #if 0
     QEFont *font;
@@ -1237,6 +1319,7 @@ enum DisplayType {
     DISP_CURSOR,
     DISP_PRINT,
     DISP_CURSOR_SCREEN,
+    DISP_SHADOW,        /* compute line shadows without output */
 };
 
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp,
@@ -1294,6 +1377,11 @@ struct InputMethod {
     int (*input_match)(int *match_buf, int match_buf_size,
                        int *match_len_ptr, const u8 *data,
                        const char32_t *buf, int len);
+    /* input candidates appends to 'out' at most 'max_count' possible
+       completions of the keystrokes in buf and returns their number.
+       May be NULL. */
+    int (*input_candidates)(buf_t *out, int max_count, const u8 *data,
+                            const char32_t *buf, int len);
     const u8 *data;
     InputMethod *next;
 };
@@ -1304,6 +1392,7 @@ void do_switch_input_method(EditState *s);
 void input_methods_init(QEmacsState *qs);
 int load_input_methods(const char *filename);
 void unload_input_methods(void);
+void do_input_method_benchmark(EditState *s, const char *name);
 
 /* the following will be suppressed */
 #define LINE_MAX_SIZE 256
@@ -1414,6 +1503,9 @@ void do_delete_window(EditState *s, int force);
 EditState *qe_split_window(EditState *s, int side_by_side, int prop);
 void do_split_window(EditState *s, int prop, int side_by_side);
 void do_create_window(EditState *s, const char *filename, const char *layout);
+void do_restore_buffer(EditState *s, const char *filename, const char *state);
+int eb_load_deferred(EditBuffer *b);
+void qe_auto_revert_update(void);
 void qe_save_window_layout(EditState *s, EditBuffer *b);
 
 void edit_display(QEmacsState *qs);
@@ -1450,6 +1542,8 @@ void do_query_replace(EditState *s, const char *search_str,
 void do_replace_string(EditState *s, const char *search_str,
                        const char *replace_str, int argval);
 void do_search_string(EditState *s, const char *search_str, int dir);
+void do_multi_occur(EditState *s, const char *search_str);
+void do_project_grep(EditState *s, const char *search_str, const char *dir);
 void do_refresh_complete(EditState *s);
 void do_kill_buffer(EditState *s, const char *bufname, int force);
 void switch_to_buffer(EditState *s, EditBuffer *b);
@@ -1803,6 +1897,7 @@ int qe_bitmap_format_to_pix_fmt(int format);
 /* shell.c */
 
 const char *get_shell(void);
+void set_error_offset(EditBuffer *b, int offset);
 void shell_colorize_line(QEColorizeContext *cp,
                          char32_t *str, int n, ModeDef *syn);
 
@@ -394,6 +394,11 @@ static const CmdDef basic_commands[] = {
           do_create_window, ESss,
           "s{Filename: }[file]|file|"
           "s{Layout: }|layout|")
+    CMD2( "restore-buffer", "",
+          "Create a buffer for a file, loaded when first displayed",
+          do_restore_buffer, ESss,
+          "s{Filename: }[file]|file|"
+          "s{State: }|state|")
     CMD1( "save-session", "",
           "Save the current session in a .qesession file",
           do_save_session, 1)
@@ -437,6 +442,12 @@ static const CmdDef basic_commands[] = {
     CMD0( "switch-input-method", "C-x C-\\",
           "",
           do_switch_input_method)
+#ifdef CONFIG_ALL_KMAPS
+    CMD2( "input-method-benchmark", "",
+          "Time typing all the key sequences of a kmap input method",
+          do_input_method_benchmark, ESs,
+          "s{Input method: }[input]|input|")
+#endif
 
     /*---------------- Styles & display ----------------*/
 
@@ -511,6 +522,11 @@ static const CmdDef basic_commands[] = {
     CMD2( "global-linum-mode", "",
           "Control the display of line numbers in the left gutter for all buffers",
           do_global_linum_mode, ESi, "P")
+#ifndef CONFIG_TINY
+    CMD2( "global-auto-revert-mode", "",
+          "Control the update of unmodified buffers when their files change on disk",
+          do_global_auto_revert_mode, ESi, "P")
+#endif
     CMD2( "linum-mode", "C-x RET l, C-c l",
           "Control the display of line numbers in the left gutter for the current buffer",
           do_linum_mode, ESi, "P")
@@ -23,6 +23,8 @@
  * THE SOFTWARE.
  */
 
+#include <dirent.h>
+
 #include "qe.h"
 #include "variables.h"
 
@@ -1449,6 +1451,300 @@ void do_search_string(EditState *s, const char *search_str, int mode)
     }
 }
 
+/* Append the lines of buffer <b> matching the search string to buffer
+ * <b1> as "name:line:text" locations usable by next-error,
+ * return the number of matching lines.
+ */
+static int eb_list_matching_lines(EditBuffer *b1, EditBuffer *b,
+                                  const char *name, int flags,
+                                  const char32_t *buf, int len)
+{
+    int offset, found_offset, found_end, p1, p2, p3;
+    int line_num, col_num, count;
+
+    count = 0;
+    for (offset = 0; offset < b->total_size; offset = p2) {
+        if (eb_search(b, 1, flags, offset, b->total_size, buf, len,
+                      NULL, NULL, &found_offset, &found_end) <= 0)
+            break;
+        p1 = eb_goto_bol(b, found_offset);
+        p2 = found_end;
+        if (eb_prevc(b, p2, &p3) != '\n')
+            p2 = eb_next_line(b, p2);
+        eb_get_pos(b, &line_num, &col_num, p1);
+        b1->offset = b1->total_size;
+        eb_printf(b1, "%s:%d:", name, line_num + 1);
+        eb_insert_buffer_convert(b1, b1->total_size, b, p1, p2 - p1);
+        if (eb_prevc(b1, b1->total_size, &p3) != '\n')
+            eb_insert_char32(b1, b1->total_size, '\n');
+        count++;
+        if (p2 <= found_offset)
+            break;
+    }
+    return count;
+}
+
+static EditBuffer *occur_new_buffer(const char *name)
+{
+    EditBuffer *b;
+
+    b = eb_find_new(name, BF_UTF8);
+    if (b) {
+        b->flags &= ~BF_READONLY;
+        eb_delete(b, 0, b->total_size);
+#if !defined(CONFIG_TINY) && !defined(CONFIG_WIN32)
+        /* make the locations available to next-error */
+        set_error_offset(b, 0);
+#endif
+    }
+    return b;
+}
+
+void do_multi_occur(EditState *s, const char *search_str)
+{
+    QEmacsState *qs = s->qe_state;
+    char32_t search_u32[SEARCH_LENGTH];
+    int search_u32_len, flags, count, nb_buffers;
+    EditBuffer *b, *b1, *b2, *tmp = NULL;
+    FILE *f;
+
+    flags = search_string_get_flags(search_str, SEARCH_FLAG_DEFAULT, &search_str);
+    search_u32_len = search_to_u32(search_u32, countof(search_u32), search_str, flags);
+    if (search_u32_len <= 0)
+        return;
+
+    b1 = occur_new_buffer("*occur*");
+    if (!b1)
+        return;
+
+    count = nb_buffers = 0;
+    for (b = qs->first_buffer; b != NULL; b = b->next) {
+        int n;
+        if (b == b1 || (b->flags & BF_SYSTEM) || b->name[0] == '*')
+            continue;
+        eb_load_deferred(b);
+        b2 = b;
+        if ((b->flags & BF_LOADING)
+        &&  (tmp || (tmp = eb_new("*occur-tmp*", BF_SYSTEM)) != NULL)) {
+            /* search the whole file, not just the part loaded so far */
+            eb_clear(tmp);
+            eb_set_charset(tmp, b->charset, b->eol_type);
+            f = fopen(b->filename, "r");
+            if (f) {
+                eb_raw_buffer_load1(tmp, f, 0);
+                fclose(f);
+                b2 = tmp;
+            }
+        }
+        n = eb_list_matching_lines(b1, b2, *b->filename ? b->filename : b->name,
+                                   flags, search_u32, search_u32_len);
+        count += n;
+        nb_buffers += (n > 0);
+    }
+    eb_free(&tmp);
+    if (!count) {
+        put_status(s, "no matches");
+        return;
+    }
+    eb_printf(b1, "// %d lines in %d buffers\n", count, nb_buffers);
+    b1->offset = 0;
+    b1->flags |= BF_READONLY;
+    show_popup(s, b1, "Matches");
+}
+
+/* Project grep: the files of a directory tree are searched
+ * incrementally from a timer in the main loop, so the results are
+ * shown while the search proceeds and editing is not blocked. Files
+ * are mmapped into a scratch buffer and searched with eb_search, files
+ * visited in a buffer are searched from the buffer contents.
+ */
+#define GREP_SLICE_MS   40    /* time slice for each batch of files */
+#define GREP_MAX_DEPTH  32    /* maximum depth of the directory tree */
+
+typedef struct GrepState {
+    EditBuffer *b;          /* buffer for the results */
+    EditBuffer *tmp;        /* scratch buffer for the files on disk */
+    QETimer *timer;
+    int flags;
+    int search_u32_len;
+    int depth;
+    DIR *dirs[GREP_MAX_DEPTH];
+    int dir_len[GREP_MAX_DEPTH];  /* length of directory path with '/' */
+    int name_offset;        /* offset of file names relative to cwd */
+    int nb_files, nb_matches, nb_found;
+    char path[MAX_FILENAME_SIZE];
+    char32_t search_u32[SEARCH_LENGTH];
+} GrepState;
+
+static GrepState *grep_state;
+
+static void grep_stop(GrepState **gsp)
+{
+    GrepState *gs = *gsp;
+
+    if (gs) {
+        qe_kill_timer(&gs->timer);
+        while (gs->depth > 0)
+            closedir(gs->dirs[--gs->depth]);
+        eb_free(&gs->tmp);
+        qe_free(gsp);
+    }
+}
+
+static int grep_push_dir(GrepState *gs)
+{
+    int len = strlen(gs->path);
+    DIR *dir;
+
+    if (gs->depth >= GREP_MAX_DEPTH || len + 2 >= ssizeof(gs->path))
+        return -1;
+    dir = opendir(gs->path);
+    if (!dir)
+        return -1;
+    if (len == 0 || gs->path[len - 1] != '/')
+        gs->path[len++] = '/';
+    gs->path[len] = '\0';
+    gs->dirs[gs->depth] = dir;
+    gs->dir_len[gs->depth] = len;
+    gs->depth++;
+    return 0;
+}
+
+/* Get the next regular file in the tree into gs->path, return 0 if found */
+static int grep_next_file(GrepState *gs)
+{
+    struct dirent *d;
+    struct stat st;
+    int len;
+
+    while (gs->depth > 0) {
+        d = readdir(gs->dirs[gs->depth - 1]);
+        if (!d) {
+            closedir(gs->dirs[--gs->depth]);
+            continue;
+        }
+        /* skip hidden files and directories such as .git */
+        if (d->d_name[0] == '.')
+            continue;
+        len = gs->dir_len[gs->depth - 1];
+        gs->path[len] = '\0';
+        if (len + (int)strlen(d->d_name) >= ssizeof(gs->path))
+            continue;
+        pstrcat(gs->path, sizeof(gs->path), d->d_name);
+        /* do not follow symbolic links to avoid loops */
+        if (lstat(gs->path, &st))
+            continue;
+        if (S_ISDIR(st.st_mode)) {
+            grep_push_dir(gs);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > 0)
+            return 0;
+    }
+    return -1;
+}
+
+static void grep_file(GrepState *gs)
+{
+    EditBuffer *b;
+    const char *name = gs->path + gs->name_offset;
+    u8 buf[1024];
+    int n;
+
+    gs->nb_files++;
+    b = eb_find_file(gs->path);
+    /* read the file if the buffer contents are incomplete */
+    if (!b || (b->flags & (BF_LOADING | BF_DEFERRED))) {
+        b = gs->tmp;
+        eb_clear(b);
+#ifdef CONFIG_MMAP
+        if (eb_mmap_buffer(b, gs->path))
+#endif
+        {
+            FILE *f = fopen(gs->path, "r");
+            if (!f)
+                return;
+            eb_raw_buffer_load1(b, f, 0);
+            fclose(f);
+        }
+        /* skip binary files */
+        n = eb_read(b, 0, buf, sizeof(buf));
+        if (memchr(buf, '\0', n))
+            return;
+    }
+    n = eb_list_matching_lines(gs->b, b, name, gs->flags,
+                               gs->search_u32, gs->search_u32_len);
+    gs->nb_matches += n;
+    gs->nb_found += (n > 0);
+}
+
+static void grep_timer_cb(void *opaque)
+{
+    GrepState *gs = opaque;
+    int start_time;
+
+    gs->timer = NULL;
+    if (gs != grep_state || !check_buffer(&gs->b)) {
+        grep_stop(&grep_state);
+        return;
+    }
+    /* the popup makes the results buffer readonly */
+    gs->b->flags &= ~BF_READONLY;
+    start_time = get_clock_ms();
+    while (get_clock_ms() - start_time < GREP_SLICE_MS) {
+        if (grep_next_file(gs)) {
+            gs->b->offset = gs->b->total_size;
+            eb_printf(gs->b, "// %d lines in %d files, %d files searched\n",
+                      gs->nb_matches, gs->nb_found, gs->nb_files);
+            gs->b->flags |= BF_READONLY;
+            put_status(NULL, "Grep finished: %d matches", gs->nb_matches);
+            grep_stop(&grep_state);
+            url_redisplay();
+            return;
+        }
+        grep_file(gs);
+    }
+    gs->b->flags |= BF_READONLY;
+    gs->timer = qe_add_timer(0, gs, grep_timer_cb);
+    url_redisplay();
+}
+
+void do_project_grep(EditState *s, const char *search_str, const char *dir)
+{
+    char cwd[MAX_FILENAME_SIZE];
+    GrepState *gs;
+    int len;
+
+    grep_stop(&grep_state);
+
+    gs = qe_mallocz(GrepState);
+    if (!gs)
+        return;
+    gs->flags = search_string_get_flags(search_str, SEARCH_FLAG_DEFAULT,
+                                        &search_str);
+    gs->search_u32_len = search_to_u32(gs->search_u32, countof(gs->search_u32),
+                                       search_str, gs->flags);
+    canonicalize_absolute_buffer_path(s->b, s->offset, gs->path,
+                                      sizeof(gs->path), *dir ? dir : ".");
+    gs->tmp = eb_new("*grep-tmp*", BF_SYSTEM | BF_UTF8);
+    gs->b = occur_new_buffer("*grep*");
+    if (gs->search_u32_len <= 0 || !gs->tmp || !gs->b || grep_push_dir(gs)) {
+        put_status(s, "Cannot search %s", gs->path);
+        grep_stop(&gs);
+        return;
+    }
+    /* show file names relative to the current directory if possible */
+    if (getcwd(cwd, sizeof(cwd))) {
+        len = strlen(cwd);
+        if (!strncmp(gs->path, cwd, len) && gs->path[len] == '/')
+            gs->name_offset = len + 1;
+    }
+    eb_printf(gs->b, "// grep \"%s\" in %s\n", search_str, gs->path);
+    grep_state = gs;
+    gs->timer = qe_add_timer(0, gs, grep_timer_cb);
+    show_popup(s, gs->b, "Grep");
+}
+
 static void minibuffer_search_start_edit(EditState *s) {
     ISearchState *is = set_search_state(s->target_window, 1, 1);
     if (is != NULL) {
@@ -1615,6 +1911,15 @@ static const CmdDef search_commands[] = {
           do_search_string, ESsi, "*"
           "s{List lines containing: }[search]|search|"
           "v", CMD_LIST_MATCHING_LINES)
+    CMD2( "multi-occur", "",
+          "List lines containing a string in all buffers",
+          do_multi_occur, ESs,
+          "s{List lines in all buffers containing: }[search]|search|")
+    CMD2( "project-grep", "",
+          "List lines containing a string in the files of a directory tree",
+          do_project_grep, ESss,
+          "s{Grep for: }[search]|search|"
+          "s{In directory: }[file]|file|")
     /* passing argument should switch to regex incremental search */
     CMD3( "isearch-backward", "C-r",
           "Search backward incrementally",
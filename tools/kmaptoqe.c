@@ -35,8 +35,6 @@
 #define countof(a)  ((int)(sizeof(a) / sizeof((a)[0])))
 #endif
 
-//#define TEST
-
 #define NB_MAX 15000
 
 typedef struct InputEntry {
@@ -44,151 +42,189 @@ typedef struct InputEntry {
     int len;
     unsigned short output[20];
     int olen;
-    int order;
 } InputEntry;
 
+/* The input sequences of each kmap are stored as a trie:
+ *   u8 flags          0x80: sequences end with an implicit space
+ *   u24 root          offset of the root node
+ * followed by the nodes, children before their parent:
+ *   u8 n              number of children
+ *   u8 olen           number of output code points, 0 if none
+ *   u16 output[olen]
+ *   u8 label[n]       input characters in increasing order
+ *   u24 child[n]      offsets of the child nodes
+ * Offsets are relative to the flags byte.  A child that is a leaf
+ * with a single output is stored inline as 0x80 followed by the u16
+ * output.  Identical subtrees are emitted once, which turns the trie
+ * into an acyclic automaton.
+ */
+typedef struct TrieNode {
+    struct TrieNode *first;     /* children in increasing label order */
+    struct TrieNode *next;      /* next sibling */
+    InputEntry *entry;          /* mapping for the sequence, if any */
+    int label;
+    int offset;                 /* offset of the emitted node */
+} TrieNode;
+
+#define NODE_MAX  (NB_MAX * 8)
+/* power of 2 above 2 * NODE_MAX: the open addressing probes in
+   trie_emit() always find a free slot */
+#define HASH_SIZE (1 << 18)
+
+#if HASH_SIZE < 2 * NODE_MAX
+#error "HASH_SIZE is too small for NODE_MAX"
+#endif
+
 static InputEntry inputs[NB_MAX];
 static int nb_inputs;
 static char kmap_names[300][128];
 static int kmap_offsets[300];
 static int nb_kmaps;
 static char name[128];
-static int table_start[NB_MAX], nb_starts;
-static int table_val[NB_MAX];
-static int is_chinese_cj, gen_table;
-static int freq[32];
+static int is_chinese_cj;
 static FILE *outfile;
-static unsigned char outbuf[100000], *outbuf_ptr;
+static TrieNode trie_nodes[NODE_MAX];
+static int nb_nodes;
+static int node_hash[HASH_SIZE];    /* emitted node offset + 1 */
+static int node_len[1 << 22];       /* emitted node length by offset */
+static unsigned char outbuf[1 << 22], *outbuf_ptr, *kmap_start;
 
-/* sort function implements strict order, making qsort stable */
-static int sort_func(const void *a1, const void *b1)
+static TrieNode *trie_new_node(int label)
 {
-    const InputEntry *a = a1;
-    const InputEntry *b = b1;
-    int val;
-
-    if (gen_table) {
-        val = a->input[0] - b->input[0];
-        if (val != 0)
-            return val;
+    TrieNode *np;
+
+    if (nb_nodes >= NODE_MAX) {
+        fprintf(stderr, "kmaptoqe: too many trie nodes\n");
+        exit(1);
+    }
+    np = &trie_nodes[nb_nodes++];
+    memset(np, 0, sizeof(*np));
+    np->label = label;
+    return np;
+}
+
+static int trie_add(TrieNode *root, InputEntry *ip, int len)
+{
+    TrieNode *np = root, **npp;
+    int i, c;
+
+    for (i = 0; i < len; i++) {
+        c = ip->input[i];
+        for (npp = &np->first; *npp && (*npp)->label < c; npp = &(*npp)->next)
+            continue;
+        if (!*npp || (*npp)->label != c) {
+            TrieNode *np1 = trie_new_node(c);
+            np1->next = *npp;
+            *npp = np1;
+        }
+        np = *npp;
     }
-    val = a->output[0] - b->output[0];
-    if (val != 0)
-        return val;
-    return a->order - b->order;
+    if (np->entry)
+        return -1;
+    np->entry = ip;
+    return 0;
 }
 
+static unsigned int hash_bytes(const unsigned char *p, int len)
+{
+    unsigned int h = 0;
 
-static int offset, write_data;
+    while (len-- > 0)
+        h = h * 31 + *p++;
+    return h;
+}
 
-static void put_byte(int b)
+static int trie_is_leaf(TrieNode *np)
 {
-    if (write_data)
-        *outbuf_ptr++ = b;
-    offset++;
+    return !np->first && np->entry->olen == 1;
 }
 
-static void gen_map(void)
+/* emit the children, then the node unless an identical node was
+   already emitted for this kmap */
+static int trie_emit(TrieNode *np)
 {
-    int len, c, d, last, delta, i, k, j;
-    int last_input0;
-    InputEntry *ip;
+    TrieNode *np1;
+    unsigned char *q;
+    unsigned int h;
+    int i, n, len, off;
 
-    last = 0;
-    nb_starts = 0;
-    last_input0 = 0;
-    offset = 0;
-    for (k = 0, ip = inputs; k < nb_inputs; k++, ip++) {
-        unsigned char *input = ip->input;
-        int first, output;
-
-        if (gen_table) {
-            if (last_input0 != ip->input[0]) {
-                if (last_input0 != 0)
-                    put_byte(0);
-                last_input0 = ip->input[0];
-                table_val[nb_starts] = last_input0;
-                table_start[nb_starts++] = offset;
-                last = 0;
-            }
+    for (n = 0, np1 = np->first; np1; np1 = np1->next, n++) {
+        if (!trie_is_leaf(np1))
+            trie_emit(np1);
+    }
+    q = outbuf_ptr;
+    if (q + 2 + 40 + 4 * n > outbuf + sizeof(outbuf)) {
+        fprintf(stderr, "kmaptoqe: output too large\n");
+        exit(1);
+    }
+    *q++ = n;
+    *q++ = np->entry ? np->entry->olen : 0;
+    if (np->entry) {
+        for (i = 0; i < np->entry->olen; i++) {
+            *q++ = (np->entry->output[i] >> 8) & 0xff;
+            *q++ = np->entry->output[i] & 0xff;
         }
+    }
+    for (np1 = np->first; np1; np1 = np1->next) {
+        *q++ = np1->label;
+    }
+    for (np1 = np->first; np1; np1 = np1->next) {
+        if (trie_is_leaf(np1)) {
+            *q++ = 0x80;
+            *q++ = (np1->entry->output[0] >> 8) & 0xff;
+            *q++ = np1->entry->output[0] & 0xff;
+            continue;
+        }
+        *q++ = (np1->offset >> 16) & 0xff;
+        *q++ = (np1->offset >> 8) & 0xff;
+        *q++ = np1->offset & 0xff;
+    }
+    len = q - outbuf_ptr;
+    for (h = hash_bytes(outbuf_ptr, len);; h++) {
+        off = node_hash[h & (HASH_SIZE - 1)] - 1;
+        if (off < 0)
+            break;
+        if (node_len[off] == len && !memcmp(kmap_start + off, outbuf_ptr, len))
+            return np->offset = off;
+    }
+    np->offset = off = outbuf_ptr - kmap_start;
+    if (off >= (1 << 23) - 1) {
+        fprintf(stderr, "kmaptoqe: kmap too large\n");
+        exit(1);
+    }
+    node_hash[h & (HASH_SIZE - 1)] = off + 1;
+    node_len[off] = len;
+    outbuf_ptr = q;
+    return off;
+}
 
-        len = ip->len;
-        output = ip->output[0];
-        delta = output - last;
-        last = output;
-
-#ifdef TEST
-        /* frequencies */
-        if (delta > 30)
-            delta = 30;
-        else if (delta < -1)
-            delta = -1;
-        freq[delta + 1]++;
-#endif
+static void gen_map(const char *filename)
+{
+    TrieNode *root;
+    InputEntry *ip;
+    int k, len, off;
 
+    nb_nodes = 0;
+    memset(node_hash, 0, sizeof(node_hash));
+    root = trie_new_node(0);
+    for (k = 0, ip = inputs; k < nb_inputs; k++, ip++) {
+        len = ip->len;
         if (is_chinese_cj) {
-            assert(input[len-1] == ' ');
+            assert(ip->input[len - 1] == ' ');
             len--;
         }
-
-        first = 0;
-        if (gen_table)
-            first = 1;
-
-        /* c = 0x00        end of table
-         * c = 0x01..0x1d  delta unicode
-         * c = 0x1e        unicode output mapping follows
-         * c = 0x1f        unicode input char follows.
-         * c = 0x20..0x7f  input character
-         * c = 0x80        unused
-         * c = 0x81        unused
-         * c = 0x82..0x9d  extra unicode outputs follow
-         * c = 0x9e        first unicode output mapping follows
-         * c = 0x9f        last unicode input char follows and delta==1.
-         * c = 0xa0..0xff  last input character and delta==1
-         */
-        for (j = first; j < len; j++) {
-            c = input[j];
-            d = 0;
-            if (j == (len - 1) && delta == 1 && ip->olen == 1)
-                d = 0x80;
-            if (c >= 0x20 && c <= 0x7f) {
-                put_byte(c | d);
-            } else {
-                put_byte(d | 0x1f);
-                put_byte((c >> 8) & 0xff);
-                put_byte(c & 0xff);
-            }
-        }
-        if (ip->olen > 1) {
-            if (delta != 0) {
-                put_byte(0x80 | 0x1e);
-                put_byte((output >> 8) & 0xff);
-                put_byte(output & 0xff);
-            }
-            put_byte(0x80 | ip->olen);
-            for (i = 1; i < ip->olen; i++) {
-                put_byte((ip->output[i] >> 8) & 0xff);
-                put_byte(ip->output[i] & 0xff);
-            }
-        } else {
-            /* XXX: potential problem if first == len. We avoid it
-            by forcing an emission of a unicode char */
-            if (first == len)
-                delta = 0;
-            if (delta != 1) {
-                if (delta >= 1 && delta <= 0x1d) {
-                    put_byte(delta);
-                } else {
-                    put_byte(0x1e);
-                    put_byte((output >> 8) & 0xff);
-                    put_byte(output & 0xff);
-                }
-            }
+        if (trie_add(root, ip, len) < 0) {
+            fprintf(stderr, "%s: duplicate mapping ignored for entry %d\n",
+                    filename, k + 1);
         }
     }
-    put_byte(0);
+    kmap_start = outbuf_ptr;
+    outbuf_ptr += 4;
+    off = trie_emit(root);
+    kmap_start[0] = is_chinese_cj ? 0x80 : 0;
+    kmap_start[1] = (off >> 16) & 0xff;
+    kmap_start[2] = (off >> 8) & 0xff;
+    kmap_start[3] = off & 0xff;
 }
 
 static void putcp(int c, int *sp)
@@ -236,220 +272,113 @@ static void putcp(int c, int *sp)
     }
 }
 
+static unsigned char dump_input[64];
+
+static void dump_leaf(int level, int trailing_space,
+                      const unsigned char *p, int olen)
+{
+    int i, sp = 1;
+
+    printf("            \"");
+    for (i = 0; i < level; i++) {
+        putcp(dump_input[i], &sp);
+    }
+    if (trailing_space) {
+        putcp(' ', &sp);
+    }
+    if (!sp)
+        printf(" ");
+    printf("=");
+    for (i = 0; i < olen; i++, p += 2) {
+        printf(" 0x%04X", (p[0] << 8) | p[1]);
+    }
+    printf("\",\n");
+}
+
+static void dump_node(const unsigned char *base, int off, int level)
+{
+    const unsigned char *p = base + off;
+    int i, n, olen, c;
+
+    n = p[0];
+    olen = p[1];
+    p += 2;
+    if (olen) {
+        dump_leaf(level, base[0] & 0x80, p, olen);
+        p += 2 * olen;
+    }
+    if (level >= countof(dump_input))
+        return;
+    for (i = 0; i < n; i++) {
+        const unsigned char *q = p + n + 3 * i;
+        c = p[i];
+        dump_input[level] = c;
+        if (q[0] & 0x80) {
+            dump_leaf(level + 1, base[0] & 0x80, q + 1, 1);
+        } else {
+            dump_node(base, (q[0] << 16) | (q[1] << 8) | q[2], level + 1);
+        }
+    }
+}
+
 static int dump_kmap(const char *filename)
 {
     FILE *f;
-    char buf[1024];
-    int i, n, c, off, pos, x;
+    unsigned char *buf, *p;
+    long size;
+    int i, off;
 
     f = fopen(filename, "rb");
     if (!f) {
         fprintf(stderr, "kmaptoqe: cannot open %s\n", filename);
         return 1;
     }
-    if (fread(buf, 4, 1, f) != 1 || memcmp(buf, "kmap", 4)) {
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(size + 1);
+    if (!buf || fread(buf, 1, size, f) != (size_t)size
+    ||  size < 8 || memcmp(buf, "kmp2", 4)) {
         fprintf(stderr, "kmaptoqe: invalid signature %s\n", filename);
         fclose(f);
+        free(buf);
         return 1;
     }
+    fclose(f);
+    buf[size] = '\0';
+
     printf("// Dump of QEmacs kmap file %s\n"
            "kmap {\n", filename);
     printf("    {\n");
-    for (nb_kmaps = 0;; nb_kmaps++) {
-        off  = getc(f) << 24;
-        off |= getc(f) << 16;
-        off |= getc(f) << 8;
-        off |= getc(f) << 0;
+    p = buf + 4;
+    for (nb_kmaps = 0; p + 4 < buf + size; nb_kmaps++) {
+        off = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
         if (off == 0)
             break;
-        kmap_offsets[nb_kmaps] = off;
-        for (i = 0;; i++) {
-            c = getc(f);
-            if (c == EOF || i >= countof(kmap_names[nb_kmaps])) {
-                fprintf(stderr, "%s: invalid map name\n", filename);
-                fclose(f);
-                return 1;
-            }
-            kmap_names[nb_kmaps][i] = c;
-            if (c == 0)
-                break;
+        if (off + 4 > size || nb_kmaps >= countof(kmap_offsets)) {
+            fprintf(stderr, "%s: invalid map offset\n", filename);
+            free(buf);
+            return 1;
         }
+        kmap_offsets[nb_kmaps] = off;
+        pstrcpy(kmap_names[nb_kmaps], sizeof(kmap_names[nb_kmaps]),
+                (char *)p + 4);
+        p += 4 + strlen((char *)p + 4) + 1;
         printf("        0x%04x: %s\n", off, kmap_names[nb_kmaps]);
     }
     printf("    }\n");
 
-    pos = ftell(f);
-
-    for (n = x = 0;;) {
-
-        if (pos == kmap_offsets[n]) {
-
-            if (x > 0) {
-                printf("\n");
-                x = 0;
-            }
-            if (n > 0) {
-                printf("        }\n");
-                printf("    }\n");
-            }
-            printf("\n    { // %s\n", kmap_names[n]);
-            c = getc(f);
-            pos++;
-            nb_starts = c & 0x7F;
-            is_chinese_cj = c >> 7;
-            gen_table = (nb_starts > 0);
-
-            printf("        nb_starts=%d, is_chinese_cj=%d\n",
-                   nb_starts, is_chinese_cj);
-
-            if (gen_table) {
-                printf("        {\n");
-                for (i = 0; i < nb_starts; i++) {
-                    c = getc(f);
-                    off  = getc(f) << 16;
-                    off |= getc(f) << 8;
-                    off |= getc(f) << 0;
-                    pos += 4;
-                    table_val[i] = c;
-                    table_start[i] = off;
-                    printf("            table_val[%d]=0x%02x ('%c'), table_start[%d]=0x%04x\n",
-                           i, c, c, i, off);
-                }
-                printf("        }\n");
-            }
-            n++;
-            printf("        {\n");
-            x = 0;
-
-            if (1) {
-                int len, olen, flag, k, s, last = 0, sp;
-
-                s = 0;
-                for (k = 0;; k++) {
-                    unsigned char *input;
-
-                    input = inputs[k].input;
-                    olen = 1;
-                    len = 0;
-                    sp = 1;
-
-                nextc:
-                    c = getc(f);
-                    pos++;
-                    if (c == EOF)
-                        break;
-
-                    /* c = 0x00        end of table
-                     * c = 0x01..0x1d  delta unicode
-                     * c = 0x1e        unicode output mapping follows
-                     * c = 0x1f        unicode input char follows.
-                     * c = 0x20..0x7f  input character
-                     * c = 0x80        unused
-                     * c = 0x81        unused
-                     * c = 0x82..0x9d  extra unicode outputs follow
-                     * c = 0x9e        first unicode output mapping follows
-                     * c = 0x9f        last unicode input char follows and delta==1.
-                     * c = 0xa0..0xff  last input character and delta==1
-                     */
-                    if (c == 0) {
-                        if (!gen_table || ++s >= nb_starts)
-                            break;
-                        last = 0;
-                        goto nextc;
-                    }
-
-                    if (len == 0) {
-                        printf("            \"");
-                        if (gen_table) {
-                            putcp(table_val[s], &sp);
-                        }
-                    }
-
-                    flag = c >> 7;
-                    c &= 0x7f;
-
-                    if (c < 0x1e) {
-                        if (flag) {
-                            olen = c;
-                        } else {
-                            last += c;
-                        }
-                        goto nextk;
-                    }
-                    if (c == 0x1e) {
-                        last  = getc(f) << 8;
-                        last |= getc(f) << 0;
-                        pos += 2;
-                        if (flag)
-                            goto nextc;
-                        else
-                            goto nextk;
-                    }
-                    if (c == 0x1f) {
-                        c  = getc(f) << 8;
-                        c |= getc(f) << 0;
-                        pos += 2;
-                        input[len++] = c;
-                        putcp(c, &sp);
-                        if (flag) {
-                            last += 1;
-                            goto nextk;
-                        }
-                        goto nextc;
-                    }
-                    if (c >= 0x20) {
-                        input[len++] = c;
-                        putcp(c, &sp);
-                        if (flag) {
-                            last += 1;
-                            goto nextk;
-                        }
-                        goto nextc;
-                    }
-                nextk:
-                    if (is_chinese_cj) {
-                        putcp(' ', &sp);
-                    }
-                    if (!sp)
-                        printf(" ");
-                    printf("= 0x%04X", last);
-                    /* multiple unicode chars */
-                    for (i = 1; i < olen; i++) {
-                        c  = getc(f) << 8;
-                        c |= getc(f) << 0;
-                        pos += 2;
-                        printf(" 0x%04X", c);
-                    }
-                    printf("\",\n");
-                }
-            }
-            if (pos == kmap_offsets[n])
-                continue;
-        }
-
-        if ((c = getc(f)) == EOF)
-            break;
-        pos++;
-
-        if (x == 0)
-            printf("            ");
-        printf("0x%02x, ", c);
-        if (++x == 8) {
-            printf("\n");
-            x = 0;
-        }
-    }
-
-    if (x > 0)
-        printf("\n");
-
-    if (n > 0) {
+    for (i = 0; i < nb_kmaps; i++) {
+        unsigned char *base = buf + kmap_offsets[i];
+        printf("\n    { // %s\n", kmap_names[i]);
+        printf("        is_chinese_cj=%d\n", base[0] >> 7);
+        printf("        {\n");
+        dump_node(base, (base[1] << 16) | (base[2] << 8) | base[3], 0);
         printf("        }\n");
         printf("    }\n");
     }
-
     printf("}\n");
-    fclose(f);
+    free(buf);
     return 0;
 }
 
@@ -497,7 +426,7 @@ static int getcp(char *p, char **pp) {
 int main(int argc, char **argv)
 {
     char *filename;
-    int i, j, k, line_num, len;
+    int i, line_num, len;
     FILE *f;
     char line[1024], *p;
     unsigned char *q;
@@ -505,7 +434,7 @@ int main(int argc, char **argv)
     InputEntry *ip;
 
     if (argc < 3) {
-        printf("kmaptoqe -- Convert yudit keyboard maps to qemacs compressed format\n"
+        printf("kmaptoqe -- Convert yudit keyboard maps to qemacs trie format\n"
                "usage: kmaptoqe outfile kmaps...\n"
                "       kmaptoqe --dump outfile\n");
         exit(1);
@@ -521,8 +450,6 @@ int main(int argc, char **argv)
     }
     outbuf_ptr = outbuf;
 
-    memset(freq, 0, sizeof(freq));
-
     nb_kmaps = 0;
     for (i = 2; i < argc; i++) {
         filename = argv[i];
@@ -546,12 +473,8 @@ int main(int argc, char **argv)
         pstrcpy(kmap_names[nb_kmaps], sizeof(kmap_names[nb_kmaps]), name);
         kmap_offsets[nb_kmaps] = outbuf_ptr - outbuf;
         nb_kmaps++;
-        /* special compression for CJ */
+        /* CJ sequences are stored without their trailing space */
         is_chinese_cj = !strcmp(name, "Chinese_CJ");
-        gen_table = !strcmp(name, "Chinese_CJ") ||
-                    !strcmp(name, "TeX") ||
-                    !strcmp(name, "Troff") ||
-                    !strcmp(name, "SGML");
 
         nb_inputs = 0;
         ip = inputs;
@@ -561,6 +484,11 @@ int main(int argc, char **argv)
                 break;
             line_num++;
             p = skipspaces(line);
+            if (nb_inputs >= NB_MAX) {
+                fprintf(stderr, "%s:%d: too many mappings\n",
+                        filename, line_num);
+                break;
+            }
             if (*p == '\0' || *p == '/' || *p == '#')
                 continue;
             if (*p != '\"')
@@ -597,7 +525,6 @@ int main(int argc, char **argv)
                 if (*p == '"')
                     break;
             }
-            ip->order = ip - inputs;
             ip++;
             nb_inputs++;
             continue;
@@ -607,37 +534,11 @@ int main(int argc, char **argv)
         skip:;
         }
 
-        qsort(inputs, nb_inputs, sizeof(InputEntry), sort_func);
-
-        /* first pass to compute offsets */
-        write_data = 0;
-        gen_map();
-
-        write_data = 1;
-
-        /* write start map */
-        put_byte(nb_starts | (is_chinese_cj ? 0x80 : 0));
-        if (gen_table) {
-            for (k = 0; k < nb_starts; k++) {
-                j = table_start[k];
-                put_byte(table_val[k]);
-                put_byte((j >> 16) & 0xff);
-                put_byte((j >> 8) & 0xff);
-                put_byte(j & 0xff);
-            }
-        }
-
-        gen_map();
+        gen_map(filename);
 
         fclose(f);
     }
 
-#ifdef TEST
-    for (k = 0; k < 32; k++) {
-        fprintf(stderr, "freq[%d] = %d\n", k, freq[k]);
-    }
-#endif
-
     /* write header */
     size = 4;
     for (i = 0; i < nb_kmaps; i++) {
@@ -645,7 +546,7 @@ int main(int argc, char **argv)
     }
     size += 4; /* last offset at zero */
 
-    fwrite("kmap", 1, 4, outfile);
+    fwrite("kmp2", 1, 4, outfile);
 
     for (i = 0; i < nb_kmaps; i++) {
         int off;
@@ -53,6 +53,8 @@ typedef uint64_t TTYChar;
 #define TTY_CHAR_GET_BG(cc)   ((uint32_t)((cc) >> (32 + 17)) & 0x1FFF)
 #define TTY_CHAR_DEFAULT      TTY_CHAR(' ', 7, 0)
 #define TTY_CHAR_COMB         0x200000
+#define TTY_CHAR_PICTURE      0x400000  /* cells covered by a graphics picture */
+#define TTY_PICTURE_IDS       0x100000
 #define TTY_CHAR_BAD          0xFFFD
 #define TTY_CHAR_NONE         0xFFFFFFFF
 #define TTY_BOLD              0x02000
@@ -60,13 +62,16 @@ typedef uint64_t TTYChar;
 #define TTY_ITALIC            0x08000
 #define TTY_BLINK             0x10000
 #define COMB_CACHE_SIZE       2048
+#ifndef CONFIG_TINY
+#define TTY_GRAPHICS          1  /* sixel and kitty graphics for pictures */
+#endif
 #else
 typedef uint32_t TTYChar;
 /* TTY composite style has 4-bit BG color, 4 attribute bits and 8-bit FG color */
 #define TTY_STYLE_BITS        16
 #define TTY_FG_COLORS         256
 #define TTY_BG_COLORS         16
-#define TTY_RGB_FG(r,g,b)     (16 + ((r) / 51 * 36) + ((g) / 51 * 6) | ((b) / 51))
+#define TTY_RGB_FG(r,g,b)     (16 + ((r) / 51 * 36) + ((g) / 51 * 6) + ((b) / 51))
 #define TTY_RGB_BG(r,g,b)     qe_map_color(QERGB(r, g, b), xterm_colors, 16, NULL)
 #define TTY_CHAR(ch,fg,bg)    ((uint32_t)(ch) | ((uint32_t)((fg) | ((bg) << 12)) << 16))
 #define TTY_CHAR2(ch,col)     ((uint32_t)(ch) | ((uint32_t)(col) << 16))
@@ -103,6 +108,26 @@ static inline void TTY_FPUTS(const char *s, FILE *fp) {
 #  define TTY_FPUTS             fputs
 #endif
 
+/* picture rendering settings */
+int tty_dither = 1;         /* use ordered dithering for limited palettes */
+int tty_graphics = -1;      /* graphics protocol, -1 for auto detection */
+
+enum TTYGraphics {
+    TTY_GRAPHICS_NONE,
+    TTY_GRAPHICS_SIXEL,
+    TTY_GRAPHICS_KITTY,
+};
+
+/* picture drawn with a graphics protocol over a cell area */
+typedef struct TTYPicture {
+    struct TTYPicture *next;
+    int id;
+    int x, y, w, h;         /* cell area */
+    int mode;               /* TTY_GRAPHICS_xxx */
+    uint64_t hash;          /* hash of the scaled pixels */
+    QEPicture *pict;        /* pixels to output, freed once emitted */
+} TTYPicture;
+
 enum InputState {
     IS_NORM,
     IS_ESC,
@@ -142,6 +167,7 @@ typedef struct TTYState {
 #define USE_BLINK_AS_BRIGHT_BG  0x08
 #define USE_256_COLORS          0x10
 #define USE_TRUE_COLORS         0x20
+#define USE_SCROLL_REGION       0x40
     /* number of colors supported by the actual terminal */
     const QEColor *term_colors;
     int term_fg_colors_count;
@@ -150,6 +176,19 @@ typedef struct TTYState {
     const QEColor *tty_colors;
     int tty_fg_colors_count;
     int tty_bg_colors_count;
+    /* picture rendering */
+    unsigned char *color_lut16;     /* 15-bit RGB to 16 color palette */
+    unsigned char *color_lut256;    /* 15-bit RGB to 256 color palette */
+    enum TTYGraphics graphics;      /* detected graphics protocol */
+    int cell_width, cell_height;    /* character cell size in pixels */
+    int picture_id;
+    int pictures_clear;
+    TTYPicture *pictures;
+    /* pending terminal scroll operations, applied before the update */
+    int nb_scrolls;
+    struct {
+        short top, bottom, dy;
+    } scrolls[8];
     /* cache for glyph combinations */
     // XXX: should keep track of max_comb and max_max_comb
     char32_t comb_cache[COMB_CACHE_SIZE];
@@ -158,6 +197,7 @@ typedef struct TTYState {
 static QEditScreen *tty_screen;   /* for tty_term_exit and tty_term_resize */
 
 static void tty_dpy_invalidate(QEditScreen *s);
+static void tty_free_pictures(TTYState *ts);
 
 static void tty_term_resize(int sig);
 static void tty_term_exit(void);
@@ -209,9 +249,11 @@ static int tty_dpy_init(QEditScreen *s,
         } else
         if (strstart(ts->term_name, "xterm", NULL)) {
             ts->term_code = TERM_XTERM;
+            ts->term_flags |= USE_SCROLL_REGION;
         } else
         if (strstart(ts->term_name, "linux", NULL)) {
             ts->term_code = TERM_LINUX;
+            ts->term_flags |= USE_SCROLL_REGION;
         } else
         if (strstart(ts->term_name, "cygwin", NULL)) {
             ts->term_code = TERM_CYGWIN;
@@ -279,6 +321,21 @@ static int tty_dpy_init(QEditScreen *s,
     ts->tty_fg_colors_count = min_int(ts->term_fg_colors_count, TTY_FG_COLORS);
     ts->tty_colors = xterm_colors;
 
+    /* Detect graphics protocols for pictures */
+    ts->graphics = TTY_GRAPHICS_NONE;
+    if (getenv("KITTY_WINDOW_ID")
+    ||  ((p = getenv("TERM_PROGRAM")) && strequal(p, "WezTerm"))
+    ||  (ts->term_name && (strstr(ts->term_name, "kitty")
+                       ||  strstr(ts->term_name, "ghostty")))) {
+        ts->graphics = TTY_GRAPHICS_KITTY;
+    } else
+    if (ts->term_name && (strstr(ts->term_name, "sixel")
+                      ||  strstart(ts->term_name, "mlterm", NULL)
+                      ||  strstart(ts->term_name, "foot", NULL)
+                      ||  strstart(ts->term_name, "yaft", NULL))) {
+        ts->graphics = TTY_GRAPHICS_SIXEL;
+    }
+
     tcgetattr(fileno(s->STDIN), &tty);
     ts->oldtty = tty;
 
@@ -451,6 +508,9 @@ static void tty_dpy_close(QEditScreen *s)
     fflush(s->STDOUT);
     tcsetattr(fileno(s->STDIN), TCSANOW, &ts->oldtty);
 
+    tty_free_pictures(ts);
+    qe_free(&ts->color_lut16);
+    qe_free(&ts->color_lut256);
     qe_free(&ts->screen);
     qe_free(&ts->line_updated);
     qe_free(&s->priv_data);
@@ -499,10 +559,13 @@ static void tty_dpy_invalidate(QEditScreen *s)
     s->height = (p = getenv("LINES")) != NULL ? atoi(p) : 25;
 
     /* update screen dimensions from pseudo tty ioctl */
+    ts->cell_width = ts->cell_height = 0;
     if (ioctl(fileno(s->STDIN), TIOCGWINSZ, &ws) == 0) {
         if (ws.ws_col >= 10 && ws.ws_row >= 4) {
             s->width = ws.ws_col;
             s->height = ws.ws_row;
+            ts->cell_width = ws.ws_xpixel / ws.ws_col;
+            ts->cell_height = ws.ws_ypixel / ws.ws_row;
         }
     }
 
@@ -532,6 +595,10 @@ static void tty_dpy_invalidate(QEditScreen *s)
     /* All rows need refresh */
     memset(ts->line_updated, 1, s->height);
 
+    /* Pictures will be redrawn by the redisplay */
+    tty_free_pictures(ts);
+    ts->nb_scrolls = 0;
+
     s->clip_x1 = 0;
     s->clip_y1 = 0;
     s->clip_x2 = s->width;
@@ -1039,6 +1106,11 @@ static void comb_cache_describe(QEditScreen *s, EditBuffer *b) {
               ts->term_fg_colors_count, ts->term_bg_colors_count);
     eb_printf(b, "%*s: fg:%d, bg:%d\n", w, "virtual tty colors",
               ts->tty_fg_colors_count, ts->tty_bg_colors_count);
+    eb_printf(b, "%*s: %s\n", w, "graphics",
+              ts->graphics == TTY_GRAPHICS_SIXEL ? "sixel" :
+              ts->graphics == TTY_GRAPHICS_KITTY ? "kitty" : "none");
+    eb_printf(b, "%*s: %dx%d\n", w, "cell pixels",
+              ts->cell_width, ts->cell_height);
 
     eb_printf(b, "\nUnicode combination cache:\n\n");
 
@@ -1161,6 +1233,450 @@ static void tty_dpy_set_clip(qe__unused__ QEditScreen *s,
 {
 }
 
+/*---------------- Pictures ----------------*/
+
+/* Return the table mapping 15-bit RGB colors to the nearest of the
+ * first 16 or 256 colors of the terminal palette.  The tables are
+ * computed on first use and replace per pixel palette searches.
+ */
+static const unsigned char *tty_get_color_lut(TTYState *ts, int count)
+{
+    unsigned char **lutp = (count <= 16) ? &ts->color_lut16 : &ts->color_lut256;
+    unsigned char *lut;
+    int i, r, g, b;
+
+    if (!*lutp) {
+        lut = qe_malloc_array(unsigned char, 32 * 32 * 32);
+        if (!lut)
+            return NULL;
+        count = (count <= 16) ? 16 : 256;
+        for (i = 0; i < 32 * 32 * 32; i++) {
+            r = (i >> 10) & 31;
+            g = (i >> 5) & 31;
+            b = i & 31;
+            lut[i] = qe_map_color(QERGB((r << 3) | (r >> 2), (g << 3) | (g >> 2),
+                                        (b << 3) | (b >> 2)),
+                                  ts->tty_colors, count, NULL);
+        }
+        *lutp = lut;
+    }
+    return *lutp;
+}
+
+typedef struct TTYColorMap {
+    const unsigned char *lut;   /* NULL for direct RGB colors */
+    int count;
+    int step;                   /* dithering amplitude */
+} TTYColorMap;
+
+static void tty_color_map_init(TTYState *ts, TTYColorMap *cm, int count)
+{
+    cm->count = count;
+    if (count > 256) {
+        /* TTY_RGB_FG() keeps 4 bits per component */
+        cm->lut = NULL;
+        cm->step = 16;
+    } else {
+        cm->lut = tty_get_color_lut(ts, count);
+        cm->step = (count > 16) ? 51 : 128;
+    }
+    if (!tty_dither)
+        cm->step = 0;
+}
+
+/* 4x4 ordered dithering matrix */
+static const unsigned char tty_bayer4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+static inline int tty_map_pixel(const TTYColorMap *cm, QEColor rgb, int x, int y)
+{
+    int r = QERGB_RED(rgb);
+    int g = QERGB_GREEN(rgb);
+    int b = QERGB_BLUE(rgb);
+
+    if (cm->step) {
+        int d = (tty_bayer4[y & 3][x & 3] * 2 - 15) * cm->step / 32;
+        r = clamp_int(r + d, 0, 255);
+        g = clamp_int(g + d, 0, 255);
+        b = clamp_int(b + d, 0, 255);
+    }
+    if (cm->lut)
+        return cm->lut[((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3)];
+    if (cm->count > 256)
+        return TTY_RGB_FG(r, g, b);
+    return qe_map_color(QERGB(r, g, b), xterm_colors, cm->count, NULL);
+}
+
+/* Draw an RGBA32 picture with half block characters, two pixel rows
+ * per character row: the top pixel is the background color and the
+ * bottom pixel the foreground color.
+ */
+static void tty_draw_half_blocks(QEditScreen *s, int dst_x, int dst_y,
+                                 int dst_w, int dst_h, const QEPicture *ip,
+                                 int src_x, int src_y)
+{
+    TTYState *ts = s->priv_data;
+    TTYChar *ptr = ts->screen + dst_y * s->width + dst_x;
+    TTYColorMap fgmap, bgmap;
+    int x, y, fg, bg;
+
+    tty_color_map_init(ts, &fgmap, ts->tty_fg_colors_count);
+    tty_color_map_init(ts, &bgmap, ts->tty_bg_colors_count);
+    for (y = 0; y < dst_h; y++) {
+        const uint32_t *p1 = (const uint32_t *)(const void *)(ip->data[0] + (src_y + y * 2) * ip->linesize[0]) + src_x;
+        const uint32_t *p2 = p1 + (ip->linesize[0] >> 2);
+        ts->line_updated[dst_y + y] = 1;
+        for (x = 0; x < dst_w; x++) {
+            bg = tty_map_pixel(&bgmap, p1[x], x, 2 * y);
+            fg = tty_map_pixel(&fgmap, p2[x], x, 2 * y + 1);
+            if (fg == bg)
+                ptr[x] = TTY_CHAR(' ', fg, bg);
+            else
+                ptr[x] = TTY_CHAR(0x2584, fg, bg);
+        }
+        ptr += s->width;
+    }
+}
+
+#ifdef TTY_GRAPHICS
+static void tty_free_pictures(TTYState *ts)
+{
+    TTYPicture *tp;
+
+    while ((tp = ts->pictures) != NULL) {
+        ts->pictures = tp->next;
+        if (tp->mode == TTY_GRAPHICS_KITTY && !tp->pict)
+            ts->pictures_clear = 1;
+        qe_free_picture(&tp->pict);
+        qe_free(&tp);
+    }
+}
+
+/* Drop the pictures whose cells have been overwritten since they were
+ * drawn.  Their other cells are blanked and synchronized again to
+ * erase the picture pixels.
+ */
+static void tty_check_pictures(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    TTYPicture **tpp, *tp;
+    TTYChar cc, *ptr;
+    int x, y, intact, shadow = ts->screen_size;
+
+    if (ts->pictures_clear) {
+        /* delete all kitty images */
+        TTY_FPUTS("\033_Ga=d,q=2\033\\", s->STDOUT);
+        ts->pictures_clear = 0;
+    }
+    for (tpp = &ts->pictures; (tp = *tpp) != NULL;) {
+        cc = TTY_CHAR(TTY_CHAR_PICTURE + tp->id, 7, 0);
+        intact = 1;
+        for (y = tp->y; intact && y < tp->y + tp->h; y++) {
+            ptr = ts->screen + y * s->width + tp->x;
+            for (x = 0; x < tp->w; x++) {
+                if (ptr[x] != cc) {
+                    intact = 0;
+                    break;
+                }
+            }
+        }
+        if (intact) {
+            tpp = &tp->next;
+            continue;
+        }
+        if (tp->mode == TTY_GRAPHICS_KITTY && !tp->pict) {
+            TTY_FPRINTF(s->STDOUT, "\033_Ga=d,d=I,i=%d,q=2\033\\", tp->id);
+        }
+        for (y = tp->y; y < tp->y + tp->h; y++) {
+            ptr = ts->screen + y * s->width + tp->x;
+            for (x = 0; x < tp->w; x++) {
+                if (ptr[x] == cc)
+                    ptr[x] = TTY_CHAR_DEFAULT;
+                ptr[x + shadow] = (TTYChar)-1;
+            }
+            ts->line_updated[y] = 1;
+        }
+        *tpp = tp->next;
+        qe_free_picture(&tp->pict);
+        qe_free(&tp);
+    }
+}
+
+static void tty_emit_sixel(QEditScreen *s, const QEPicture *ip)
+{
+    TTYState *ts = s->priv_data;
+    TTYColorMap cm;
+    unsigned char *idx, *bits, *b;
+    unsigned char used[256], band[256];
+    int w = ip->width, h = ip->height;
+    int x, x1, y, k, i, n, c, run;
+
+    tty_color_map_init(ts, &cm, 256);
+    idx = qe_malloc_array(unsigned char, w * h);
+    bits = qe_mallocz_array(unsigned char, 256 * w);
+    if (!idx || !bits || !cm.lut)
+        goto done;
+
+    /* map the pixels to the 256 color palette */
+    memset(used, 0, sizeof used);
+    for (y = 0; y < h; y++) {
+        const uint32_t *p = (const uint32_t *)(const void *)(ip->data[0] + y * ip->linesize[0]);
+        for (x = 0; x < w; x++) {
+            c = tty_map_pixel(&cm, p[x], x, y);
+            idx[y * w + x] = c;
+            used[c] = 1;
+        }
+    }
+    TTY_FPRINTF(s->STDOUT, "\033P0;1;0q\"1;1;%d;%d", w, h);
+    for (c = 0; c < 256; c++) {
+        if (used[c]) {
+            QEColor rgb = xterm_colors[c];
+            TTY_FPRINTF(s->STDOUT, "#%d;2;%d;%d;%d", c,
+                        (QERGB_RED(rgb) * 100 + 127) / 255,
+                        (QERGB_GREEN(rgb) * 100 + 127) / 255,
+                        (QERGB_BLUE(rgb) * 100 + 127) / 255);
+            used[c] = 0;
+        }
+    }
+    /* output bands of 6 pixel rows, one pass per color in the band */
+    for (y = 0; y < h; y += 6) {
+        n = 0;
+        for (k = 0; k < 6 && y + k < h; k++) {
+            const unsigned char *p = idx + (y + k) * w;
+            for (x = 0; x < w; x++) {
+                c = p[x];
+                if (!used[c]) {
+                    used[c] = 1;
+                    band[n++] = c;
+                }
+                bits[c * w + x] |= 1 << k;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            c = band[i];
+            b = bits + c * w;
+            TTY_FPRINTF(s->STDOUT, "#%d", c);
+            for (x = 0; x < w; x = x1) {
+                for (x1 = x + 1; x1 < w && b[x1] == b[x]; x1++)
+                    continue;
+                run = x1 - x;
+                if (run > 3) {
+                    TTY_FPRINTF(s->STDOUT, "!%d%c", run, 63 + b[x]);
+                } else {
+                    while (run-- > 0)
+                        TTY_PUTC(63 + b[x], s->STDOUT);
+                }
+            }
+            TTY_PUTC('$', s->STDOUT);
+            memset(b, 0, w);
+            used[c] = 0;
+        }
+        TTY_PUTC('-', s->STDOUT);
+    }
+    TTY_FPUTS("\033\\", s->STDOUT);
+ done:
+    qe_free(&idx);
+    qe_free(&bits);
+}
+
+static void tty_emit_kitty(QEditScreen *s, const TTYPicture *tp)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const QEPicture *ip = tp->pict;
+    unsigned char chunk[3 * 1024];
+    char out[4 * 1024];
+    int w = ip->width, h = ip->height;
+    int x, y, i, n, len, first = 1;
+
+    /* send RGB pixels by chunks of 1024 pixels, base64 encoded */
+    for (x = y = 0; y < h;) {
+        const uint32_t *p = (const uint32_t *)(const void *)(ip->data[0] + y * ip->linesize[0]);
+        for (n = 0; n < (int)sizeof(chunk) && y < h; n += 3) {
+            QEColor rgb = p[x];
+            chunk[n + 0] = QERGB_RED(rgb);
+            chunk[n + 1] = QERGB_GREEN(rgb);
+            chunk[n + 2] = QERGB_BLUE(rgb);
+            if (++x == w) {
+                x = 0;
+                if (++y < h)
+                    p = (const uint32_t *)(const void *)(ip->data[0] + y * ip->linesize[0]);
+            }
+        }
+        for (i = len = 0; i < n; i += 3) {
+            uint32_t v = (chunk[i] << 16) | (chunk[i + 1] << 8) | chunk[i + 2];
+            out[len++] = b64[(v >> 18) & 63];
+            out[len++] = b64[(v >> 12) & 63];
+            out[len++] = b64[(v >> 6) & 63];
+            out[len++] = b64[v & 63];
+        }
+        if (first) {
+            TTY_FPRINTF(s->STDOUT, "\033_Ga=T,f=24,s=%d,v=%d,i=%d,c=%d,r=%d,C=1,q=2,m=%d;",
+                        w, h, tp->id, tp->w, tp->h, y < h);
+            first = 0;
+        } else {
+            TTY_FPRINTF(s->STDOUT, "\033_Gm=%d;", y < h);
+        }
+        TTY_FWRITE(out, 1, len, s->STDOUT);
+        TTY_FPUTS("\033\\", s->STDOUT);
+    }
+}
+
+static void tty_emit_pictures(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    TTYPicture *tp;
+
+    for (tp = ts->pictures; tp; tp = tp->next) {
+        if (tp->pict) {
+            TTY_FPRINTF(s->STDOUT, "\033[%d;%dH", tp->y + 1, tp->x + 1);
+            if (tp->mode == TTY_GRAPHICS_KITTY)
+                tty_emit_kitty(s, tp);
+            else
+                tty_emit_sixel(s, tp->pict);
+            qe_free_picture(&tp->pict);
+        }
+    }
+}
+
+static uint64_t tty_picture_hash(const QEPicture *ip)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int x, y;
+
+    for (y = 0; y < ip->height; y++) {
+        const uint32_t *p = (const uint32_t *)(const void *)(ip->data[0] + y * ip->linesize[0]);
+        for (x = 0; x < ip->width; x++) {
+            hash = (hash ^ p[x]) * 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+/* Scale a picture to the pixel size of a cell area and queue it for
+ * output with a graphics protocol.  The cells are filled with a
+ * placeholder specific to the picture so the text output skips them
+ * and later changes can be detected.  Redrawing the same pixels at
+ * the same place reuses the picture already displayed.
+ */
+static int tty_add_picture(QEditScreen *s, int mode,
+                           int dst_x, int dst_y, int dst_w, int dst_h,
+                           const QEPicture *ip,
+                           int src_x, int src_y, int src_w, int src_h,
+                           int flags)
+{
+    TTYState *ts = s->priv_data;
+    TTYPicture *tp, *tp1;
+    TTYChar cc, *ptr;
+    int x, y, cw = ts->cell_width, ch = ts->cell_height;
+
+    if (cw <= 0 || ch <= 0) {
+        /* kitty scales the picture to the cell area */
+        if (mode != TTY_GRAPHICS_KITTY)
+            return -1;
+        cw = 8;
+        ch = 16;
+    }
+    tp = qe_mallocz(TTYPicture);
+    if (!tp)
+        return -1;
+    tp->pict = qe_create_picture(dst_w * cw, dst_h * ch, QEBITMAP_FORMAT_RGBA32, 0);
+    if (!tp->pict || !tp->pict->data[0]
+    ||  qe_picture_copy(tp->pict, 0, 0, tp->pict->width, tp->pict->height,
+                        ip, src_x, src_y, src_w, src_h, flags)) {
+        qe_free_picture(&tp->pict);
+        qe_free(&tp);
+        return -1;
+    }
+    tp->x = dst_x;
+    tp->y = dst_y;
+    tp->w = dst_w;
+    tp->h = dst_h;
+    tp->mode = mode;
+    tp->hash = tty_picture_hash(tp->pict);
+    for (tp1 = ts->pictures; tp1; tp1 = tp1->next) {
+        if (tp1->x == tp->x && tp1->y == tp->y && tp1->w == tp->w
+        &&  tp1->h == tp->h && tp1->mode == tp->mode && tp1->hash == tp->hash)
+            break;
+    }
+    if (tp1) {
+        qe_free_picture(&tp->pict);
+        qe_free(&tp);
+        tp = tp1;
+    } else {
+        ts->picture_id = ts->picture_id % (TTY_PICTURE_IDS - 1) + 1;
+        tp->id = ts->picture_id;
+        tp->next = ts->pictures;
+        ts->pictures = tp;
+    }
+
+    cc = TTY_CHAR(TTY_CHAR_PICTURE + tp->id, 7, 0);
+    for (y = 0; y < dst_h; y++) {
+        ptr = ts->screen + (dst_y + y) * s->width + dst_x;
+        for (x = 0; x < dst_w; x++) {
+            ptr[x] = cc;
+        }
+        ts->line_updated[dst_y + y] = 1;
+    }
+    return 0;
+}
+#else
+static void tty_free_pictures(qe__unused__ TTYState *ts) {}
+static inline void tty_check_pictures(qe__unused__ QEditScreen *s) {}
+static inline void tty_emit_pictures(qe__unused__ QEditScreen *s) {}
+#endif
+
+/* Move screen rows, if the area spans full rows, also scroll the
+ * terminal contents with a scroll region at the next flush and
+ * update the shadow buffer accordingly so only the uncovered rows
+ * are output.
+ */
+static void tty_dpy_scroll(QEditScreen *s, int x1, int y1, int w, int h, int dy)
+{
+    TTYState *ts = s->priv_data;
+    int y, n, shadow = ts->screen_size;
+    int term_scroll;
+    TTYChar *ptr;
+
+    n = abs(dy);
+    if (n == 0 || n >= h)
+        return;
+
+    term_scroll = ((ts->term_flags & USE_SCROLL_REGION)
+                   && x1 == 0 && w == s->width
+                   && !ts->pictures
+                   && ts->nb_scrolls < countof(ts->scrolls));
+    if (term_scroll) {
+        ts->scrolls[ts->nb_scrolls].top = y1;
+        ts->scrolls[ts->nb_scrolls].bottom = y1 + h;
+        ts->scrolls[ts->nb_scrolls].dy = dy;
+        ts->nb_scrolls++;
+    }
+    for (y = 0; y < h - n; y++) {
+        /* iterate in the direction of the move */
+        int dst = (dy < 0) ? y1 + y : y1 + h - 1 - y;
+        int src = dst - dy;
+
+        ptr = ts->screen + dst * s->width + x1;
+        blockmove(ptr, ptr + (src - dst) * s->width, w);
+        if (term_scroll)
+            blockmove(ptr + shadow, ptr + shadow + (src - dst) * s->width, w);
+    }
+    for (y = y1; y < y1 + h; y++) {
+        ts->line_updated[y] = 1;
+    }
+    if (term_scroll) {
+        /* the rows uncovered by the terminal scroll must be output */
+        y = (dy < 0) ? y1 + h - n : y1;
+        memset(ts->screen + shadow + y * s->width, 0xFF,
+               n * s->width * sizeof(TTYChar));
+    }
+}
+
 static void tty_dpy_flush(QEditScreen *s)
 {
     TTYState *ts = s->priv_data;
@@ -1189,6 +1705,23 @@ static void tty_dpy_flush(QEditScreen *s)
      * pretend it's OK: */
     ts->screen[shadow - 1] = ts->screen[2 * shadow - 1];
 
+    tty_check_pictures(s);
+
+    if (ts->nb_scrolls) {
+        int i;
+
+        for (i = 0; i < ts->nb_scrolls; i++) {
+            /* set scroll region, delete or insert lines at the top */
+            TTY_FPRINTF(s->STDOUT, "\033[%d;%dr\033[%d;1H\033[%d%c",
+                        ts->scrolls[i].top + 1, ts->scrolls[i].bottom,
+                        ts->scrolls[i].top + 1, abs(ts->scrolls[i].dy),
+                        ts->scrolls[i].dy < 0 ? 'M' : 'L');
+        }
+        /* reset scroll region */
+        TTY_FPUTS("\033[r", s->STDOUT);
+        ts->nb_scrolls = 0;
+    }
+
     for (y = 0; y < s->height; y++) {
         if (ts->line_updated[y]) {
             ts->line_updated[y] = 0;
@@ -1266,6 +1799,13 @@ static void tty_dpy_flush(QEditScreen *s)
                 ch = TTY_CHAR_GET_CH(cc);
                 if ((char32_t)ch == TTY_CHAR_NONE)
                     continue;
+#ifdef TTY_GRAPHICS
+                if (ch >= TTY_CHAR_PICTURE && ch < TTY_CHAR_PICTURE + TTY_PICTURE_IDS) {
+                    /* leave the picture pixels alone */
+                    gotopos = 1;
+                    continue;
+                }
+#endif
                 if (gotopos) {
                     /* Move the cursor: row and col are 1 based
                        but ptr1 has already been incremented */
@@ -1500,6 +2040,7 @@ static void tty_dpy_flush(QEditScreen *s)
 
     // XXX: should check if needed
     TTY_FPUTS("\033[0m", s->STDOUT);
+    tty_emit_pictures(s);
     if (ts->cursor_y + 1 >= 0 && ts->cursor_x + 1 >= 0) {
         TTY_FPRINTF(s->STDOUT, "\033[?25h\033[%d;%dH",
                     ts->cursor_y + 1, ts->cursor_x + 1);
@@ -1582,25 +2123,7 @@ static void tty_dpy_bmp_draw(QEditScreen *s, QEBitmap *bp,
         }
     } else
     if (pp->format == QEBITMAP_FORMAT_RGBA32) {
-#if 0
-        /* XXX: inefficient and currently unused */
-        for (y = 0; y < dst_h; y++) {
-            QEColor *p1 = (QEColor *)(void*)(data + (src_y + y * 2) * linesize) + src_x;
-            QEColor *p2 = (QEColor *)(void*)((unsigned char*)p1 + linesize);
-            ts->line_updated[dst_y + y] = 1;
-            for (x = 0; x < dst_w; x++) {
-                QEColor bg3 = p1[x];
-                QEColor fg3 = p2[x];
-                int bg = QERGB_RED(bg3) / 43 * 36 + QERGB_GREEN(bg3) / 43 * 6 + QERGB_BLUE(bg3);
-                int fg = QERGB_RED(fg3) / 43 * 36 + QERGB_GREEN(fg3) / 43 * 6 + QERGB_BLUE(fg3);
-                if (fg == bg)
-                    ptr[x] = TTY_CHAR(' ', fg, bg);
-                else
-                    ptr[x] = TTY_CHAR(0x2584, fg, bg);
-            }
-            ptr += s->width;
-        }
-#endif
+        tty_draw_half_blocks(s, dst_x, dst_y, dst_w, dst_h, pp, src_x, src_y);
     }
 }
 
@@ -1619,6 +2142,14 @@ static int tty_dpy_draw_picture(QEditScreen *s,
     const QEPicture *ip = ip0;
     QEPicture *ip1 = NULL;
 
+#ifdef TTY_GRAPHICS
+    int mode = (tty_graphics >= 0) ? tty_graphics : ts->graphics;
+    if ((mode == TTY_GRAPHICS_SIXEL || mode == TTY_GRAPHICS_KITTY)
+    &&  !tty_add_picture(s, mode, dst_x, dst_y, dst_w, dst_h,
+                         ip0, src_x, src_y, src_w, src_h, flags)) {
+        return 0;
+    }
+#endif
     if ((src_w == dst_w && src_h == 2 * dst_h)
     &&  ip->format == QEBITMAP_FORMAT_8BIT
     &&  ip->palette
@@ -1658,24 +2189,8 @@ static int tty_dpy_draw_picture(QEditScreen *s,
             src_w = ip1->width;
             src_h = ip1->height;
         }
-        /* Use terminal true color emulation */
-        ptr = ts->screen + dst_y * s->width + dst_x;
-        for (y = 0; y < dst_h; y++) {
-            uint32_t *p1 = (uint32_t*)(void*)(ip->data[0] + (src_y + y * 2) * ip->linesize[0]) + src_x;
-            uint32_t *p2 = p1 + (ip->linesize[0] >> 2);
-            ts->line_updated[dst_y + y] = 1;
-            for (x = 0; x < dst_w; x++) {
-                int bg = p1[x];
-                int fg = p2[x];
-                bg = TTY_RGB_BG(QERGB_RED(bg), QERGB_GREEN(bg), QERGB_BLUE(bg));
-                fg = TTY_RGB_FG(QERGB_RED(fg), QERGB_GREEN(fg), QERGB_BLUE(fg));
-                if (fg == bg)
-                    ptr[x] = TTY_CHAR(' ', fg, bg);
-                else
-                    ptr[x] = TTY_CHAR(0x2584, fg, bg);
-            }
-            ptr += s->width;
-        }
+        /* Use half blocks with terminal colors */
+        tty_draw_half_blocks(s, dst_x, dst_y, dst_w, dst_h, ip, src_x, src_y);
         qe_free_picture(&ip1);
     }
     return 0;
@@ -1713,6 +2228,7 @@ static QEDisplay tty_dpy = {
     tty_dpy_draw_picture,
     NULL, /* dpy_full_screen */
     tty_dpy_describe,
+    tty_dpy_scroll,
     NULL, /* next */
 };
 
@@ -57,11 +57,16 @@ typedef struct BottomHalfEntry {
     void *opaque;
 } BottomHalfEntry;
 
+/* Active timers are kept in a binary min-heap ordered by timeout:
+ * the next deadline is at the top, insertion and removal are
+ * O(log n).  Each timer stores its heap position for removal.
+ */
 struct QETimer {
     void *opaque;
     void (*cb)(void *opaque);
     int timeout;
-    struct QETimer *next;
+    int index;              /* position in timer_heap, -1 if expired */
+    struct QETimer *next;   /* list of expired timers */
 };
 
 static fd_set url_rfds, url_wfds;
@@ -71,7 +76,8 @@ static int url_exit_request;
 static int url_display_request;
 static LIST_HEAD(pid_handlers);
 static LIST_HEAD(bottom_halves);
-static QETimer *first_timer;
+static QETimer **timer_heap;
+static int timer_count, timer_size;
 
 
 void set_read_handler(int fd, void (*cb)(void *opaque), void *opaque)
@@ -157,36 +163,102 @@ void unregister_bottom_half(void (*cb)(void *opaque), void *opaque)
     }
 }
 
+/* timeouts are compared modulo 2^32 to handle clock wrap around */
+static inline int timer_before(const QETimer *a, const QETimer *b) {
+    return (a->timeout - b->timeout) < 0;
+}
+
+static inline void timer_heap_set(int i, QETimer *ti) {
+    timer_heap[i] = ti;
+    ti->index = i;
+}
+
+static void timer_heap_up(int i) {
+    QETimer *ti = timer_heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!timer_before(ti, timer_heap[parent]))
+            break;
+        timer_heap_set(i, timer_heap[parent]);
+        i = parent;
+    }
+    timer_heap_set(i, ti);
+}
+
+static void timer_heap_down(int i) {
+    QETimer *ti = timer_heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= timer_count)
+            break;
+        if (child + 1 < timer_count
+        &&  timer_before(timer_heap[child + 1], timer_heap[child]))
+            child++;
+        if (!timer_before(timer_heap[child], ti))
+            break;
+        timer_heap_set(i, timer_heap[child]);
+        i = child;
+    }
+    timer_heap_set(i, ti);
+}
+
+static void timer_heap_remove(QETimer *ti) {
+    int i = ti->index;
+    QETimer *last = timer_heap[--timer_count];
+
+    ti->index = -1;
+    if (last != ti) {
+        timer_heap_set(i, last);
+        if (i > 0 && timer_before(last, timer_heap[(i - 1) >> 1]))
+            timer_heap_up(i);
+        else
+            timer_heap_down(i);
+    }
+}
+
 QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque))
 {
     QETimer *ti;
 
+    if (timer_count >= timer_size) {
+        int new_size = max_int(16, timer_size + (timer_size >> 1));
+        if (!qe_realloc(&timer_heap, new_size * sizeof(*timer_heap)))
+            return NULL;
+        timer_size = new_size;
+    }
     ti = qe_mallocz(QETimer);
     if (!ti)
         return NULL;
     ti->timeout = get_clock_ms() + delay;
     ti->opaque = opaque;
     ti->cb = cb;
-    ti->next = first_timer;
-    first_timer = ti;
+    timer_heap[timer_count] = ti;
+    timer_heap_up(timer_count++);
     return ti;
 }
 
+/* The timer is freed after its callback returns: callbacks must clear
+   the owner's QETimer pointer unless they reschedule the timer, a stale
+   pointer must not be passed to qe_kill_timer().
+   Timers must only be added and killed from the main thread.
+ */
 void qe_kill_timer(QETimer **tip)
 {
-    if (*tip) {
-        QETimer **pt;
-
-        /* remove timer from list of active timers and free it */
-        for (pt = &first_timer; *pt != NULL; pt = &(*pt)->next) {
-            if (*pt == (*tip)) {
-                *pt = (*tip)->next;
-                qe_free(tip);
-                return;
-            }
+    QETimer *ti = *tip;
+
+    if (ti) {
+        if (ti->index >= 0) {
+            /* remove timer from heap of active timers and free it */
+            timer_heap_remove(ti);
+            qe_free(tip);
+        } else {
+            /* timer expired and is being dispatched: just disable it,
+               check_timers() will free it */
+            ti->cb = NULL;
+            *tip = NULL;
         }
-        /* timer not found, was probably alread freed */
-        *tip = NULL;
     }
 }
 
@@ -213,30 +285,33 @@ static inline void call_bottom_halves(void)
    check_timers() */
 static inline int check_timers(int max_delay)
 {
-    QETimer *ti, **pt;
-    int timeout, cur_time;
+    QETimer *ti, *expired, **pt;
+    int delay, cur_time;
 
     cur_time = get_clock_ms();
-    timeout = cur_time + max_delay;
-    pt = &first_timer;
-    for (;;) {
-        ti = *pt;
-        if (ti == NULL)
-            break;
-        if ((ti->timeout - cur_time) <= 0) {
-            /* timer expired : suppress it from timer list and call callback */
-            *pt = ti->next;
-            /* warning: a new timer can be added in the callback */
+    /* extract expired timers before calling the callbacks so
+       timers added by the callbacks are handled on the next call */
+    pt = &expired;
+    while (timer_count > 0 && (timer_heap[0]->timeout - cur_time) <= 0) {
+        ti = timer_heap[0];
+        timer_heap_remove(ti);
+        *pt = ti;
+        pt = &ti->next;
+    }
+    *pt = NULL;
+    while ((ti = expired) != NULL) {
+        expired = ti->next;
+        /* warning: a new timer can be added in the callback */
+        if (ti->cb)
             ti->cb(ti->opaque);
-            qe_free(&ti);
-            call_bottom_halves();
-        } else {
-            if ((ti->timeout - timeout) < 0)
-                timeout = ti->timeout;
-            pt = &ti->next;
-        }
+        qe_free(&ti);
+        call_bottom_halves();
     }
-    return timeout - cur_time;
+    delay = max_delay;
+    if (timer_count > 0) {
+        delay = clamp_int(timer_heap[0]->timeout - cur_time, 0, max_delay);
+    }
+    return delay;
 }
 
 static void url_block_reset(void)
@@ -349,12 +424,21 @@ void url_redisplay(void)
     url_display_request = 1;
 }
 
+/* Use a monotonic clock when available: the clocks are used for
+   timers and elapsed time, which must not jump when the system time
+   is set.
+ */
 int get_clock_ms(void) {
 #ifdef CONFIG_WIN32
     struct _timeb tb;
 
     _ftime(&tb);
     return tb.time * 1000 + tb.millitm;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
 #else
     struct timeval tv;
 
@@ -369,6 +453,11 @@ int get_clock_usec(void) {
 
     _ftime(&tb);
     return tb.time * 1000000 + tb.millitm * 1000;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + (ts.tv_nsec / 1000);
 #else
     struct timeval tv;
 
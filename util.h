@@ -638,6 +638,6 @@ static inline char32_t qe_wtoupper(char32_t c) {
 typedef struct CompleteState CompleteState;
 typedef void (*CompleteFunc)(CompleteState *cp, const char *str, int mode);
 /* mode values for default CompleteFunc passed to complete_xxx() functions */
-enum { CT_TEST, CT_GLOB, CT_IGLOB, CT_STRX, CT_SET };
+enum { CT_TEST, CT_GLOB, CT_IGLOB, CT_STRX, CT_SET, CT_RANK };
 
 #endif  /* UTIL_H */
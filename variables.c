@@ -29,6 +29,8 @@ static QVarType qe_variable_set_value_offset(EditState *s, VarDef *vp, void *ptr
                                              const char *value, int num);
 static QVarType qe_variable_set_value_generic(EditState *s, VarDef *vp, void *ptr,
                                               const char *value, int num);
+static QVarType qe_variable_set_value_auto_revert(EditState *s, VarDef *vp, void *ptr,
+                                                  const char *value, int num);
 
 const char * const var_domain[] = {
     "global",   /* VAR_GLOBAL */
@@ -74,6 +76,25 @@ static VarDef var_table[] = {
            "Size from which files are mmapped instead of loaded in memory." )
     S_VAR( "max-load-size", max_load_size, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Maximum size for files to be loaded or mmapped into a buffer." )
+    S_VAR( "async-load-threshold", async_load_threshold, VAR_NUMBER, VAR_RW_SAVE,
+           "Size from which files are loaded in the background, 0 to disable." )
+    S_VAR( "async-save-threshold", async_save_threshold, VAR_NUMBER, VAR_RW_SAVE,
+           "Size from which buffers are saved in the background, 0 to disable." )
+    S_VAR_F( "global-auto-revert-mode", global_auto_revert_mode, VAR_NUMBER, VAR_RW_SAVE,
+             qe_variable_set_value_auto_revert,
+             "Set to update unmodified buffers when their files change on disk." )
+    S_VAR( "undo-limit", undo_limit, VAR_NUMBER, VAR_RW_SAVE,
+           "Memory budget for the undo information of a buffer, 0 for no limit." )
+    S_VAR( "undo-spill-limit", undo_spill_limit, VAR_NUMBER, VAR_RW_SAVE,
+           "Size limit of the temporary file for older undo information, 0 to discard it." )
+    S_VAR( "shell-scrollback-size", shell_scrollback_size, VAR_NUMBER, VAR_RW_SAVE,
+           "Default value of `scrollback-size` for new shell buffers." )
+    S_VAR( "shell-scrollback-lines", shell_scrollback_lines, VAR_NUMBER, VAR_RW_SAVE,
+           "Default value of `scrollback-lines` for new shell buffers." )
+    S_VAR( "project-root", project_root, VAR_CHARS, VAR_RW_SAVE,
+           "Root of the project tree indexed for file completion, default is the git top-level directory." )
+    S_VAR( "file-index-limit", file_index_limit, VAR_NUMBER, VAR_RW_SAVE,
+           "Maximum number of files in a project file index, 0 to disable the index." )
     S_VAR( "show-unicode", show_unicode, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Set to show non-ASCII characters as unicode escape sequences." )
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
@@ -99,6 +120,10 @@ static VarDef var_table[] = {
            "Distance between tab stops (for display of tab characters), in columns." )
     B_VAR( "fill-column", fill_column, VAR_NUMBER, VAR_RW,   // XXX: need set_value function
            "Column beyond which automatic line-wrapping should happen." )
+    B_VAR( "scrollback-size", scrollback_size, VAR_NUMBER, VAR_RW,
+           "Size beyond which old shell output is discarded, 0 for no limit." )
+    B_VAR( "scrollback-lines", scrollback_lines, VAR_NUMBER, VAR_RW,
+           "Number of lines beyond which old shell output is discarded, 0 for no limit." )
 
     W_VAR_F( "point", offset, VAR_NUMBER, VAR_RW, qe_variable_set_value_offset,    /* should be window-point */
            "Current value of point in this window." )
@@ -133,6 +158,10 @@ static VarDef var_table[] = {
 #endif
     G_VAR( "force-tty", force_tty, VAR_NUMBER, VAR_RW,
            "Set to prevent graphics display." )
+    G_VAR( "tty-dither", tty_dither, VAR_NUMBER, VAR_RW_SAVE,
+           "Set to dither pictures on terminals with limited colors." )
+    G_VAR( "tty-graphics", tty_graphics, VAR_NUMBER, VAR_RW_SAVE,
+           "Terminal graphics for pictures: 0=none, 1=sixel, 2=kitty, -1=detect." )
     G_VAR( "disable-crc", disable_crc, VAR_NUMBER, VAR_RW_SAVE,
            "Set to prevent CRC based display cache." )
     G_VAR( "use-html", use_html, VAR_NUMBER, VAR_RW, NULL )
@@ -331,6 +360,18 @@ static QVarType qe_variable_set_value_generic(EditState *s, VarDef *vp, void *pt
     return vp->type;
 }
 
+static QVarType qe_variable_set_value_auto_revert(EditState *s, VarDef *vp, void *ptr,
+                                                  const char *value, int num)
+{
+    QVarType type = qe_variable_set_value_generic(s, vp, ptr, value, num);
+
+#ifndef CONFIG_TINY
+    /* start or stop watching the files */
+    qe_auto_revert_update();
+#endif
+    return type;
+}
+
 QVarType qe_set_variable(EditState *s, const char *name,
                          const char *value, int num)
 {
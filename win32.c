@@ -534,6 +534,7 @@ static QEDisplay win32_dpy = {
     NULL, /* dpy_draw_picture */
     NULL, /* dpy_full_screen */
     NULL, /* dpy_describe */
+    NULL, /* dpy_scroll */
     NULL, /* next */
 };
 
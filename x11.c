@@ -1066,6 +1066,32 @@ static void x11_dpy_flush(QEditScreen *s)
 #endif
 }
 
+static void x11_dpy_scroll(QEditScreen *s, int x, int y, int w, int h, int dy)
+{
+    X11State *xs = s->priv_data;
+    int src_y = y, dst_y = y;
+
+    if (dy < 0)
+        src_y -= dy;
+    else
+        dst_y += dy;
+    h -= abs(dy);
+    if (w <= 0 || h <= 0)
+        return;
+#ifdef CONFIG_DOUBLE_BUFFER
+    XCopyArea(xs->display, xs->dbuffer, xs->dbuffer, xs->gc_pixmap,
+              x, src_y, w, h, x, dst_y);
+    update_rect(xs, x, dst_y, x + w, dst_y + h);
+#else
+    /* parts of the window that are not visible cannot be copied:
+       request GraphicsExpose events to redraw them */
+    XSetGraphicsExposures(xs->display, xs->gc_pixmap, True);
+    XCopyArea(xs->display, xs->window, xs->window, xs->gc_pixmap,
+              x, src_y, w, h, x, dst_y);
+    XSetGraphicsExposures(xs->display, xs->gc_pixmap, False);
+#endif
+}
+
 static void x11_dpy_full_screen(QEditScreen *s, int full_screen)
 {
     X11State *xs = s->priv_data;
@@ -1362,6 +1388,15 @@ static void x11_handle_event(void *opaque)
             }
             break;
 
+        case GraphicsExpose:
+            {
+                /* area could not be copied by x11_dpy_scroll */
+                XGraphicsExposeEvent *xe = &xev.xgraphicsexpose;
+
+                qe_expose_add(s, rgn, xe->x, xe->y, xe->width, xe->height);
+            }
+            break;
+
         case ButtonPress:
         case ButtonRelease:
             {
@@ -1988,6 +2023,7 @@ static QEDisplay x11_dpy = {
     x11_dpy_draw_picture,
     x11_dpy_full_screen,
     NULL, /* dpy_describe */
+    x11_dpy_scroll,
     NULL, /* next */
 };
 